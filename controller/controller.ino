@@ -1,65 +1,210 @@
 #include "RF24.h"
 #include <SPI.h>
 
-#include "shared.h"
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+#include <lamphouse_radio_irq.h>
+#include "exposure.h"
+#include "history.h"
+#include "meter.h"
+#include "teststrip.h"
 
 #undef DEBUG
 
 /* Notes:
- *  Timing logic susceptible to overflow.  Will only be a problem if system is on
- *  continuously for ~ 50 days.
+ *  Exposure timing is relative to the start of each exposure (see exposure.h),
+ *  so is unaffected by millis() overflow after ~ 50 days.
  */
 /* ATmega168 RF24 notes:
  *  Receive -> Send state change takes 270 us
  *  Send -> Receive state change takes 250 us
+ * Replies are sent as ACK payloads (see lamphouse_shared.h), so the controller stays in
+ * receive mode, and only changes to send an event.  The radio queues up to
+ * ACK_PAYLOAD_QUEUE_LENGTH of them, and sends the oldest with each ACK, so
+ * replies to several commands can be waiting at once.
+ */
+/* The radio is interrupt driven.  Its IRQ output is on INT0, and its handler
+ * reads received packets into _receive_queue, so loop() touches the radio only
+ * when there's something to do.  Reading the radio takes tens of
+ * microseconds, so the handler masks INT0 and re-enables interrupts while it
+ * does so, to keep the exposure timer interrupts on time.  loop() masks INT0
+ * in the same way while it uses the radio itself.
+ *
+ * Events are sent without waiting: the IRQ is unmasked for TX data sent and
+ * max retries only while one is, and the handler latches them into
+ * _radio_irq (see lamphouse_radio_irq.h), which loop() dispatches to
+ * event_sent() or event_failed().  Until then the radio isn't listening, so
+ * loop() leaves the received packets and the radio settings alone.
  */
 
 const static uint8_t PIN_RADIO_CE = 8;
 const static uint8_t PIN_RADIO_CSN = 10;
+const static uint8_t PIN_RADIO_IRQ = 2;         // INT0
+
+// Must be a power of two
+const static uint8_t RECEIVE_QUEUE_LENGTH = 4;
+const static uint8_t REPLAY_CACHE_LENGTH = REPLAY_WINDOW;
+const static uint8_t ACK_PAYLOAD_QUEUE_LENGTH = 3;     // The radio's TX FIFO
+
+// Events are only sent by the controller, so its radio's retries are set for
+// them: short, as the controller can't receive while it sends, and the master
+// may be mid-exchange.  Up to 3 retries 500 us apart, and then up to
+// EVENT_MAX_ATTEMPTS attempts EVENT_RETRY_MILLIS apart.
+const static uint8_t EVENT_RETRY_DELAY = 1;
+const static uint8_t EVENT_RETRY_COUNT = 3;
+const static uint8_t EVENT_MAX_ATTEMPTS = 5;
+const static uint8_t EVENT_RETRY_MILLIS = 20;
+
+// Well beyond the retries of an event, in case its interrupt is missed.
+// The controller doesn't listen while it sends an event, so a command sent
+// meanwhile, eg COMMAND_STOP_EXPOSURE, gets through on the master's next
+// retry after the event: within about 7 ms at 250 kbps (4 transmissions of
+// about 1.3 ms, 500 us apart), or this timeout if the interrupt is missed.
+// One received just before the event is acted on at once (see loop()).
+const static uint8_t EVENT_SEND_TIMEOUT_MILLIS = 10;
+
+// Channel output pins and the exposure timer are in exposure_avr.cpp, and the
+// light meter input is in meter_avr.cpp.
+
+
+// What COMMAND_START_EXPOSURE starts, as last set
+enum ExposureMode {
+    EXPOSURE_MODE_TIMED,                // COMMAND_SET_EXPOSURE
+    EXPOSURE_MODE_DOSE,                 // COMMAND_SET_DOSE
+    EXPOSURE_MODE_METERED               // COMMAND_SET_METERED
+};
 
-const static int PIN_OUT_GREEN = 3;     // D3
-const static int PIN_OUT_BLUE = 6;      // D6
-const static int PIN_OUT_RED = 9;       // D9
 
+struct ReceivedPacket
+{
+    RadioPacket packet[PACKET_SIZE];
+    uint32_t irq_micros;                // exposure_timebase_micros() at the radio interrupt
+};
 
-struct ControllerInternalStatus
+
+// Written only by the radio interrupt at head, and read only by loop() at
+// tail.  Empty when they're equal, so holds up to RECEIVE_QUEUE_LENGTH - 1.
+struct ReceiveQueue
 {
-    ControllerState state;
-    uint8_t channel_power[3];
-    uint32_t target_millis;
-    uint32_t start_millis;
-    uint32_t end_millis;
+    ReceivedPacket entries[RECEIVE_QUEUE_LENGTH];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    volatile uint8_t overflows;
+    volatile uint8_t received;          // Packets received, including any dropped; wraps
 };
 
-#ifdef DEBUG
-struct ControllerExternalStatus
+
+// A command acted on, so that a retry of it can be answered without acting
+// on it again.  The reply is reconstructed from the command and message.
+struct ReplayEntry
+{
+    uint8_t counter;            // Packet counter
+    CommsCommand command;
+    uint8_t checksum;           // Of the rest of the packet, in case the master has restarted its counter
+    CommsMessage message;
+};
+
+
+// The last REPLAY_CACHE_LENGTH commands acted on, oldest overwritten first
+struct ReplayCache
+{
+    ReplayEntry entries[REPLAY_CACHE_LENGTH];
+    uint8_t next;
+};
+
+
+struct ControllerInternalStatus
 {
-    ControllerState state;
-    uint8_t channel_power[3];
+    uint16_t channel_power[3];  // 12-bit (see lamphouse_shared.h); red is in whole 8-bit steps
     uint32_t target_millis;
-    uint32_t achieved_millis;
+    uint16_t target_sub_micros;
+    uint32_t target_dose[3];
+    uint32_t target_meter_dose;
+    ExposureMode mode;
+    ProgramStep program[PROGRAM_MAX_STEPS];
+    uint8_t program_length;
+    bool program_running;       // Last exposure started was the program, rather than a single exposure
+    int16_t skew_counts[2];     // Last COMMAND_MEASURE_SKEW: switch-on, switch-off
+    bool latency_pending;       // An output-changing command hasn't taken effect yet
+    uint32_t latency_irq_micros;    // Its radio interrupt time
+    uint16_t latency_micros;    // Command-to-light latency, as COMMAND_REPORT_LATENCY
+    uint16_t worst_latency_micros;
+    bool history_pending;       // The exposure or program started last is still to be recorded,
+    uint32_t history_target_millis; // with its target and powers as it started
+    uint16_t history_target_sub_micros;
+    bool history_timed;
+    uint16_t history_power[3];  // Green and blue; a program's from its first step
+    uint8_t history_sequence;   // First record asked for by COMMAND_REPORT_HISTORY
+    CommsCommand reply_command; // The last command acted on, whose reply was queued last
+    CommsMessage reply_message;
+    uint8_t reply_counter;      // Its packet counter
+    uint8_t ack_payloads_queued;    // Replies queued in the radio and not yet sent, as far as is known
+    uint8_t ack_payloads_received;  // _receive_queue.received when it was last updated
+    ControllerState event_state;    // As last sent in an event
+    uint8_t event_step_index;
+    uint8_t event_attempts;     // At sending the current event; EVENT_MAX_ATTEMPTS once sent or abandoned
+    uint32_t event_attempt_millis;
+    bool event_sending;         // Waiting for the radio to send it, or give up
+    uint8_t radio_data_rate;    // As set by COMMAND_SET_RADIO, or the defaults
+    uint8_t radio_pa_level;
+    uint8_t radio_channel;      // As set by COMMAND_SET_CHANNEL, or RADIO_CHANNEL
+    bool radio_probation;       // Not yet received at the settings, so may go back to these:
+    uint8_t radio_previous_data_rate;
+    uint8_t radio_previous_pa_level;
+    uint8_t radio_previous_channel;
+    uint8_t radio_received;     // _receive_queue.received when last checked
+    uint32_t radio_received_millis; // When it last changed, or the settings did
 };
-#endif
 
 
 
 void initialise_outputs();
 void initialise_radio();
 
+void radio_isr();
 void communicate_with_master();
-void process_timers();
+bool command_switches_outputs(CommsCommand command);
+const ReplayEntry* replay_find(const RadioPacket* packet);
+void replay_add(const RadioPacket* packet, CommsMessage message);
+uint8_t replay_checksum(const RadioPacket* packet);
+void update_latency();
+uint16_t reported_latency();
+void update_history();
+void begin_history();
+void update_events();
+void update_radio();
+void apply_radio_settings(uint8_t data_rate, uint8_t pa_level, uint8_t channel);
+void send_event();
+void event_sent(uint32_t);
+void event_failed(uint32_t);
+void finish_event(bool sent);
+void current_target(uint32_t* target_millis, uint16_t* target_sub_micros);
 
 CommsMessage process_command(const RadioPacket* in_packet);
-void construct_return_packet(CommsMessage message, RadioPacket* return_packet);
-CommsMessage respond_to_master(const RadioPacket* return_packet);
+void construct_return_packet(CommsCommand command, CommsMessage message, RadioPacket* return_packet);
+void queue_current_reply();
+void queue_reply(const RadioPacket* reply);
+void update_ack_payloads_queued();
 CommsMessage set_exposure(const RadioPacket* in_packet);
+CommsMessage set_dose(const RadioPacket* in_packet);
+CommsMessage set_metered(const RadioPacket* in_packet);
 CommsMessage start_exposure();
 CommsMessage stop_exposure();
 CommsMessage set_channel_power(const RadioPacket* in_packet);
+CommsMessage upload_program_step(const RadioPacket* in_packet);
+CommsMessage start_program();
+CommsMessage continue_program();
+CommsMessage start_test_strip(const RadioPacket* in_packet);
+CommsMessage measure_skew(const RadioPacket* in_packet);
+CommsMessage report_history(const RadioPacket* in_packet);
+CommsMessage expose(const RadioPacket* in_packet);
+CommsMessage set_radio(const RadioPacket* in_packet);
+CommsMessage set_channel(const RadioPacket* in_packet);
+void start_radio_probation();
+uint16_t unpack_target_sub_micros(const RadioPacket* packet);
 
 
 #ifdef DEBUG
-CommsMessage interpret_packet(const uint8_t* returned_packet, ControllerExternalStatus* controller_status);
 void print_packet_raw(const RadioPacket* packet);
 void print_packet(const RadioPacket* packet);
 #endif
@@ -67,6 +212,9 @@ void print_packet(const RadioPacket* packet);
 
 static RF24 _radio(PIN_RADIO_CE, PIN_RADIO_CSN);
 static ControllerInternalStatus _state;
+static ReceiveQueue _receive_queue;
+static ReplayCache _replay_cache;
+static RadioIrqQueue _radio_irq;
 
 
 void setup()
@@ -86,147 +234,734 @@ void setup()
 
 void initialise_outputs()
 {
-    _state.state = CONTROLLER_STATE_NOT_EXPOSING;
     _state.channel_power[0] = 0;
     _state.channel_power[1] = 0;
     _state.channel_power[2] = 0;
     _state.target_millis = 0;
-    _state.start_millis = 0;
-    _state.end_millis = 0;
+    _state.target_sub_micros = 0;
+    _state.target_dose[0] = 0;
+    _state.target_dose[1] = 0;
+    _state.target_dose[2] = 0;
+    _state.target_meter_dose = 0;
+    _state.mode = EXPOSURE_MODE_TIMED;
+    _state.program_length = 0;
+    _state.program_running = false;
+    _state.skew_counts[0] = 0;
+    _state.skew_counts[1] = 0;
+    _state.latency_pending = false;
+    _state.latency_irq_micros = 0;
+    _state.latency_micros = 0xFFFF;
+    _state.worst_latency_micros = 0xFFFF;
+    _state.history_pending = false;
+    _state.history_sequence = 0;
+    _state.reply_command = COMMAND_REPORT_STATUS;
+    _state.reply_message = MESSAGE_OK;
+    _state.reply_counter = 0xFF;
+    _state.ack_payloads_queued = 0;
+    _state.ack_payloads_received = 0;
+    _state.event_state = CONTROLLER_STATE_NOT_EXPOSING;
+    _state.event_step_index = 0;
+    _state.event_attempts = EVENT_MAX_ATTEMPTS;
+    _state.event_attempt_millis = 0;
+    _state.event_sending = false;
+
+    for (uint8_t i = 0; i < REPLAY_CACHE_LENGTH; i++)
+    {
+        // Can't match a command: COMMAND_FETCH_REPLY is never cached
+        _replay_cache.entries[i].command = COMMAND_FETCH_REPLY;
+    }
+    _replay_cache.next = 0;
 
-    // Set outputs to off
-    pinMode(PIN_OUT_RED, OUTPUT);
-    pinMode(PIN_OUT_GREEN, OUTPUT);
-    pinMode(PIN_OUT_BLUE, OUTPUT);
-    analogWrite(PIN_OUT_RED, 0);
-    analogWrite(PIN_OUT_GREEN, 0);
-    analogWrite(PIN_OUT_BLUE, 0);
+    // Sets outputs to off, and starts the exposure timer and light meter
+    exposure_init();
+    meter_init();
+    history_init();
 }
 
 
 void initialise_radio()
 {
     _radio.begin();
-    _radio.setRetries(15,15);
+    _radio.setRetries(EVENT_RETRY_DELAY, EVENT_RETRY_COUNT);
     _radio.setChannel(RADIO_CHANNEL);
     _radio.setAddressWidth(5);
-#ifdef DEBUG
-    _radio.setPALevel(RF24_PA_MIN);     // For close-proximity testing
-#else
-    _radio.setPALevel(RF24_PA_LOW);
-#endif
+    _radio.setDataRate(rf24_datarate_e(RADIO_DEFAULT_DATA_RATE));
+    _radio.setPALevel(RADIO_DEFAULT_PA_LEVEL);
+    _radio.enableAckPayload();          // Replies go in ACK payloads, so this transmits only events
     _radio.openWritingPipe(RADIO_ADDRESS_INTERFACE);
     _radio.openReadingPipe(1, RADIO_ADDRESS_CONTROLLER);
+    _radio.maskIRQ(true, true, false);  // Interrupt on receive only
+
+    _receive_queue.head = 0;
+    _receive_queue.tail = 0;
+    _receive_queue.overflows = 0;
+    _receive_queue.received = 0;
+
+    radio_irq_init(&_radio_irq);
+    radio_irq_register(&_radio_irq, RADIO_IRQ_TX_DONE, event_sent);
+    radio_irq_register(&_radio_irq, RADIO_IRQ_TX_FAILED, event_failed);
+
+    _state.radio_data_rate = RADIO_DEFAULT_DATA_RATE;
+    _state.radio_pa_level = RADIO_DEFAULT_PA_LEVEL;
+    _state.radio_channel = RADIO_CHANNEL;
+    _state.radio_probation = false;
+    _state.radio_received = 0;
+    _state.radio_received_millis = millis();
+
+    pinMode(PIN_RADIO_IRQ, INPUT);
+    attachInterrupt(digitalPinToInterrupt(PIN_RADIO_IRQ), radio_isr, FALLING);
+
+    EIMSK &= ~_BV(INT0);
     _radio.startListening();
+    EIMSK |= _BV(INT0);
+
+    queue_current_reply();
 }
 
 
 void loop()
 {
-    communicate_with_master();
-    process_timers();
+    // Exposures are ended by the exposure timer interrupts, so there's nothing
+    // timing-critical here.
+    radio_irq_dispatch(&_radio_irq, NULL);
+    update_history();
+    update_latency();
+
+    if (_state.event_sending)
+    {
+        // A command received as the event started isn't kept waiting for it:
+        // the event is abandoned, and its reply brings the master up to date.
+        if (_receive_queue.tail != _receive_queue.head ||
+                millis() - _state.event_attempt_millis >= EVENT_SEND_TIMEOUT_MILLIS)
+            finish_event(false);
+        else
+            return;
+    }
+
+    if (_receive_queue.tail != _receive_queue.head)
+        communicate_with_master();
+
+    update_events();
+    update_radio();
+}
+
+
+void radio_isr()
+{
+    uint32_t irq_micros = exposure_timebase_micros();
+    bool tx_ok, tx_fail, rx_ready;
+
+    EIMSK &= ~_BV(INT0);
+    interrupts();
+
+    // Clears the IRQ, so that the next packet gives a new edge
+    _radio.whatHappened(tx_ok, tx_fail, rx_ready);
+
+    // Received packets are queued below instead
+    if (tx_ok || tx_fail)
+        radio_irq_latch(&_radio_irq, radio_irq_flags(tx_ok, tx_fail, false), irq_micros);
+
+    while (_radio.available())
+    {
+        uint8_t head = _receive_queue.head;
+
+        _receive_queue.received++;
+        uint8_t next_head = (head + 1) & (RECEIVE_QUEUE_LENGTH - 1);
+
+        if (next_head == _receive_queue.tail)
+        {
+            // Full.  Drop the packet; the master will time out and retry.
+            RadioPacket discard[PACKET_SIZE];
+            _radio.read(&discard, PACKET_SIZE);
+            if (_receive_queue.overflows != 0xFF)
+                _receive_queue.overflows++;
+            continue;
+        }
+
+        _radio.read(&_receive_queue.entries[head].packet, PACKET_SIZE);
+        _receive_queue.entries[head].irq_micros = irq_micros;
+        __asm__ __volatile__("" ::: "memory");      // Fill the entry before publishing it
+        _receive_queue.head = next_head;
+    }
+
+    noInterrupts();
+    EIMSK |= _BV(INT0);
 }
 
 
+// Acts on the received commands, and queues the reply to each as an ACK
+// payload.
 void communicate_with_master()
 {
-    bool message_received = false;
-    RadioPacket in_packet[PACKET_SIZE], return_packet[PACKET_SIZE];
     CommsMessage return_message;
+    CommsCommand command;
     
-    while (_radio.available())
+    update_ack_payloads_queued();
+
+    while (_receive_queue.tail != _receive_queue.head)
     {
-        message_received = true;
-        _radio.read(&in_packet, PACKET_SIZE);
+        __asm__ __volatile__("" ::: "memory");      // Read the entry only once it's published
+        const ReceivedPacket& received = _receive_queue.entries[_receive_queue.tail];
+
 #ifdef DEBUG
         Serial.println("Recieved packet:");
-        print_packet(&in_packet[0]);
+        print_packet(&received.packet[0]);
 #endif
-        return_message = process_command(&in_packet[0]);
+        command = CommsCommand(PacketCommand::get(&received.packet[0]));
+        const ReplayEntry* replay = replay_find(&received.packet[0]);
+
+        if (replay != NULL)
+        {
+            // A retry of a command already acted on, whose reply was lost.
+            // Acting on it again could, for example, restart an exposure.
+            // Reading history is safe to repeat, and its reply depends on
+            // the page asked for.
+            if (command == COMMAND_REPORT_HISTORY)
+                report_history(&received.packet[0]);
+            _state.reply_command = command;
+            _state.reply_message = replay->message;
+            _state.reply_counter = PacketCounter::get(&received.packet[0]);
+            queue_current_reply();
+        }
+        else if (command != COMMAND_FETCH_REPLY)
+        {
+            // Latch the switch this command makes, once any earlier one's
+            // latency is in
+            if (command_switches_outputs(command))
+            {
+                update_latency();
+                exposure_mark_switch();
+            }
+
+            return_message = process_command(&received.packet[0]);
+            _state.reply_command = command;
+            _state.reply_message = return_message;
+            _state.reply_counter = PacketCounter::get(&received.packet[0]);
+            replay_add(&received.packet[0], return_message);
+
+            if (return_message == MESSAGE_OK && command_switches_outputs(command))
+            {
+                _state.latency_pending = true;
+                _state.latency_irq_micros = received.irq_micros;
+            }
+            queue_current_reply();
+        }
+        else if (_state.ack_payloads_queued == 0)
+        {
+            // Nothing left to send, so send the last reply again, refreshed
+            // with the current status
+            queue_current_reply();
+        }
+
+        __asm__ __volatile__("" ::: "memory");      // Finish with the entry before freeing it
+        _receive_queue.tail = (_receive_queue.tail + 1) & (RECEIVE_QUEUE_LENGTH - 1);
     }
     
-    if (message_received)
+    // The master learns of changes up to now from the reply, so only later
+    // ones need an event.  This also keeps events out of its exchanges.
+    _state.event_state = exposure_state();
+    _state.event_step_index = exposure_step_index();
+    _state.event_attempts = EVENT_MAX_ATTEMPTS;
+}
+
+
+// Sends an event when the exposure state or program step changes, retrying
+// failed sends every EVENT_RETRY_MILLIS while they're still current.
+void update_events()
+{
+    ControllerState state = exposure_state();
+    uint8_t step_index = exposure_step_index();
+
+    if (state != _state.event_state || step_index != _state.event_step_index)
+    {
+        _state.event_state = state;
+        _state.event_step_index = step_index;
+        _state.event_attempts = 0;
+    }
+    else if (_state.event_attempts == EVENT_MAX_ATTEMPTS || millis() - _state.event_attempt_millis < EVENT_RETRY_MILLIS)
+        return;
+
+    _state.event_attempt_millis = millis();
+    _state.event_attempts++;
+
+    send_event();
+}
+
+
+// Starts sending the current status to the master as an event (see
+// lamphouse_shared.h), which finish_event() completes.  The controller can't
+// receive while it sends, but a command sent meanwhile is retried by the
+// master's radio.
+void send_event()
+{
+    RadioPacket event[ACK_PAYLOAD_SIZE];
+    CommsCommand format = _state.mode == EXPOSURE_MODE_DOSE && !_state.program_running ? COMMAND_REPORT_DOSE : COMMAND_REPORT_STATUS;
+
+    memset(&event[0], 0, ACK_PAYLOAD_SIZE);
+    construct_return_packet(format, MESSAGE_OK, &event[0]);
+    AckPayloadCounter::put(&event[0], format);
+    AckPayloadLatency::put(&event[0], reported_latency());
+
+#ifdef DEBUG
+    Serial.println("Sending event:");
+    print_packet(&event[0]);
+#endif
+
+    _state.event_sending = true;
+
+    EIMSK &= ~_BV(INT0);
+    _radio.stopListening();
+    _radio.maskIRQ(false, false, false);
+    _radio.startFastWrite(&event[0], ACK_PAYLOAD_SIZE, false);
+    EIMSK |= _BV(INT0);
+}
+
+
+// Only the event's outcome matters, not when the radio interrupted.
+void event_sent(uint32_t)
+{
+    if (_state.event_sending)
+        finish_event(true);
+}
+
+
+void event_failed(uint32_t)
+{
+    if (_state.event_sending)
+        finish_event(false);
+}
+
+
+// Goes back to listening once the event is sent, or given up on.
+void finish_event(bool sent)
+{
+    EIMSK &= ~_BV(INT0);
+    if (!sent)
+        _radio.flush_tx();
+    _radio.maskIRQ(true, true, false);
+    _radio.startListening();
+    EIMSK |= _BV(INT0);
+
+    _state.event_sending = false;
+    if (sent)
+        _state.event_attempts = EVENT_MAX_ATTEMPTS;
+
+    // Changing mode flushed the queued replies.  The master retries for any
+    // it was waiting for.
+    _state.ack_payloads_queued = 0;
+    queue_current_reply();
+}
+
+
+// Goes back to the previous radio settings if the master hasn't been heard
+// from at new ones within RADIO_PROBATION_MILLIS, and to the defaults if it
+// hasn't been heard from at all within RADIO_SILENCE_MILLIS (see
+// COMMAND_SET_RADIO in lamphouse_shared.h).
+void update_radio()
+{
+    uint8_t received = _receive_queue.received;
+
+    if (received != _state.radio_received)
     {
-        construct_return_packet(return_message, &return_packet[0]);
+        _state.radio_received = received;
+        _state.radio_received_millis = millis();
+        _state.radio_probation = false;
+        return;
+    }
+
+    uint32_t silent_millis = millis() - _state.radio_received_millis;
+
+    if (_state.radio_probation && silent_millis >= RADIO_PROBATION_MILLIS)
+        apply_radio_settings(_state.radio_previous_data_rate, _state.radio_previous_pa_level, _state.radio_previous_channel);
+    else if (silent_millis >= RADIO_SILENCE_MILLIS &&
+        (_state.radio_data_rate != RADIO_DEFAULT_DATA_RATE || _state.radio_pa_level != RADIO_DEFAULT_PA_LEVEL ||
+            _state.radio_channel != RADIO_CHANNEL))
+        apply_radio_settings(RADIO_DEFAULT_DATA_RATE, RADIO_DEFAULT_PA_LEVEL, RADIO_CHANNEL);
+    else
+        return;
+
+    _state.radio_probation = false;
+    queue_current_reply();
+}
+
+
+// Changing mode flushes the queued replies, so the caller queues the current
+// one again.
+void apply_radio_settings(uint8_t data_rate, uint8_t pa_level, uint8_t channel)
+{
 #ifdef DEBUG
-        Serial.println("Sending packet:");
-        print_packet(&return_packet[0]);
+    Serial.print("Radio settings: ");
+    Serial.print(data_rate);
+    Serial.print(", ");
+    Serial.print(pa_level);
+    Serial.print(", channel ");
+    Serial.println(channel);
 #endif
-        respond_to_master(&return_packet[0]);
+
+    EIMSK &= ~_BV(INT0);
+    _radio.stopListening();
+    _radio.setDataRate(rf24_datarate_e(data_rate));
+    _radio.setPALevel(pa_level);
+    _radio.setChannel(channel);
+    _radio.startListening();
+    EIMSK |= _BV(INT0);
+
+    _state.radio_data_rate = data_rate;
+    _state.radio_pa_level = pa_level;
+    _state.radio_channel = channel;
+    _state.radio_received = _receive_queue.received;
+    _state.radio_received_millis = millis();
+    _state.ack_payloads_queued = 0;
+}
+
+
+// Records the last exposure or program once it has finished.  Also called
+// before starting another, so one that finished since loop() last ran is
+// recorded before the engine's achieved time is cleared.
+void update_history()
+{
+    if (!_state.history_pending || exposure_state() != CONTROLLER_STATE_NOT_EXPOSING)
+        return;
+
+    uint32_t achieved_millis;
+    uint16_t achieved_sub_micros;
+
+    exposure_achieved(&achieved_millis, &achieved_sub_micros);
+
+    history_add(_state.history_target_millis, _state.history_target_sub_micros, achieved_millis, achieved_sub_micros,
+        _state.history_timed, _state.history_power[1], _state.history_power[2]);
+    _state.history_pending = false;
+}
+
+
+// Takes the target and powers of the exposure or program just started, so
+// that a program uploaded or settings changed before it's recorded don't
+// change its record.
+void begin_history()
+{
+    current_target(&_state.history_target_millis, &_state.history_target_sub_micros);
+    _state.history_timed = _state.program_running || _state.mode == EXPOSURE_MODE_TIMED;
+    if (_state.program_running)
+    {
+        _state.history_power[1] = _state.program[0].green_power;
+        _state.history_power[2] = _state.program[0].blue_power;
+    }
+    else
+    {
+        _state.history_power[1] = _state.channel_power[1];
+        _state.history_power[2] = _state.channel_power[2];
+    }
+    _state.history_pending = true;
+}
+
+
+// The target time of the exposure or program started last; the program total
+// if a program.
+void current_target(uint32_t* target_millis, uint16_t* target_sub_micros)
+{
+    if (!_state.program_running)
+    {
+        *target_millis = _state.target_millis;
+        *target_sub_micros = _state.target_sub_micros;
+        return;
+    }
+
+    *target_millis = 0;
+    *target_sub_micros = 0;
+    for (uint8_t i = 0; i < _state.program_length; i++)
+    {
+        *target_millis += _state.program[i].millis;
+        *target_sub_micros += _state.program[i].sub_micros;
+        *target_millis += *target_sub_micros / 1000;
+        *target_sub_micros %= 1000;
+    }
+}
+
+
+bool command_switches_outputs(CommsCommand command)
+{
+    switch (command)
+    {
+        case COMMAND_START_EXPOSURE:
+        case COMMAND_STOP_EXPOSURE:
+        case COMMAND_SET_CHANNEL_POWER:
+        case COMMAND_PROGRAM_START:
+        case COMMAND_PROGRAM_CONTINUE:
+        case COMMAND_TEST_STRIP:
+        case COMMAND_EXPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+// The cached entry for a retried command, or NULL if the command is new.
+const ReplayEntry* replay_find(const RadioPacket* packet)
+{
+    uint8_t checksum = replay_checksum(packet);
+
+    for (uint8_t i = 0; i < REPLAY_CACHE_LENGTH; i++)
+    {
+        const ReplayEntry& entry = _replay_cache.entries[i];
+
+        if (entry.command == CommsCommand(PacketCommand::get(packet)) && entry.counter == PacketCounter::get(packet) && entry.checksum == checksum)
+            return &entry;
     }
+
+    return NULL;
+}
+
+
+void replay_add(const RadioPacket* packet, CommsMessage message)
+{
+    ReplayEntry& entry = _replay_cache.entries[_replay_cache.next];
+
+    entry.counter = PacketCounter::get(packet);
+    entry.command = CommsCommand(PacketCommand::get(packet));
+    entry.checksum = replay_checksum(packet);
+    entry.message = message;
+
+    _replay_cache.next = (_replay_cache.next + 1) % REPLAY_CACHE_LENGTH;
+}
+
+
+// Sum of the bytes between the command and the packet counter
+uint8_t replay_checksum(const RadioPacket* packet)
+{
+    uint8_t checksum = 0;
+
+    for (uint8_t i = 1; i < 15; i++)
+        checksum += packet[i];
+
+    return checksum;
+}
+
+
+// Completes the latency of the last output-changing command, once the
+// engine has switched the outputs for it.  The engine latches the time of
+// that switch (see exposure_mark_switch()), so a later one, such as the end
+// of a short exposure, doesn't lengthen it.
+void update_latency()
+{
+    uint32_t switch_micros;
+
+    if (!_state.latency_pending || !exposure_switch_micros(&switch_micros))
+        return;
+
+    uint32_t latency_micros = switch_micros - _state.latency_irq_micros;
+
+    if (latency_micros > 0xFFFE)
+        latency_micros = 0xFFFE;
+
+    _state.latency_micros = latency_micros;
+    if (_state.worst_latency_micros == 0xFFFF || latency_micros > _state.worst_latency_micros)
+        _state.worst_latency_micros = latency_micros;
+    _state.latency_pending = false;
+}
+
+
+// The latency as replies report it (see lamphouse_shared.h)
+uint16_t reported_latency()
+{
+    update_latency();
+
+    return _state.latency_pending ? 0xFFFF : _state.latency_micros;
 }
 
 
 CommsMessage process_command(const RadioPacket* in_packet)
 {
     CommsCommand command;
-    command = CommsCommand(in_packet[0]);
+    command = CommsCommand(PacketCommand::get(in_packet));
     
     switch (command)
     {
-        case COMMAND_REPORT_STATUS:     return MESSAGE_OK;
-        case COMMAND_SET_EXPOSURE:      return set_exposure(in_packet);
-        case COMMAND_START_EXPOSURE:    return start_exposure();
-        case COMMAND_STOP_EXPOSURE:     return stop_exposure();
-        case COMMAND_SET_CHANNEL_POWER: return set_channel_power(in_packet);
+        case COMMAND_REPORT_STATUS:          return MESSAGE_OK;
+        case COMMAND_SET_EXPOSURE:           return set_exposure(in_packet);
+        case COMMAND_START_EXPOSURE:         return start_exposure();
+        case COMMAND_STOP_EXPOSURE:          return stop_exposure();
+        case COMMAND_SET_CHANNEL_POWER:      return set_channel_power(in_packet);
+        case COMMAND_PROGRAM_UPLOAD_STEP:    return upload_program_step(in_packet);
+        case COMMAND_PROGRAM_START:          return start_program();
+        case COMMAND_PROGRAM_CONTINUE:       return continue_program();
+        case COMMAND_TEST_STRIP:             return start_test_strip(in_packet);
+        case COMMAND_SET_DOSE:               return set_dose(in_packet);
+        case COMMAND_REPORT_DOSE:            return MESSAGE_OK;
+        case COMMAND_SET_METERED:            return set_metered(in_packet);
+        case COMMAND_REPORT_METER:           return MESSAGE_OK;
+        case COMMAND_MEASURE_SKEW:           return measure_skew(in_packet);
+        case COMMAND_REPORT_LATENCY:         return MESSAGE_OK;
+        case COMMAND_REPORT_HISTORY:         return report_history(in_packet);
+        case COMMAND_EXPOSE:                 return expose(in_packet);
+        case COMMAND_FETCH_REPLY:            return MESSAGE_OK;
+        case COMMAND_SET_RADIO:              return set_radio(in_packet);
+        case COMMAND_SET_CHANNEL:            return set_channel(in_packet);
     }
     
     return MESSAGE_INVALID_COMMAND;
 }
 
 
-void construct_return_packet(CommsMessage message, RadioPacket* return_packet)
+void construct_return_packet(CommsCommand command, CommsMessage message, RadioPacket* return_packet)
 {
-    uint32_t achieved_millis = _state.end_millis - _state.start_millis;
-    
-    return_packet[0] = (uint8_t(message) & 0x3F) | (uint8_t(_state.state) << 6);
-    
-    return_packet[1] = _state.channel_power[0];
-    return_packet[2] = _state.channel_power[1];
-    return_packet[3] = _state.channel_power[2];
-    
-    return_packet[4] = _state.target_millis >> 32;
-    return_packet[5] = (_state.target_millis >> 16) & 0xFF;
-    return_packet[6] = (_state.target_millis >> 8) & 0xFF;
-    return_packet[7] = _state.target_millis & 0xFF;
-    
-    return_packet[8] = achieved_millis >> 32;
-    return_packet[9] = (achieved_millis >> 16) & 0xFF;
-    return_packet[10] = (achieved_millis >> 8) & 0xFF;
-    return_packet[11] = achieved_millis & 0xFF;
+    uint32_t target_millis;
+    uint16_t target_sub_micros;
+    uint32_t achieved_millis;
+    uint16_t achieved_sub_micros;
+
+    ReplyState::put(return_packet, exposure_state());
+    ReplyMessage::put(return_packet, message);
+
+    if (command == COMMAND_REPORT_HISTORY)
+    {
+        // Records in place of the whole status
+        history_read(_state.history_sequence, HISTORY_RECORDS_PER_PACKET, &return_packet[2], &return_packet[1]);
+        return;
+    }
+
+    current_target(&target_millis, &target_sub_micros);
+    exposure_achieved(&achieved_millis, &achieved_sub_micros);
+
+    ReplyRedPower::put(return_packet, _state.channel_power[0] >> 4);
+    ReplyGreenPower::put(return_packet, _state.channel_power[1]);
+    ReplyBluePower::put(return_packet, _state.channel_power[2]);
+    ReplyTargetMillis::put(return_packet, target_millis);
+    ReplyAchievedMillis::put(return_packet, achieved_millis);
+    ReplyTargetSubMicros::put(return_packet, target_sub_micros);
+    ReplyAchievedSubMicros::put(return_packet, achieved_sub_micros);
+    ReplyStepIndex::put(return_packet, exposure_step_index());
+
+    if (command == COMMAND_REPORT_DOSE)
+    {
+        uint32_t green_dose, blue_dose;
+
+        exposure_dose(&green_dose, &blue_dose);
+        ReplyGreenDose::put(return_packet, green_dose);
+        ReplyBlueDose::put(return_packet, blue_dose);
+    }
+    else if (command == COMMAND_REPORT_METER)
+    {
+        uint32_t measured_dose, light_level;
+        uint16_t measured_dose_fraction, dark;
+
+        uint8_t lock_state = exposure_hw_lock();
+        meter_dose(&measured_dose, &measured_dose_fraction);
+        light_level = meter_rate();
+        dark = meter_dark();
+        exposure_hw_unlock(lock_state);
+
+        // Mean over the last period, in ADC counts above dark
+        light_level = (light_level + EXPOSURE_PERIOD_MICROS / 2) / EXPOSURE_PERIOD_MICROS;
+
+        ReplyMeterDose::put(return_packet, measured_dose);
+        ReplyMeterDark::put(return_packet, dark);
+        ReplyMeterLight::put(return_packet, light_level);
+    }
+    else if (command == COMMAND_REPORT_LATENCY)
+    {
+        ReplyLatency::put(return_packet, reported_latency());
+        ReplyWorstLatency::put(return_packet, _state.worst_latency_micros);
+        ReplyReceiveOverflows::put(return_packet, _receive_queue.overflows);
+    }
+    else if (command == COMMAND_MEASURE_SKEW)
+    {
+        ReplyOnSkew::put(return_packet, _state.skew_counts[0]);
+        ReplyOffSkew::put(return_packet, _state.skew_counts[1]);
+    }
 }
 
 
-CommsMessage respond_to_master(const RadioPacket* return_packet)
+void queue_current_reply()
 {
-    _radio.stopListening();
-    if (!_radio.write(return_packet, PACKET_SIZE))
+    RadioPacket reply[ACK_PAYLOAD_SIZE];
+
+    memset(&reply[0], 0, ACK_PAYLOAD_SIZE);
+    construct_return_packet(_state.reply_command, _state.reply_message, &reply[0]);
+    AckPayloadCounter::put(&reply[0], _state.reply_counter);
+    AckPayloadLatency::put(&reply[0], reported_latency());
+#ifdef DEBUG
+    Serial.println("Queueing packet:");
+    print_packet(&reply[0]);
+#endif
+    queue_reply(&reply[0]);
+}
+
+
+// Queues reply to follow any ACK payloads already queued.  If the radio's
+// queue is full, the replies in it are dropped, and the master retries for
+// them.
+void queue_reply(const RadioPacket* reply)
+{
+    EIMSK &= ~_BV(INT0);
+    if (_state.ack_payloads_queued >= ACK_PAYLOAD_QUEUE_LENGTH)
     {
-        _radio.startListening();
-        return MESSAGE_NO_RECEIVER;
+        _radio.flush_tx();
+        _state.ack_payloads_queued = 0;
     }
-    _radio.startListening();
+    _radio.writeAckPayload(1, reply, ACK_PAYLOAD_SIZE);
+    _state.ack_payloads_queued++;
+    EIMSK |= _BV(INT0);
+}
 
-    return MESSAGE_OK;
+
+// The radio sends a queued ACK payload, if it has one, with the ACK to each
+// packet it receives.  It doesn't say how many it still holds, so they're
+// counted off against the packets received.
+void update_ack_payloads_queued()
+{
+    uint8_t received = _receive_queue.received;
+    uint8_t sent = received - _state.ack_payloads_received;
+
+    _state.ack_payloads_received = received;
+    _state.ack_payloads_queued = sent >= _state.ack_payloads_queued ? 0 : _state.ack_payloads_queued - sent;
 }
 
 
 CommsMessage set_exposure(const RadioPacket* in_packet)
 {
-    if (_state.state == CONTROLLER_STATE_EXPOSING)
+    if (exposure_state() != CONTROLLER_STATE_NOT_EXPOSING)
         return MESSAGE_CANNOT_SET_EXPOSURE_WHILE_EXPOSING;
     
-    _state.channel_power[1] = in_packet[2];
-    _state.channel_power[2] = in_packet[3];
-    _state.target_millis = in_packet[4];
-    _state.target_millis <<= 8;
-    _state.target_millis |= in_packet[5];
-    _state.target_millis <<= 8;
-    _state.target_millis |= in_packet[6];
-    _state.target_millis <<= 8;
-    _state.target_millis |= in_packet[7];
-    _state.start_millis = 0;
-    _state.end_millis = 0;
+    _state.channel_power[1] = CommandGreenPower::get(in_packet);
+    _state.channel_power[2] = CommandBluePower::get(in_packet);
+    _state.target_millis = CommandTargetMillis::get(in_packet);
+    _state.target_sub_micros = unpack_target_sub_micros(in_packet);
+    _state.mode = EXPOSURE_MODE_TIMED;
+
+    return MESSAGE_OK;
+}
+
+
+CommsMessage set_dose(const RadioPacket* in_packet)
+{
+    if (exposure_state() != CONTROLLER_STATE_NOT_EXPOSING)
+        return MESSAGE_CANNOT_SET_EXPOSURE_WHILE_EXPOSING;
+
+    _state.channel_power[1] = CommandGreenPower::get(in_packet);
+    _state.channel_power[2] = CommandBluePower::get(in_packet);
+    _state.target_dose[1] = CommandGreenDose::get(in_packet);
+    _state.target_dose[2] = CommandBlueDose::get(in_packet);
+    // There's no target time; the exposure lasts as long as the doses take.
+    _state.target_millis = 0;
+    _state.target_sub_micros = 0;
+    _state.mode = EXPOSURE_MODE_DOSE;
+
+    return MESSAGE_OK;
+}
+
+
+CommsMessage set_metered(const RadioPacket* in_packet)
+{
+    if (exposure_state() != CONTROLLER_STATE_NOT_EXPOSING)
+        return MESSAGE_CANNOT_SET_EXPOSURE_WHILE_EXPOSING;
+
+    _state.channel_power[1] = CommandGreenPower::get(in_packet);
+    _state.channel_power[2] = CommandBluePower::get(in_packet);
+    _state.target_meter_dose = CommandMeterDose::get(in_packet);
+    _state.target_millis = 0;
+    _state.target_sub_micros = 0;
+    _state.mode = EXPOSURE_MODE_METERED;
 
     return MESSAGE_OK;
 }
@@ -234,94 +969,235 @@ CommsMessage set_exposure(const RadioPacket* in_packet)
 
 CommsMessage start_exposure()
 {
-    if (_state.state == CONTROLLER_STATE_EXPOSING)
+    bool started;
+
+    update_history();
+    switch (_state.mode)
+    {
+        case EXPOSURE_MODE_DOSE:
+            started = exposure_start_dose(_state.channel_power[1], _state.channel_power[2], _state.target_dose[1], _state.target_dose[2]);
+            break;
+        case EXPOSURE_MODE_METERED:
+            started = exposure_start_metered(_state.channel_power[1], _state.channel_power[2], _state.target_meter_dose);
+            break;
+        default:
+            started = exposure_start(_state.channel_power[1], _state.channel_power[2], _state.target_millis, _state.target_sub_micros);
+    }
+
+    if (!started)
         return MESSAGE_EXPOSURE_ALREADY_UNDERWAY;
 
-    _state.state = CONTROLLER_STATE_EXPOSING;
-    _state.start_millis = millis();
-    analogWrite(PIN_OUT_BLUE, _state.channel_power[2]);
-    analogWrite(PIN_OUT_GREEN, _state.channel_power[1]);
+    _state.program_running = false;
+    begin_history();
 
     return MESSAGE_OK;    
 }
 
 
-CommsMessage stop_exposure()
+// COMMAND_SET_CHANNEL_POWER, COMMAND_SET_EXPOSURE or COMMAND_SET_DOSE, and
+// COMMAND_START_EXPOSURE in one.
+CommsMessage expose(const RadioPacket* in_packet)
 {
-    if (_state.state == CONTROLLER_STATE_NOT_EXPOSING)
-        return MESSAGE_NOT_EXPOSING;
-    
-    _state.state = CONTROLLER_STATE_NOT_EXPOSING;
+    CommsMessage message = set_exposure(in_packet);
 
-    analogWrite(PIN_OUT_BLUE, 0);
-    analogWrite(PIN_OUT_GREEN, 0);
-    _state.end_millis = millis();
+    if (message != MESSAGE_OK)
+        return message;
 
-    return MESSAGE_OK;    
+    _state.channel_power[0] = uint16_t(CommandRedPower::get(in_packet)) << 4;
+    exposure_hw_write_channel(CHANNEL_RED, _state.channel_power[0]);
+
+    if (CommandExposeFlags::get(in_packet) & EXPOSE_FLAG_BY_DOSE)
+    {
+        // Dose in 8-bit power-milliseconds, rounded
+        uint64_t target_micros = uint64_t(_state.target_millis) * 1000 + _state.target_sub_micros;
+        const uint32_t dose_divisor = uint32_t(POWER_FINE_STEPS) * 1000;
+
+        _state.target_dose[1] = uint32_t((target_micros * _state.channel_power[1] + dose_divisor / 2) / dose_divisor);
+        _state.target_dose[2] = uint32_t((target_micros * _state.channel_power[2] + dose_divisor / 2) / dose_divisor);
+        _state.target_millis = 0;
+        _state.target_sub_micros = 0;
+        _state.mode = EXPOSURE_MODE_DOSE;
+    }
+
+    return start_exposure();
+}
+
+
+// The reply is queued after the change, so goes at the new settings.
+CommsMessage set_radio(const RadioPacket* in_packet)
+{
+    uint8_t data_rate = CommandRadioDataRate::get(in_packet);
+    uint8_t pa_level = CommandRadioPaLevel::get(in_packet);
+
+    if (data_rate > RF24_250KBPS || pa_level > RF24_PA_MAX)
+        return MESSAGE_SET_FAILED;
+
+    start_radio_probation();
+    apply_radio_settings(data_rate, pa_level, _state.radio_channel);
+
+    return MESSAGE_OK;
+}
+
+
+// As set_radio()
+CommsMessage set_channel(const RadioPacket* in_packet)
+{
+    uint8_t channel = CommandRadioChannel::get(in_packet);
+
+    if (channel > RADIO_MAX_CHANNEL)
+        return MESSAGE_SET_FAILED;
+
+    start_radio_probation();
+    apply_radio_settings(_state.radio_data_rate, _state.radio_pa_level, channel);
+
+    return MESSAGE_OK;
+}
+
+
+// Keeps the settings last heard at, to go back to.  A switch made while
+// still on probation keeps those from before it.
+void start_radio_probation()
+{
+    if (!_state.radio_probation)
+    {
+        _state.radio_previous_data_rate = _state.radio_data_rate;
+        _state.radio_previous_pa_level = _state.radio_pa_level;
+        _state.radio_previous_channel = _state.radio_channel;
+    }
+    _state.radio_probation = true;
 }
 
 
-void process_timers()
+CommsMessage stop_exposure()
 {
-    if (_state.state != CONTROLLER_STATE_EXPOSING)
-        return;       // Not exposing
-        
-    _state.end_millis = millis();
-    uint32_t exposed_time = _state.end_millis - _state.start_millis;
+    if (!exposure_stop())
+        return MESSAGE_NOT_EXPOSING;
 
-    if (exposed_time >= _state.target_millis)
-        stop_exposure();
+    return MESSAGE_OK;    
 }
 
 
 CommsMessage set_channel_power(const RadioPacket* in_packet)
 {
-    if (_state.state == CONTROLLER_STATE_EXPOSING)
-        return MESSAGE_CANNOT_SET_EXPOSURE_WHILE_EXPOSING;
+    if (exposure_state() != CONTROLLER_STATE_NOT_EXPOSING)
+    {
+        // Dose and metered exposures take the new powers into account, so
+        // they can be changed while they run.
+        if (!exposure_set_dose_power(CommandGreenPower::get(in_packet), CommandBluePower::get(in_packet)))
+            return MESSAGE_CANNOT_SET_EXPOSURE_WHILE_EXPOSING;
+
+        _state.channel_power[0] = uint16_t(CommandRedPower::get(in_packet)) << 4;
+        _state.channel_power[1] = CommandGreenPower::get(in_packet);
+        _state.channel_power[2] = CommandBluePower::get(in_packet);
+        exposure_hw_write_channel(CHANNEL_RED, _state.channel_power[0]);
+
+        return MESSAGE_OK;
+    }
     
-    _state.channel_power[0] = in_packet[1];
-    _state.channel_power[1] = in_packet[2];
-    _state.channel_power[2] = in_packet[3];
-    _state.start_millis = 0;
-    _state.end_millis = 0;
-    analogWrite(PIN_OUT_RED, _state.channel_power[0]);
-    analogWrite(PIN_OUT_GREEN, _state.channel_power[1]);
-    analogWrite(PIN_OUT_BLUE, _state.channel_power[2]);
+    _state.channel_power[0] = uint16_t(CommandRedPower::get(in_packet)) << 4;
+    _state.channel_power[1] = CommandGreenPower::get(in_packet);
+    _state.channel_power[2] = CommandBluePower::get(in_packet);
+    exposure_hw_write_channel(CHANNEL_RED, _state.channel_power[0]);
+    exposure_set_idle_power(_state.channel_power[1], _state.channel_power[2]);
 
     return MESSAGE_OK;   
 }
 
 
+CommsMessage upload_program_step(const RadioPacket* in_packet)
+{
+    // The engine reads the program while it runs
+    if (exposure_state() != CONTROLLER_STATE_NOT_EXPOSING)
+        return MESSAGE_CANNOT_SET_EXPOSURE_WHILE_EXPOSING;
 
-#ifdef DEBUG
-CommsMessage interpret_packet(const uint8_t* returned_packet, ControllerExternalStatus* controller_status)
+    uint8_t index = CommandStepIndex::get(in_packet);
+    if (index > _state.program_length || index >= PROGRAM_MAX_STEPS)
+        return MESSAGE_INVALID_PROGRAM;
+
+    ProgramStep& step = _state.program[index];
+    packet_decode_program_step(in_packet, &step);
+    if (step.sub_micros > 999)
+        step.sub_micros = 999;
+
+    _state.program_length = index + 1;
+
+    return MESSAGE_OK;
+}
+
+
+CommsMessage start_program()
 {
-    controller_status->state = ControllerState(returned_packet[0] >> 6);
-    
-    controller_status->channel_power[0] = returned_packet[1];
-    controller_status->channel_power[1] = returned_packet[2];
-    controller_status->channel_power[2] = returned_packet[3];
-    
-    controller_status->target_millis = returned_packet[4];
-    controller_status->target_millis <<= 8;
-    controller_status->target_millis |= returned_packet[5];
-    controller_status->target_millis <<= 8;
-    controller_status->target_millis |= returned_packet[6];
-    controller_status->target_millis <<= 8;
-    controller_status->target_millis |= returned_packet[7];
+    if (exposure_state() != CONTROLLER_STATE_NOT_EXPOSING)
+        return MESSAGE_EXPOSURE_ALREADY_UNDERWAY;
 
-    controller_status->achieved_millis = returned_packet[8];
-    controller_status->achieved_millis <<= 8;
-    controller_status->achieved_millis |= returned_packet[9];
-    controller_status->achieved_millis <<= 8;
-    controller_status->achieved_millis |= returned_packet[10];
-    controller_status->achieved_millis <<= 8;
-    controller_status->achieved_millis |= returned_packet[11];
+    update_history();
+    if (!exposure_run_program(&_state.program[0], _state.program_length))
+        return MESSAGE_INVALID_PROGRAM;
 
-    return CommsMessage(returned_packet[0] & 0x3F);
+    _state.program_running = true;
+    begin_history();
+
+    return MESSAGE_OK;
+}
+
+
+CommsMessage continue_program()
+{
+    if (!exposure_continue())
+        return MESSAGE_NOT_EXPOSING;
+
+    return MESSAGE_OK;
+}
+
+
+CommsMessage start_test_strip(const RadioPacket* in_packet)
+{
+    if (exposure_state() != CONTROLLER_STATE_NOT_EXPOSING)
+        return MESSAGE_EXPOSURE_ALREADY_UNDERWAY;
+
+    uint8_t strip_count = CommandStripCount::get(in_packet);
+
+    if (!test_strip_build(&_state.program[0], CommandGreenPower::get(in_packet), CommandBluePower::get(in_packet),
+            CommandTargetMillis::get(in_packet), unpack_target_sub_micros(in_packet),
+            CommandStopDivisor::get(in_packet), strip_count, CommandStripPauseMillis::get(in_packet)))
+        return MESSAGE_INVALID_PROGRAM;
+
+    _state.program_length = strip_count;
+
+    return start_program();
+}
+
+
+CommsMessage report_history(const RadioPacket* in_packet)
+{
+    _state.history_sequence = CommandHistorySequence::get(in_packet);
+
+    return MESSAGE_OK;
+}
+
+
+CommsMessage measure_skew(const RadioPacket* in_packet)
+{
+    if (!exposure_measure_skew(CommandGreenPower::get(in_packet), CommandBluePower::get(in_packet), &_state.skew_counts[0], &_state.skew_counts[1]))
+        return MESSAGE_EXPOSURE_ALREADY_UNDERWAY;
+
+    return MESSAGE_OK;
+}
+
+
+uint16_t unpack_target_sub_micros(const RadioPacket* packet)
+{
+    uint16_t sub_micros = CommandTargetSubMicros::get(packet);
+
+    if (sub_micros > 999)
+        sub_micros = 999;
+
+    return sub_micros;
 }
 
 
+
+#ifdef DEBUG
 void print_packet_raw(const RadioPacket* packet)
 {
     Serial.println("RAW PACKET:");
@@ -339,7 +1215,7 @@ void print_packet(const RadioPacket* packet)
     CommsMessage msg;
     ControllerExternalStatus controller_status;
     
-    msg = interpret_packet(packet, &controller_status);
+    msg = packet_decode_status(packet, &controller_status);
 
     print_packet_raw(packet);
     Serial.println("PACKET:");
@@ -354,17 +1230,19 @@ void print_packet(const RadioPacket* packet)
     Serial.print("Blue:     ");
     Serial.println(controller_status.channel_power[2]);
     Serial.print("Target:   ");
-    Serial.println(controller_status.target_millis);
+    Serial.print(controller_status.target_millis);
+    Serial.print(" ms + ");
+    Serial.print(controller_status.target_sub_micros);
+    Serial.println(" us");
     Serial.print("Achieved: ");
-    Serial.println(controller_status.achieved_millis);
-    Serial.print("Reserved: ");
-    Serial.print(packet[12]);
-    Serial.print(" ");
-    Serial.print(packet[13]);
-    Serial.print(" ");
-    Serial.print(packet[14]);
-    Serial.print(" ");
+    Serial.print(controller_status.achieved_millis);
+    Serial.print(" ms + ");
+    Serial.print(controller_status.achieved_sub_micros);
+    Serial.println(" us");
+    Serial.print("Step:     ");
+    Serial.println(controller_status.step_index);
+    Serial.print("Fine:     ");
     Serial.println(packet[15]);
 }
 #endif
-
+
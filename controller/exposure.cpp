@@ -0,0 +1,1052 @@
+#include "exposure.h"
+#include "meter.h"
+
+
+enum ExposurePhase {
+    EXPOSURE_PHASE_IDLE                             = 0,
+    EXPOSURE_PHASE_PENDING                          = 1,    // Waiting for the next period to start the current step
+    EXPOSURE_PHASE_EXPOSING                         = 2,
+    EXPOSURE_PHASE_PAUSED                           = 3,    // Timed pause before the current step
+    EXPOSURE_PHASE_HOLDING                          = 4     // Waiting for exposure_continue() before the current step
+};
+
+// periods_remaining for a segment with no scheduled end
+const static uint32_t EXPOSURE_OPEN_PERIODS = 0xFFFFFFFF;
+
+// Powers are 12-bit, and dose is in 8-bit power-milliseconds, so this many
+// 12-bit power-counts make a unit of dose.  It's 2^8 * 125, which keeps the
+// division in exposure_add_dose() to 16 bits.
+const static uint16_t EXPOSURE_DOSE_FRACTION = POWER_FINE_STEPS * EXPOSURE_COUNTS_PER_PERIOD;
+
+/* A program is run as a chain of segments (step exposures and pauses), each
+ * starting where the previous one ended.  Segment timing is therefore tracked
+ * in timer counts relative to the period grid:
+ *   periods_remaining  Period interrupts until the segment's final period.
+ *   final_counts       Where the segment ends in its final period; 0 is at
+ *                      the start of the period.
+ * The timer's compare point only takes effect from the period after it's
+ * loaded, so compare_load_period records when it was loaded.  A segment that
+ * would end in the same period as its compare point was loaded is instead
+ * ended at the start of the next period, late by the rest of that period,
+ * rather than busy-waited for in the interrupt or with interrupts locked.
+ * This only happens to a segment shorter than the rest of the period it
+ * starts in, or replanned mid-period, and its achieved time shows it.
+ */
+struct ExposureEngine
+{
+    volatile uint8_t phase;
+    const ProgramStep* steps;
+    uint8_t step_count;
+    volatile uint8_t step_index;
+    ProgramStep single_step;            // exposure_start() runs this as a one-step program
+
+    volatile uint32_t periods_remaining;
+    volatile uint16_t final_counts;
+    uint16_t compare_counts;
+    uint32_t compare_load_period;
+
+    uint32_t step_start_period;         // When the current step's outputs were switched on
+    uint16_t step_start_counts;
+
+    uint32_t achieved_millis;           // Total exposure time of completed steps
+    uint16_t achieved_sub_micros;
+
+    volatile uint32_t timebase_periods;
+
+    // Dose mode (exposure_start_dose()), run as single_step with an open end.
+    // Each channel's dose is added up every period, and when its power
+    // changes, at the whole-period rates precomputed by
+    // exposure_dose_set_rates(), so the interrupts need no 32-bit
+    // multiplies or divides until the end is due.
+    bool dose_mode;
+    uint32_t dose_target[3];            // Indexed by channel; red is unused
+    uint32_t dose[3];
+    uint16_t dose_fraction[3];          // Remainder of dose, in 12-bit power-counts
+    uint8_t period_dose[3];             // Dose per period at the current power
+    uint16_t period_dose_fraction[3];   // and its remainder
+    uint8_t dose_done;                  // Bit per channel that has reached its target
+    uint8_t dose_ending;                // Bit per channel the current segment ends
+    uint32_t interval_start_period;
+    uint16_t interval_start_counts;
+
+    // Metered mode (exposure_start_metered()), also run as single_step with
+    // an open end, until the meter's measured dose reaches meter_target.
+    bool metered;
+    uint32_t meter_target;
+
+    // When the outputs were last written, as the timer read just after
+    uint32_t output_period;
+    uint16_t output_counts;
+
+    // When the outputs were first switched since exposure_mark_switch()
+    bool switched;
+    uint32_t switch_period;
+    uint16_t switch_counts;
+};
+
+
+static ExposureEngine _engine;
+
+
+static void exposure_arm();
+static void exposure_begin_step(uint16_t start_counts);
+static void exposure_schedule(uint16_t start_counts, uint32_t millis, uint16_t sub_micros);
+static void exposure_final_period(uint16_t now_counts);
+static void exposure_segment_end(uint16_t counts);
+static void exposure_outputs_off();
+static void exposure_add_current_step(uint32_t* millis, uint16_t* sub_micros);
+static void exposure_add_switched_step(uint32_t start_period, uint16_t start_counts);
+static void exposure_add_time(uint32_t* millis, uint16_t* sub_micros, uint32_t add_millis, int32_t add_sub_micros);
+static void exposure_elapsed(uint32_t start_period, uint16_t start_counts, uint16_t now_counts, uint32_t* millis, uint16_t* sub_micros);
+static void exposure_interval(uint32_t start_period, uint16_t start_counts, uint32_t end_period, uint16_t end_counts,
+    uint32_t* millis, uint16_t* sub_micros);
+static void exposure_begin_dose();
+static void exposure_dose_set_rates();
+static void exposure_dose_period();
+static void exposure_plan_dose(uint16_t now_counts);
+static int32_t exposure_dose_interval_counts(uint16_t now_counts);
+static void exposure_dose_interval_end(uint16_t now_counts);
+static void exposure_dose_segment_end(uint16_t counts);
+static void exposure_dose_write_channels();
+static uint16_t exposure_dose_power(uint8_t channel);
+static void exposure_add_dose(uint8_t channel, uint32_t counts, uint32_t* dose, uint16_t* dose_fraction);
+static void exposure_begin_metered();
+static void exposure_metered_period();
+static void exposure_finish();
+static void exposure_write_channels(uint16_t green_power, uint16_t blue_power);
+
+
+void exposure_init()
+{
+    _engine.phase = EXPOSURE_PHASE_IDLE;
+    _engine.steps = 0;
+    _engine.step_count = 0;
+    _engine.step_index = 0;
+    _engine.single_step.green_power = 0;
+    _engine.single_step.blue_power = 0;
+    _engine.single_step.millis = 0;
+    _engine.single_step.sub_micros = 0;
+    _engine.single_step.pause_millis = 0;
+    _engine.periods_remaining = 0;
+    _engine.final_counts = 0;
+    _engine.compare_counts = 0;
+    _engine.compare_load_period = 0;
+    _engine.step_start_period = 0;
+    _engine.step_start_counts = 0;
+    _engine.achieved_millis = 0;
+    _engine.achieved_sub_micros = 0;
+    _engine.timebase_periods = 0;
+    _engine.dose_mode = false;
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        _engine.dose_target[channel] = 0;
+        _engine.dose[channel] = 0;
+        _engine.dose_fraction[channel] = 0;
+        _engine.period_dose[channel] = 0;
+        _engine.period_dose_fraction[channel] = 0;
+    }
+    _engine.dose_done = 0;
+    _engine.dose_ending = 0;
+    _engine.interval_start_period = 0;
+    _engine.interval_start_counts = 0;
+    _engine.metered = false;
+    _engine.meter_target = 0;
+    _engine.output_period = 0;
+    _engine.output_counts = 0;
+    _engine.switched = false;
+    _engine.switch_period = 0;
+    _engine.switch_counts = 0;
+
+    exposure_hw_init();
+}
+
+
+bool exposure_start(uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros)
+{
+    if (_engine.phase != EXPOSURE_PHASE_IDLE)
+        return false;
+
+    _engine.single_step.green_power = green_power;
+    _engine.single_step.blue_power = blue_power;
+    _engine.single_step.millis = target_millis;
+    _engine.single_step.sub_micros = target_sub_micros;
+    _engine.single_step.pause_millis = 0;
+
+    return exposure_run_program(&_engine.single_step, 1);
+}
+
+
+bool exposure_run_program(const ProgramStep* steps, uint8_t step_count)
+{
+    if (_engine.phase != EXPOSURE_PHASE_IDLE || step_count == 0)
+        return false;
+
+    uint8_t lock_state = exposure_hw_lock();
+
+    _engine.steps = steps;
+    _engine.step_count = step_count;
+    _engine.step_index = 0;
+    _engine.achieved_millis = 0;
+    _engine.achieved_sub_micros = 0;
+    _engine.dose_mode = false;
+    _engine.metered = false;
+    exposure_arm();
+
+    exposure_hw_unlock(lock_state);
+
+    return true;
+}
+
+
+bool exposure_start_dose(uint16_t green_power, uint16_t blue_power, uint32_t green_dose, uint32_t blue_dose)
+{
+    if (_engine.phase != EXPOSURE_PHASE_IDLE)
+        return false;
+
+    uint8_t lock_state = exposure_hw_lock();
+
+    _engine.single_step.green_power = green_power;
+    _engine.single_step.blue_power = blue_power;
+    _engine.single_step.millis = 0;
+    _engine.single_step.sub_micros = 0;
+    _engine.single_step.pause_millis = 0;
+    _engine.steps = &_engine.single_step;
+    _engine.step_count = 1;
+    _engine.step_index = 0;
+    _engine.achieved_millis = 0;
+    _engine.achieved_sub_micros = 0;
+
+    _engine.metered = false;
+    _engine.dose_mode = true;
+    _engine.dose_target[CHANNEL_GREEN] = green_dose;
+    _engine.dose_target[CHANNEL_BLUE] = blue_dose;
+    _engine.dose[CHANNEL_GREEN] = 0;
+    _engine.dose[CHANNEL_BLUE] = 0;
+    _engine.dose_fraction[CHANNEL_GREEN] = 0;
+    _engine.dose_fraction[CHANNEL_BLUE] = 0;
+    _engine.dose_done = 0;
+    if (green_dose == 0)
+        _engine.dose_done |= (1 << CHANNEL_GREEN);
+    if (blue_dose == 0)
+        _engine.dose_done |= (1 << CHANNEL_BLUE);
+    exposure_dose_set_rates();
+    _engine.phase = EXPOSURE_PHASE_PENDING;
+
+    // A dose due in the first period is planned here, so that its compare
+    // point is loaded in time (see exposure_final_period()).
+    exposure_plan_dose(0);
+
+    exposure_hw_unlock(lock_state);
+
+    return true;
+}
+
+
+bool exposure_start_metered(uint16_t green_power, uint16_t blue_power, uint32_t meter_dose)
+{
+    if (_engine.phase != EXPOSURE_PHASE_IDLE)
+        return false;
+
+    uint8_t lock_state = exposure_hw_lock();
+
+    _engine.single_step.green_power = green_power;
+    _engine.single_step.blue_power = blue_power;
+    _engine.single_step.millis = 0;
+    _engine.single_step.sub_micros = 0;
+    _engine.single_step.pause_millis = 0;
+    _engine.steps = &_engine.single_step;
+    _engine.step_count = 1;
+    _engine.step_index = 0;
+    _engine.achieved_millis = 0;
+    _engine.achieved_sub_micros = 0;
+
+    _engine.dose_mode = false;
+    _engine.metered = true;
+    _engine.meter_target = meter_dose;
+    _engine.phase = EXPOSURE_PHASE_PENDING;
+
+    exposure_hw_unlock(lock_state);
+
+    return true;
+}
+
+
+bool exposure_set_dose_power(uint16_t green_power, uint16_t blue_power)
+{
+    if (!(_engine.dose_mode || _engine.metered) ||
+        (_engine.phase != EXPOSURE_PHASE_PENDING && _engine.phase != EXPOSURE_PHASE_EXPOSING))
+        return false;
+
+    uint8_t lock_state = exposure_hw_lock();
+
+    if (_engine.phase == EXPOSURE_PHASE_EXPOSING && _engine.metered)
+    {
+        // The meter sees the change; nothing to replan.
+        _engine.single_step.green_power = green_power;
+        _engine.single_step.blue_power = blue_power;
+        exposure_write_channels(green_power, blue_power);
+    }
+    else if (_engine.phase == EXPOSURE_PHASE_EXPOSING)
+    {
+        // Close the interval at the old powers, and replan the rest of the
+        // exposure from here at the new ones.
+        uint16_t now_counts = exposure_hw_counter();
+
+        exposure_hw_disable_compare();
+        exposure_dose_interval_end(now_counts);
+        _engine.single_step.green_power = green_power;
+        _engine.single_step.blue_power = blue_power;
+        exposure_dose_set_rates();
+        exposure_dose_write_channels();
+        exposure_plan_dose(now_counts);
+        exposure_final_period(now_counts);
+    }
+    else
+    {
+        _engine.single_step.green_power = green_power;
+        _engine.single_step.blue_power = blue_power;
+        if (_engine.dose_mode)
+        {
+            exposure_dose_set_rates();
+            exposure_plan_dose(0);
+        }
+    }
+
+    exposure_hw_unlock(lock_state);
+
+    return true;
+}
+
+
+bool exposure_continue()
+{
+    if (_engine.phase != EXPOSURE_PHASE_HOLDING)
+        return false;
+
+    uint8_t lock_state = exposure_hw_lock();
+    exposure_arm();
+    exposure_hw_unlock(lock_state);
+
+    return true;
+}
+
+
+bool exposure_stop()
+{
+    bool stopped = true;
+    uint8_t lock_state = exposure_hw_lock();
+
+    switch (_engine.phase)
+    {
+        case EXPOSURE_PHASE_EXPOSING:
+            if (_engine.dose_mode)
+                exposure_dose_interval_end(exposure_hw_counter());
+            exposure_outputs_off();
+            exposure_add_switched_step(_engine.step_start_period, _engine.step_start_counts);
+            break;
+        case EXPOSURE_PHASE_PENDING:
+        case EXPOSURE_PHASE_PAUSED:
+        case EXPOSURE_PHASE_HOLDING:
+            break;          // Lights are already off
+        default:
+            stopped = false;
+    }
+
+    exposure_hw_disable_compare();
+    _engine.phase = EXPOSURE_PHASE_IDLE;
+
+    exposure_hw_unlock(lock_state);
+
+    return stopped;
+}
+
+
+ControllerState exposure_state()
+{
+    switch (_engine.phase)
+    {
+        case EXPOSURE_PHASE_PENDING:
+        case EXPOSURE_PHASE_EXPOSING:   return CONTROLLER_STATE_EXPOSING;
+        case EXPOSURE_PHASE_PAUSED:     return CONTROLLER_STATE_PAUSED;
+        case EXPOSURE_PHASE_HOLDING:    return CONTROLLER_STATE_HOLDING;
+    }
+
+    return CONTROLLER_STATE_NOT_EXPOSING;
+}
+
+
+uint8_t exposure_step_index()
+{
+    return _engine.step_index;
+}
+
+
+bool exposure_dose_mode()
+{
+    return _engine.dose_mode;
+}
+
+
+void exposure_dose(uint32_t* green_dose, uint32_t* blue_dose)
+{
+    uint8_t lock_state = exposure_hw_lock();
+
+    uint32_t dose[3];
+    dose[CHANNEL_GREEN] = _engine.dose[CHANNEL_GREEN];
+    dose[CHANNEL_BLUE] = _engine.dose[CHANNEL_BLUE];
+
+    if (_engine.dose_mode && _engine.phase == EXPOSURE_PHASE_EXPOSING)
+    {
+        int32_t counts = exposure_dose_interval_counts(exposure_hw_counter());
+
+        for (uint8_t channel = CHANNEL_GREEN; channel <= CHANNEL_BLUE; channel++)
+        {
+            uint16_t dose_fraction = _engine.dose_fraction[channel];
+
+            if (counts > 0 && !(_engine.dose_done & (1 << channel)))
+                exposure_add_dose(channel, counts, &dose[channel], &dose_fraction);
+        }
+    }
+
+    exposure_hw_unlock(lock_state);
+
+    *green_dose = dose[CHANNEL_GREEN];
+    *blue_dose = dose[CHANNEL_BLUE];
+}
+
+
+void exposure_achieved(uint32_t* achieved_millis, uint16_t* achieved_sub_micros)
+{
+    uint8_t lock_state = exposure_hw_lock();
+
+    *achieved_millis = _engine.achieved_millis;
+    *achieved_sub_micros = _engine.achieved_sub_micros;
+    if (_engine.phase == EXPOSURE_PHASE_EXPOSING)
+        exposure_add_current_step(achieved_millis, achieved_sub_micros);
+
+    exposure_hw_unlock(lock_state);
+}
+
+
+uint32_t exposure_timebase_micros()
+{
+    uint32_t periods;
+    uint16_t counts;
+    uint8_t lock_state = exposure_hw_lock();
+
+    periods = _engine.timebase_periods;
+    counts = exposure_hw_counter();
+
+    exposure_hw_unlock(lock_state);
+
+    return periods * EXPOSURE_PERIOD_MICROS + counts / EXPOSURE_COUNTS_PER_MICRO;
+}
+
+
+// Latches the time base of the next output switch, for
+// exposure_switch_micros().
+void exposure_mark_switch()
+{
+    uint8_t lock_state = exposure_hw_lock();
+    _engine.switched = false;
+    exposure_hw_unlock(lock_state);
+}
+
+
+// The time base at which the engine first switched the outputs after the last
+// exposure_mark_switch().  False if it hasn't switched them since.
+bool exposure_switch_micros(uint32_t* switch_micros)
+{
+    bool switched;
+    uint32_t periods;
+    uint16_t counts;
+    uint8_t lock_state = exposure_hw_lock();
+
+    switched = _engine.switched;
+    periods = _engine.switch_period;
+    counts = _engine.switch_counts;
+
+    exposure_hw_unlock(lock_state);
+
+    *switch_micros = periods * EXPOSURE_PERIOD_MICROS + counts / EXPOSURE_COUNTS_PER_MICRO;
+    return switched;
+}
+
+
+// Sets the outputs directly, eg for focusing.  Only while idle.
+bool exposure_set_idle_power(uint16_t green_power, uint16_t blue_power)
+{
+    bool idle;
+    uint8_t lock_state = exposure_hw_lock();
+
+    idle = _engine.phase == EXPOSURE_PHASE_IDLE;
+    if (idle)
+        exposure_write_channels(green_power, blue_power);
+
+    exposure_hw_unlock(lock_state);
+
+    return idle;
+}
+
+
+// Switches the outputs itself, so only while idle.
+bool exposure_measure_skew(uint16_t green_power, uint16_t blue_power, int16_t* on_skew_counts, int16_t* off_skew_counts)
+{
+    if (_engine.phase != EXPOSURE_PHASE_IDLE)
+        return false;
+
+    exposure_hw_measure_skew(green_power, blue_power, on_skew_counts, off_skew_counts);
+
+    return true;
+}
+
+
+void exposure_isr_period()
+{
+    _engine.timebase_periods++;
+
+    switch (_engine.phase)
+    {
+        case EXPOSURE_PHASE_PENDING:
+            if (_engine.dose_mode)
+                exposure_begin_dose();
+            else if (_engine.metered)
+                exposure_begin_metered();
+            else
+                exposure_begin_step(0);
+            break;
+        case EXPOSURE_PHASE_EXPOSING:
+            if (_engine.metered)
+            {
+                exposure_metered_period();
+                break;
+            }
+            if (_engine.dose_mode)
+            {
+                exposure_dose_period();
+                break;
+            }
+            _engine.periods_remaining--;
+            break;
+        case EXPOSURE_PHASE_PAUSED:
+            _engine.periods_remaining--;
+            break;
+        default:
+            return;
+    }
+
+    exposure_final_period(0);
+}
+
+
+void exposure_isr_compare()
+{
+    exposure_hw_disable_compare();
+
+    if ((_engine.phase == EXPOSURE_PHASE_EXPOSING || _engine.phase == EXPOSURE_PHASE_PAUSED) &&
+        _engine.periods_remaining == 0)
+    {
+        uint16_t end_counts = _engine.final_counts;
+
+        exposure_segment_end(end_counts);
+        exposure_final_period(end_counts);
+    }
+}
+
+
+// Start the current step at the next period.  Called with interrupts locked.
+static void exposure_arm()
+{
+    // Scheduling now loads the step's compare point in time for it to be in
+    // effect, should the step be shorter than a period.
+    const ProgramStep* step = &_engine.steps[_engine.step_index];
+    exposure_schedule(0, step->millis, step->sub_micros);
+    _engine.phase = EXPOSURE_PHASE_PENDING;
+}
+
+
+static void exposure_begin_step(uint16_t start_counts)
+{
+    const ProgramStep* step = &_engine.steps[_engine.step_index];
+
+    exposure_write_channels(step->green_power, step->blue_power);
+    _engine.phase = EXPOSURE_PHASE_EXPOSING;
+    _engine.step_start_period = _engine.output_period;
+    _engine.step_start_counts = _engine.output_counts;
+    exposure_schedule(start_counts, step->millis, step->sub_micros);
+}
+
+
+static void exposure_schedule(uint16_t start_counts, uint32_t millis, uint16_t sub_micros)
+{
+    uint16_t end_counts;
+
+    millis += sub_micros / 1000;
+    sub_micros %= 1000;
+    end_counts = start_counts + sub_micros * EXPOSURE_COUNTS_PER_MICRO;
+
+    // One period per millisecond
+    _engine.periods_remaining = millis + end_counts / EXPOSURE_COUNTS_PER_PERIOD;
+    _engine.final_counts = end_counts % EXPOSURE_COUNTS_PER_PERIOD;
+
+    if (_engine.final_counts != 0 && _engine.final_counts != _engine.compare_counts)
+    {
+        exposure_hw_set_compare(_engine.final_counts);
+        _engine.compare_counts = _engine.final_counts;
+        // Allow for a period interrupt that's pending
+        _engine.compare_load_period = _engine.timebase_periods + exposure_hw_counter() / EXPOSURE_COUNTS_PER_PERIOD;
+    }
+}
+
+
+/* Called from the timer interrupts, now_counts into the current period.  If
+ * the current segment ends in this period, ends it, along with any following
+ * segments that also end in this period.
+ */
+static void exposure_final_period(uint16_t now_counts)
+{
+    while (_engine.periods_remaining == 0 &&
+           (_engine.phase == EXPOSURE_PHASE_EXPOSING || _engine.phase == EXPOSURE_PHASE_PAUSED))
+    {
+        uint16_t end_counts = _engine.final_counts;
+
+        if (end_counts > now_counts)
+        {
+            if (_engine.compare_load_period == _engine.timebase_periods)
+            {
+                // Ends in the next period interrupt
+                _engine.periods_remaining = 1;
+                _engine.final_counts = 0;
+                return;
+            }
+            if (exposure_hw_enable_compare(end_counts))
+                return;             // Ends in the compare interrupt
+        }
+
+        exposure_segment_end(end_counts);
+        now_counts = end_counts;
+    }
+}
+
+
+// The current segment has ended, counts into this period.
+static void exposure_segment_end(uint16_t counts)
+{
+    const ProgramStep* step = &_engine.steps[_engine.step_index];
+
+    if (_engine.dose_mode)
+    {
+        exposure_dose_segment_end(counts);
+        return;
+    }
+    if (_engine.metered)
+    {
+        exposure_finish();
+        return;
+    }
+
+    if (_engine.phase == EXPOSURE_PHASE_PAUSED)
+    {
+        exposure_begin_step(counts);
+        return;
+    }
+
+    // The step ran from its switch on to the switch below, as timed by the
+    // timer, so its achieved time includes the interrupt latency of both.
+    uint32_t start_period = _engine.step_start_period;
+    uint16_t start_counts = _engine.step_start_counts;
+
+    if (_engine.step_index + 1 >= _engine.step_count)
+    {
+        exposure_outputs_off();
+        exposure_add_switched_step(start_period, start_counts);
+        _engine.phase = EXPOSURE_PHASE_IDLE;
+        return;
+    }
+
+    _engine.step_index++;
+
+    if (step->pause_millis == 0)
+    {
+        // Straight into the next step, without switching off in between.
+        exposure_begin_step(counts);
+        exposure_add_switched_step(start_period, start_counts);
+    }
+    else if (step->pause_millis == PROGRAM_PAUSE_HOLD)
+    {
+        exposure_outputs_off();
+        exposure_add_switched_step(start_period, start_counts);
+        _engine.phase = EXPOSURE_PHASE_HOLDING;
+    }
+    else
+    {
+        exposure_outputs_off();
+        exposure_add_switched_step(start_period, start_counts);
+        _engine.phase = EXPOSURE_PHASE_PAUSED;
+        exposure_schedule(counts, step->pause_millis, 0);
+    }
+}
+
+
+static void exposure_outputs_off()
+{
+    exposure_write_channels(0, 0);
+}
+
+
+// Adds the exposure so far of the current step.  Called with interrupts locked.
+static void exposure_add_current_step(uint32_t* millis, uint16_t* sub_micros)
+{
+    uint32_t step_millis;
+    uint16_t step_sub_micros;
+
+    exposure_elapsed(_engine.step_start_period, _engine.step_start_counts, exposure_hw_counter(),
+        &step_millis, &step_sub_micros);
+    exposure_add_time(millis, sub_micros, step_millis, step_sub_micros);
+}
+
+
+// Adds the time from a step's switch on, at start_period, start_counts, to
+// the outputs' last switch.  Called with interrupts locked.
+static void exposure_add_switched_step(uint32_t start_period, uint16_t start_counts)
+{
+    uint32_t step_millis;
+    uint16_t step_sub_micros;
+
+    exposure_interval(start_period, start_counts, _engine.output_period, _engine.output_counts,
+        &step_millis, &step_sub_micros);
+    exposure_add_time(&_engine.achieved_millis, &_engine.achieved_sub_micros, step_millis, step_sub_micros);
+}
+
+
+// Time from start_period, start_counts to now_counts into the current period.
+static void exposure_elapsed(uint32_t start_period, uint16_t start_counts, uint16_t now_counts,
+    uint32_t* millis, uint16_t* sub_micros)
+{
+    exposure_interval(start_period, start_counts, _engine.timebase_periods, now_counts, millis, sub_micros);
+}
+
+
+static void exposure_interval(uint32_t start_period, uint16_t start_counts, uint32_t end_period, uint16_t end_counts,
+    uint32_t* millis, uint16_t* sub_micros)
+{
+    // The counter exceeds one period if a period interrupt is pending, so can
+    // be either side of the start count.
+    *millis = 0;
+    *sub_micros = 0;
+    exposure_add_time(millis, sub_micros, end_period - start_period,
+        (int32_t(end_counts) - int32_t(start_counts)) / EXPOSURE_COUNTS_PER_MICRO);
+}
+
+
+// add_sub_micros may be negative, provided the resulting time is not.
+static void exposure_add_time(uint32_t* millis, uint16_t* sub_micros, uint32_t add_millis, int32_t add_sub_micros)
+{
+    int32_t total_sub_micros = int32_t(*sub_micros) + add_sub_micros;
+
+    *millis += add_millis;
+    while (total_sub_micros < 0)
+    {
+        total_sub_micros += 1000;
+        (*millis)--;
+    }
+    *millis += total_sub_micros / 1000;
+    *sub_micros = total_sub_micros % 1000;
+}
+
+
+// Start a dose exposure at the start of this period.
+static void exposure_begin_dose()
+{
+    _engine.phase = EXPOSURE_PHASE_EXPOSING;
+    _engine.interval_start_period = _engine.timebase_periods;
+    _engine.interval_start_counts = 0;
+
+    exposure_dose_write_channels();
+    _engine.step_start_period = _engine.output_period;
+    _engine.step_start_counts = _engine.output_counts;
+
+    if (_engine.dose_done == ((1 << CHANNEL_GREEN) | (1 << CHANNEL_BLUE)))
+    {
+        _engine.phase = EXPOSURE_PHASE_IDLE;
+        return;
+    }
+
+    exposure_plan_dose(0);
+}
+
+
+// Precomputes each channel's dose per period at its current power, from
+// loop() with interrupts locked.
+static void exposure_dose_set_rates()
+{
+    for (uint8_t channel = CHANNEL_GREEN; channel <= CHANNEL_BLUE; channel++)
+    {
+        uint16_t power = exposure_dose_power(channel);
+
+        _engine.period_dose[channel] = power / POWER_FINE_STEPS;
+        _engine.period_dose_fraction[channel] = (power % POWER_FINE_STEPS) * EXPOSURE_COUNTS_PER_PERIOD;
+    }
+}
+
+
+// Period interrupt of a dose exposure.  Adds the last period's dose, then
+// counts down to the scheduled end, or plans it once it's due.
+static void exposure_dose_period()
+{
+    exposure_dose_interval_end(0);
+
+    if (_engine.periods_remaining != EXPOSURE_OPEN_PERIODS)
+    {
+        _engine.periods_remaining--;
+        return;
+    }
+
+    exposure_plan_dose(0);
+}
+
+
+/* Schedule the end of the current segment for the first channel to reach its
+ * target at the current powers, once that's due within two periods, which
+ * leaves time for the compare point to take effect.  Until then, or if every
+ * remaining channel is at zero power, the segment is left open and
+ * exposure_dose_period() plans again next period.  The remaining dose is
+ * then at most a few hundred units, so it fits 32 bits in power-counts.
+ */
+static void exposure_plan_dose(uint16_t now_counts)
+{
+    uint16_t end_counts = 0xFFFF;       // From now_counts
+
+    _engine.dose_ending = 0;
+    for (uint8_t channel = CHANNEL_GREEN; channel <= CHANNEL_BLUE; channel++)
+    {
+        uint16_t power = exposure_dose_power(channel);
+
+        if ((_engine.dose_done & (1 << channel)) || power == 0)
+            continue;
+
+        uint32_t remaining = 0;
+        if (_engine.dose[channel] < _engine.dose_target[channel])
+        {
+            uint32_t units = _engine.dose_target[channel] - _engine.dose[channel];
+
+            // Two periods give at most 2 * period_dose + 2 units
+            if (units > 2 * uint32_t(_engine.period_dose[channel]) + 2)
+                continue;
+            remaining = units * EXPOSURE_DOSE_FRACTION - _engine.dose_fraction[channel];
+        }
+        if (remaining >= uint32_t(power) * (2 * EXPOSURE_COUNTS_PER_PERIOD))
+            continue;
+
+        // Time to the target in counts, rounded up
+        uint16_t counts = uint16_t((remaining + power - 1) / power);
+
+        if (counts < end_counts)
+        {
+            end_counts = counts;
+            _engine.dose_ending = 0;
+        }
+        if (counts == end_counts)
+            _engine.dose_ending |= (1 << channel);
+    }
+
+    if (_engine.dose_ending == 0)
+    {
+        _engine.periods_remaining = EXPOSURE_OPEN_PERIODS;
+        _engine.final_counts = 0;
+        return;
+    }
+
+    uint16_t micros = (end_counts + EXPOSURE_COUNTS_PER_MICRO - 1) / EXPOSURE_COUNTS_PER_MICRO;
+    exposure_schedule(now_counts, micros / 1000, micros % 1000);
+}
+
+
+// Counts from the start of the current interval to now_counts into this
+// period.  Not positive for an interval started at a period wrap whose
+// interrupt hasn't yet run.
+static int32_t exposure_dose_interval_counts(uint16_t now_counts)
+{
+    return int32_t(_engine.timebase_periods - _engine.interval_start_period) * EXPOSURE_COUNTS_PER_PERIOD +
+        int32_t(now_counts) - int32_t(_engine.interval_start_counts);
+}
+
+
+// Adds the dose since the start of the current interval, and starts a new one.
+static void exposure_dose_interval_end(uint16_t now_counts)
+{
+    int32_t counts = exposure_dose_interval_counts(now_counts);
+
+    if (counts <= 0)
+        return;
+
+    for (uint8_t channel = CHANNEL_GREEN; channel <= CHANNEL_BLUE; channel++)
+    {
+        if (!(_engine.dose_done & (1 << channel)))
+            exposure_add_dose(channel, counts, &_engine.dose[channel], &_engine.dose_fraction[channel]);
+    }
+
+    _engine.interval_start_period = _engine.timebase_periods;
+    _engine.interval_start_counts = now_counts;
+}
+
+
+// One or more channels have reached their target dose, counts into this period.
+static void exposure_dose_segment_end(uint16_t counts)
+{
+    exposure_dose_interval_end(counts);
+
+    for (uint8_t channel = CHANNEL_GREEN; channel <= CHANNEL_BLUE; channel++)
+    {
+        if (_engine.dose_ending & (1 << channel))
+        {
+            // Exact, where the interval sum may be short by rounding
+            _engine.dose[channel] = _engine.dose_target[channel];
+            _engine.dose_fraction[channel] = 0;
+            _engine.dose_done |= (1 << channel);
+        }
+    }
+    exposure_dose_write_channels();
+
+    if (_engine.dose_done == ((1 << CHANNEL_GREEN) | (1 << CHANNEL_BLUE)))
+    {
+        exposure_finish();
+        return;
+    }
+
+    exposure_plan_dose(counts);
+}
+
+
+// Both channels at their powers, less any whose dose is done
+static void exposure_dose_write_channels()
+{
+    exposure_write_channels(
+        (_engine.dose_done & (1 << CHANNEL_GREEN)) ? 0 : _engine.single_step.green_power,
+        (_engine.dose_done & (1 << CHANNEL_BLUE)) ? 0 : _engine.single_step.blue_power);
+}
+
+
+static uint16_t exposure_dose_power(uint8_t channel)
+{
+    return channel == CHANNEL_GREEN ? _engine.single_step.green_power : _engine.single_step.blue_power;
+}
+
+
+// Start a metered exposure at the start of this period.
+static void exposure_begin_metered()
+{
+    // The lights were off for the previous period, so that's the dark level.
+    meter_zero();
+
+    exposure_write_channels(_engine.single_step.green_power, _engine.single_step.blue_power);
+    _engine.phase = EXPOSURE_PHASE_EXPOSING;
+    _engine.step_start_period = _engine.output_period;
+    _engine.step_start_counts = _engine.output_counts;
+    _engine.periods_remaining = EXPOSURE_OPEN_PERIODS;
+    _engine.final_counts = 0;
+}
+
+
+/* Period interrupt of a metered exposure, after meter_period().  Ends the
+ * exposure if the target has been reached.  Otherwise, once the target is due
+ * within two periods at the last period's light level, schedules the end
+ * there, which leaves time for the compare point to take effect.
+ */
+static void exposure_metered_period()
+{
+    uint32_t dose;
+    uint16_t dose_fraction;
+
+    meter_dose(&dose, &dose_fraction);
+
+    if (dose >= _engine.meter_target)
+    {
+        exposure_finish();
+        return;
+    }
+
+    if (_engine.periods_remaining != EXPOSURE_OPEN_PERIODS)
+    {
+        _engine.periods_remaining--;
+        return;
+    }
+
+    // Remaining dose in count-milliseconds, then count-microseconds, against
+    // the rate in count-microseconds per period, which is at most about 2^20
+    // from the 10-bit ADC
+    uint32_t rate = meter_rate();
+    uint32_t remaining_dose = _engine.meter_target - dose;
+
+    if (rate == 0 || remaining_dose > 2 * (rate / 1000) + 2)
+        return;
+
+    uint32_t remaining = remaining_dose * 1000 - dose_fraction;
+
+    if (remaining >= 2 * rate)
+        return;
+
+    // remaining < 2 * rate, so remaining * 1000 fits 32 bits for any rate
+    // the ADC gives; scale down any more
+    while (rate >= (uint32_t(1) << 21))
+    {
+        remaining >>= 1;
+        rate >>= 1;
+    }
+
+    uint32_t micros = remaining * EXPOSURE_PERIOD_MICROS / rate;
+    exposure_schedule(0, micros / 1000, micros % 1000);
+}
+
+
+// End a dose or metered exposure.
+static void exposure_finish()
+{
+    exposure_outputs_off();
+    exposure_add_switched_step(_engine.step_start_period, _engine.step_start_counts);
+    _engine.phase = EXPOSURE_PHASE_IDLE;
+}
+
+
+/* Adds the dose of channel at its current power for the given counts.  Whole
+ * periods add the rates from exposure_dose_set_rates(), so only the part
+ * period takes a multiply, and a 16-bit divide: the total is then under 2^24,
+ * and EXPOSURE_DOSE_FRACTION is 2^8 * 125.
+ */
+static void exposure_add_dose(uint8_t channel, uint32_t counts, uint32_t* dose, uint16_t* dose_fraction)
+{
+    uint32_t fraction = *dose_fraction;
+
+    for (; counts >= EXPOSURE_COUNTS_PER_PERIOD; counts -= EXPOSURE_COUNTS_PER_PERIOD)
+    {
+        *dose += _engine.period_dose[channel];
+        fraction += _engine.period_dose_fraction[channel];
+        if (fraction >= EXPOSURE_DOSE_FRACTION)
+        {
+            fraction -= EXPOSURE_DOSE_FRACTION;
+            (*dose)++;
+        }
+    }
+
+    fraction += uint32_t(exposure_dose_power(channel)) * uint16_t(counts);
+
+    uint16_t whole = uint16_t(fraction >> 8) / (EXPOSURE_DOSE_FRACTION >> 8);
+    *dose += whole;
+    *dose_fraction = uint16_t(fraction - uint32_t(whole) * EXPOSURE_DOSE_FRACTION);
+}
+
+
+// Called with interrupts locked.
+static void exposure_write_channels(uint16_t green_power, uint16_t blue_power)
+{
+    exposure_hw_write_channels(green_power, blue_power);
+
+    _engine.output_period = _engine.timebase_periods;
+    _engine.output_counts = exposure_hw_counter();
+    if (!_engine.switched)
+    {
+        _engine.switch_period = _engine.output_period;
+        _engine.switch_counts = _engine.output_counts;
+        _engine.switched = true;
+    }
+}
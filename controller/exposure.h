@@ -0,0 +1,136 @@
+#ifndef _EXPOSURE_H
+#define _EXPOSURE_H
+
+#include <stdint.h>
+
+#include <lamphouse_shared.h>
+
+/* Exposure engine.
+ *
+ * Exposures are timed by a hardware timer rather than by polling millis()
+ * from loop(), so that the lights go off on time whatever the main loop (and
+ * in particular the radio) is doing.
+ *
+ * The timer free-runs with a period of EXPOSURE_PERIOD_MICROS.  Both edges of
+ * an exposure are taken in timer interrupts:
+ *   - The outputs are switched on in the first period interrupt following
+ *     exposure_start().
+ *   - The outputs are switched off in the period interrupt that completes the
+ *     target, or, if the target is not a whole number of periods, in a
+ *     compare interrupt set to the remainder within the final period.
+ *
+ * A single exposure is run as a one-step program (see ProgramStep in
+ * lamphouse_shared.h).  Multi-step programs are run entirely from the timer interrupts:
+ * each step or pause starts at the timer count where the previous one ended,
+ * and consecutive steps switch the outputs directly from one set of powers to
+ * the next, so there is no gap between them.
+ *
+ * Exposure times are held as whole milliseconds (timer periods) plus a
+ * sub-millisecond remainder in microseconds, and achieved times are counted
+ * from the start of the exposure rather than from absolute time, so neither
+ * overflows however long the controller has been up.  Achieved times are
+ * measured: each step runs from the timer count read as its outputs were
+ * switched on to the one read as they were switched off, so they include
+ * the interrupt latency at either end, where the target doesn't.  The same timer also
+ * provides a free-running microsecond time base, exposure_timebase_micros().
+ * It wraps every ~71 minutes, so must only be used to measure intervals, by
+ * unsigned subtraction.
+ * exposure_switch_micros() gives the time base at which the engine first
+ * switched the outputs after the last exposure_mark_switch(), latched as it
+ * switches them, so later switches don't move it.
+ *
+ * Dose mode (exposure_start_dose()) exposes each channel until its dose, the
+ * integral of power over time in power-milliseconds (see lamphouse_shared.h), reaches a
+ * target, so that the powers can be changed mid-exposure with
+ * exposure_set_dose_power() for burning and dodging.  Power is constant
+ * between changes, so the engine adds each period's dose at a rate
+ * precomputed from the power, and once a channel's target is due within two
+ * periods schedules its end from the remaining dose, to the same timer
+ * resolution as a timed exposure.  exposure_achieved() then reports the time
+ * taken.
+ *
+ * Metered mode (exposure_start_metered()) instead ends on the dose measured
+ * by the light meter (see meter.h), taking both channels' light together.
+ * The meter is integrated once a period, so the end is predicted from the
+ * last period's light level once it's due within two periods, and scheduled
+ * as a timed end from there.
+ *
+ * The engine itself is hardware independent.  Hardware is accessed only
+ * through the exposure_hw_* hooks below, which are implemented for the ATmega
+ * in exposure_avr.cpp.  A host build can supply its own hooks and drive the
+ * engine by calling exposure_isr_period() and exposure_isr_compare() from a
+ * simulated timer.
+ */
+
+const static uint16_t EXPOSURE_PERIOD_MICROS = 1000;
+const static uint8_t EXPOSURE_COUNTS_PER_MICRO = 2;
+const static uint16_t EXPOSURE_COUNTS_PER_PERIOD = EXPOSURE_PERIOD_MICROS * EXPOSURE_COUNTS_PER_MICRO;
+
+const static uint8_t CHANNEL_RED = 0;
+const static uint8_t CHANNEL_GREEN = 1;
+const static uint8_t CHANNEL_BLUE = 2;
+
+
+void exposure_init();
+bool exposure_start(uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros);
+bool exposure_run_program(const ProgramStep* steps, uint8_t step_count);
+bool exposure_continue();
+bool exposure_start_dose(uint16_t green_power, uint16_t blue_power, uint32_t green_dose, uint32_t blue_dose);
+bool exposure_start_metered(uint16_t green_power, uint16_t blue_power, uint32_t meter_dose);
+bool exposure_set_dose_power(uint16_t green_power, uint16_t blue_power);
+bool exposure_set_idle_power(uint16_t green_power, uint16_t blue_power);
+bool exposure_stop();
+ControllerState exposure_state();
+uint8_t exposure_step_index();
+bool exposure_dose_mode();
+void exposure_dose(uint32_t* green_dose, uint32_t* blue_dose);
+void exposure_achieved(uint32_t* achieved_millis, uint16_t* achieved_sub_micros);
+uint32_t exposure_timebase_micros();
+void exposure_mark_switch();
+bool exposure_switch_micros(uint32_t* switch_micros);
+bool exposure_measure_skew(uint16_t green_power, uint16_t blue_power, int16_t* on_skew_counts, int16_t* off_skew_counts);
+
+// Timer interrupt entry points.
+void exposure_isr_period();
+void exposure_isr_compare();
+
+
+/* Hardware hooks.
+ *
+ * exposure_hw_set_compare() loads the compare point, in timer counts from the
+ * start of a period.  It takes effect from the next period onwards.
+ *
+ * exposure_hw_enable_compare() enables the compare interrupt for the current
+ * period, at the compare point loaded in an earlier period (given as counts).
+ * It returns false if the compare point has already passed, or is too close
+ * to the start of the period to be caught by an interrupt; in that case it
+ * returns at or after the compare point, and the caller must act on it itself.
+ *
+ * exposure_hw_wait() busy-waits until counts into the current period.  The
+ * engine itself never waits: it's for exposure_hw_enable_compare()'s compare
+ * points too close to the start of a period to interrupt for, so is short.
+ *
+ * exposure_hw_counter() returns the timer counts since the start of the
+ * current period, including a period that has elapsed but whose interrupt is
+ * still pending.  It is only called with interrupts locked.
+ *
+ * exposure_hw_write_channels() sets green and blue together, so that both
+ * switch at the same instant.  The engine always switches them this way.
+ *
+ * exposure_hw_measure_skew() switches green and blue on at the given powers
+ * and then off, and measures the time between the two channels' edges, in
+ * timer counts, green's less blue's.  It leaves both off.
+ */
+void exposure_hw_init();
+void exposure_hw_set_compare(uint16_t counts);
+bool exposure_hw_enable_compare(uint16_t counts);
+void exposure_hw_disable_compare();
+void exposure_hw_wait(uint16_t counts);
+uint16_t exposure_hw_counter();
+void exposure_hw_write_channel(uint8_t channel, uint16_t power);
+void exposure_hw_write_channels(uint16_t green_power, uint16_t blue_power);
+void exposure_hw_measure_skew(uint16_t green_power, uint16_t blue_power, int16_t* on_skew_counts, int16_t* off_skew_counts);
+uint8_t exposure_hw_lock();
+void exposure_hw_unlock(uint8_t lock_state);
+
+#endif
@@ -0,0 +1,438 @@
+/* ATmega168 hardware hooks for the exposure engine.
+ *
+ * Timer1 is the exposure time base.  It is taken over from the Arduino core
+ * and run in fast PWM mode 14 (TOP = ICR1) at clk/8, giving 0.5 us counts and
+ * a 1 ms period:
+ *   - TIMER1_OVF  (at TOP) is the period interrupt.
+ *   - TIMER1_COMPB is the compare interrupt.  OC1B is D10, the radio CSN, so
+ *     the OC1B pin output is left disconnected and OCR1B is used for the
+ *     interrupt only.
+ *   - OC1A (D9, red channel) is still driven as PWM, at 1 kHz with duty
+ *     OCR1A / ICR1.  analogWrite() no longer scales correctly on this pin, so
+ *     all channel writes must go through the exposure_hw_write_channel*()
+ *     hooks.
+ *
+ * Channels are driven by writing their timer and port registers directly,
+ * through the compile-time pin map ChannelPin below, rather than through
+ * analogWrite() and digitalWrite(), which look the pin up at run time.  The
+ * outputs' port bits are held low, so disconnecting a timer output switches
+ * the pin off at once.  exposure_hw_write_channels() computes both green and
+ * blue settings first and then writes all their registers together in one
+ * critical section, so the channels switch within a few cycles of each other.
+ *
+ * Green (OC2B, D3) and blue (OC0A, D6) are on 8-bit timers, so are given
+ * 16-bit duty by dithering: each PWM period outputs the duty's upper 8 bits
+ * or one more, carrying the lower 8 bits in a first-order sigma-delta
+ * accumulator, so the mean over 256 periods is exact.  Timer2 is switched to
+ * fast PWM at clk/64, the same as the Arduino core's Timer0, so both have a
+ * period of 1.024 ms, and the dither is stepped once per period from the
+ * Timer2 overflow interrupt.  Powers are linearised to duty first (see
+ * linearisation.h).  Timers 0, 1 and 2 are started together from reset
+ * prescalers, so the green and blue PWM periods are in phase, and an edge
+ * written to both lands in the same period on both.
+ *
+ * Assumes a 16 MHz clock.
+ */
+#if defined(__AVR__)
+
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+#include "exposure.h"
+#include "linearisation.h"
+#include "meter.h"
+
+
+const static uint8_t PIN_OUT_GREEN = 3; // D3
+const static uint8_t PIN_OUT_BLUE = 6;  // D6
+const static uint8_t PIN_OUT_RED = 9;   // D9
+
+// Compare points closer than this to the start of a period may have passed
+// by the time the period interrupt can enable the compare interrupt, and are
+// busy-waited for instead.  20 us.
+const static uint16_t EXPOSURE_HW_MIN_COMPARE_COUNTS = 40;
+
+// Skew measurements give up on an edge after two PWM periods.
+const static uint16_t EXPOSURE_HW_SKEW_TIMEOUT_COUNTS = 4096;
+
+
+/* Pin to timer map.  Each PWM pin that can drive a channel has a
+ * specialisation giving its compare register and output enable bit, and its
+ * port bit.  There is no general definition, so using a pin without one fails
+ * to compile.
+ */
+template <uint8_t pin> struct ChannelPin;
+
+template <> struct ChannelPin<3>        // OC2B, PD3
+{
+    typedef uint8_t Compare;
+    static volatile uint8_t& compare() { return OCR2B; }
+    static volatile uint8_t& control() { return TCCR2A; }
+    static const uint8_t CONNECT = _BV(COM2B1);
+    static volatile uint8_t& port() { return PORTD; }
+    static volatile uint8_t& ddr() { return DDRD; }
+    static volatile uint8_t& input() { return PIND; }
+    static const uint8_t BIT = _BV(PD3);
+};
+
+template <> struct ChannelPin<6>        // OC0A, PD6
+{
+    typedef uint8_t Compare;
+    static volatile uint8_t& compare() { return OCR0A; }
+    static volatile uint8_t& control() { return TCCR0A; }
+    static const uint8_t CONNECT = _BV(COM0A1);
+    static volatile uint8_t& port() { return PORTD; }
+    static volatile uint8_t& ddr() { return DDRD; }
+    static volatile uint8_t& input() { return PIND; }
+    static const uint8_t BIT = _BV(PD6);
+};
+
+template <> struct ChannelPin<9>        // OC1A, PB1
+{
+    typedef uint16_t Compare;
+    static volatile uint16_t& compare() { return OCR1A; }
+    static volatile uint8_t& control() { return TCCR1A; }
+    static const uint8_t CONNECT = _BV(COM1A1);
+    static volatile uint8_t& port() { return PORTB; }
+    static volatile uint8_t& ddr() { return DDRB; }
+    static volatile uint8_t& input() { return PINB; }
+    static const uint8_t BIT = _BV(PB1);
+};
+
+typedef ChannelPin<PIN_OUT_RED> RedPin;
+typedef ChannelPin<PIN_OUT_GREEN> GreenPin;
+typedef ChannelPin<PIN_OUT_BLUE> BluePin;
+
+
+template <typename Pin> static inline void channel_pin_init()
+{
+    Pin::port() &= ~Pin::BIT;
+    Pin::ddr() |= Pin::BIT;
+}
+
+
+template <typename Pin> static inline void channel_pin_connect(typename Pin::Compare compare)
+{
+    Pin::compare() = compare;
+    Pin::control() |= Pin::CONNECT;
+}
+
+
+template <typename Pin> static inline void channel_pin_disconnect()
+{
+    Pin::control() &= ~Pin::CONNECT;
+}
+
+
+template <typename Pin> static inline bool channel_pin_high()
+{
+    return (Pin::input() & Pin::BIT) != 0;
+}
+
+
+// A channel's duty is level / 256 of the period, plus fraction / 256 of a
+// level on average.  level is at least 1 while on, as a compare value of
+// zero still gives a one-count pulse each period.
+struct DitheredChannel
+{
+    volatile bool on;
+    volatile uint16_t level;            // 1-256
+    volatile uint8_t fraction;
+    uint8_t accumulator;
+    uint16_t power;                     // As last written
+};
+
+
+static DitheredChannel _green_dither;
+static DitheredChannel _blue_dither;
+
+
+static void exposure_hw_set_dither(DitheredChannel* dither, uint16_t duty);
+static uint8_t exposure_hw_dither_step(DitheredChannel* dither);
+static void exposure_hw_capture_edges(bool high, uint16_t start_counts, uint16_t* green_counts, uint16_t* blue_counts);
+
+
+template <typename Pin> static inline void exposure_hw_apply_dither(const DitheredChannel* dither)
+{
+    if (dither->on)
+        channel_pin_connect<Pin>(dither->level - 1);
+    else
+        channel_pin_disconnect<Pin>();
+}
+
+
+void exposure_hw_init()
+{
+    channel_pin_init<RedPin>();
+    channel_pin_init<GreenPin>();
+    channel_pin_init<BluePin>();
+
+    uint8_t sreg = SREG;
+    cli();
+    GTCCR = _BV(TSM) | _BV(PSRASY) | _BV(PSRSYNC);     // Hold the prescalers in reset
+    TCCR1B = 0;                                         // Stop while reconfiguring
+    TCCR1A = _BV(WGM11);                                // Mode 14, OC1A and OC1B disconnected
+    ICR1 = EXPOSURE_COUNTS_PER_PERIOD - 1;
+    OCR1A = 0;
+    OCR1B = 0;
+    TIFR1 = _BV(TOV1) | _BV(OCF1A) | _BV(OCF1B);
+    TIMSK1 = _BV(TOIE1);
+    TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS11);       // Mode 14, clk/8
+
+    TCCR2A = _BV(WGM21) | _BV(WGM20);                   // Fast PWM, OC2B disconnected
+    TCCR2B = _BV(CS22);                                 // clk/64
+    TIFR2 = _BV(TOV2);
+    TIMSK2 = _BV(TOIE2);
+
+    TCNT0 = 0;
+    TCNT1 = 0;
+    TCNT2 = 0;
+    GTCCR = 0;                                          // Start all three in phase
+    SREG = sreg;
+
+    exposure_hw_write_channel(CHANNEL_RED, 0);
+    exposure_hw_write_channels(0, 0);
+}
+
+
+void exposure_hw_set_compare(uint16_t counts)
+{
+    uint8_t sreg = SREG;
+    cli();
+    OCR1B = counts;
+    SREG = sreg;
+}
+
+
+bool exposure_hw_enable_compare(uint16_t counts)
+{
+    if (counts < EXPOSURE_HW_MIN_COMPARE_COUNTS)
+    {
+        exposure_hw_wait(counts);
+        return false;
+    }
+
+    TIFR1 = _BV(OCF1B);
+    TIMSK1 |= _BV(OCIE1B);
+
+    if (TCNT1 >= counts)
+    {
+        // Missed it.  The caller acts on it now.
+        TIMSK1 &= ~_BV(OCIE1B);
+        return false;
+    }
+
+    return true;
+}
+
+
+void exposure_hw_disable_compare()
+{
+    TIMSK1 &= ~_BV(OCIE1B);
+}
+
+
+void exposure_hw_wait(uint16_t counts)
+{
+    while (TCNT1 < counts);
+}
+
+
+uint16_t exposure_hw_counter()
+{
+    uint16_t counts = TCNT1;
+
+    // The period has wrapped but its interrupt hasn't run yet.
+    if ((TIFR1 & _BV(TOV1)) && counts < EXPOSURE_COUNTS_PER_PERIOD / 2)
+        counts += EXPOSURE_COUNTS_PER_PERIOD;
+
+    return counts;
+}
+
+
+void exposure_hw_write_channel(uint8_t channel, uint16_t power)
+{
+    if (channel == CHANNEL_GREEN)
+    {
+        exposure_hw_write_channels(power, _blue_dither.power);
+        return;
+    }
+    if (channel == CHANNEL_BLUE)
+    {
+        exposure_hw_write_channels(_green_dither.power, power);
+        return;
+    }
+
+    // Red is the safelight, so isn't linearised.  It runs at the Timer1
+    // period, with duty OCR1A / ICR1.
+    if (power > POWER_FULL)
+        power = POWER_FULL;
+    uint16_t compare = uint16_t((uint32_t(power) * (EXPOSURE_COUNTS_PER_PERIOD - 1) + POWER_FULL / 2) / POWER_FULL);
+
+    uint8_t sreg = SREG;
+    cli();
+    // Zero is handled by disconnecting OC1A, as a compare value of zero still
+    // gives a one-count pulse each period.
+    if (power == 0)
+        channel_pin_disconnect<RedPin>();
+    else
+        channel_pin_connect<RedPin>(compare);
+    SREG = sreg;
+}
+
+
+void exposure_hw_write_channels(uint16_t green_power, uint16_t blue_power)
+{
+    // Linearising is the slow part, so is done before locking.
+    uint16_t green_duty = linearise_power(green_power);
+    uint16_t blue_duty = linearise_power(blue_power);
+
+    uint8_t sreg = SREG;
+    cli();
+    _green_dither.power = green_power;
+    _blue_dither.power = blue_power;
+    exposure_hw_set_dither(&_green_dither, green_duty);
+    exposure_hw_set_dither(&_blue_dither, blue_duty);
+    exposure_hw_apply_dither<GreenPin>(&_green_dither);
+    exposure_hw_apply_dither<BluePin>(&_blue_dither);
+    SREG = sreg;
+}
+
+
+/* Switches green and blue on, and then off, through
+ * exposure_hw_write_channels(), and times each channel's edges by polling
+ * its pin against Timer1.  Skews are green's edge time less blue's, in timer
+ * counts.  Interrupts are locked throughout, so the dither is not stepped,
+ * and at full power both outputs are steady while on: the skew is then that
+ * of the register writes.  At lower power it includes the PWM phase.
+ */
+void exposure_hw_measure_skew(uint16_t green_power, uint16_t blue_power, int16_t* on_skew_counts, int16_t* off_skew_counts)
+{
+    uint16_t green_counts, blue_counts;
+
+    uint8_t sreg = SREG;
+    cli();
+
+    // Start from both off
+    exposure_hw_write_channels(0, 0);
+    exposure_hw_capture_edges(false, TCNT1, &green_counts, &blue_counts);
+
+    uint16_t start_counts = TCNT1;
+    exposure_hw_write_channels(green_power, blue_power);
+    exposure_hw_capture_edges(true, start_counts, &green_counts, &blue_counts);
+    *on_skew_counts = int16_t(green_counts - blue_counts);
+
+    start_counts = TCNT1;
+    exposure_hw_write_channels(0, 0);
+    exposure_hw_capture_edges(false, start_counts, &green_counts, &blue_counts);
+    *off_skew_counts = int16_t(green_counts - blue_counts);
+
+    SREG = sreg;
+}
+
+
+// Called with interrupts locked.
+static void exposure_hw_set_dither(DitheredChannel* dither, uint16_t duty)
+{
+    dither->on = duty != 0;
+    if (duty == 0xFFFF)
+    {
+        dither->level = 256;
+        dither->fraction = 0;
+    }
+    else
+    {
+        dither->level = duty >> 8;
+        dither->fraction = duty & 0xFF;
+        if (dither->level == 0)
+            dither->level = 1;
+    }
+}
+
+
+// Polls until both outputs are at the given level, or the timeout, giving
+// the counts from start_counts at which each first was.
+static void exposure_hw_capture_edges(bool high, uint16_t start_counts, uint16_t* green_counts, uint16_t* blue_counts)
+{
+    uint16_t last_counts = start_counts;
+    uint16_t elapsed = 0;
+    bool green_seen = false, blue_seen = false;
+
+    *green_counts = EXPOSURE_HW_SKEW_TIMEOUT_COUNTS;
+    *blue_counts = EXPOSURE_HW_SKEW_TIMEOUT_COUNTS;
+
+    while (!(green_seen && blue_seen) && elapsed < EXPOSURE_HW_SKEW_TIMEOUT_COUNTS)
+    {
+        bool green_high = channel_pin_high<GreenPin>();
+        bool blue_high = channel_pin_high<BluePin>();
+        uint16_t now_counts = TCNT1;
+
+        elapsed += now_counts >= last_counts ? now_counts - last_counts : now_counts + EXPOSURE_COUNTS_PER_PERIOD - last_counts;
+        last_counts = now_counts;
+
+        if (!green_seen && green_high == high)
+        {
+            *green_counts = elapsed;
+            green_seen = true;
+        }
+        if (!blue_seen && blue_high == high)
+        {
+            *blue_counts = elapsed;
+            blue_seen = true;
+        }
+    }
+}
+
+
+// The compare value for the next period
+static uint8_t exposure_hw_dither_step(DitheredChannel* dither)
+{
+    uint8_t previous = dither->accumulator;
+
+    dither->accumulator += dither->fraction;
+
+    // Carry out of the accumulator
+    if (dither->accumulator < previous)
+        return dither->level;           // level + 1 - 1
+
+    return dither->level - 1;
+}
+
+
+uint8_t exposure_hw_lock()
+{
+    uint8_t sreg = SREG;
+    cli();
+    return sreg;
+}
+
+
+void exposure_hw_unlock(uint8_t lock_state)
+{
+    SREG = lock_state;
+}
+
+
+ISR(TIMER1_OVF_vect)
+{
+    meter_period();
+    exposure_isr_period();
+}
+
+
+ISR(TIMER1_COMPB_vect)
+{
+    exposure_isr_compare();
+}
+
+
+// The compare values written here take effect from the timers' next periods.
+ISR(TIMER2_OVF_vect)
+{
+    if (_green_dither.on)
+        GreenPin::compare() = exposure_hw_dither_step(&_green_dither);
+    if (_blue_dither.on)
+        BluePin::compare() = exposure_hw_dither_step(&_blue_dither);
+}
+
+#endif
@@ -0,0 +1,102 @@
+#include "history.h"
+
+
+struct History
+{
+    RadioPacket records[HISTORY_LENGTH][HISTORY_RECORD_SIZE];
+    uint8_t next_sequence;              // Of the next record added
+    uint8_t count;                      // Records held
+};
+
+
+static History _history;
+
+
+static int8_t history_overshoot(uint32_t target_millis, uint16_t target_sub_micros, uint32_t achieved_millis, uint16_t achieved_sub_micros);
+
+
+void history_init()
+{
+    _history.next_sequence = 0;
+    _history.count = 0;
+}
+
+
+void history_add(uint32_t target_millis, uint16_t target_sub_micros, uint32_t achieved_millis, uint16_t achieved_sub_micros,
+    bool timed, uint16_t green_power, uint16_t blue_power)
+{
+    RadioPacket* record = _history.records[_history.next_sequence & (HISTORY_LENGTH - 1)];
+
+    // Longer exposures saturate
+    if (achieved_millis > HISTORY_MAX_MILLIS)
+    {
+        achieved_millis = HISTORY_MAX_MILLIS;
+        achieved_sub_micros = 999;
+    }
+
+    uint32_t achieved = (achieved_millis << 10) | achieved_sub_micros;
+
+    record[0] = achieved >> 24;
+    record[1] = (achieved >> 16) & 0xFF;
+    record[2] = (achieved >> 8) & 0xFF;
+    record[3] = achieved & 0xFF;
+    record[4] = uint8_t(timed ? history_overshoot(target_millis, target_sub_micros, achieved_millis, achieved_sub_micros) : HISTORY_OVERSHOOT_UNTIMED);
+    record[5] = green_power >> 4;
+    record[6] = blue_power >> 4;
+
+    _history.next_sequence++;
+    if (_history.count < HISTORY_LENGTH)
+        _history.count++;
+}
+
+
+/* Copies up to max_records consecutive records into bytes, starting from
+ * first_sequence, or from the oldest held if that has been overwritten.
+ * Unused record slots are filled with HISTORY_RECORD_EMPTY.  Returns the
+ * number of records copied, and the sequence number of the first.
+ */
+uint8_t history_read(uint8_t first_sequence, uint8_t max_records, RadioPacket* bytes, uint8_t* returned_first_sequence)
+{
+    uint8_t behind = _history.next_sequence - first_sequence;
+
+    if (behind > _history.count)
+    {
+        first_sequence = _history.next_sequence - _history.count;
+        behind = _history.count;
+    }
+
+    uint8_t record_count = behind < max_records ? behind : max_records;
+
+    for (uint8_t i = 0; i < max_records; i++)
+    {
+        const RadioPacket* record = _history.records[uint8_t(first_sequence + i) & (HISTORY_LENGTH - 1)];
+
+        for (uint8_t j = 0; j < HISTORY_RECORD_SIZE; j++)
+            bytes[i * HISTORY_RECORD_SIZE + j] = i < record_count ? record[j] : HISTORY_RECORD_EMPTY;
+    }
+
+    *returned_first_sequence = first_sequence;
+
+    return record_count;
+}
+
+
+// Achieved less target, in microseconds, saturating at +-HISTORY_OVERSHOOT_MAX
+static int8_t history_overshoot(uint32_t target_millis, uint16_t target_sub_micros, uint32_t achieved_millis, uint16_t achieved_sub_micros)
+{
+    int32_t overshoot_millis = int32_t(achieved_millis - target_millis);
+
+    if (overshoot_millis > 1)
+        return HISTORY_OVERSHOOT_MAX;
+    if (overshoot_millis < -1)
+        return -HISTORY_OVERSHOOT_MAX;
+
+    int16_t overshoot_micros = int16_t(overshoot_millis * 1000 + int16_t(achieved_sub_micros) - int16_t(target_sub_micros));
+
+    if (overshoot_micros > HISTORY_OVERSHOOT_MAX)
+        return HISTORY_OVERSHOOT_MAX;
+    if (overshoot_micros < -HISTORY_OVERSHOOT_MAX)
+        return -HISTORY_OVERSHOOT_MAX;
+
+    return int8_t(overshoot_micros);
+}
@@ -0,0 +1,28 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <stdint.h>
+
+#include <lamphouse_shared.h>
+
+/* Exposure history.
+ *
+ * A record of each finished exposure or program is kept in a small ring
+ * buffer, so the interface can audit timing accuracy over a print session by
+ * reading the records back in pages (COMMAND_REPORT_HISTORY), rather than
+ * the controller sending anything per exposure.  The oldest record is
+ * overwritten once the buffer is full.
+ *
+ * Records are numbered by an 8-bit sequence number, which wraps.  They are
+ * held in their packet format (see lamphouse_shared.h), 7 bytes each, as RAM is short.
+ */
+
+const static uint8_t HISTORY_LENGTH = 16;       // Records; must be a power of two
+
+
+void history_init();
+void history_add(uint32_t target_millis, uint16_t target_sub_micros, uint32_t achieved_millis, uint16_t achieved_sub_micros,
+    bool timed, uint16_t green_power, uint16_t blue_power);
+uint8_t history_read(uint8_t first_sequence, uint8_t max_records, RadioPacket* bytes, uint8_t* returned_first_sequence);
+
+#endif
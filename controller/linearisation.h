@@ -0,0 +1,102 @@
+#ifndef _LINEARISATION_H
+#define _LINEARISATION_H
+
+#include <stdint.h>
+
+#include <lamphouse_shared.h>
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#define LINEARISATION_READ(address) pgm_read_word(address)
+#else
+#ifndef PROGMEM
+#define PROGMEM
+#endif
+#define LINEARISATION_READ(address) (*(address))
+#endif
+
+/* Power linearisation.
+ *
+ * Maps a channel power (0 to POWER_FULL, linear in light output) to a 16-bit
+ * PWM duty (0 to 0xFFFF), correcting for the LED drivers' response.  The
+ * response is modelled by led_light() below: no light up to
+ * LED_TURN_ON_DUTY, as the driver's rise and fall take up the start of each
+ * pulse, then light in proportion to duty, less LED_DROOP_PERMILLE at full
+ * duty as the LEDs heat up.  Both constants should be measured for each
+ * build.
+ *
+ * The table is generated by the compiler from the model, by inverting it with
+ * a constexpr bisection, and is held in flash.  It has an entry every
+ * LINEARISATION_STEP of power, and is interpolated between.  The first entry
+ * is the turn-on duty, which low powers start from; zero power is off.
+ */
+
+const static uint16_t LED_TURN_ON_DUTY = 328;           // ~0.5%
+const static uint16_t LED_DROOP_PERMILLE = 50;
+
+const static uint16_t LINEARISATION_STEP = 80;                  // Divides POWER_FULL
+const static uint8_t LINEARISATION_ENTRIES = POWER_FULL / LINEARISATION_STEP + 1;
+
+
+// Relative light output at duty, in arbitrary units
+constexpr uint64_t led_light(uint32_t duty)
+{
+    return duty <= LED_TURN_ON_DUTY ? 0 :
+        uint64_t(duty - LED_TURN_ON_DUTY) * (uint64_t(0xFFFF) * 1000 - uint64_t(LED_DROOP_PERMILLE) * duty);
+}
+
+
+// Smallest duty in [low, high] giving at least light
+constexpr uint16_t linearisation_invert(uint64_t light, uint32_t low, uint32_t high)
+{
+    return low >= high ? uint16_t(low) :
+        led_light((low + high) / 2) < light ?
+            linearisation_invert(light, (low + high) / 2 + 1, high) :
+            linearisation_invert(light, low, (low + high) / 2);
+}
+
+
+constexpr uint16_t linearised_duty(uint32_t power)
+{
+    return power == 0 ? LED_TURN_ON_DUTY :
+        power >= POWER_FULL ? 0xFFFF :
+        linearisation_invert(led_light(0xFFFF) * power / POWER_FULL, 0, 0xFFFF);
+}
+
+
+template<uint16_t... Duties> struct LinearisationTable
+{
+    static const uint16_t duty[sizeof...(Duties)];
+};
+
+template<uint16_t... Duties> const uint16_t LinearisationTable<Duties...>::duty[sizeof...(Duties)] PROGMEM = { Duties... };
+
+// Builds LinearisationTable<linearised_duty(0), linearised_duty(STEP), ...>
+template<uint8_t N, uint16_t... Duties> struct MakeLinearisationTable
+{
+    typedef typename MakeLinearisationTable<N - 1, linearised_duty(uint32_t(N - 1) * LINEARISATION_STEP), Duties...>::type type;
+};
+
+template<uint16_t... Duties> struct MakeLinearisationTable<0, Duties...>
+{
+    typedef LinearisationTable<Duties...> type;
+};
+
+typedef MakeLinearisationTable<LINEARISATION_ENTRIES>::type Linearisation;
+
+
+inline uint16_t linearise_power(uint16_t power)
+{
+    if (power == 0)
+        return 0;
+    if (power >= POWER_FULL)
+        return 0xFFFF;
+
+    uint8_t index = power / LINEARISATION_STEP;
+    uint16_t low = LINEARISATION_READ(&Linearisation::duty[index]);
+    uint16_t high = LINEARISATION_READ(&Linearisation::duty[index + 1]);
+
+    return low + uint16_t(uint32_t(high - low) * (power % LINEARISATION_STEP) / LINEARISATION_STEP);
+}
+
+#endif
@@ -0,0 +1,99 @@
+#include "meter.h"
+
+
+struct Meter
+{
+    uint16_t sample_micros;
+
+    volatile uint32_t pending_sum;      // Samples so far this period
+    volatile uint16_t pending_count;
+
+    uint32_t last_sum;                  // The previous period's samples
+    uint16_t last_count;
+
+    uint16_t dark;                      // ADC counts
+    uint32_t dose;                      // Count-milliseconds
+    uint16_t dose_fraction;             // Remainder of dose, in count-microseconds
+    uint32_t rate;                      // Dose over the previous period, in count-microseconds
+};
+
+
+static Meter _meter;
+
+
+void meter_init()
+{
+    _meter.pending_sum = 0;
+    _meter.pending_count = 0;
+    _meter.last_sum = 0;
+    _meter.last_count = 0;
+    _meter.dark = 0;
+    _meter.dose = 0;
+    _meter.dose_fraction = 0;
+    _meter.rate = 0;
+
+    _meter.sample_micros = meter_hw_init();
+}
+
+
+// Called from the exposure timer interrupts.
+void meter_zero()
+{
+    if (_meter.last_count != 0)
+        _meter.dark = (_meter.last_sum + _meter.last_count / 2) / _meter.last_count;
+
+    _meter.dose = 0;
+    _meter.dose_fraction = 0;
+    _meter.rate = 0;
+}
+
+
+// Only consistent from the exposure timer interrupts, or with them locked.
+void meter_dose(uint32_t* dose, uint16_t* dose_fraction)
+{
+    *dose = _meter.dose;
+    *dose_fraction = _meter.dose_fraction;
+}
+
+
+uint32_t meter_rate()
+{
+    return _meter.rate;
+}
+
+
+uint16_t meter_dark()
+{
+    return _meter.dark;
+}
+
+
+void meter_isr_sample(uint16_t sample)
+{
+    _meter.pending_sum += sample;
+    _meter.pending_count++;
+}
+
+
+void meter_period()
+{
+    // The ADC interrupt doesn't nest inside the timer interrupt, so the
+    // pending samples can be taken without locking.
+    uint32_t sum = _meter.pending_sum;
+    uint16_t count = _meter.pending_count;
+    _meter.pending_sum = 0;
+    _meter.pending_count = 0;
+
+    _meter.last_sum = sum;
+    _meter.last_count = count;
+
+    uint32_t dark_sum = uint32_t(_meter.dark) * count;
+    uint32_t light = sum > dark_sum ? sum - dark_sum : 0;
+    uint32_t micros = light * _meter.sample_micros;
+
+    _meter.rate = micros;
+
+    micros += _meter.dose_fraction;
+    _meter.dose += micros / 1000;
+    _meter.dose_fraction = micros % 1000;
+}
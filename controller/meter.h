@@ -0,0 +1,46 @@
+#ifndef _METER_H
+#define _METER_H
+
+#include <stdint.h>
+
+/* Light meter.
+ *
+ * A photodiode on a spare analog input measures the light reaching the
+ * baseboard, so that exposures can be ended on the light actually delivered
+ * rather than on power and time, which drift as the LEDs age and warm up.
+ * The photodiode amplifier should be filtered to well below the channels'
+ * PWM frequencies (~500 Hz and ~1 kHz), but with a time constant short
+ * compared to the exposure, as the measured dose lags by about that much.
+ *
+ * The ADC free-runs at a fixed sample rate, and its interrupt only adds each
+ * sample to a pending sum (meter_isr_sample()).  The exposure timer's period
+ * interrupt then calls meter_period() once per millisecond, which integrates
+ * the period's samples, less the dark level, into a running dose.
+ *
+ * Measured dose is in count-milliseconds: one millisecond at one ADC count
+ * above dark.  meter_zero() takes the dark level as the mean of the previous
+ * period's samples and clears the dose, so is called as the lights come on,
+ * which also excludes a safelight from the dose.
+ *
+ * Like the exposure engine, the core is hardware independent.  The ADC is
+ * set up by meter_hw_init(), implemented for the ATmega in meter_avr.cpp; a
+ * host build can supply its own, and feed recorded or synthetic samples to
+ * meter_isr_sample().
+ */
+
+void meter_init();
+void meter_zero();
+void meter_dose(uint32_t* dose, uint16_t* dose_fraction);
+uint32_t meter_rate();
+uint16_t meter_dark();
+
+// Interrupt entry points.  meter_period() must be called at the start of
+// each exposure timer period, before exposure_isr_period().
+void meter_isr_sample(uint16_t sample);
+void meter_period();
+
+// Hardware hook.  Starts the ADC sampling, and returns the sample period in
+// microseconds.
+uint16_t meter_hw_init();
+
+#endif
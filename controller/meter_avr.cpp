@@ -0,0 +1,39 @@
+/* ATmega168 hardware hook for the light meter.
+ *
+ * The ADC free-runs on the photodiode input with a prescaler of 128, so at
+ * 16 MHz samples every 13 ADC clocks = 104 us (~9.6 kHz), against AVcc.
+ * analogRead() must not be used while the meter is running.
+ */
+#if defined(__AVR__)
+
+#include <Arduino.h>
+#include <avr/interrupt.h>
+
+#include "meter.h"
+
+
+const static uint8_t METER_ADC_CHANNEL = 0;     // A0
+const static uint16_t METER_SAMPLE_MICROS = 104;
+
+
+uint16_t meter_hw_init()
+{
+    uint8_t sreg = SREG;
+    cli();
+    DIDR0 |= _BV(METER_ADC_CHANNEL);                    // Disable the pin's digital input buffer
+    ADMUX = _BV(REFS0) | METER_ADC_CHANNEL;             // AVcc reference, right adjusted
+    ADCSRB = 0;                                         // Free running
+    ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIF) | _BV(ADIE) |
+             _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);      // clk/128
+    SREG = sreg;
+
+    return METER_SAMPLE_MICROS;
+}
+
+
+ISR(ADC_vect)
+{
+    meter_isr_sample(ADC);
+}
+
+#endif
@@ -0,0 +1,56 @@
+#include "teststrip.h"
+
+
+// 2^(j/12) for j = 0..11, in Q15 (32768 = 1.0)
+const static uint16_t TWELFTH_STOP_FACTORS_Q15[12] = {
+    32768, 34716, 36781, 38968, 41285, 43740, 46341, 49097, 52016, 55109, 58386, 61858
+};
+
+
+static uint64_t test_strip_cumulative_micros(uint32_t base_micros, uint8_t twelfths);
+
+
+bool test_strip_build(ProgramStep* steps, uint16_t green_power, uint16_t blue_power,
+    uint32_t base_millis, uint16_t base_sub_micros, uint8_t stop_divisor, uint8_t strip_count,
+    uint16_t pause_millis)
+{
+    if (stop_divisor == 0 || 12 % stop_divisor != 0)
+        return false;
+    if (strip_count == 0 || strip_count > PROGRAM_MAX_STEPS)
+        return false;
+
+    // Work in microseconds.  This limits the base time to ~71 minutes.
+    uint64_t base_micros = uint64_t(base_millis) * 1000 + base_sub_micros;
+    if (base_micros > 0xFFFFFFFF)
+        return false;
+
+    uint8_t twelfths_per_strip = 12 / stop_divisor;
+    uint64_t previous_micros = 0;
+
+    for (uint8_t k = 0; k < strip_count; k++)
+    {
+        uint64_t cumulative_micros = test_strip_cumulative_micros(uint32_t(base_micros), k * twelfths_per_strip);
+        uint64_t step_micros = cumulative_micros - previous_micros;
+
+        steps[k].green_power = green_power;
+        steps[k].blue_power = blue_power;
+        steps[k].millis = uint32_t(step_micros / 1000);
+        steps[k].sub_micros = uint16_t(step_micros % 1000);
+        steps[k].pause_millis = k + 1 < strip_count ? pause_millis : 0;
+
+        previous_micros = cumulative_micros;
+    }
+
+    return true;
+}
+
+
+// base_micros * 2^(twelfths/12), rounded to the nearest microsecond
+static uint64_t test_strip_cumulative_micros(uint32_t base_micros, uint8_t twelfths)
+{
+    uint64_t scaled = uint64_t(base_micros) * TWELFTH_STOP_FACTORS_Q15[twelfths % 12];
+
+    scaled <<= twelfths / 12;
+
+    return (scaled + (1 << 14)) >> 15;
+}
@@ -0,0 +1,25 @@
+#ifndef _TESTSTRIP_H
+#define _TESTSTRIP_H
+
+#include <stdint.h>
+
+#include <lamphouse_shared.h>
+
+/* Test strip generator.
+ *
+ * Builds an f-stop test strip as an exposure program.  Strip k (from 0) is to
+ * receive a total exposure of base * 2^(k/stop_divisor), so the first step
+ * exposes the whole sheet for the base time, and each following step adds
+ * the increment to the next strip, with a pause (normally a hold) before each
+ * for the card to be moved.
+ *
+ * There's no FPU, so 2^(k/n) is taken from a fixed-point table of twelfth
+ * stops.  stop_divisor must therefore divide 12 (3, 6 and 12 being the
+ * useful ones).
+ */
+
+bool test_strip_build(ProgramStep* steps, uint16_t green_power, uint16_t blue_power,
+    uint32_t base_millis, uint16_t base_sub_micros, uint8_t stop_divisor, uint8_t strip_count,
+    uint16_t pause_millis);
+
+#endif
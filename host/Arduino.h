@@ -0,0 +1,98 @@
+#ifndef _HOST_ARDUINO_H
+#define _HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Arduino shim for the host simulator (see sim.h).  Just what the sketches
+ * use, for both the ATmega and the Maple Mini.  Clock and pin calls spend
+ * the board's SimBoardConfig.call_nanos of virtual time.
+ */
+
+// As the IDE defines, for the code that checks it
+#define ARDUINO 10805
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define LSBFIRST 0
+#define MSBFIRST 1
+
+#define DEC 10
+#define HEX 16
+#define BIN 2
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define pgm_read_byte(address) (*(const uint8_t*)(address))
+#define pgm_read_word(address) (*(const uint16_t*)(address))
+#define pgm_read_byte_near(address) pgm_read_byte(address)
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+
+// The ATmega's external interrupt mask, per board
+#define EIMSK (sim_eimsk())
+#define INT0 0
+#define digitalPinToInterrupt(pin) (pin)
+
+// Maple Mini pins, numbered clear of the ATmega's
+enum {
+    PA0 = 32, PA1, PA2, PA3, PA4, PA5, PA6, PA7, PA8, PA9, PA10, PA11, PA12, PA13, PA14, PA15,
+    PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7, PB8, PB9, PB10, PB11, PB12, PB13, PB14, PB15,
+    PC13 = PB15 + 14, PC14, PC15
+};
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+
+uint32_t millis();
+uint32_t micros();
+void delay(uint32_t ms);
+void delayMicroseconds(uint32_t us);
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+void analogWrite(uint8_t pin, int value);
+int analogRead(uint8_t pin);
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode);
+void detachInterrupt(uint8_t pin);
+void interrupts();
+void noInterrupts();
+uint8_t& sim_eimsk();
+
+
+class SimSerial
+{
+public:
+    void begin(unsigned long) { }
+    void print(const char* s);
+    void print(char c);
+    void print(long value, int base = DEC);
+    void print(unsigned long value, int base = DEC);
+    void print(int value, int base = DEC) { print(long(value), base); }
+    void print(unsigned int value, int base = DEC) { print((unsigned long)value, base); }
+    void print(unsigned char value, int base = DEC) { print((unsigned long)value, base); }
+    void print(double value, int digits = 2);
+    void println() { print("\n"); }
+    template <typename T> void println(T value) { print(value); println(); }
+    template <typename T> void println(T value, int format) { print(value, format); println(); }
+};
+
+extern SimSerial Serial;
+
+#endif
@@ -0,0 +1,92 @@
+#ifndef __RF24_H__
+#define __RF24_H__
+
+#include <stdint.h>
+
+/* Simulated nRF24L01+ for the host simulator (see sim.h), with the API of
+ * both the Arduino RF24 library the controller builds against and the
+ * interface's RF24_STM32, whose include guard this shares so that it stands
+ * in for it.  Behaves as the chip does, as far as the sketches can tell:
+ *   - Enhanced ShockBurst: auto-ACK with retries after ARD, up to ARC, then
+ *     MAX_RT, which halts sending until cleared; duplicate packets (same PID)
+ *     are ACKed but not received again.
+ *   - ACK payloads, which a receiver sends from its TX FIFO and drops once
+ *     the sender has moved on to its next packet.
+ *   - 3-deep TX and RX FIFOs; a packet that finds the RX FIFO full isn't
+ *     ACKed.
+ *   - TX_DS, MAX_RT and RX_DR, with the IRQ pin low while any unmasked one
+ *     is set.
+ *   - Airtime and turnaround from the data rate, address width and payload
+ *     size, so that an ARD too short for an ACK payload loses it.
+ * The link's loss, latency and so on are set by SimLinkConfig.  Each call
+ * spends the SPI time it would take on the board.  testRPD() finds a
+ * signal on the channel at random, as likely as SimLinkConfig.channel_busy
+ * says, once the radio has been listening long enough for it to settle.
+ */
+
+typedef enum { RF24_PA_MIN = 0, RF24_PA_LOW, RF24_PA_HIGH, RF24_PA_MAX, RF24_PA_ERROR } rf24_pa_dbm_e;
+typedef enum { RF24_1MBPS = 0, RF24_2MBPS, RF24_250KBPS } rf24_datarate_e;
+typedef enum { RF24_CRC_DISABLED = 0, RF24_CRC_8, RF24_CRC_16 } rf24_crclength_e;
+
+struct SimRadio;
+
+
+class RF24
+{
+public:
+    RF24(uint16_t ce_pin, uint16_t csn_pin);
+
+    bool begin(void);
+    bool isChipConnected() { return true; }
+    void startListening(void);
+    void stopListening(void);
+    bool available(void);
+    bool available(uint8_t* pipe_num);
+    void read(void* buf, uint8_t len);
+    bool write(const void* buf, uint8_t len);
+    bool write(const void* buf, uint8_t len, const bool multicast);
+    bool writeFast(const void* buf, uint8_t len);
+    bool writeFast(const void* buf, uint8_t len, const bool multicast);
+    void startFastWrite(const void* buf, uint8_t len, const bool multicast, bool startTx = 1);
+    bool txStandBy();
+    bool txFifoEmpty();
+    void writeAckPayload(uint8_t pipe, const void* buf, uint8_t len);
+    bool isAckPayloadAvailable(void);
+    uint8_t getDynamicPayloadSize(void);
+    void whatHappened(bool& tx_ok, bool& tx_fail, bool& rx_ready);
+    void maskIRQ(bool tx_ok, bool tx_fail, bool rx_ready);
+    void openWritingPipe(const uint8_t* address);
+    void openReadingPipe(uint8_t number, const uint8_t* address);
+    void closeReadingPipe(uint8_t pipe);
+    void setAddressWidth(uint8_t a_width);
+    void setRetries(uint8_t delay, uint8_t count);
+    void setChannel(uint8_t channel);
+    uint8_t getChannel(void);
+    void setPALevel(uint8_t level);
+    uint8_t getPALevel(void);
+    bool setDataRate(rf24_datarate_e speed);
+    rf24_datarate_e getDataRate(void);
+    void setCRCLength(rf24_crclength_e) { }
+    void enableAckPayload(void);
+    void enableDynamicPayloads(void);
+    void enableDynamicAck(void) { }
+    void setAutoAck(bool) { }
+    void powerDown(void);
+    void powerUp(void);
+    uint8_t flush_tx(void);
+    uint8_t flush_rx(void);
+    bool testRPD(void);
+    bool testCarrier(void) { return testRPD(); }
+    uint8_t observeTx(void);
+    bool verifyShadowRegisters(void) { return true; }
+
+    uint32_t txDelay;
+    uint32_t csDelay;
+
+private:
+    void spi(uint8_t transactions, uint8_t bytes);
+
+    SimRadio* sim;
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef _HOST_SPI_H
+#define _HOST_SPI_H
+
+#include <stdint.h>
+
+/* SPI shim for the host simulator (see sim.h).  The radio is simulated above
+ * the bus, in RF24.h, so this only has to accept its sketch's set-up.  Other
+ * devices, attached with sim_attach_spi(), see each byte of transfer() and
+ * dmaTransfer(), which spend the bytes' time at the bus's clock: the Maple
+ * Mini's bus 1 runs from 72 MHz and bus 2 from 36 MHz, divided by the clock
+ * divider.  The set-up calls are out of line, so that a test building a
+ * driver without the simulator can supply its own (see rf24_spi_test.cpp).
+ */
+
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+#define SPI_CLOCK_DIV2 0
+#define SPI_CLOCK_DIV4 1
+#define SPI_CLOCK_DIV8 2
+#define SPI_CLOCK_DIV16 3
+#define SPI_CLOCK_DIV32 4
+#define SPI_CLOCK_DIV64 5
+#define SPI_CLOCK_DIV128 6
+#define SPI_CLOCK_DIV256 7
+
+
+class SPIClass
+{
+public:
+    SPIClass(uint8_t bus = 1) : bus(bus), divider(SPI_CLOCK_DIV32) { }
+
+    void begin() { }
+    void end() { }
+    void setBitOrder(uint8_t order);
+    void setDataMode(uint8_t mode);
+    void setClockDivider(uint8_t divider);
+    uint8_t transfer(uint8_t data);
+    uint8_t dmaTransfer(const void* transmit, void* receive, uint16_t length);
+
+private:
+    uint8_t bus;
+    uint8_t divider;
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,295 @@
+/* The controller sketch, built for the host simulator (see sim.h), with the
+ * exposure and meter hardware hooks in place of exposure_avr.cpp and
+ * meter_avr.cpp.
+ *
+ * The sketch is built in namespace controller, as the interface has
+ * functions of the same names.  The headers it shares with the interface are
+ * included first, outside it, so that their include guards keep them there.
+ *
+ * Timer1 is modelled as exposure_avr.cpp runs it: 0.5 us counts and a 1 ms
+ * period, from exposure_hw_init().  The compare point loaded by
+ * exposure_hw_set_compare() takes effect from the next period, and the
+ * compare interrupt is raised only in a period it's enabled for.  The ADC
+ * samples the light every METER_SAMPLE_MICROS, at a level in proportion to
+ * the green and blue powers.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "RF24.h"
+#include "sim.h"
+#include "sim_boards.h"
+
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+#include <lamphouse_radio_irq.h>
+
+
+namespace controller {
+
+#include "../controller/controller.ino"
+#include "../controller/exposure.cpp"
+#include "../controller/history.cpp"
+#include "../controller/meter.cpp"
+#include "../controller/teststrip.cpp"
+
+
+const static SimNanos TIMER_COUNT_NANOS = SIM_NANOS_PER_MICRO / EXPOSURE_COUNTS_PER_MICRO;
+const static SimNanos TIMER_PERIOD_NANOS = EXPOSURE_PERIOD_MICROS * SIM_NANOS_PER_MICRO;
+
+// As exposure_avr.cpp
+const static uint16_t TIMER_MIN_COMPARE_COUNTS = 40;
+
+const static uint16_t METER_SAMPLE_MICROS = 104;
+const static uint16_t METER_DARK_SAMPLE = 12;
+
+// Interrupt entry, before the handler acts, and its work and exit after.
+// These are fixed allowances, not measured from the handlers' code, so the
+// simulator doesn't show what a handler's arithmetic costs on the ATmega.
+const static SimNanos ISR_ENTRY_NANOS = 2 * SIM_NANOS_PER_MICRO;
+const static SimNanos PERIOD_ISR_NANOS = 10 * SIM_NANOS_PER_MICRO;
+const static SimNanos COMPARE_ISR_NANOS = 4 * SIM_NANOS_PER_MICRO;
+const static SimNanos ADC_ISR_NANOS = 2 * SIM_NANOS_PER_MICRO;
+
+
+struct HostTimer
+{
+    SimNanos start;                     // Of count 0 of period 0
+    uint32_t period;                    // The current period
+    uint16_t compare_counts;            // OCR1B, as loaded
+    uint16_t active_compare_counts;     // As taken up at the start of the current period
+    bool compare_enabled;               // OCIE1B
+};
+
+
+static HostTimer _timer;
+static uint16_t _channel_power[3];
+
+
+static void timer_period_event();
+static void timer_schedule_compare();
+static uint16_t timer_counts();
+static void timer_period_isr();
+static void timer_compare_isr();
+static void adc_sample_event();
+static void adc_isr();
+
+
+void exposure_hw_init()
+{
+    uint8_t lock_state = exposure_hw_lock();
+
+    _timer.start = sim_now();
+    _timer.period = 0;
+    _timer.compare_counts = 0;
+    _timer.active_compare_counts = 0;
+    _timer.compare_enabled = false;
+
+    sim_attach_irq(SIM_BOARD_CONTROLLER, SIM_IRQ_TIMER_PERIOD, timer_period_isr);
+    sim_attach_irq(SIM_BOARD_CONTROLLER, SIM_IRQ_TIMER_COMPARE, timer_compare_isr);
+    sim_schedule(_timer.start + TIMER_PERIOD_NANOS, timer_period_event);
+
+    exposure_hw_unlock(lock_state);
+
+    exposure_hw_write_channel(CHANNEL_RED, 0);
+    exposure_hw_write_channels(0, 0);
+}
+
+
+void exposure_hw_set_compare(uint16_t counts)
+{
+    _timer.compare_counts = counts;
+}
+
+
+bool exposure_hw_enable_compare(uint16_t counts)
+{
+    if (counts < TIMER_MIN_COMPARE_COUNTS)
+    {
+        exposure_hw_wait(counts);
+        return false;
+    }
+
+    sim_clear_irq(SIM_BOARD_CONTROLLER, SIM_IRQ_TIMER_COMPARE);
+    _timer.compare_enabled = true;
+
+    if (timer_counts() >= counts)
+    {
+        // Missed it.  The caller acts on it now.
+        _timer.compare_enabled = false;
+        return false;
+    }
+
+    timer_schedule_compare();
+    return true;
+}
+
+
+void exposure_hw_disable_compare()
+{
+    _timer.compare_enabled = false;
+}
+
+
+void exposure_hw_wait(uint16_t counts)
+{
+    uint16_t now_counts;
+
+    while ((now_counts = timer_counts()) < counts)
+        sim_spend((counts - now_counts) * TIMER_COUNT_NANOS);
+}
+
+
+uint16_t exposure_hw_counter()
+{
+    uint16_t counts = timer_counts();
+
+    // The period has wrapped but its interrupt hasn't run yet.
+    if (sim_irq_pending(SIM_BOARD_CONTROLLER, SIM_IRQ_TIMER_PERIOD) && counts < EXPOSURE_COUNTS_PER_PERIOD / 2)
+        counts += EXPOSURE_COUNTS_PER_PERIOD;
+
+    return counts;
+}
+
+
+void exposure_hw_write_channel(uint8_t channel, uint16_t power)
+{
+    _channel_power[channel] = power;
+    sim_light(_channel_power[CHANNEL_RED], _channel_power[CHANNEL_GREEN], _channel_power[CHANNEL_BLUE]);
+}
+
+
+void exposure_hw_write_channels(uint16_t green_power, uint16_t blue_power)
+{
+    _channel_power[CHANNEL_GREEN] = green_power;
+    _channel_power[CHANNEL_BLUE] = blue_power;
+    sim_light(_channel_power[CHANNEL_RED], green_power, blue_power);
+}
+
+
+// The simulated channels switch together, so there's no skew to measure
+void exposure_hw_measure_skew(uint16_t green_power, uint16_t blue_power, int16_t* on_skew_counts, int16_t* off_skew_counts)
+{
+    exposure_hw_write_channels(green_power, blue_power);
+    exposure_hw_wait(timer_counts() + 100);
+    exposure_hw_write_channels(0, 0);
+
+    *on_skew_counts = 0;
+    *off_skew_counts = 0;
+}
+
+
+uint8_t exposure_hw_lock()
+{
+    return sim_lock();
+}
+
+
+void exposure_hw_unlock(uint8_t lock_state)
+{
+    sim_unlock(lock_state != 0);
+}
+
+
+uint16_t meter_hw_init()
+{
+    sim_attach_irq(SIM_BOARD_CONTROLLER, SIM_IRQ_ADC, adc_isr);
+    sim_schedule(sim_now() + METER_SAMPLE_MICROS * SIM_NANOS_PER_MICRO, adc_sample_event);
+
+    return METER_SAMPLE_MICROS;
+}
+
+
+// TOV1, and the compare point loaded in the last period taking effect
+static void timer_period_event()
+{
+    _timer.period++;
+    _timer.active_compare_counts = _timer.compare_counts;
+    sim_raise_irq(SIM_BOARD_CONTROLLER, SIM_IRQ_TIMER_PERIOD);
+
+    if (_timer.compare_enabled)
+        timer_schedule_compare();
+    sim_schedule(_timer.start + (_timer.period + 1) * TIMER_PERIOD_NANOS, timer_period_event);
+}
+
+
+// OCF1B in the current period, if the compare is still enabled then
+static void timer_schedule_compare()
+{
+    uint32_t period = _timer.period;
+    SimNanos at = _timer.start + period * TIMER_PERIOD_NANOS + _timer.active_compare_counts * TIMER_COUNT_NANOS;
+
+    sim_schedule(at, [period]() {
+        if (_timer.compare_enabled && _timer.period == period)
+            sim_raise_irq(SIM_BOARD_CONTROLLER, SIM_IRQ_TIMER_COMPARE);
+    });
+}
+
+
+// TCNT1
+static uint16_t timer_counts()
+{
+    SimNanos into_period = sim_now() - _timer.start - _timer.period * TIMER_PERIOD_NANOS;
+
+    if (into_period >= TIMER_PERIOD_NANOS)
+        return EXPOSURE_COUNTS_PER_PERIOD - 1;      // Wrapped, but the board hasn't seen it yet
+
+    return uint16_t(into_period / TIMER_COUNT_NANOS);
+}
+
+
+static void timer_period_isr()
+{
+    sim_spend(ISR_ENTRY_NANOS);
+    meter_period();
+    exposure_isr_period();
+    sim_spend(PERIOD_ISR_NANOS);
+}
+
+
+static void timer_compare_isr()
+{
+    sim_spend(ISR_ENTRY_NANOS);
+    exposure_isr_compare();
+    sim_spend(COMPARE_ISR_NANOS);
+}
+
+
+static void adc_sample_event()
+{
+    sim_raise_irq(SIM_BOARD_CONTROLLER, SIM_IRQ_ADC);
+    sim_schedule(sim_now() + METER_SAMPLE_MICROS * SIM_NANOS_PER_MICRO, adc_sample_event);
+}
+
+
+// Full green and blue together read about 512 counts above dark
+static void adc_isr()
+{
+    sim_spend(ISR_ENTRY_NANOS);
+    meter_isr_sample(METER_DARK_SAMPLE + uint16_t((uint32_t(_channel_power[CHANNEL_GREEN]) + _channel_power[CHANNEL_BLUE]) *
+        256 / POWER_FULL));
+    sim_spend(ADC_ISR_NANOS);
+}
+
+}   // namespace controller
+
+
+void controller_setup()
+{
+    controller::setup();
+}
+
+
+void controller_loop()
+{
+    controller::loop();
+}
+
+
+const ProgramStep* controller_program(uint8_t* length)
+{
+    *length = controller::_state.program_length;
+    return &controller::_state.program[0];
+}
@@ -0,0 +1,471 @@
+/* Tests the exposure engine's dose and metered modes, and the light meter,
+ * on the host.  Unlike lamphouse_sim.cpp this runs no radio or simulator:
+ * exposure.cpp and meter.cpp are driven from a plain model of Timer1, stepped
+ * a count at a time, with ADC samples from synthetic light traces fed to
+ * meter_isr_sample().  Interrupts take no time, so the outputs switch at the
+ * exact counts the engine asks for.
+ *
+ * Checks
+ *   - Dose mode: each channel switches off once power * on-time reaches its
+ *     target, and no more than a microsecond later, including across an
+ *     exposure_set_dose_power() change, and exposure_dose() reports the
+ *     targets.
+ *   - The meter: its dark level, and its integrated dose and rate over
+ *     steady, step-change and noisy traces, against the traces' samples.
+ *   - Metered mode: the switch-off point against where the trace's light
+ *     reaches the target.
+ *   - The history record of a timed exposure: its overshoot is the time
+ *     the switch-off interrupt was held off, as the outputs switched.
+ *
+ * Build, from the top of the repository:
+ *   g++ -std=gnu++11 -O2 -Ihost -Ilibraries/LamphouseShared \
+ *       host/exposure_test.cpp libraries/LamphouseShared/lamphouse_shared.cpp -o exposure_test
+ * Exits 1 if any check fails.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lamphouse_shared.h>
+
+#include "../controller/exposure.cpp"
+#include "../controller/history.cpp"
+#include "../controller/meter.cpp"
+
+
+// As exposure_avr.cpp and controller_board.cpp
+const static uint16_t TIMER_MIN_COMPARE_COUNTS = 40;
+const static uint16_t METER_SAMPLE_MICROS = 104;
+const static uint16_t METER_SAMPLE_COUNTS = METER_SAMPLE_MICROS * EXPOSURE_COUNTS_PER_MICRO;
+const static uint16_t METER_DARK_SAMPLE = 12;
+
+// ADC counts above dark for a light level, and the trace's level from its
+// start, in timer counts
+typedef uint16_t (*LightTrace)(uint64_t counts);
+
+
+struct TestTimer
+{
+    uint64_t counts;                    // Since exposure_hw_init()
+    uint16_t compare_counts;            // As loaded
+    uint16_t active_compare_counts;     // As taken up at the start of the current period
+    bool compare_enabled;
+    uint16_t compare_delay_counts;      // The compare interrupt is held off this long
+};
+
+
+struct TestLight
+{
+    uint16_t power[3];
+    uint64_t last_change;               // Timer counts
+    uint64_t power_counts[3];           // Integral of power over time, per channel
+    uint64_t off_counts;                // Of the last switch to all off
+
+    LightTrace trace;                   // While any channel is on
+    uint64_t trace_start;
+    uint64_t trace_micros;              // Dose of the trace's samples while on, in count-microseconds
+};
+
+
+static TestTimer _timer;
+static TestLight _light;
+static int _failures;
+
+
+static void check(bool ok, const char* name)
+{
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+        _failures++;
+}
+
+
+void exposure_hw_init()
+{
+    _timer.counts = 0;
+    _timer.compare_counts = 0;
+    _timer.active_compare_counts = 0;
+    _timer.compare_enabled = false;
+    _timer.compare_delay_counts = 0;
+}
+
+
+void exposure_hw_set_compare(uint16_t counts)
+{
+    _timer.compare_counts = counts;
+}
+
+
+bool exposure_hw_enable_compare(uint16_t counts)
+{
+    if (counts < TIMER_MIN_COMPARE_COUNTS)
+    {
+        exposure_hw_wait(counts);
+        return false;
+    }
+
+    if (exposure_hw_counter() >= counts)
+        return false;
+
+    _timer.compare_enabled = true;
+    return true;
+}
+
+
+void exposure_hw_disable_compare()
+{
+    _timer.compare_enabled = false;
+}
+
+
+// Without interrupts, as the engine only waits with them locked
+void exposure_hw_wait(uint16_t counts)
+{
+    uint16_t now_counts = exposure_hw_counter();
+
+    if (now_counts < counts)
+        _timer.counts += counts - now_counts;
+}
+
+
+uint16_t exposure_hw_counter()
+{
+    return uint16_t(_timer.counts % EXPOSURE_COUNTS_PER_PERIOD);
+}
+
+
+static void light_integrate()
+{
+    uint64_t counts = _timer.counts - _light.last_change;
+
+    for (uint8_t channel = 0; channel < 3; channel++)
+        _light.power_counts[channel] += uint64_t(_light.power[channel]) * counts;
+    _light.last_change = _timer.counts;
+}
+
+
+static bool light_on()
+{
+    return _light.power[CHANNEL_GREEN] != 0 || _light.power[CHANNEL_BLUE] != 0;
+}
+
+
+void exposure_hw_write_channel(uint8_t channel, uint16_t power)
+{
+    light_integrate();
+    _light.power[channel] = power;
+}
+
+
+void exposure_hw_write_channels(uint16_t green_power, uint16_t blue_power)
+{
+    bool was_on = light_on();
+
+    light_integrate();
+    _light.power[CHANNEL_GREEN] = green_power;
+    _light.power[CHANNEL_BLUE] = blue_power;
+
+    if (!was_on && light_on())
+        _light.trace_start = _timer.counts;
+    if (was_on && !light_on())
+        _light.off_counts = _timer.counts;
+}
+
+
+void exposure_hw_measure_skew(uint16_t, uint16_t, int16_t* on_skew_counts, int16_t* off_skew_counts)
+{
+    *on_skew_counts = 0;
+    *off_skew_counts = 0;
+}
+
+
+uint8_t exposure_hw_lock()
+{
+    return 0;
+}
+
+
+void exposure_hw_unlock(uint8_t)
+{
+}
+
+
+uint16_t meter_hw_init()
+{
+    return METER_SAMPLE_MICROS;
+}
+
+
+// Advances the timer a count, taking its interrupts and the ADC's
+static void tick()
+{
+    _timer.counts++;
+
+    if (_timer.counts % METER_SAMPLE_COUNTS == 0)
+    {
+        uint16_t light = 0;
+
+        if (light_on() && _light.trace)
+        {
+            light = _light.trace(_timer.counts - _light.trace_start);
+            _light.trace_micros += uint64_t(light) * METER_SAMPLE_MICROS;
+        }
+        meter_isr_sample(METER_DARK_SAMPLE + light);
+    }
+
+    uint16_t counts = exposure_hw_counter();
+
+    if (counts == 0)
+    {
+        _timer.active_compare_counts = _timer.compare_counts;
+        meter_period();
+        exposure_isr_period();
+    }
+    else if (_timer.compare_enabled && counts == _timer.active_compare_counts + _timer.compare_delay_counts)
+    {
+        exposure_isr_compare();
+    }
+}
+
+
+static void run_counts(uint32_t counts)
+{
+    while (counts-- > 0)
+        tick();
+}
+
+
+// Runs until the exposure ends, or limit counts
+static bool run_exposure(uint32_t limit)
+{
+    while (exposure_state() != CONTROLLER_STATE_NOT_EXPOSING && limit-- > 0)
+        tick();
+
+    return exposure_state() == CONTROLLER_STATE_NOT_EXPOSING;
+}
+
+
+static void reset(LightTrace trace)
+{
+    exposure_init();
+    meter_init();
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        _light.power[channel] = 0;
+        _light.power_counts[channel] = 0;
+    }
+    _light.last_change = 0;
+    _light.off_counts = 0;
+    _light.trace = trace;
+    _light.trace_start = 0;
+    _light.trace_micros = 0;
+
+    // Part way into a period, as loop() would be, with a dark period behind it
+    run_counts(3 * EXPOSURE_COUNTS_PER_PERIOD + 777);
+}
+
+
+// Whether the channel's power-counts reached its target dose, and by no more
+// than a microsecond at its final power
+static bool dose_reached(uint8_t channel, uint32_t target, uint16_t final_power)
+{
+    uint64_t target_counts = uint64_t(target) * POWER_FINE_STEPS * EXPOSURE_COUNTS_PER_PERIOD;
+    uint64_t counts = _light.power_counts[channel];
+
+    return counts >= target_counts && counts <= target_counts + uint64_t(final_power) * EXPOSURE_COUNTS_PER_MICRO;
+}
+
+
+static void test_dose(uint16_t green_power, uint16_t blue_power, uint32_t green_dose, uint32_t blue_dose)
+{
+    char name[80];
+    uint32_t green, blue;
+
+    reset(0);
+    exposure_start_dose(green_power, blue_power, green_dose, blue_dose);
+    bool ended = run_exposure(100000 * EXPOSURE_COUNTS_PER_PERIOD);
+    light_integrate();
+    exposure_dose(&green, &blue);
+
+    snprintf(name, sizeof(name), "Dose %u/%u at %u/%u", unsigned(green_dose), unsigned(blue_dose),
+        green_power, blue_power);
+    check(ended && dose_reached(CHANNEL_GREEN, green_dose, green_power) &&
+        dose_reached(CHANNEL_BLUE, blue_dose, blue_power) && green == green_dose && blue == blue_dose, name);
+}
+
+
+/* Channels ending in the same period, other than at the same count.  There's
+ * one compare point, which takes effect the period after it's loaded, so the
+ * later end is at the start of the next period (see exposure.cpp).
+ */
+static void test_dose_same_period()
+{
+    reset(0);
+    exposure_start_dose(POWER_FULL, 1000, 100, 7);
+    bool ended = run_exposure(100 * EXPOSURE_COUNTS_PER_PERIOD);
+    light_integrate();
+
+    check(ended && dose_reached(CHANNEL_BLUE, 7, 1000) &&
+        _light.power_counts[CHANNEL_GREEN] == uint64_t(POWER_FULL) * EXPOSURE_COUNTS_PER_PERIOD,
+        "Dose, two ends in one period: the later at the next period");
+}
+
+
+// Burning in: the powers change part way through
+static void test_dose_change()
+{
+    uint32_t green, blue;
+
+    reset(0);
+    exposure_start_dose(POWER_FULL, 1000, 2000, 300);
+    run_counts(1234 * EXPOSURE_COUNTS_PER_MICRO);
+
+    exposure_dose(&green, &blue);
+    bool part = green > 0 && green < 2000 && blue > 0 && blue < 300;
+
+    exposure_set_dose_power(POWER_FULL / 3 + 7, 3333);
+    bool ended = run_exposure(100000 * EXPOSURE_COUNTS_PER_PERIOD);
+    light_integrate();
+    exposure_dose(&green, &blue);
+
+    check(part && ended && dose_reached(CHANNEL_GREEN, 2000, POWER_FULL / 3 + 7) &&
+        dose_reached(CHANNEL_BLUE, 300, 3333) && green == 2000 && blue == 300, "Dose with a power change");
+}
+
+
+static uint16_t trace_steady(uint64_t)
+{
+    return 200;
+}
+
+
+static uint16_t trace_step(uint64_t counts)
+{
+    return counts < 5000 * EXPOSURE_COUNTS_PER_MICRO ? 400 : 150;
+}
+
+
+// Zero mean over each 12 samples, so over most periods
+static uint16_t trace_noisy(uint64_t counts)
+{
+    static const int8_t noise[] = { 9, -4, 3, -11, 0, 6, -7, 2, -3, 10, -1, -4 };
+
+    return uint16_t(300 + noise[(counts / METER_SAMPLE_COUNTS) % sizeof(noise)]);
+}
+
+
+// The meter alone: the lights on with the trace for periods, and the meter's
+// dose and last rate against the samples
+static void test_meter(LightTrace trace, uint32_t periods, uint32_t max_error, const char* name)
+{
+    uint32_t dose;
+    uint16_t dose_fraction;
+
+    reset(trace);
+
+    // meter_zero() at the start of a period, as exposure_begin_metered()
+    run_counts(EXPOSURE_COUNTS_PER_PERIOD - exposure_hw_counter());
+    meter_zero();
+    uint16_t dark = meter_dark();
+    exposure_hw_write_channels(POWER_FULL, 0);
+    run_counts(periods * EXPOSURE_COUNTS_PER_PERIOD);
+    exposure_hw_write_channels(0, 0);
+
+    meter_dose(&dose, &dose_fraction);
+    uint64_t measured = uint64_t(dose) * 1000 + dose_fraction;
+    uint64_t expected = _light.trace_micros;
+    uint32_t error = uint32_t(measured > expected ? measured - expected : expected - measured);
+
+    char full_name[80];
+    snprintf(full_name, sizeof(full_name), "Meter, %s: dose %llu of %llu count-us", name,
+        (unsigned long long)measured, (unsigned long long)expected);
+    check(dark == METER_DARK_SAMPLE && error <= max_error && meter_rate() > 0, full_name);
+}
+
+
+// A metered exposure to the target, and where it switched off against where
+// the trace reached the target, in microseconds
+static void test_metered(LightTrace trace, uint32_t target, uint32_t max_error_micros, const char* name)
+{
+    reset(trace);
+    exposure_start_metered(POWER_FULL, POWER_FULL, target);
+    bool ended = run_exposure(100000 * EXPOSURE_COUNTS_PER_PERIOD);
+
+    // Where the continuous trace reached the target
+    uint64_t target_counts = uint64_t(target) * 1000 * EXPOSURE_COUNTS_PER_MICRO;
+    uint64_t sum = 0;
+    uint64_t reached = 0;
+    while (sum < target_counts)
+        sum += trace(++reached);
+
+    int64_t error_counts = int64_t(_light.off_counts - _light.trace_start) - int64_t(reached);
+    int32_t error_micros = int32_t(error_counts / EXPOSURE_COUNTS_PER_MICRO);
+
+    char full_name[80];
+    snprintf(full_name, sizeof(full_name), "Metered, %s: off %+d us from the target", name, int(error_micros));
+    check(ended && abs(error_micros) <= int32_t(max_error_micros), full_name);
+}
+
+
+/* A timed exposure whose switch-off interrupt is held off by delay_micros,
+ * as by a locked section, and its history record as update_history() in
+ * controller.ino adds it.  The overshoot is the time the outputs were on
+ * beyond the target, here the delay.
+ */
+static void test_history(uint32_t millis, uint16_t sub_micros, uint16_t delay_micros)
+{
+    uint32_t achieved_millis;
+    uint16_t achieved_sub_micros;
+    RadioPacket records[HISTORY_RECORD_SIZE];
+    uint8_t first;
+
+    reset(0);
+    history_init();
+    _timer.compare_delay_counts = delay_micros * EXPOSURE_COUNTS_PER_MICRO;
+    exposure_start(POWER_FULL, 0, millis, sub_micros);
+    bool ended = run_exposure(100000 * EXPOSURE_COUNTS_PER_PERIOD);
+    light_integrate();
+
+    exposure_achieved(&achieved_millis, &achieved_sub_micros);
+    history_add(millis, sub_micros, achieved_millis, achieved_sub_micros, true, POWER_FULL, 0);
+    history_read(0, 1, records, &first);
+
+    int64_t on_micros = int64_t(_light.power_counts[CHANNEL_GREEN] / POWER_FULL / EXPOSURE_COUNTS_PER_MICRO);
+    int64_t error_micros = on_micros - (int64_t(millis) * 1000 + sub_micros);
+
+    char name[80];
+    snprintf(name, sizeof(name), "History, %u.%03u ms held off %u us: overshoot %d us", unsigned(millis),
+        sub_micros, delay_micros, int(int8_t(records[4])));
+    check(ended && int8_t(records[4]) == error_micros && error_micros == delay_micros, name);
+}
+
+
+int main()
+{
+    // Timed ends within the first period, across periods, and long ones
+    test_dose(POWER_FULL, POWER_FULL, 1, 1);
+    test_dose(POWER_FULL, 100, 100, 7);
+    test_dose(2049, 17, 1000, 3);
+    test_dose(POWER_FULL, POWER_FULL, 1000000, 900000);
+    test_dose(POWER_FULL, 0, 50, 0);
+    test_dose_same_period();
+    test_dose_change();
+
+    test_meter(trace_steady, 100, 0, "steady");
+    test_meter(trace_step, 100, 0, "step change");
+    test_meter(trace_noisy, 100, 0, "noisy");
+
+    // The meter's dose is of whole samples, so the end can be out by up to a
+    // sample's dose either way, besides the rate of the last period
+    test_metered(trace_steady, 1000, 2 * METER_SAMPLE_MICROS, "steady");
+    test_metered(trace_step, 3000, 2 * METER_SAMPLE_MICROS, "step change");
+    test_metered(trace_noisy, 2000, 2 * METER_SAMPLE_MICROS, "noisy");
+
+    test_history(250, 0, 0);
+    test_history(1234, 567, 0);
+    test_history(250, 100, 25);
+    test_history(3, 400, 90);
+
+    printf("%s\n", _failures ? "FAIL" : "PASS");
+    return _failures ? 1 : 0;
+}
@@ -0,0 +1,1253 @@
+#include <math.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "sim.h"
+#include "ft81x.h"
+
+#include "../interface/FT8.h"
+
+
+const static uint32_t RAM_G_SIZE = 1024 * 1024;
+const static uint32_t RAM_DL_SIZE = 8 * 1024;
+const static uint32_t RAM_REG_SIZE = 4 * 1024;
+const static uint32_t RAM_CMD_SIZE = 4 * 1024;
+const static uint16_t RAM_CMD_MASK = RAM_CMD_SIZE - 1;
+const static uint32_t TRACKER_REGS_SIZE = 5 * 4;
+
+const static uint8_t CHIP_ID = 0x7C;
+const static uint16_t CMD_READ_FAULT = 0xFFF;
+const static uint32_t NO_TOUCH_XY = 0x80008000UL;
+const static uint32_t SYSTEM_KHZ = 60000;
+
+const static uint32_t DEFAULT_FGCOLOR = 0x003870;
+const static uint32_t DEFAULT_BGCOLOR = 0x002040;
+const static uint8_t DEFAULT_TAG = 255;
+const static uint8_t CALIBRATE_TOUCHES = 3;
+
+// Co-processor time.  It runs at 60 MHz, taking a few cycles for each word
+// of RAM_CMD and each display list entry it writes, and longer for a widget
+// as it lays it out.  These are estimates, to compare one frame with another,
+// not measurements.
+const static SimNanos COPRO_WORD_NANOS = 70;
+const static SimNanos COPRO_DL_NANOS = 35;
+const static SimNanos COPRO_CHAR_NANOS = 300;
+const static SimNanos COPRO_KEY_NANOS = 1500;
+const static SimNanos COPRO_MEMORY_BYTE_NANOS = 5;
+
+// ROM font heights, fonts 16 to 34.  Text is taken as 0.4 of its height a
+// character wide, which is narrower than any, so that only text that's
+// certainly too long is found off the screen.
+const static uint8_t ROM_FONT_FIRST = 16;
+const static uint8_t ROM_FONT_HEIGHTS[] = { 8, 8, 16, 16, 13, 17, 20, 22, 29, 38, 16, 20, 25, 28, 36, 49, 63, 83, 108 };
+const static uint8_t ROM_FONT_COUNT = sizeof(ROM_FONT_HEIGHTS);
+const static uint8_t UNKNOWN_FONT_HEIGHT = 20;
+
+
+enum CommandPayload {
+    PAYLOAD_NONE,
+    PAYLOAD_STRING,                     // A string, padded to a word, after the arguments
+    PAYLOAD_DATA,                       // CMD_MEMWRITE's bytes, padded to a word
+    PAYLOAD_UNKNOWN                     // Data whose length is only found by decoding it
+};
+
+
+struct CommandInfo
+{
+    uint32_t command;
+    const char* name;
+    uint8_t arg_bytes;                  // After the command word
+    CommandPayload payload;
+    SimNanos nanos;                     // Besides its words and display list entries
+};
+
+
+const static CommandInfo COMMANDS[] = {
+    { CMD_DLSTART,      "DLSTART",      0,  PAYLOAD_NONE,    500 },
+    { CMD_SWAP,         "SWAP",         0,  PAYLOAD_NONE,    500 },
+    { CMD_COLDSTART,    "COLDSTART",    0,  PAYLOAD_NONE,    2000 },
+    { CMD_INTERRUPT,    "INTERRUPT",    4,  PAYLOAD_NONE,    200 },
+    { CMD_APPEND,       "APPEND",       8,  PAYLOAD_NONE,    500 },
+    { CMD_REGREAD,      "REGREAD",      8,  PAYLOAD_NONE,    200 },
+    { CMD_MEMWRITE,     "MEMWRITE",     8,  PAYLOAD_DATA,    200 },
+    { CMD_INFLATE,      "INFLATE",      4,  PAYLOAD_UNKNOWN, 0 },
+    { CMD_LOADIMAGE,    "LOADIMAGE",    8,  PAYLOAD_UNKNOWN, 0 },
+    { CMD_PLAYVIDEO,    "PLAYVIDEO",    4,  PAYLOAD_UNKNOWN, 0 },
+    { CMD_MEDIAFIFO,    "MEDIAFIFO",    8,  PAYLOAD_NONE,    200 },
+    { CMD_VIDEOSTART,   "VIDEOSTART",   0,  PAYLOAD_NONE,    200 },
+    { CMD_VIDEOFRAME,   "VIDEOFRAME",   8,  PAYLOAD_NONE,    200 },
+    { CMD_MEMCRC,       "MEMCRC",       12, PAYLOAD_NONE,    500 },
+    { CMD_MEMZERO,      "MEMZERO",      8,  PAYLOAD_NONE,    200 },
+    { CMD_MEMSET,       "MEMSET",       12, PAYLOAD_NONE,    200 },
+    { CMD_MEMCPY,       "MEMCPY",       12, PAYLOAD_NONE,    200 },
+    { CMD_BUTTON,       "BUTTON",       12, PAYLOAD_STRING,  4000 },
+    { CMD_CLOCK,        "CLOCK",        16, PAYLOAD_NONE,    15000 },
+    { CMD_FGCOLOR,      "FGCOLOR",      4,  PAYLOAD_NONE,    200 },
+    { CMD_BGCOLOR,      "BGCOLOR",      4,  PAYLOAD_NONE,    200 },
+    { CMD_GRADCOLOR,    "GRADCOLOR",    4,  PAYLOAD_NONE,    200 },
+    { CMD_GAUGE,        "GAUGE",        16, PAYLOAD_NONE,    12000 },
+    { CMD_GRADIENT,     "GRADIENT",     16, PAYLOAD_NONE,    3000 },
+    { CMD_SETMATRIX,    "SETMATRIX",    0,  PAYLOAD_NONE,    500 },
+    { CMD_TEXT,         "TEXT",         8,  PAYLOAD_STRING,  1500 },
+    { CMD_SETBITMAP,    "SETBITMAP",    12, PAYLOAD_NONE,    500 },
+    { CMD_SETBASE,      "SETBASE",      4,  PAYLOAD_NONE,    200 },
+    { CMD_NUMBER,       "NUMBER",       12, PAYLOAD_NONE,    2000 },
+    { CMD_LOADIDENTITY, "LOADIDENTITY", 0,  PAYLOAD_NONE,    200 },
+    { CMD_GETPROPS,     "GETPROPS",     12, PAYLOAD_NONE,    200 },
+    { CMD_GETPTR,       "GETPTR",       4,  PAYLOAD_NONE,    200 },
+    { CMD_KEYS,         "KEYS",         12, PAYLOAD_STRING,  3000 },
+    { CMD_PROGRESS,     "PROGRESS",     16, PAYLOAD_NONE,    2500 },
+    { CMD_SLIDER,       "SLIDER",       16, PAYLOAD_NONE,    3000 },
+    { CMD_SCROLLBAR,    "SCROLLBAR",    16, PAYLOAD_NONE,    3000 },
+    { CMD_TOGGLE,       "TOGGLE",       12, PAYLOAD_STRING,  4000 },
+    { CMD_DIAL,         "DIAL",         12, PAYLOAD_NONE,    8000 },
+    { CMD_SPINNER,      "SPINNER",      8,  PAYLOAD_NONE,    5000 },
+    { CMD_STOP,         "STOP",         0,  PAYLOAD_NONE,    200 },
+    { CMD_SCREENSAVER,  "SCREENSAVER",  0,  PAYLOAD_NONE,    200 },
+    { CMD_SKETCH,       "SKETCH",       16, PAYLOAD_NONE,    200 },
+    { CMD_LOGO,         "LOGO",         0,  PAYLOAD_NONE,    200 },
+    { CMD_CALIBRATE,    "CALIBRATE",    4,  PAYLOAD_NONE,    1000 },
+    { CMD_SETFONT,      "SETFONT",      8,  PAYLOAD_NONE,    1000 },
+    { CMD_SETFONT2,     "SETFONT2",     12, PAYLOAD_NONE,    1000 },
+    { CMD_SETSCRATCH,   "SETSCRATCH",   4,  PAYLOAD_NONE,    200 },
+    { CMD_ROMFONT,      "ROMFONT",      8,  PAYLOAD_NONE,    1000 },
+    { CMD_TRACK,        "TRACK",        12, PAYLOAD_NONE,    300 },
+    { CMD_SNAPSHOT,     "SNAPSHOT",     4,  PAYLOAD_NONE,    200 },
+    { CMD_SNAPSHOT2,    "SNAPSHOT2",    16, PAYLOAD_NONE,    200 },
+    { CMD_SETROTATE,    "SETROTATE",    4,  PAYLOAD_NONE,    2000 },
+    { CMD_TRANSLATE,    "TRANSLATE",    8,  PAYLOAD_NONE,    500 },
+    { CMD_SCALE,        "SCALE",        8,  PAYLOAD_NONE,    500 },
+    { CMD_ROTATE,       "ROTATE",       4,  PAYLOAD_NONE,    1000 },
+    { CMD_GETMATRIX,    "GETMATRIX",    24, PAYLOAD_NONE,    200 },
+};
+
+const static uint8_t COMMAND_COUNT = sizeof(COMMANDS) / sizeof(COMMANDS[0]);
+
+
+struct Tracker
+{
+    bool set;
+    int16_t x, y, w, h;                 // A rotary tracker, about x, y, if w and h are 1
+};
+
+
+static uint8_t _board;
+
+// Memory
+static std::vector<uint8_t> _ram_g;
+static uint8_t _ram_dl[RAM_DL_SIZE];
+static uint8_t _reg[RAM_REG_SIZE];
+static uint8_t _ram_cmd[RAM_CMD_SIZE];
+static bool _active;
+static SimNanos _active_at;
+static SimNanos _scan_at;               // The pixel clock starting
+
+// The host's transaction
+static uint32_t _count;
+static uint8_t _header[3];
+static bool _writing;
+static uint32_t _start_address;
+static uint32_t _address;
+static SimNanos _transaction_at;
+static uint32_t _latch_address;
+static uint32_t _latch;
+
+// Co-processor
+static uint16_t _cmd_read;
+static uint32_t _cmd_dl;
+static bool _coprocessor_running;
+static bool _calibrating;
+static uint8_t _calibrate_touches;
+static SimNanos _swap_at;               // Display list writes wait for the swap before
+static uint8_t _font_rom[32];           // Font handles' ROM fonts, or 0
+static uint8_t _base;
+static uint8_t _rotate;
+static uint8_t _tag;
+static uint32_t _color;
+static uint32_t _fgcolor;
+static uint32_t _bgcolor;
+static Tracker _trackers[256];
+
+// Frames
+static std::vector<Ft81xFrame> _frames;
+static Ft81xFrame _frame;
+static bool _in_frame;
+static bool _host_frame_started;
+static SimNanos _host_frame_start;
+static uint32_t _frame_bytes_mark;
+static uint32_t _frame_transactions_mark;
+static int32_t _shown = -1;
+
+static bool _touching;
+static int16_t _touch_x;
+static int16_t _touch_y;
+
+static Ft81xStats _stats;
+
+
+static void spi_select(bool selected);
+static uint8_t spi_transfer(uint8_t mosi);
+static void end_transaction();
+static Ft81xTraffic classify(uint32_t address, bool write, uint32_t count);
+static void host_command(uint8_t command);
+static uint32_t next_address(uint32_t address);
+static uint8_t read_byte(uint32_t address);
+static uint32_t read_word(uint32_t address);
+static uint8_t memory_byte(uint32_t address);
+static void write_byte(uint32_t address, uint8_t value);
+static bool wrote(uint32_t address);
+static void reset_coprocessor();
+static void start_coprocessor();
+static void coprocessor_step();
+static void coprocessor_idle();
+static void coprocessor_fault(const char* reason, uint32_t command);
+static bool decode_length(uint32_t command, const CommandInfo* info, uint16_t available, uint16_t* length);
+static SimNanos execute(uint32_t command, const CommandInfo* info, uint16_t length, uint32_t* dl_words);
+static void draw_widget(uint32_t command, const std::string& text, uint32_t* dl_words, SimNanos* nanos);
+static void finish_frame(SimNanos finished);
+static const CommandInfo* find_command(uint32_t command);
+static uint8_t cmd_byte(uint16_t offset);
+static uint32_t cmd_word(uint16_t offset);
+static int16_t cmd_int16(uint16_t offset);
+static void cmd_store(uint16_t offset, uint32_t value);
+static uint16_t cmd_string(uint16_t offset, uint16_t available, std::string* text);
+static uint16_t reg16(uint32_t address);
+static void store_reg32(uint32_t address, uint32_t value);
+static SimNanos frame_nanos();
+static SimNanos next_frame_at(SimNanos at);
+static uint8_t font_height(int16_t font);
+static uint32_t touch_tag();
+static bool hit_widget(const Ft81xWidget* widget, int16_t x, int16_t y, uint8_t* tag);
+static uint32_t crc32(uint32_t address, uint32_t bytes);
+
+
+void ft81x_init(uint8_t board, uint8_t cs_pin)
+{
+    SimSpiDevice device;
+
+    _board = board;
+    _ram_g.assign(RAM_G_SIZE, 0);
+    memset(_ram_dl, 0, sizeof(_ram_dl));
+    memset(_reg, 0, sizeof(_reg));
+    memset(_ram_cmd, 0, sizeof(_ram_cmd));
+    memset(&_stats, 0, sizeof(_stats));
+    _active = false;
+    _count = 0;
+    _frames.clear();
+    _shown = -1;
+    _touching = false;
+    reset_coprocessor();
+
+    device.cs_pin = cs_pin;
+    device.select = spi_select;
+    device.transfer = spi_transfer;
+    sim_attach_spi(board, FT81X_BUS, &device);
+}
+
+
+void ft81x_touch(int16_t x, int16_t y)
+{
+    if (!_touching && _calibrating && ++_calibrate_touches == CALIBRATE_TOUCHES)
+    {
+        // The calibration succeeds; the touch transform is left as it was
+        cmd_store(4, 1);
+        _calibrating = false;
+        _cmd_read = (_cmd_read + 8) & RAM_CMD_MASK;
+        start_coprocessor();
+    }
+
+    _touching = true;
+    _touch_x = x;
+    _touch_y = y;
+}
+
+
+void ft81x_release()
+{
+    _touching = false;
+}
+
+
+// The topmost widget decides it, as the tag buffer would
+uint8_t ft81x_tag_at(const Ft81xFrame* frame, int16_t x, int16_t y)
+{
+    uint8_t tag;
+
+    if (frame == NULL)
+        return 0;
+
+    for (size_t i = frame->widgets.size(); i > 0; i--)
+    {
+        if (hit_widget(&frame->widgets[i - 1], x, y, &tag))
+            return tag;
+    }
+
+    return 0;
+}
+
+
+// The middle of a widget, or key, with tag that a touch there would find
+bool ft81x_find_tag(const Ft81xFrame* frame, uint8_t tag, int16_t* x, int16_t* y)
+{
+    if (frame == NULL)
+        return false;
+
+    for (size_t i = 0; i < frame->widgets.size(); i++)
+    {
+        const Ft81xWidget& w = frame->widgets[i];
+
+        if (w.command == CMD_KEYS)
+        {
+            size_t key = w.text.find(char(tag));
+
+            if (key == std::string::npos || w.text.empty())
+                continue;
+            *x = w.x + int16_t((2 * key + 1) * w.w / (2 * w.text.size()));
+        }
+        else if (w.tag == tag)
+            *x = w.x + w.w / 2;
+        else
+            continue;
+
+        *y = w.y + w.h / 2;
+        if (ft81x_tag_at(frame, *x, *y) == tag)
+            return true;
+    }
+
+    return false;
+}
+
+
+const std::vector<Ft81xFrame>& ft81x_frames()
+{
+    return _frames;
+}
+
+
+// Until the next frame is finished
+const Ft81xFrame* ft81x_shown_frame()
+{
+    return _shown < 0 ? NULL : &_frames[_shown];
+}
+
+
+// As rotated by CMD_SETROTATE
+void ft81x_screen_size(int16_t* width, int16_t* height)
+{
+    bool portrait = (_rotate & 2) != 0;
+
+    *width = int16_t(reg16(portrait ? REG_VSIZE : REG_HSIZE));
+    *height = int16_t(reg16(portrait ? REG_HSIZE : REG_VSIZE));
+}
+
+
+const Ft81xStats* ft81x_stats()
+{
+    return &_stats;
+}
+
+
+const char* ft81x_command_name(uint32_t command)
+{
+    const CommandInfo* info = find_command(command);
+
+    return info == NULL ? "?" : info->name;
+}
+
+
+bool ft81x_same_widgets(const Ft81xFrame* a, const Ft81xFrame* b)
+{
+    if (a->widgets.size() != b->widgets.size())
+        return false;
+
+    for (size_t i = 0; i < a->widgets.size(); i++)
+    {
+        const Ft81xWidget& p = a->widgets[i];
+        const Ft81xWidget& q = b->widgets[i];
+
+        if (p.command != q.command || p.x != q.x || p.y != q.y || p.w != q.w || p.h != q.h || p.font != q.font ||
+            p.options != q.options || p.value != q.value || p.range != q.range || p.tag != q.tag ||
+            p.color != q.color || p.fgcolor != q.fgcolor || p.bgcolor != q.bgcolor || p.text != q.text)
+            return false;
+    }
+
+    return true;
+}
+
+
+void ft81x_print_frame(FILE* file, const Ft81xFrame* frame)
+{
+    fprintf(file, "Frame %u at %.4f s: %u command bytes, %u SPI bytes in %u transactions, %u DL bytes, "
+        "co-processor %.1f us, %.1f us from first byte to swap\n",
+        frame->number, double(frame->finished) / (1000 * SIM_NANOS_PER_MILLI), frame->command_bytes, frame->spi_bytes,
+        frame->spi_transactions, frame->dl_bytes, double(frame->coprocessor_nanos) / SIM_NANOS_PER_MICRO,
+        double(frame->finished - frame->started) / SIM_NANOS_PER_MICRO);
+
+    for (size_t i = 0; i < frame->widgets.size(); i++)
+    {
+        const Ft81xWidget& w = frame->widgets[i];
+
+        fprintf(file, "  %-9s tag %3u  %4d,%-4d %4dx%-4d font %2d options 0x%04x value %ld color %06x fg %06x bg %06x \"%s\"\n",
+            ft81x_command_name(w.command), w.tag, w.x, w.y, w.w, w.h, w.font, w.options, long(w.value),
+            unsigned(w.color), unsigned(w.fgcolor), unsigned(w.bgcolor), w.text.c_str());
+    }
+}
+
+
+static void spi_select(bool selected)
+{
+    if (!selected)
+    {
+        end_transaction();
+        return;
+    }
+
+    _count = 0;
+    _latch_address = UINT32_MAX;
+    _transaction_at = sim_now();
+}
+
+
+// Three bytes of address, then a write's data, or a dummy byte and a read's
+static uint8_t spi_transfer(uint8_t mosi)
+{
+    uint32_t index = _count++;
+
+    if (index < 3)
+    {
+        _header[index] = mosi;
+        if (index == 2)
+        {
+            _writing = (_header[0] & 0xC0) == 0x80;
+            _start_address = (uint32_t(_header[0] & 0x3F) << 16) | (uint32_t(_header[1]) << 8) | _header[2];
+            _address = _start_address;
+        }
+        return 0;
+    }
+
+    if (_writing)
+    {
+        write_byte(_address, mosi);
+        _address = next_address(_address);
+        return 0;
+    }
+
+    if (index == 3)
+        return 0;
+
+    uint8_t value = read_byte(_address);
+    _address = next_address(_address);
+    return value;
+}
+
+
+static void end_transaction()
+{
+    if (_count == 0)
+        return;
+
+    Ft81xTraffic traffic = FT81X_TRAFFIC_OTHER;
+
+    if (_count == 3 && (_header[0] & 0xC0) != 0x80)
+        host_command(_header[0]);
+    else if (_count > 3)
+        traffic = classify(_start_address, _writing, _count);
+
+    _stats.transactions[traffic]++;
+    _stats.bytes[traffic] += _count;
+
+    if (traffic == FT81X_TRAFFIC_COMMANDS && !_host_frame_started)
+    {
+        _host_frame_started = true;
+        _host_frame_start = _transaction_at;
+    }
+
+    if (!_writing || _count <= 3)
+        return;
+
+    if (wrote(REG_CMD_READ))
+    {
+        // The host clearing a fault
+        _cmd_read = reg16(REG_CMD_READ) & RAM_CMD_MASK;
+        _stats.fault = false;
+    }
+    if (wrote(REG_CMD_WRITE))
+        start_coprocessor();
+    if (wrote(REG_CMD_DL))
+        _cmd_dl = reg16(REG_CMD_DL);
+    if (wrote(REG_PCLK))
+        _scan_at = sim_now();
+    if (wrote(REG_ROTATE))
+        _rotate = _reg[REG_ROTATE - FT8_RAM_REG];
+    if (wrote(REG_DLSWAP) && _reg[REG_DLSWAP - FT8_RAM_REG] != 0)
+    {
+        SimNanos at = _reg[REG_DLSWAP - FT8_RAM_REG] == FT8_DLSWAP_FRAME ? next_frame_at(sim_now()) : sim_now();
+
+        sim_schedule(at, []() { _reg[REG_DLSWAP - FT8_RAM_REG] = FT8_DLSWAP_DONE; });
+    }
+}
+
+
+static Ft81xTraffic classify(uint32_t address, bool write, uint32_t count)
+{
+    if (write && address >= FT8_RAM_CMD && address < FT8_RAM_CMD + RAM_CMD_SIZE)
+        return FT81X_TRAFFIC_COMMANDS;
+    if (write && address == REG_CMD_WRITE)
+        return FT81X_TRAFFIC_START;
+    if (!write && address == REG_CMD_READ)
+        return FT81X_TRAFFIC_POLL;
+    if (!write && ((address >= REG_TOUCH_MODE && address <= REG_TOUCH_DIRECT_Z1Z2) ||
+        (address >= REG_TRACKER && address < REG_TRACKER + TRACKER_REGS_SIZE)))
+        return FT81X_TRAFFIC_TOUCH;
+    return FT81X_TRAFFIC_OTHER;
+}
+
+
+static void host_command(uint8_t command)
+{
+    _stats.host_commands++;
+
+    switch (command)
+    {
+        case FT8_ACTIVE:
+            if (!_active)
+                _active_at = sim_now();
+            _active = true;
+            break;
+        case FT8_STANDBY:
+        case FT8_SLEEP:
+        case FT8_PWRDOWN:
+            _active = false;
+            break;
+        case FT8_CORERST:
+            reset_coprocessor();
+            break;
+        default:                        // Clock selection
+            break;
+    }
+}
+
+
+// RAM_CMD wraps
+static uint32_t next_address(uint32_t address)
+{
+    if (address >= FT8_RAM_CMD && address < FT8_RAM_CMD + RAM_CMD_SIZE)
+        return FT8_RAM_CMD + ((address + 1 - FT8_RAM_CMD) & RAM_CMD_MASK);
+    return address + 1;
+}
+
+
+// A word is read whole at its first byte, so that it isn't torn
+static uint8_t read_byte(uint32_t address)
+{
+    uint32_t aligned = address & ~3UL;
+
+    if (aligned != _latch_address)
+    {
+        _latch = read_word(aligned);
+        _latch_address = aligned;
+    }
+
+    return uint8_t(_latch >> (8 * (address & 3)));
+}
+
+
+static uint32_t read_word(uint32_t address)
+{
+    if (!_active)
+        return 0;
+
+    if (address >= REG_TRACKER && address < REG_TRACKER + TRACKER_REGS_SIZE)
+    {
+        uint32_t tag = touch_tag();
+        const Tracker& tracker = _trackers[tag];
+
+        if (address != REG_TRACKER || tag == 0 || !tracker.set)
+            return 0;
+
+        double value;
+        if (tracker.w == 1 && tracker.h == 1)
+        {
+            // Clockwise from straight down
+            value = atan2(-double(_touch_x - tracker.x), double(_touch_y - tracker.y)) / (2 * M_PI);
+            if (value < 0)
+                value += 1;
+        }
+        else if (tracker.w >= tracker.h)
+            value = double(_touch_x - tracker.x) / tracker.w;
+        else
+            value = double(_touch_y - tracker.y) / tracker.h;
+
+        return (uint32_t(std::min(std::max(value, 0.0), 1.0) * 0xFFFF) << 16) | tag;
+    }
+
+    bool touched = _touching && _reg[REG_TOUCH_MODE - FT8_RAM_REG] != FT8_TMODE_OFF;
+    uint32_t touch_xy = touched ? (uint32_t(uint16_t(_touch_x)) << 16) | uint16_t(_touch_y) : NO_TOUCH_XY;
+    SimNanos since = sim_now() - _scan_at;
+
+    switch (address)
+    {
+        case REG_ID:
+            return CHIP_ID;
+        case REG_FRAMES:
+            return frame_nanos() == 0 ? 0 : uint32_t(since / frame_nanos());
+        case REG_CLOCK:
+            return uint32_t((sim_now() - _active_at) * SYSTEM_KHZ / SIM_NANOS_PER_MILLI);
+        case REG_CMD_READ:
+            return _cmd_read;
+        case REG_CMD_DL:
+            return _cmd_dl;
+        case REG_CMDB_SPACE:
+            return (RAM_CMD_SIZE - 4 - ((reg16(REG_CMD_WRITE) - _cmd_read) & RAM_CMD_MASK)) & ~3UL;
+        case REG_TOUCH_RAW_XY:          // The touch transform isn't modelled
+        case REG_TOUCH_SCREEN_XY:
+        case REG_TOUCH_TAG_XY:
+            return touch_xy;
+        case REG_TOUCH_RZ:
+            return touched ? 100 : 32767;
+        case REG_TOUCH_TAG:
+            return touch_tag();
+        default:
+            break;
+    }
+
+    return uint32_t(memory_byte(address)) | (uint32_t(memory_byte(address + 1)) << 8) |
+        (uint32_t(memory_byte(address + 2)) << 16) | (uint32_t(memory_byte(address + 3)) << 24);
+}
+
+
+// As stored, without the live registers
+static uint8_t memory_byte(uint32_t address)
+{
+    if (address < RAM_G_SIZE)
+        return _ram_g[address];
+    if (address >= FT8_RAM_DL && address < FT8_RAM_DL + RAM_DL_SIZE)
+        return _ram_dl[address - FT8_RAM_DL];
+    if (address >= FT8_RAM_REG && address < FT8_RAM_REG + RAM_REG_SIZE)
+        return _reg[address - FT8_RAM_REG];
+    if (address >= FT8_RAM_CMD && address < FT8_RAM_CMD + RAM_CMD_SIZE)
+        return _ram_cmd[address - FT8_RAM_CMD];
+
+    _stats.unmapped++;
+    return 0;
+}
+
+
+static void write_byte(uint32_t address, uint8_t value)
+{
+    if (address < RAM_G_SIZE)
+        _ram_g[address] = value;
+    else if (address >= FT8_RAM_DL && address < FT8_RAM_DL + RAM_DL_SIZE)
+        _ram_dl[address - FT8_RAM_DL] = value;
+    else if (address >= FT8_RAM_REG && address < FT8_RAM_REG + RAM_REG_SIZE)
+        _reg[address - FT8_RAM_REG] = value;
+    else if (address >= FT8_RAM_CMD && address < FT8_RAM_CMD + RAM_CMD_SIZE)
+        _ram_cmd[address - FT8_RAM_CMD] = value;
+    else
+        _stats.unmapped++;
+}
+
+
+// Whether the write just ended covered the register at address
+static bool wrote(uint32_t address)
+{
+    return address >= _start_address && address < _start_address + (_count - 3);
+}
+
+
+static void reset_coprocessor()
+{
+    _cmd_read = 0;
+    _cmd_dl = 0;
+    store_reg32(REG_CMD_WRITE, 0);
+    _coprocessor_running = false;
+    _calibrating = false;
+    _swap_at = 0;
+    _stats.fault = false;
+    _base = 10;
+    _rotate = 0;
+    _tag = DEFAULT_TAG;
+    _color = 0xFFFFFF;
+    _fgcolor = DEFAULT_FGCOLOR;
+    _bgcolor = DEFAULT_BGCOLOR;
+    _in_frame = false;
+    _host_frame_started = false;
+    _frame_bytes_mark = 0;
+    _frame_transactions_mark = 0;
+
+    for (uint8_t i = 0; i < 32; i++)
+        _font_rom[i] = i >= ROM_FONT_FIRST ? i : 0;
+    for (uint16_t i = 0; i < 256; i++)
+        _trackers[i].set = false;
+}
+
+
+static void start_coprocessor()
+{
+    if (_coprocessor_running || _calibrating || _stats.fault)
+        return;
+
+    _coprocessor_running = true;
+    sim_schedule(sim_now(), coprocessor_step);
+}
+
+
+// The next command, if the host has written all of it
+static void coprocessor_step()
+{
+    uint16_t available = (reg16(REG_CMD_WRITE) - _cmd_read) & RAM_CMD_MASK;
+
+    if (available < 4)
+    {
+        coprocessor_idle();
+        return;
+    }
+
+    uint32_t command = cmd_word(0);
+    const CommandInfo* info = find_command(command);
+    uint16_t length = 4;
+
+    if (command >= CMD_DLSTART && info == NULL)
+    {
+        coprocessor_fault("unknown command", command);
+        return;
+    }
+    if (info != NULL && info->payload == PAYLOAD_UNKNOWN)
+    {
+        coprocessor_fault("data of unknown length", command);
+        return;
+    }
+    if (info != NULL && !decode_length(command, info, available, &length))
+    {
+        // Resumed by the host's next REG_CMD_WRITE
+        _coprocessor_running = false;
+        return;
+    }
+
+    // Once swapped, a display list can't be written until it's shown
+    if (command != CMD_SWAP && sim_now() < _swap_at)
+    {
+        sim_schedule(_swap_at, coprocessor_step);
+        return;
+    }
+
+    uint32_t dl_words = 0;
+    SimNanos nanos = execute(command, info, length, &dl_words);
+
+    nanos += (length / 4) * COPRO_WORD_NANOS + dl_words * COPRO_DL_NANOS;
+    _cmd_dl += 4 * dl_words;
+    if (_in_frame || command == CMD_SWAP)
+    {
+        _frame.command_bytes += length;
+        _frame.coprocessor_nanos += nanos;
+    }
+    if (command == CMD_SWAP)
+        finish_frame(sim_now() + nanos);
+
+    if (_calibrating)
+    {
+        _coprocessor_running = false;
+        return;
+    }
+
+    sim_schedule(sim_now() + nanos, [length]() {
+        _cmd_read = (_cmd_read + length) & RAM_CMD_MASK;
+        coprocessor_step();
+    });
+}
+
+
+static void coprocessor_idle()
+{
+    _coprocessor_running = false;
+
+    // Commands outside a frame, as at start-up, don't count towards the next
+    if (!_in_frame)
+    {
+        _host_frame_started = false;
+        _frame_bytes_mark = _stats.bytes[FT81X_TRAFFIC_COMMANDS] + _stats.bytes[FT81X_TRAFFIC_START] +
+            _stats.bytes[FT81X_TRAFFIC_POLL];
+        _frame_transactions_mark = _stats.transactions[FT81X_TRAFFIC_COMMANDS] +
+            _stats.transactions[FT81X_TRAFFIC_START] + _stats.transactions[FT81X_TRAFFIC_POLL];
+    }
+}
+
+
+static void coprocessor_fault(const char* reason, uint32_t command)
+{
+    _stats.fault = true;
+    snprintf(_stats.fault_reason, sizeof(_stats.fault_reason), "%s 0x%08x (%s)", reason, unsigned(command),
+        ft81x_command_name(command));
+    _cmd_read = CMD_READ_FAULT;
+    _coprocessor_running = false;
+}
+
+
+// The command's length in RAM_CMD, if the host has written it all
+static bool decode_length(uint32_t command, const CommandInfo* info, uint16_t available, uint16_t* length)
+{
+    *length = 4 + info->arg_bytes;
+    if (*length > available)
+        return false;
+
+    if (info->payload == PAYLOAD_STRING)
+    {
+        uint16_t bytes = cmd_string(*length, available, NULL);
+
+        if (bytes == 0)
+            return false;
+        *length += bytes;
+    }
+    else if (info->payload == PAYLOAD_DATA)
+        *length += (cmd_word(8) + 3) & ~3UL;
+
+    return *length <= available;
+}
+
+
+static SimNanos execute(uint32_t command, const CommandInfo* info, uint16_t length, uint32_t* dl_words)
+{
+    // Display list entries are copied, keeping the state the widgets use
+    if (info == NULL)
+    {
+        *dl_words = 1;
+        if ((command >> 24) == (TAG(0) >> 24))
+            _tag = uint8_t(command);
+        else if ((command >> 24) == (DL_COLOR_RGB >> 24))
+            _color = command & 0xFFFFFF;
+        return 0;
+    }
+
+    SimNanos nanos = info->nanos;
+    std::string text;
+
+    if (info->payload == PAYLOAD_STRING)
+        cmd_string(4 + info->arg_bytes, length, &text);
+
+    switch (command)
+    {
+        case CMD_DLSTART:
+            _cmd_dl = 0;
+            _tag = DEFAULT_TAG;
+            _color = 0xFFFFFF;
+            _in_frame = true;
+            _frame = Ft81xFrame();
+            _frame.started = _host_frame_started ? _host_frame_start : sim_now();
+            break;
+        case CMD_COLDSTART:
+            reset_coprocessor();
+            break;
+        case CMD_FGCOLOR:
+            _fgcolor = cmd_word(4) & 0xFFFFFF;
+            break;
+        case CMD_BGCOLOR:
+            _bgcolor = cmd_word(4) & 0xFFFFFF;
+            break;
+        case CMD_SETBASE:
+            _base = uint8_t(cmd_word(4));
+            break;
+        case CMD_ROMFONT:
+            _font_rom[cmd_word(4) & 31] = uint8_t(cmd_word(8));
+            break;
+        case CMD_SETFONT:
+        case CMD_SETFONT2:
+            _font_rom[cmd_word(4) & 31] = 0;
+            break;
+        case CMD_SETROTATE:
+            _rotate = uint8_t(cmd_word(4));
+            _reg[REG_ROTATE - FT8_RAM_REG] = _rotate;
+            break;
+        case CMD_TRACK:
+        {
+            Tracker& tracker = _trackers[uint8_t(cmd_int16(12))];
+
+            tracker.x = cmd_int16(4);
+            tracker.y = cmd_int16(6);
+            tracker.w = cmd_int16(8);
+            tracker.h = cmd_int16(10);
+            tracker.set = tracker.w != 0 || tracker.h != 0;
+            break;
+        }
+        case CMD_INTERRUPT:
+            nanos += cmd_word(4) * SIM_NANOS_PER_MILLI;
+            break;
+        case CMD_APPEND:
+            *dl_words = cmd_word(8) / 4;
+            break;
+        case CMD_SETBITMAP:
+            *dl_words = 6;
+            break;
+        case CMD_MEMWRITE:
+        {
+            uint32_t ptr = cmd_word(4), bytes = cmd_word(8);
+
+            for (uint32_t i = 0; i < bytes; i++)
+                write_byte(ptr + i, cmd_byte(12 + i));
+            nanos += bytes * COPRO_MEMORY_BYTE_NANOS;
+            break;
+        }
+        case CMD_MEMSET:
+        case CMD_MEMZERO:
+        {
+            uint32_t ptr = cmd_word(4);
+            uint32_t bytes = cmd_word(command == CMD_MEMSET ? 12 : 8);
+            uint8_t value = command == CMD_MEMSET ? cmd_byte(8) : 0;
+
+            for (uint32_t i = 0; i < bytes; i++)
+                write_byte(ptr + i, value);
+            nanos += bytes * COPRO_MEMORY_BYTE_NANOS;
+            break;
+        }
+        case CMD_MEMCPY:
+        {
+            uint32_t dest = cmd_word(4), src = cmd_word(8), bytes = cmd_word(12);
+
+            for (uint32_t i = 0; i < bytes; i++)
+                write_byte(dest + i, memory_byte(src + i));
+            nanos += bytes * COPRO_MEMORY_BYTE_NANOS;
+            break;
+        }
+        case CMD_MEMCRC:
+            cmd_store(12, crc32(cmd_word(4), cmd_word(8)));
+            nanos += cmd_word(8) * COPRO_MEMORY_BYTE_NANOS;
+            break;
+        case CMD_REGREAD:
+            cmd_store(8, read_word(cmd_word(4)));
+            break;
+        case CMD_GETPTR:                // Nothing is ever inflated
+            cmd_store(4, 0);
+            break;
+        case CMD_GETPROPS:              // Nor any image loaded
+            cmd_store(4, 0);
+            cmd_store(8, 0);
+            cmd_store(12, 0);
+            break;
+        case CMD_CALIBRATE:             // Finished by ft81x_touch()
+            _calibrating = true;
+            _calibrate_touches = 0;
+            break;
+        case CMD_SNAPSHOT:
+        case CMD_SNAPSHOT2:
+            nanos += frame_nanos();
+            break;
+        case CMD_BUTTON:
+        case CMD_TEXT:
+        case CMD_KEYS:
+        case CMD_TOGGLE:
+        case CMD_NUMBER:
+        case CMD_DIAL:
+        case CMD_GAUGE:
+        case CMD_CLOCK:
+        case CMD_PROGRESS:
+        case CMD_SLIDER:
+        case CMD_SCROLLBAR:
+        case CMD_SPINNER:
+        case CMD_GRADIENT:
+            draw_widget(command, text, dl_words, &nanos);
+            break;
+        default:                        // Matrix and other state the widgets here don't use
+            break;
+    }
+
+    return nanos;
+}
+
+
+// Logs it, and estimates its display list entries and time
+static void draw_widget(uint32_t command, const std::string& text, uint32_t* dl_words, SimNanos* nanos)
+{
+    Ft81xWidget w;
+
+    w.command = command;
+    w.x = cmd_int16(4);
+    w.y = cmd_int16(6);
+    w.w = 0;
+    w.h = 0;
+    w.round = false;
+    w.font = 0;
+    w.options = 0;
+    w.value = 0;
+    w.range = 0;
+    w.tag = _tag;
+    w.color = _color;
+    w.fgcolor = _fgcolor;
+    w.bgcolor = _bgcolor;
+    w.text = text;
+
+    switch (command)
+    {
+        case CMD_BUTTON:
+        case CMD_KEYS:
+            w.w = cmd_int16(8);
+            w.h = cmd_int16(10);
+            w.font = cmd_int16(12);
+            w.options = uint16_t(cmd_int16(14));
+            if (command == CMD_KEYS)
+            {
+                *dl_words = 4 + 11 * text.size();
+                *nanos += text.size() * COPRO_KEY_NANOS;
+            }
+            else
+                *dl_words = 12 + text.size();
+            break;
+        case CMD_TEXT:
+        case CMD_NUMBER:
+        {
+            char digits[16];
+
+            w.font = cmd_int16(8);
+            w.options = uint16_t(cmd_int16(10));
+            if (command == CMD_NUMBER)
+            {
+                w.value = int32_t(cmd_word(12));
+                snprintf(digits, sizeof(digits), _base == 16 ? "%lx" : "%ld", long(w.value));
+                w.text = digits;
+            }
+
+            w.h = font_height(w.font);
+            w.w = int16_t(w.text.size() * w.h * 2 / 5);
+            if (w.options & FT8_OPT_RIGHTX)
+                w.x -= w.w;
+            else if (w.options & FT8_OPT_CENTERX)
+                w.x -= w.w / 2;
+            if (w.options & FT8_OPT_CENTERY)
+                w.y -= w.h / 2;
+            *dl_words = 4 + w.text.size();
+            break;
+        }
+        case CMD_TOGGLE:
+            w.w = cmd_int16(8);
+            w.font = cmd_int16(10);
+            w.options = uint16_t(cmd_int16(12));
+            w.value = uint16_t(cmd_int16(14));
+            w.h = font_height(w.font);
+            *dl_words = 20 + text.size();
+            break;
+        case CMD_DIAL:
+        case CMD_GAUGE:
+        case CMD_CLOCK:
+        {
+            int16_t r = cmd_int16(8);
+
+            w.x -= r;
+            w.y -= r;
+            w.w = 2 * r;
+            w.h = 2 * r;
+            w.round = true;
+            w.options = uint16_t(cmd_int16(10));
+            if (command == CMD_DIAL)
+                w.value = uint16_t(cmd_int16(12));
+            else if (command == CMD_GAUGE)
+            {
+                w.value = uint16_t(cmd_int16(16));
+                w.range = uint16_t(cmd_int16(18));
+            }
+            *dl_words = command == CMD_DIAL ? 24 : command == CMD_GAUGE ? 40 : 60;
+            break;
+        }
+        case CMD_PROGRESS:
+        case CMD_SLIDER:
+        case CMD_SCROLLBAR:
+            w.w = cmd_int16(8);
+            w.h = cmd_int16(10);
+            w.options = uint16_t(cmd_int16(12));
+            w.value = uint16_t(cmd_int16(14));
+            w.range = uint16_t(cmd_int16(command == CMD_SCROLLBAR ? 18 : 16));
+            *dl_words = 16;
+            break;
+        case CMD_SPINNER:
+            *dl_words = 40;
+            break;
+        case CMD_GRADIENT:
+            *dl_words = 12;
+            break;
+    }
+
+    *nanos += w.text.size() * COPRO_CHAR_NANOS;
+    if (_in_frame)
+        _frame.widgets.push_back(w);
+}
+
+
+// Logs the frame, to be shown from the next frame boundary
+static void finish_frame(SimNanos finished)
+{
+    if (!_in_frame)
+        return;
+
+    uint32_t bytes = _stats.bytes[FT81X_TRAFFIC_COMMANDS] + _stats.bytes[FT81X_TRAFFIC_START] +
+        _stats.bytes[FT81X_TRAFFIC_POLL];
+    uint32_t transactions = _stats.transactions[FT81X_TRAFFIC_COMMANDS] + _stats.transactions[FT81X_TRAFFIC_START] +
+        _stats.transactions[FT81X_TRAFFIC_POLL];
+
+    _frame.number = _frames.size();
+    _frame.finished = finished;
+    _frame.spi_bytes = bytes - _frame_bytes_mark;
+    _frame.spi_transactions = transactions - _frame_transactions_mark;
+    _frame.dl_bytes = _cmd_dl + 4;
+    _frames.push_back(_frame);
+
+    _frame_bytes_mark = bytes;
+    _frame_transactions_mark = transactions;
+    _host_frame_started = false;
+    _in_frame = false;
+
+    int32_t number = _frame.number;
+    _swap_at = next_frame_at(finished);
+    sim_schedule(_swap_at, [number]() { _shown = number; });
+}
+
+
+static const CommandInfo* find_command(uint32_t command)
+{
+    if (command < CMD_DLSTART)
+        return NULL;
+
+    for (uint8_t i = 0; i < COMMAND_COUNT; i++)
+    {
+        if (COMMANDS[i].command == command)
+            return &COMMANDS[i];
+    }
+
+    return NULL;
+}
+
+
+// RAM_CMD, from REG_CMD_READ
+static uint8_t cmd_byte(uint16_t offset)
+{
+    return _ram_cmd[(_cmd_read + offset) & RAM_CMD_MASK];
+}
+
+
+static uint32_t cmd_word(uint16_t offset)
+{
+    return uint32_t(cmd_byte(offset)) | (uint32_t(cmd_byte(offset + 1)) << 8) |
+        (uint32_t(cmd_byte(offset + 2)) << 16) | (uint32_t(cmd_byte(offset + 3)) << 24);
+}
+
+
+static int16_t cmd_int16(uint16_t offset)
+{
+    return int16_t(cmd_byte(offset) | (cmd_byte(offset + 1) << 8));
+}
+
+
+static void cmd_store(uint16_t offset, uint32_t value)
+{
+    for (uint8_t i = 0; i < 4; i++)
+        _ram_cmd[(_cmd_read + offset + i) & RAM_CMD_MASK] = uint8_t(value >> (8 * i));
+}
+
+
+// The string's length, with its terminator and padding, or 0 if it isn't all there
+static uint16_t cmd_string(uint16_t offset, uint16_t available, std::string* text)
+{
+    for (uint16_t i = offset; i < available; i++)
+    {
+        char c = char(cmd_byte(i));
+
+        if (c == '\0')
+            return (i - offset + 1 + 3) & ~3;
+        if (text != NULL)
+            text->push_back(c);
+    }
+
+    return 0;
+}
+
+
+static uint16_t reg16(uint32_t address)
+{
+    return _reg[address - FT8_RAM_REG] | (_reg[address - FT8_RAM_REG + 1] << 8);
+}
+
+
+static void store_reg32(uint32_t address, uint32_t value)
+{
+    for (uint8_t i = 0; i < 4; i++)
+        _reg[address - FT8_RAM_REG + i] = uint8_t(value >> (8 * i));
+}
+
+
+// 0 until the pixel clock runs
+static SimNanos frame_nanos()
+{
+    uint32_t pclk = _reg[REG_PCLK - FT8_RAM_REG];
+
+    return SimNanos(reg16(REG_HCYCLE)) * reg16(REG_VCYCLE) * pclk * SIM_NANOS_PER_MILLI / SYSTEM_KHZ;
+}
+
+
+static SimNanos next_frame_at(SimNanos at)
+{
+    SimNanos frame = frame_nanos();
+
+    if (frame == 0 || at < _scan_at)
+        return at;
+    return _scan_at + ((at - _scan_at) / frame + 1) * frame;
+}
+
+
+static uint8_t font_height(int16_t font)
+{
+    uint8_t rom = font >= 0 && font < 32 ? _font_rom[font] : 0;
+
+    if (rom < ROM_FONT_FIRST || rom >= ROM_FONT_FIRST + ROM_FONT_COUNT)
+        return UNKNOWN_FONT_HEIGHT;
+    return ROM_FONT_HEIGHTS[rom - ROM_FONT_FIRST];
+}
+
+
+static uint32_t touch_tag()
+{
+    if (!_touching || _reg[REG_TOUCH_MODE - FT8_RAM_REG] == FT8_TMODE_OFF)
+        return 0;
+    return ft81x_tag_at(ft81x_shown_frame(), _touch_x, _touch_y);
+}
+
+
+// A key's tag is its character
+static bool hit_widget(const Ft81xWidget* widget, int16_t x, int16_t y, uint8_t* tag)
+{
+    const Ft81xWidget& w = *widget;
+
+    if (x < w.x || y < w.y || x >= w.x + w.w || y >= w.y + w.h)
+        return false;
+
+    if (w.round)
+    {
+        int32_t dx = 2 * (x - w.x) - w.w, dy = 2 * (y - w.y) - w.h;
+
+        if (dx * dx + dy * dy > int32_t(w.w) * w.w)
+            return false;
+    }
+
+    if (w.command == CMD_KEYS)
+    {
+        if (w.text.empty())
+            return false;
+        *tag = uint8_t(w.text[(x - w.x) * w.text.size() / w.w]);
+    }
+    else
+        *tag = w.tag;
+
+    return true;
+}
+
+
+// As CMD_MEMCRC: CRC-32, as IEEE 802.3
+static uint32_t crc32(uint32_t address, uint32_t bytes)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    for (uint32_t i = 0; i < bytes; i++)
+    {
+        crc ^= memory_byte(address + i);
+        for (uint8_t bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+
+    return ~crc;
+}
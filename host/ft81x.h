@@ -0,0 +1,112 @@
+#ifndef _FT81X_H
+#define _FT81X_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "sim.h"
+
+/* Emulated FT81x display controller for the host simulator (see sim.h), on
+ * the SPI bus the interface's FT8_config.cpp drives, byte for byte: host
+ * commands, memory reads with their dummy byte, and writes, which wrap
+ * within RAM_CMD as the chip's do.  Its memory map has RAM_G, RAM_DL, the
+ * registers and RAM_CMD, with REG_ID, REG_FRAMES, REG_CLOCK, REG_CMD_READ,
+ * REG_CMD_WRITE, REG_CMD_DL, REG_CMDB_SPACE, REG_DLSWAP, the touch registers
+ * and REG_TRACKER live.
+ *
+ * The co-processor consumes RAM_CMD from REG_CMD_READ up to REG_CMD_WRITE a
+ * command at a time, each taking an estimated time (see ft81x.cpp), so that
+ * REG_CMD_READ catches up as it would and FT8_busy() polls for as long.
+ * The commands the interface sends, its widgets, colours, tags, fonts and
+ * trackers, are decoded; the display list they'd produce is only counted,
+ * not rendered.  Each CMD_DLSTART to CMD_SWAP is logged as an Ft81xFrame,
+ * which is shown from the next frame boundary at the panel's timing.
+ * Commands with data of a length only known by decoding it (CMD_INFLATE,
+ * CMD_LOADIMAGE, CMD_PLAYVIDEO) fault the co-processor, as does anything
+ * unknown: REG_CMD_READ reads 0xFFF.
+ *
+ * Touches are given in screen coordinates, after CMD_SETROTATE, so the touch
+ * transform is left alone.  The tag under a touch is found from the widgets
+ * of the frame shown; text has only an estimated size from its font's
+ * height.
+ */
+
+const static uint8_t FT81X_BUS = 2;
+
+
+// The host's SPI transactions, by what they're for
+enum Ft81xTraffic {
+    FT81X_TRAFFIC_COMMANDS,             // Writes to RAM_CMD
+    FT81X_TRAFFIC_START,                // Writes to REG_CMD_WRITE
+    FT81X_TRAFFIC_POLL,                 // Reads of REG_CMD_READ
+    FT81X_TRAFFIC_TOUCH,                // Reads of the touch registers and REG_TRACKER
+    FT81X_TRAFFIC_OTHER,                // Host commands, and any other reads and writes
+    FT81X_TRAFFIC_COUNT
+};
+
+
+// A co-processor widget, as drawn
+struct Ft81xWidget
+{
+    uint32_t command;                   // CMD_BUTTON and so on
+    int16_t x, y, w, h;                 // Its bounds on screen
+    bool round;                         // Only the circle within its bounds is touchable
+    int16_t font;
+    uint16_t options;
+    int32_t value;                      // The dial's, the number, the toggle's state and so on
+    uint16_t range;
+    uint8_t tag;                        // From the last TAG()
+    uint32_t color;                     // From the last COLOR_RGB()
+    uint32_t fgcolor;
+    uint32_t bgcolor;
+    std::string text;
+};
+
+
+struct Ft81xFrame
+{
+    uint32_t number;
+    SimNanos started;                   // The host's first byte of it
+    SimNanos finished;                  // The co-processor reaching its CMD_SWAP
+    uint32_t command_bytes;             // In RAM_CMD, from CMD_DLSTART to CMD_SWAP
+    uint32_t spi_bytes;                 // On the bus for commands, starts and polls since the last frame
+    uint32_t spi_transactions;
+    uint32_t dl_bytes;                  // Display list, estimated for the widgets
+    SimNanos coprocessor_nanos;
+    std::vector<Ft81xWidget> widgets;
+};
+
+
+struct Ft81xStats
+{
+    uint32_t transactions[FT81X_TRAFFIC_COUNT];
+    uint32_t bytes[FT81X_TRAFFIC_COUNT];
+    uint32_t host_commands;
+    uint32_t unmapped;                  // Reads and writes outside the memory map
+    bool fault;
+    char fault_reason[64];
+};
+
+
+void ft81x_init(uint8_t board, uint8_t cs_pin);
+
+// Scripted touches, and the tag a touch would find on a frame
+void ft81x_touch(int16_t x, int16_t y);
+void ft81x_release();
+uint8_t ft81x_tag_at(const Ft81xFrame* frame, int16_t x, int16_t y);
+bool ft81x_find_tag(const Ft81xFrame* frame, uint8_t tag, int16_t* x, int16_t* y);
+
+// The frames the co-processor has finished, in order, and the one shown
+const std::vector<Ft81xFrame>& ft81x_frames();
+const Ft81xFrame* ft81x_shown_frame();
+void ft81x_screen_size(int16_t* width, int16_t* height);
+
+const Ft81xStats* ft81x_stats();
+const char* ft81x_command_name(uint32_t command);
+bool ft81x_same_widgets(const Ft81xFrame* a, const Ft81xFrame* b);
+void ft81x_print_frame(FILE* file, const Ft81xFrame* frame);
+
+#endif
@@ -0,0 +1,29 @@
+/* The interface's radio code, built for the host simulator (see sim.h).
+ * interface.ino and tft.cpp are either replaced by the script in
+ * lamphouse_sim.cpp, which calls comms.h, or built on the emulated display
+ * by interface_display.cpp.
+ *
+ * As for the controller (see controller_board.cpp), the code is built in
+ * namespace interface, with the shared headers included first.  comms.cpp
+ * goes last, as it includes the register names of nRF24L01_STM32.h.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "RF24.h"
+#include "sim.h"
+
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+#include <lamphouse_radio_irq.h>
+
+
+namespace interface {
+
+#include "../interface/rtt.cpp"
+#include "../interface/link.cpp"
+#include "../interface/comms.cpp"
+
+}   // namespace interface
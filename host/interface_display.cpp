@@ -0,0 +1,44 @@
+/* The interface sketch itself, interface.ino and tft.cpp, built for the host
+ * simulator (see sim.h) with its display and touch screen on the emulated
+ * FT81x (see ft81x.h).  Linked with interface_board.cpp, for the radio code,
+ * and interface_ft8.cpp, in place of the script in lamphouse_sim.cpp.
+ *
+ * As interface_board.cpp, the code is built in namespace interface, with the
+ * shared headers included first.  The FT8 library is in its own file, as
+ * FT8_commands.cpp defines cmdOffset volatile, which FT8_commands.h declares
+ * without.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "RF24.h"
+#include "sim.h"
+#include "sim_boards.h"
+#include "ft81x.h"
+
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+
+
+namespace interface {
+
+#include "../interface/interface.ino"
+#include "../interface/tft.cpp"
+
+}   // namespace interface
+
+
+void interface_setup()
+{
+    ft81x_init(SIM_BOARD_INTERFACE, FT8_CS);
+    interface::setup();
+}
+
+
+void interface_loop()
+{
+    interface::loop();
+}
@@ -0,0 +1,16 @@
+/* The interface's FT8 display library, built for the host simulator (see
+ * interface_display.cpp), where its SPI reaches the emulated FT81x.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Arduino.h"
+#include "SPI.h"
+
+
+namespace interface {
+
+#include "../interface/FT8_config.cpp"
+#include "../interface/FT8_commands.cpp"
+
+}   // namespace interface
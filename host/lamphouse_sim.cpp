@@ -0,0 +1,609 @@
+/* Runs the controller and interface together over the simulated link (see
+ * sim.h), and measures end-to-end timing:
+ *   - Touch to light: from a touch asking for a channel power, as the
+ *     interface's touch handling queues COMMAND_SET_CHANNEL_POWER, to the
+ *     controller switching its outputs to it.
+ *   - Exposure error: the time the controller's outputs were on for a queued
+ *     exposure, less its target.
+ * After the exposures, their records are read back from the controller's
+ * history, in pages fetched together (see communicate_pipelined()), and
+ * checked against the times measured.
+ * The interface's loop() runs comms_poll() and the display loop's schedule,
+ * as interface.ino, with display updates spending their SPI time and touch
+ * slots running the script below in place of the touch screen.
+ *
+ * Exits 1 if any touch or exposure didn't take effect, or a --max threshold
+ * was exceeded, so that it can be run as a check.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Arduino.h"
+#include "sim.h"
+#include "sim_boards.h"
+
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+
+
+namespace interface {
+#include "../interface/comms.h"
+}
+
+
+const static uint8_t CONTROLLER_PIN_RADIO_IRQ = 2;
+const static uint8_t INTERFACE_PIN_RADIO_IRQ = PC14;
+
+// The interface's display loop (see interface.ino and tft.cpp)
+const static uint16_t DISPLAY_LOOP_MILLIS = 20;
+const static uint8_t DISPLAY_LOOP_MODES = 5;
+const static uint16_t CONTROLLER_HEARTBEAT_MILLIS = 1000;
+const static uint16_t CONTROLLER_PROGRESS_MILLIS = 200;
+const static SimNanos DEFAULT_DISPLAY_UPDATE_NANOS = 1500 * SIM_NANOS_PER_MICRO;
+const static SimNanos TOUCH_READ_NANOS = 60 * SIM_NANOS_PER_MICRO;
+
+// After both boards' setup, including the interface's channel survey
+const static SimNanos SETTLE_NANOS = 2000 * SIM_NANOS_PER_MILLI;
+
+const static uint32_t TOUCH_MIN_GAP_MILLIS = 30;
+const static uint32_t TOUCH_MAX_GAP_MILLIS = 150;
+const static SimNanos TOUCH_TIMEOUT_NANOS = 2000 * SIM_NANOS_PER_MILLI;
+const static uint16_t TOUCH_GREEN_POWER = POWER_FULL / 2;
+
+const static uint32_t EXPOSURE_MIN_MILLIS = 100;
+const static uint32_t EXPOSURE_MAX_MILLIS = 3000;
+const static SimNanos EXPOSURE_TIMEOUT_NANOS = 3000 * SIM_NANOS_PER_MILLI;     // Beyond the target
+const static SimNanos EXPOSURE_GAP_NANOS = 300 * SIM_NANOS_PER_MILLI;
+const static uint16_t EXPOSURE_GREEN_POWER = POWER_FULL;
+
+// Between a history record's achieved time and the time measured: the timer
+// counts it's taken from are 0.5 us
+const static double HISTORY_TOLERANCE_MICROS = 1;
+
+const static SimNanos RUN_STEP_NANOS = 100 * SIM_NANOS_PER_MILLI;
+
+
+enum ScenarioPhase {
+    PHASE_SETTLE,
+    PHASE_TOUCH,
+    PHASE_TOUCH_WAIT,
+    PHASE_LIGHTS_OFF,
+    PHASE_EXPOSE,
+    PHASE_EXPOSE_WAIT,
+    PHASE_HISTORY,
+    PHASE_DONE
+};
+
+
+struct ScenarioConfig
+{
+    uint32_t seed;
+    uint32_t touches;
+    uint32_t exposures;
+    SimNanos display_update_nanos;
+    double max_latency_millis;          // p99; 0 for none
+    double max_error_micros;            // Worst; 0 for none
+};
+
+
+struct Scenario
+{
+    ScenarioPhase phase;
+    SimNanos next_at;                   // Earliest the next step of the phase goes
+
+    uint32_t touches;
+    uint32_t touches_missed;
+    uint16_t touch_green;               // Asked for by the last touch
+    SimNanos touch_at;
+    std::vector<SimNanos> latencies;
+    std::vector<uint16_t> reported_latencies;  // Microseconds, from the replies to the touches
+    uint32_t unreported_latencies;      // Replies to touches without one
+
+    uint32_t exposures;
+    uint32_t exposures_missed;
+    uint32_t target_millis;
+    uint16_t target_sub_micros;
+    SimNanos expose_at;
+    SimNanos light_on_at;               // 0 until the exposure's lights come on
+    std::vector<int64_t> errors;        // Nanoseconds, achieved less target
+    std::vector<SimNanos> targets;
+
+    CommsMessage history_message;
+    uint8_t history_records;            // That match an exposure
+    bool history_complete;              // Up to the last exposure, from the first or the oldest kept
+    double worst_history_micros;        // Achieved, as recorded, against as measured
+
+    uint16_t light_green;               // As last written by the controller
+    uint32_t events;
+    uint32_t queries;
+    uint32_t failed_queries;
+    uint32_t failed_requests;
+    bool exposing;                      // As the display would think, for its query rate
+};
+
+
+static ScenarioConfig _config;
+static Scenario _scenario;
+
+
+static void script_setup();
+static void script_loop();
+static void display_step(uint8_t mode);
+static void run_script();
+static void read_history();
+static void query_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+static void request_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+static void touch_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+static void light_changed(SimNanos at, uint16_t red, uint16_t green, uint16_t blue);
+static uint32_t random_between(uint32_t low, uint32_t high);
+static bool parse_options(int argc, char** argv, SimLinkConfig* link);
+static void report(const SimLinkConfig* link, double* p99_latency_millis, double* worst_error_micros);
+static double percentile(std::vector<double> values, uint8_t percent);
+
+
+int main(int argc, char** argv)
+{
+    SimLinkConfig link;
+    SimBoardConfig controller_board, interface_board;
+
+    if (!parse_options(argc, argv, &link))
+        return 2;
+
+    sim_init(_config.seed, &link);
+    sim_set_light_observer(light_changed);
+
+    controller_board.setup = controller_setup;
+    controller_board.loop = controller_loop;
+    controller_board.loop_nanos = 20 * SIM_NANOS_PER_MICRO;
+    controller_board.call_nanos = 1000;
+    controller_board.spi_byte_nanos = 2500;
+    controller_board.radio_irq_pin = CONTROLLER_PIN_RADIO_IRQ;
+    controller_board.avr = true;
+    sim_add_board(SIM_BOARD_CONTROLLER, &controller_board);
+
+    interface_board.setup = script_setup;
+    interface_board.loop = script_loop;
+    interface_board.loop_nanos = 5 * SIM_NANOS_PER_MICRO;
+    interface_board.call_nanos = 200;
+    interface_board.spi_byte_nanos = 1000;
+    interface_board.radio_irq_pin = INTERFACE_PIN_RADIO_IRQ;
+    interface_board.avr = false;
+    sim_add_board(SIM_BOARD_INTERFACE, &interface_board);
+
+    _scenario.phase = PHASE_SETTLE;
+
+    SimNanos limit = SETTLE_NANOS + _config.touches * (TOUCH_TIMEOUT_NANOS + TOUCH_MAX_GAP_MILLIS * SIM_NANOS_PER_MILLI) +
+        _config.exposures * ((EXPOSURE_MAX_MILLIS + 1) * SIM_NANOS_PER_MILLI + EXPOSURE_TIMEOUT_NANOS + EXPOSURE_GAP_NANOS) +
+        2 * RUN_STEP_NANOS;
+
+    while (_scenario.phase != PHASE_DONE && sim_now() < limit)
+        sim_run_until(sim_now() + RUN_STEP_NANOS);
+
+    double p99_latency_millis, worst_error_micros;
+    report(&link, &p99_latency_millis, &worst_error_micros);
+
+    bool failed = _scenario.phase != PHASE_DONE || _scenario.touches_missed != 0 || _scenario.exposures_missed != 0 ||
+        _scenario.unreported_latencies != 0 || _scenario.history_message != MESSAGE_OK ||
+        !_scenario.history_complete ||
+        _scenario.worst_history_micros > HISTORY_TOLERANCE_MICROS ||
+        (_config.max_latency_millis > 0 && p99_latency_millis > _config.max_latency_millis) ||
+        (_config.max_error_micros > 0 && worst_error_micros > _config.max_error_micros);
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed ? 1 : 0;
+}
+
+
+static void script_setup()
+{
+    interface::initialise_radio();
+}
+
+
+// As interface.ino: comms_poll(), then the display loop's events, and every
+// DISPLAY_LOOP_MILLIS the next of its modes.
+static void script_loop()
+{
+    static uint32_t display_next_update = 0;
+    static uint8_t mode = 0;
+
+    interface::comms_poll();
+
+    ControllerExternalStatus status;
+    bool dose_reply;
+    uint32_t green_dose, blue_dose;
+
+    if (interface::receive_event(&status, &dose_reply, &green_dose, &blue_dose))
+    {
+        _scenario.events++;
+        _scenario.exposing = status.state != CONTROLLER_STATE_NOT_EXPOSING;
+    }
+
+    uint32_t tick = millis();
+    if (tick < display_next_update)
+        return;
+
+    display_step(mode);
+
+    mode = (mode + 1) % DISPLAY_LOOP_MODES;
+    display_next_update = tick + DISPLAY_LOOP_MILLIS;
+}
+
+
+//  Mode    Action
+//  0       Radio query, if due
+//  1       Display update
+//  2       Touch
+//  3       Display update
+//  4       Touch
+static void display_step(uint8_t mode)
+{
+    static uint32_t last_query_millis = 0;
+
+    if (mode == 0)
+    {
+        if (millis() - last_query_millis < (_scenario.exposing ? CONTROLLER_PROGRESS_MILLIS : CONTROLLER_HEARTBEAT_MILLIS))
+            return;
+        last_query_millis = millis();
+
+        interface::request_command(COMMAND_REPORT_STATUS, query_reply);
+    }
+    else if (mode % 2 == 0)
+    {
+        sim_spend(TOUCH_READ_NANOS);
+        run_script();
+    }
+    else
+        sim_spend(_config.display_update_nanos);
+}
+
+
+// What the user does, at each touch slot
+static void run_script()
+{
+    SimNanos now = sim_now();
+    Scenario& s = _scenario;
+
+    switch (s.phase)
+    {
+        case PHASE_SETTLE:
+            if (now < SETTLE_NANOS)
+                break;
+            s.phase = _config.touches > 0 ? PHASE_TOUCH : PHASE_LIGHTS_OFF;
+            s.next_at = now;
+            break;
+        case PHASE_TOUCH:
+            if (now < s.next_at)
+                break;
+            s.touch_green = s.touch_green == 0 ? TOUCH_GREEN_POWER : 0;
+            s.touch_at = now;
+            if (!interface::request_channel_power(0, s.touch_green, 0, touch_reply))
+                s.failed_requests++;
+            s.phase = PHASE_TOUCH_WAIT;
+            break;
+        case PHASE_TOUCH_WAIT:
+            // Ended by light_changed(), unless it times out
+            if (now - s.touch_at < TOUCH_TIMEOUT_NANOS)
+                break;
+            s.touches_missed++;
+            s.touches++;
+            s.phase = s.touches < _config.touches ? PHASE_TOUCH : PHASE_LIGHTS_OFF;
+            s.next_at = now;
+            break;
+        case PHASE_LIGHTS_OFF:
+            if (_config.exposures == 0)
+            {
+                s.phase = PHASE_HISTORY;
+                break;
+            }
+            interface::request_channel_power(0, 0, 0, request_reply);
+            s.phase = PHASE_EXPOSE;
+            s.next_at = now + EXPOSURE_GAP_NANOS;
+            break;
+        case PHASE_EXPOSE:
+            if (now < s.next_at)
+                break;
+            s.target_millis = random_between(EXPOSURE_MIN_MILLIS, EXPOSURE_MAX_MILLIS);
+            s.target_sub_micros = random_between(0, 999);
+            s.expose_at = now;
+            s.light_on_at = 0;
+            s.exposing = true;
+            if (!interface::request_expose(0, EXPOSURE_GREEN_POWER, 0, s.target_millis, s.target_sub_micros, false, request_reply))
+                s.failed_requests++;
+            s.phase = PHASE_EXPOSE_WAIT;
+            break;
+        case PHASE_EXPOSE_WAIT:
+            if (now - s.expose_at < s.target_millis * SIM_NANOS_PER_MILLI + EXPOSURE_TIMEOUT_NANOS)
+                break;
+            s.exposures_missed++;
+            s.exposures++;
+            s.phase = s.exposures < _config.exposures ? PHASE_EXPOSE : PHASE_HISTORY;
+            s.next_at = now + EXPOSURE_GAP_NANOS;
+            break;
+        case PHASE_HISTORY:
+            read_history();
+            s.phase = PHASE_DONE;
+            break;
+        case PHASE_DONE:
+            break;
+    }
+}
+
+
+// Reads back the records of the last exposures, as many as a pipelined
+// transfer brings, which are numbered from 0 as the controller has had no
+// others, and compares each with the one measured.
+// A missed exposure may not have been recorded, so then the records can't
+// be matched up.
+static void read_history()
+{
+    Scenario& s = _scenario;
+    interface::ExposureHistoryRecord records[interface::COMMS_PIPELINE_MAX * HISTORY_RECORDS_PER_PACKET];
+    uint8_t pages = std::min(uint32_t(interface::COMMS_PIPELINE_MAX), (_config.exposures + 1) / HISTORY_RECORDS_PER_PACKET);
+    uint8_t first = s.errors.size() > pages * HISTORY_RECORDS_PER_PACKET ? s.errors.size() - pages * HISTORY_RECORDS_PER_PACKET : 0;
+    std::vector<bool> matched(s.errors.size(), false);
+    uint8_t count;
+
+    s.history_message = interface::query_history_pages(first, pages, &records[0], &count);
+    if (s.history_message != MESSAGE_OK || s.exposures_missed != 0)
+        return;
+    s.history_complete = s.errors.empty() || (count > 0 && records[count - 1].sequence == s.errors.size() - 1);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        // Pages asked for before the oldest kept all return that
+        if (records[i].sequence >= s.errors.size() || matched[records[i].sequence])
+            continue;
+        matched[records[i].sequence] = true;
+
+        double recorded = records[i].achieved_millis * 1000.0 + records[i].achieved_sub_micros;
+        double measured = double(s.targets[records[i].sequence] + s.errors[records[i].sequence]) / SIM_NANOS_PER_MICRO;
+
+        s.worst_history_micros = std::max(s.worst_history_micros, fabs(recorded - measured));
+        s.history_records++;
+    }
+}
+
+
+static void query_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    ControllerExternalStatus status;
+
+    _scenario.queries++;
+    if (message != MESSAGE_OK || interface::interpret_return_packet(reply, &status) != MESSAGE_OK)
+    {
+        _scenario.failed_queries++;
+        return;
+    }
+
+    _scenario.exposing = status.state != CONTROLLER_STATE_NOT_EXPOSING;
+}
+
+
+static void request_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    if (message != MESSAGE_OK)
+        _scenario.failed_requests++;
+}
+
+
+// The controller switches the power as it acts on the command, so the reply
+// should carry that switch's latency.
+static void touch_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    ControllerExternalStatus status;
+
+    if (message != MESSAGE_OK || interface::interpret_return_packet(reply, &status) != MESSAGE_OK)
+    {
+        _scenario.failed_requests++;
+        return;
+    }
+
+    if (status.latency_micros == 0xFFFF)
+        _scenario.unreported_latencies++;
+    else
+        _scenario.reported_latencies.push_back(status.latency_micros);
+}
+
+
+// From the controller's exposure hooks, whichever board is running
+static void light_changed(SimNanos at, uint16_t red, uint16_t green, uint16_t blue)
+{
+    Scenario& s = _scenario;
+    uint16_t previous_green = s.light_green;
+
+    s.light_green = green;
+    if (green == previous_green)
+        return;
+
+    if (s.phase == PHASE_TOUCH_WAIT && green == s.touch_green)
+    {
+        s.latencies.push_back(at - s.touch_at);
+        s.touches++;
+        s.phase = s.touches < _config.touches ? PHASE_TOUCH : PHASE_LIGHTS_OFF;
+        s.next_at = at + random_between(TOUCH_MIN_GAP_MILLIS, TOUCH_MAX_GAP_MILLIS) * SIM_NANOS_PER_MILLI;
+    }
+    else if (s.phase == PHASE_EXPOSE_WAIT && previous_green == 0)
+        s.light_on_at = at;
+    else if (s.phase == PHASE_EXPOSE_WAIT && green == 0 && s.light_on_at != 0)
+    {
+        SimNanos target = s.target_millis * SIM_NANOS_PER_MILLI + s.target_sub_micros * SIM_NANOS_PER_MICRO;
+
+        s.errors.push_back(int64_t(at - s.light_on_at) - int64_t(target));
+        s.targets.push_back(target);
+        s.exposures++;
+        s.phase = s.exposures < _config.exposures ? PHASE_EXPOSE : PHASE_HISTORY;
+        s.next_at = at + EXPOSURE_GAP_NANOS;
+    }
+}
+
+
+static uint32_t random_between(uint32_t low, uint32_t high)
+{
+    return low + uint32_t(sim_random() * (high - low + 1));
+}
+
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --seed N              Random seed (1)\n"
+        "  --loss P              Probability a packet is lost (0)\n"
+        "  --ack-loss P          Probability an ACK is lost (0)\n"
+        "  --dup P               Probability a retransmit is received again (0)\n"
+        "  --latency-us N        Added each way (0)\n"
+        "  --jitter-us N         Up to this added at random, each way (0)\n"
+        "  --no-auto-ack         Send no ACKs\n"
+        "  --touches N           Channel power touches (50)\n"
+        "  --exposures N         Exposures (10)\n"
+        "  --display-us N        Each display update (%u)\n"
+        "  --max-latency-ms X    Fail if the p99 touch to light latency is over X\n"
+        "  --max-error-us X      Fail if any exposure is out by more than X\n",
+        program, unsigned(DEFAULT_DISPLAY_UPDATE_NANOS / SIM_NANOS_PER_MICRO));
+}
+
+
+static bool parse_options(int argc, char** argv, SimLinkConfig* link)
+{
+    _config.seed = 1;
+    _config.touches = 50;
+    _config.exposures = 10;
+    _config.display_update_nanos = DEFAULT_DISPLAY_UPDATE_NANOS;
+    _config.max_latency_millis = 0;
+    _config.max_error_micros = 0;
+
+    link->loss = 0;
+    link->ack_loss = 0;
+    link->duplicate = 0;
+    link->latency_nanos = 0;
+    link->jitter_nanos = 0;
+    link->auto_ack = true;
+    link->channel_busy = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* option = argv[i];
+
+        if (strcmp(option, "--no-auto-ack") == 0)
+        {
+            link->auto_ack = false;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return false;
+        }
+        double value = atof(argv[++i]);
+
+        if (strcmp(option, "--seed") == 0)
+            _config.seed = uint32_t(value);
+        else if (strcmp(option, "--loss") == 0)
+            link->loss = value;
+        else if (strcmp(option, "--ack-loss") == 0)
+            link->ack_loss = value;
+        else if (strcmp(option, "--dup") == 0)
+            link->duplicate = value;
+        else if (strcmp(option, "--latency-us") == 0)
+            link->latency_nanos = SimNanos(value * SIM_NANOS_PER_MICRO);
+        else if (strcmp(option, "--jitter-us") == 0)
+            link->jitter_nanos = SimNanos(value * SIM_NANOS_PER_MICRO);
+        else if (strcmp(option, "--touches") == 0)
+            _config.touches = uint32_t(value);
+        else if (strcmp(option, "--exposures") == 0)
+            _config.exposures = uint32_t(value);
+        else if (strcmp(option, "--display-us") == 0)
+            _config.display_update_nanos = SimNanos(value * SIM_NANOS_PER_MICRO);
+        else if (strcmp(option, "--max-latency-ms") == 0)
+            _config.max_latency_millis = value;
+        else if (strcmp(option, "--max-error-us") == 0)
+            _config.max_error_micros = value;
+        else
+        {
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static void report(const SimLinkConfig* link, double* p99_latency_millis, double* worst_error_micros)
+{
+    const Scenario& s = _scenario;
+    const SimLinkStats* stats = sim_link_stats();
+    std::vector<double> latencies, errors, reported_latencies;
+    double worst_latency = 0;
+
+    for (size_t i = 0; i < s.latencies.size(); i++)
+    {
+        latencies.push_back(double(s.latencies[i]) / SIM_NANOS_PER_MILLI);
+        worst_latency = std::max(worst_latency, latencies.back());
+    }
+
+    for (size_t i = 0; i < s.reported_latencies.size(); i++)
+        reported_latencies.push_back(s.reported_latencies[i]);
+
+    *worst_error_micros = 0;
+    for (size_t i = 0; i < s.errors.size(); i++)
+    {
+        errors.push_back(double(s.errors[i]) / SIM_NANOS_PER_MICRO);
+        *worst_error_micros = std::max(*worst_error_micros, fabs(errors.back()));
+    }
+
+    *p99_latency_millis = percentile(latencies, 99);
+
+    printf("Link: loss %.3f, ACK loss %.3f, duplicate %.3f, latency %.1f us, jitter %.1f us%s; seed %u\n",
+        link->loss, link->ack_loss, link->duplicate, double(link->latency_nanos) / SIM_NANOS_PER_MICRO,
+        double(link->jitter_nanos) / SIM_NANOS_PER_MICRO, link->auto_ack ? "" : ", no auto ACK", _config.seed);
+    printf("Simulated: %.3f s\n", double(sim_now()) / (1000 * SIM_NANOS_PER_MILLI));
+    printf("Touches: %u of %u took effect; touch to light median %.2f ms, p99 %.2f ms, worst %.2f ms\n",
+        unsigned(s.touches - s.touches_missed), _config.touches, percentile(latencies, 50), *p99_latency_millis,
+        worst_latency);
+    printf("Controller latency: carried by %u of %u touch replies; median %.0f us, worst %.0f us\n",
+        unsigned(reported_latencies.size()), unsigned(reported_latencies.size() + s.unreported_latencies),
+        percentile(reported_latencies, 50), percentile(reported_latencies, 100));
+    printf("Exposures: %u of %u completed; error median %.1f us, worst %.1f us\n",
+        unsigned(s.exposures - s.exposures_missed), _config.exposures, percentile(errors, 50), *worst_error_micros);
+    printf("History: %u of %u exposures read back (%s); achieved within %.1f us of measured\n",
+        unsigned(s.history_records), unsigned(s.errors.size()), s.history_message == MESSAGE_OK ? "ok" : "failed",
+        s.worst_history_micros);
+    printf("Interface: %u events, %u status queries (%u failed), %u requests failed\n",
+        s.events, s.queries, s.failed_queries, s.failed_requests);
+    printf("Radio: %u transmissions, %u received, %u lost, %u ACKs lost, %u late ACKs, %u duplicates, %u RX full, %u MAX_RT\n",
+        stats->transmissions, stats->received, stats->lost, stats->acks_lost, stats->late_acks, stats->duplicates,
+        stats->rx_full, stats->max_retries);
+
+    uint32_t median_micros, p99_micros, timeout_micros;
+    interface::LinkStats link_stats;
+
+    interface::query_round_trip(&median_micros, &p99_micros, &timeout_micros);
+    interface::query_link(&link_stats);
+
+    printf("Round trip: median %u us, p99 %u us, timeout %u us\n", median_micros, p99_micros, timeout_micros);
+    printf("Link monitor: level %u, channel %u, %u packets, %u retransmits, %u lost, %u of %u exchanges failed, %u switches\n",
+        link_stats.level, link_stats.channel, link_stats.packets, link_stats.retransmits, link_stats.lost_packets,
+        link_stats.failed_exchanges, link_stats.exchanges, link_stats.switches);
+}
+
+
+// Nearest rank; 0 if there are none
+static double percentile(std::vector<double> values, uint8_t percent)
+{
+    if (values.empty())
+        return 0;
+
+    std::sort(values.begin(), values.end());
+    size_t rank = (values.size() * percent + 99) / 100;
+
+    return values[rank == 0 ? 0 : rank - 1];
+}
@@ -0,0 +1,471 @@
+/* Tests the interface's link monitor (interface/link.cpp) as it runs, with
+ * both boards over the simulated link (see sim.h), whose loss and busy
+ * channels are changed from phase to phase by SimLinkConfig:
+ *   - Startup: a WiFi network over RADIO_CHANNEL, so the survey in
+ *     initialise_radio() moves the link below it.
+ *   - Survey: a second network over that channel, and a survey started as
+ *     the diagnostics screen would, which moves the link below both.  The
+ *     survey runs a channel at a time from comms_poll(), so loop() keeps
+ *     running and the queries keep succeeding throughout.
+ * In each, the channel chosen is checked to be the nearest to RADIO_CHANNEL
+ * whose neighbours within LINK_SURVEY_SPREAD are all quiet.  Then:
+ *   - Clean: the level is lowered from the default, a step at a time.
+ *   - Lossy: it's raised at once, to the most robust level.
+ *   - Clean again: it steps back down, more slowly as the lowered levels
+ *     that had to be raised have doubled the run of good windows needed.
+ *   - ACK loss: the switches, whose ACKs may be lost after the controller
+ *     has switched, still leave both ends at the same settings.
+ *   - Blackout: the interface falls back to the default level and
+ *     RADIO_CHANNEL after LINK_LOST_EXCHANGES failed exchanges.
+ *   - Restored: the exchanges succeed again at once, as the blackout
+ *     outlasts RADIO_SILENCE_MILLIS, so the controller has gone back to the
+ *     defaults too.
+ * The interface queries the controller's status every QUERY_MILLIS, so that
+ * the monitor has packets to go on.
+ *
+ * Build, from the top of the repository:
+ *   g++ -std=gnu++11 -O2 -Ihost -Ilibraries/LamphouseShared \
+ *       host/sim.cpp host/sim_radio.cpp host/controller_board.cpp \
+ *       host/interface_board.cpp host/link_test.cpp \
+ *       libraries/LamphouseShared/lamphouse_shared.cpp -o link_test
+ * Exits 1 if any check fails.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Arduino.h"
+#include "sim.h"
+#include "sim_boards.h"
+
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+
+
+namespace interface {
+#include "../interface/comms.h"
+}
+
+
+const static uint8_t CONTROLLER_PIN_RADIO_IRQ = 2;
+const static uint8_t INTERFACE_PIN_RADIO_IRQ = PC14;
+
+const static uint32_t SEED = 1;
+const static uint16_t QUERY_MILLIS = 5;
+
+// After both boards' setup, including the interface's channel survey
+const static SimNanos SETTLE_NANOS = 2000 * SIM_NANOS_PER_MILLI;
+const static SimNanos SAMPLE_NANOS = 100 * SIM_NANOS_PER_MILLI;
+
+// The most the level may take to be raised once loss starts
+const static SimNanos RAISE_NANOS = 1000 * SIM_NANOS_PER_MILLI;
+
+// The most exchanges may take to succeed again once the link is restored
+const static SimNanos RESTORE_NANOS = 100 * SIM_NANOS_PER_MILLI;
+
+// The longest loop() may go between passes while a survey runs: about as
+// long as an exchange's steps can hold it up, against the 30 ms a sweep
+// took when the survey ran straight through
+const static SimNanos SURVEY_LOOP_NANOS = 2000 * SIM_NANOS_PER_MICRO;
+
+// WiFi networks, about 20 channels wide, and how often they're on the air
+const static uint8_t WIFI_HALF_WIDTH = 11;
+const static uint8_t WIFI_LOW_CHANNEL = 66;
+const static double WIFI_BUSY = 0.5;
+
+
+enum PhaseId {
+    PHASE_SURVEY,
+    PHASE_CLEAN,
+    PHASE_LOSSY,
+    PHASE_CLEAN_AGAIN,
+    PHASE_ACK_LOSS,
+    PHASE_BLACKOUT,
+    PHASE_RESTORED,
+    PHASE_COUNT
+};
+
+
+struct Phase
+{
+    const char* name;
+    uint32_t millis;
+    double loss;
+    double ack_loss;
+    bool survey;                        // Start a survey
+};
+
+const static Phase PHASES[PHASE_COUNT] = {
+    { "Survey", 3000, 0, 0, true },
+    { "Clean", 20000, 0, 0, false },
+    { "Lossy", 5000, 0.15, 0.1, false },
+    { "Clean again", 30000, 0, 0, false },
+    { "ACK loss", 10000, 0.2, 0.3, false },
+    { "Blackout", RADIO_SILENCE_MILLIS + 1000, 1, 0, false },
+    { "Restored", 10000, 0, 0, false }
+};
+
+
+// Every SAMPLE_NANOS
+struct Sample
+{
+    SimNanos at;
+    uint8_t level;
+    uint8_t channel;
+    bool ends_agree;                    // Both radios at the same channel and data rate
+};
+
+
+struct PhaseResult
+{
+    SimNanos start;
+    std::vector<Sample> samples;
+    uint32_t exchanges;
+    uint32_t failed_exchanges;
+    SimNanos last_failed_at;            // 0 if none
+    SimNanos first_ok_at;               // 0 if none
+    uint16_t switches;                  // Of the level, as counted by the monitor
+    SimNanos longest_loop_nanos;        // Between passes of loop()
+};
+
+
+// Of each channel, that testRPD() finds a signal on it
+static double _startup_busy[SIM_RADIO_CHANNELS];
+static double _survey_busy[SIM_RADIO_CHANNELS];
+
+static PhaseResult _results[PHASE_COUNT];
+static uint8_t _phase;
+static bool _survey_wanted;
+static uint8_t _startup_channel;
+static int _failures;
+
+
+static void script_setup();
+static void script_loop();
+static void query_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+static void add_wifi(double* busy, uint8_t channel);
+static void set_phase(uint8_t phase);
+static void take_sample();
+static void check(bool ok, const char* name);
+static void check_results();
+
+
+int main()
+{
+    SimLinkConfig link;
+    SimBoardConfig controller_board, interface_board;
+
+    link.loss = 0;
+    link.ack_loss = 0;
+    link.duplicate = 0;
+    link.latency_nanos = 0;
+    link.jitter_nanos = 0;
+    link.auto_ack = true;
+    link.channel_busy = _startup_busy;
+
+    add_wifi(_startup_busy, RADIO_CHANNEL);
+    add_wifi(_survey_busy, RADIO_CHANNEL);
+    add_wifi(_survey_busy, WIFI_LOW_CHANNEL);
+    sim_init(SEED, &link);
+
+    controller_board.setup = controller_setup;
+    controller_board.loop = controller_loop;
+    controller_board.loop_nanos = 20 * SIM_NANOS_PER_MICRO;
+    controller_board.call_nanos = 1000;
+    controller_board.spi_byte_nanos = 2500;
+    controller_board.radio_irq_pin = CONTROLLER_PIN_RADIO_IRQ;
+    controller_board.avr = true;
+    sim_add_board(SIM_BOARD_CONTROLLER, &controller_board);
+
+    interface_board.setup = script_setup;
+    interface_board.loop = script_loop;
+    interface_board.loop_nanos = 5 * SIM_NANOS_PER_MICRO;
+    interface_board.call_nanos = 200;
+    interface_board.spi_byte_nanos = 1000;
+    interface_board.radio_irq_pin = INTERFACE_PIN_RADIO_IRQ;
+    interface_board.avr = false;
+    sim_add_board(SIM_BOARD_INTERFACE, &interface_board);
+
+    sim_run_until(SETTLE_NANOS);
+
+    interface::LinkStats stats;
+    interface::query_link(&stats);
+    _startup_channel = stats.channel;
+
+    for (uint8_t phase = 0; phase < PHASE_COUNT; phase++)
+    {
+        SimNanos end = sim_now() + PHASES[phase].millis * SIM_NANOS_PER_MILLI;
+
+        set_phase(phase);
+        while (sim_now() < end)
+        {
+            sim_run_until(sim_now() + SAMPLE_NANOS);
+            take_sample();
+        }
+
+        interface::query_link(&stats);
+        _results[phase].switches = stats.switches - _results[phase].switches;
+    }
+
+    check_results();
+
+    printf("%s\n", _failures ? "FAIL" : "PASS");
+    return _failures ? 1 : 0;
+}
+
+
+static void script_setup()
+{
+    interface::initialise_radio();
+}
+
+
+// comms_poll(), as interface.ino, with a status query every QUERY_MILLIS
+static void script_loop()
+{
+    static uint32_t last_query_millis = 0;
+    static SimNanos last_loop_at = 0;
+    PhaseResult& result = _results[_phase];
+
+    if (last_loop_at != 0)
+        result.longest_loop_nanos = std::max(result.longest_loop_nanos, sim_now() - last_loop_at);
+    last_loop_at = sim_now();
+
+    if (_survey_wanted)
+    {
+        interface::comms_survey_channels();
+        _survey_wanted = false;
+    }
+
+    interface::comms_poll();
+
+    if (millis() - last_query_millis < QUERY_MILLIS)
+        return;
+    last_query_millis = millis();
+
+    interface::request_command(COMMAND_REPORT_STATUS, query_reply);
+}
+
+
+static void query_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    PhaseResult& result = _results[_phase];
+
+    if (sim_now() < SETTLE_NANOS)
+        return;
+
+    result.exchanges++;
+    if (message != MESSAGE_OK)
+    {
+        result.failed_exchanges++;
+        result.last_failed_at = sim_now();
+    }
+    else if (result.first_ok_at == 0)
+        result.first_ok_at = sim_now();
+}
+
+
+// Busy on the channels within WIFI_HALF_WIDTH of channel
+static void add_wifi(double* busy, uint8_t channel)
+{
+    for (int16_t i = int16_t(channel) - WIFI_HALF_WIDTH; i <= channel + WIFI_HALF_WIDTH; i++)
+    {
+        if (i >= 0 && i < SIM_RADIO_CHANNELS)
+            busy[i] = WIFI_BUSY;
+    }
+}
+
+
+// After the settling, at the survey's profile of busy channels throughout
+static void set_phase(uint8_t phase)
+{
+    SimLinkConfig link = *sim_link_config();
+    interface::LinkStats stats;
+
+    link.loss = PHASES[phase].loss;
+    link.ack_loss = PHASES[phase].ack_loss;
+    link.channel_busy = _survey_busy;
+    sim_set_link_config(&link);
+    _survey_wanted = PHASES[phase].survey;
+
+    interface::query_link(&stats);
+    _phase = phase;
+    _results[phase].start = sim_now();
+    _results[phase].switches = stats.switches;
+}
+
+
+static void take_sample()
+{
+    interface::LinkStats stats;
+    Sample sample;
+    uint8_t controller_channel, controller_rate, controller_pa;
+    uint8_t interface_channel, interface_rate, interface_pa;
+
+    interface::query_link(&stats);
+    sim_radio_settings(SIM_BOARD_CONTROLLER, &controller_channel, &controller_rate, &controller_pa);
+    sim_radio_settings(SIM_BOARD_INTERFACE, &interface_channel, &interface_rate, &interface_pa);
+
+    sample.at = sim_now();
+    sample.level = stats.level;
+    sample.channel = stats.channel;
+    sample.ends_agree = controller_channel == interface_channel && controller_rate == interface_rate;
+    _results[_phase].samples.push_back(sample);
+}
+
+
+static void check(bool ok, const char* name)
+{
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+        _failures++;
+}
+
+
+// Of those whose neighbours within LINK_SURVEY_SPREAD are all quiet, the
+// nearest RADIO_CHANNEL, the lower of two as near
+static uint8_t quiet_channel(const double* busy)
+{
+    for (uint8_t distance = 0; distance <= interface::LINK_CHANNEL_COUNT; distance++)
+    {
+        for (int16_t channel : { RADIO_CHANNEL - distance, RADIO_CHANNEL + distance })
+        {
+            bool quiet = channel >= 0 && channel < interface::LINK_CHANNEL_COUNT;
+
+            for (int16_t i = channel - interface::LINK_SURVEY_SPREAD; quiet && i <= channel + interface::LINK_SURVEY_SPREAD; i++)
+                quiet = i < 0 || i >= interface::LINK_CHANNEL_COUNT || busy[i] == 0;
+            if (quiet)
+                return channel;
+        }
+    }
+
+    return RADIO_CHANNEL;
+}
+
+
+static uint8_t lowest_level(uint8_t phase)
+{
+    uint8_t level = interface::LINK_LEVEL_COUNT;
+
+    for (size_t i = 0; i < _results[phase].samples.size(); i++)
+        level = std::min(level, _results[phase].samples[i].level);
+
+    return level;
+}
+
+
+static uint8_t highest_level(uint8_t phase, SimNanos by_nanos)
+{
+    const PhaseResult& result = _results[phase];
+    uint8_t level = 0;
+
+    for (size_t i = 0; i < result.samples.size() && result.samples[i].at - result.start <= by_nanos; i++)
+        level = std::max(level, result.samples[i].level);
+
+    return level;
+}
+
+
+// From the start of the phase to the first sample below level
+static SimNanos time_below(uint8_t phase, uint8_t level)
+{
+    const PhaseResult& result = _results[phase];
+
+    for (size_t i = 0; i < result.samples.size(); i++)
+    {
+        if (result.samples[i].level < level)
+            return result.samples[i].at - result.start;
+    }
+
+    return PHASES[phase].millis * SIM_NANOS_PER_MILLI;
+}
+
+
+// Of the samples, the fraction at which both ends agree
+static double agreeing(uint8_t phase)
+{
+    const PhaseResult& result = _results[phase];
+    uint32_t count = 0;
+
+    for (size_t i = 0; i < result.samples.size(); i++)
+        count += result.samples[i].ends_agree;
+
+    return double(count) / result.samples.size();
+}
+
+
+static void print_phase(uint8_t phase)
+{
+    const PhaseResult& result = _results[phase];
+
+    printf("%s: loop() every %.0f us at most, %u of %u exchanges failed, %u switches, levels", PHASES[phase].name,
+        double(result.longest_loop_nanos) / SIM_NANOS_PER_MICRO,
+        unsigned(result.failed_exchanges), unsigned(result.exchanges), unsigned(result.switches));
+    for (size_t i = 0; i < result.samples.size(); i += 10)
+        printf(" %u", result.samples[i].level);
+    printf("\n");
+}
+
+
+static void check_results()
+{
+    const PhaseResult& clean = _results[PHASE_CLEAN];
+    const PhaseResult& survey = _results[PHASE_SURVEY];
+    const PhaseResult& lossy = _results[PHASE_LOSSY];
+    const PhaseResult& clean_again = _results[PHASE_CLEAN_AGAIN];
+    const PhaseResult& ack_loss = _results[PHASE_ACK_LOSS];
+    const PhaseResult& blackout = _results[PHASE_BLACKOUT];
+    const PhaseResult& restored = _results[PHASE_RESTORED];
+    const uint8_t most_robust = interface::LINK_LEVEL_COUNT - 1;
+    char name[80];
+
+    for (uint8_t phase = 0; phase < PHASE_COUNT; phase++)
+        print_phase(phase);
+
+    snprintf(name, sizeof(name), "Startup: survey chose channel %u, expected %u", _startup_channel,
+        quiet_channel(_startup_busy));
+    check(_startup_channel == quiet_channel(_startup_busy) && _startup_channel != RADIO_CHANNEL, name);
+
+    snprintf(name, sizeof(name), "Survey: chose channel %u, expected %u, ends agree", survey.samples.back().channel,
+        quiet_channel(_survey_busy));
+    check(survey.samples.back().channel == quiet_channel(_survey_busy) && survey.samples.back().channel != _startup_channel &&
+        survey.samples.back().ends_agree, name);
+
+    snprintf(name, sizeof(name), "Survey: loop() every %.0f us at most, %u of %u failed",
+        double(survey.longest_loop_nanos) / SIM_NANOS_PER_MICRO, unsigned(survey.failed_exchanges), unsigned(survey.exchanges));
+    check(survey.longest_loop_nanos <= SURVEY_LOOP_NANOS && survey.failed_exchanges == 0, name);
+
+    snprintf(name, sizeof(name), "Clean: lowered to level %u, no exchanges failed", lowest_level(PHASE_CLEAN));
+    check(clean.samples.back().level < interface::LINK_DEFAULT_LEVEL && clean.failed_exchanges == 0 &&
+        agreeing(PHASE_CLEAN) == 1, name);
+
+    snprintf(name, sizeof(name), "Lossy: raised to level %u within %u ms", highest_level(PHASE_LOSSY, RAISE_NANOS),
+        unsigned(RAISE_NANOS / SIM_NANOS_PER_MILLI));
+    check(highest_level(PHASE_LOSSY, RAISE_NANOS) == most_robust && lossy.samples.back().level == most_robust, name);
+
+    snprintf(name, sizeof(name), "Clean again: lowered to level %u, no exchanges failed", lowest_level(PHASE_CLEAN_AGAIN));
+    check(clean_again.samples.back().level < interface::LINK_DEFAULT_LEVEL && clean_again.failed_exchanges == 0 &&
+        agreeing(PHASE_CLEAN_AGAIN) == 1, name);
+
+    // The first step down waits out the good windows, doubled since the first
+    SimNanos first_step = time_below(PHASE_CLEAN, interface::LINK_DEFAULT_LEVEL);
+    SimNanos step_again = time_below(PHASE_CLEAN_AGAIN, most_robust);
+    snprintf(name, sizeof(name), "Clean again: first step down after %.0f ms, against %.0f ms",
+        double(step_again) / SIM_NANOS_PER_MILLI, double(first_step) / SIM_NANOS_PER_MILLI);
+    check(step_again > first_step, name);
+
+    snprintf(name, sizeof(name), "ACK loss: ends agree at %.0f%% of samples, %u of %u failed", 100 * agreeing(PHASE_ACK_LOSS),
+        unsigned(ack_loss.failed_exchanges), unsigned(ack_loss.exchanges));
+    check(ack_loss.samples.back().ends_agree && agreeing(PHASE_ACK_LOSS) >= 0.95 &&
+        ack_loss.failed_exchanges * 100 <= ack_loss.exchanges, name);
+
+    check(blackout.samples.back().level == interface::LINK_DEFAULT_LEVEL && blackout.samples.back().channel == RADIO_CHANNEL &&
+        blackout.failed_exchanges > 0, "Blackout: falls back to the default level and channel");
+
+    snprintf(name, sizeof(name), "Restored: exchanges succeed again after %.0f ms",
+        restored.first_ok_at == 0 ? 0.0 : double(restored.first_ok_at - restored.start) / SIM_NANOS_PER_MILLI);
+    check(restored.first_ok_at != 0 && restored.first_ok_at - restored.start <= RESTORE_NANOS && restored.samples.back().ends_agree &&
+        restored.last_failed_at < restored.first_ok_at, name);
+}
@@ -0,0 +1,580 @@
+/* Tests the packet codec (lamphouse_packet.h) on the host, and times it
+ * against the same packets packed with hand-written shifts.
+ *
+ * Checks, for every Command*, Reply*, Packet* and AckPayload* field:
+ *   - It covers exactly the bits lamphouse_shared.h gives it, in order of
+ *     significance, MSB first across bytes, including the split powers.
+ *   - put() then get() returns the value, for edge values and random ones.
+ *   - put() leaves every other bit of the packet as it was, whatever they
+ *     hold.
+ * And for each packet format, that its fields don't overlap, and that all of
+ * them written in either order read back, such as the sub-millisecond times,
+ * step index and fine powers sharing bytes 12-15.
+ *
+ * The benchmark encodes and decodes status replies both ways, checks that
+ * the two agree byte for byte, and reports the time per packet.  It's host
+ * time, so only shows whether the templates inline to the same work as the
+ * shifts, not what either costs on the boards.
+ *
+ * Build, from the top of the repository:
+ *   g++ -std=gnu++11 -O2 -Ihost -Ilibraries/LamphouseShared \
+ *       host/packet_test.cpp libraries/LamphouseShared/lamphouse_shared.cpp -o packet_test
+ * and run, optionally with the number of benchmark packets.  Exits 1 if any
+ * check fails.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+
+
+const static uint32_t RANDOM_VALUES = 2000;
+const static uint32_t DEFAULT_BENCHMARK_PACKETS = 10000000;
+
+
+// A field, whatever its type
+struct FieldOps
+{
+    const char* name;
+    const char* layout;                 // "BYTE:MASK ...", as lamphouse_shared.h
+    void (*put)(RadioPacket* packet, uint32_t value);
+    uint32_t (*get)(const RadioPacket* packet);
+};
+
+
+template <typename FIELD>
+static void field_put(RadioPacket* packet, uint32_t value)
+{
+    FIELD::put(packet, typename FIELD::Type(value));
+}
+
+
+template <typename FIELD>
+static uint32_t field_get(const RadioPacket* packet)
+{
+    return FIELD::get(packet);
+}
+
+
+#define FIELD(NAME, LAYOUT) { #NAME, LAYOUT, field_put<NAME>, field_get<NAME> }
+
+static const FieldOps ALL_FIELDS[] = {
+    FIELD(PacketCommand, "0:FF"),
+    FIELD(PacketCounter, "15:FF"),
+    FIELD(AckPayloadCounter, "16:FF"),
+    FIELD(AckPayloadLatency, "17:FF 18:FF"),
+    FIELD(CommandRedPower, "1:FF"),
+    FIELD(CommandGreenPower, "2:FF 14:F0"),
+    FIELD(CommandBluePower, "3:FF 14:0F"),
+    FIELD(CommandTargetMillis, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(CommandTargetSubMicros, "12:FF 13:C0"),
+    FIELD(CommandGreenDose, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(CommandBlueDose, "8:FF 9:FF 10:FF 11:FF"),
+    FIELD(CommandMeterDose, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(CommandStepIndex, "1:FF"),
+    FIELD(CommandStepPauseMillis, "8:FF 9:FF"),
+    FIELD(CommandStopDivisor, "8:FF"),
+    FIELD(CommandStripCount, "9:FF"),
+    FIELD(CommandStripPauseMillis, "10:FF 11:FF"),
+    FIELD(CommandExposeFlags, "8:FF"),
+    FIELD(CommandHistorySequence, "1:FF"),
+    FIELD(CommandRadioDataRate, "1:FF"),
+    FIELD(CommandRadioPaLevel, "2:FF"),
+    FIELD(CommandRadioChannel, "1:FF"),
+    FIELD(ReplyState, "0:C0"),
+    FIELD(ReplyMessage, "0:3F"),
+    FIELD(ReplyRedPower, "1:FF"),
+    FIELD(ReplyGreenPower, "2:FF 15:F0"),
+    FIELD(ReplyBluePower, "3:FF 15:0F"),
+    FIELD(ReplyTargetMillis, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(ReplyAchievedMillis, "8:FF 9:FF 10:FF 11:FF"),
+    FIELD(ReplyTargetSubMicros, "12:FF 13:C0"),
+    FIELD(ReplyAchievedSubMicros, "13:3F 14:F0"),
+    FIELD(ReplyStepIndex, "14:0F"),
+    FIELD(ReplyGreenDose, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(ReplyBlueDose, "8:FF 9:FF 10:FF 11:FF"),
+    FIELD(ReplyMeterDose, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(ReplyMeterDark, "8:FF 9:FF"),
+    FIELD(ReplyMeterLight, "10:FF 11:FF"),
+    FIELD(ReplyLatency, "4:FF 5:FF"),
+    FIELD(ReplyWorstLatency, "6:FF 7:FF"),
+    FIELD(ReplyReceiveOverflows, "8:FF"),
+    FIELD(ReplyOnSkew, "4:FF 5:FF"),
+    FIELD(ReplyOffSkew, "6:FF 7:FF"),
+    FIELD(ReplyHistorySequence, "1:FF"),
+};
+
+// Packet formats, each of fields that are written together
+static const FieldOps EXPOSURE_COMMAND[] = {
+    FIELD(PacketCommand, "0:FF"),
+    FIELD(CommandRedPower, "1:FF"),
+    FIELD(CommandGreenPower, "2:FF 14:F0"),
+    FIELD(CommandBluePower, "3:FF 14:0F"),
+    FIELD(CommandTargetMillis, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(CommandTargetSubMicros, "12:FF 13:C0"),
+    FIELD(PacketCounter, "15:FF"),
+};
+
+static const FieldOps PROGRAM_STEP_COMMAND[] = {
+    FIELD(PacketCommand, "0:FF"),
+    FIELD(CommandStepIndex, "1:FF"),
+    FIELD(CommandGreenPower, "2:FF 14:F0"),
+    FIELD(CommandBluePower, "3:FF 14:0F"),
+    FIELD(CommandTargetMillis, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(CommandStepPauseMillis, "8:FF 9:FF"),
+    FIELD(CommandTargetSubMicros, "12:FF 13:C0"),
+    FIELD(PacketCounter, "15:FF"),
+};
+
+static const FieldOps DOSE_COMMAND[] = {
+    FIELD(PacketCommand, "0:FF"),
+    FIELD(CommandGreenPower, "2:FF 14:F0"),
+    FIELD(CommandBluePower, "3:FF 14:0F"),
+    FIELD(CommandGreenDose, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(CommandBlueDose, "8:FF 9:FF 10:FF 11:FF"),
+    FIELD(PacketCounter, "15:FF"),
+};
+
+static const FieldOps TEST_STRIP_COMMAND[] = {
+    FIELD(PacketCommand, "0:FF"),
+    FIELD(CommandGreenPower, "2:FF 14:F0"),
+    FIELD(CommandBluePower, "3:FF 14:0F"),
+    FIELD(CommandTargetMillis, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(CommandStopDivisor, "8:FF"),
+    FIELD(CommandStripCount, "9:FF"),
+    FIELD(CommandStripPauseMillis, "10:FF 11:FF"),
+    FIELD(CommandTargetSubMicros, "12:FF 13:C0"),
+    FIELD(PacketCounter, "15:FF"),
+};
+
+static const FieldOps STATUS_ACK_PAYLOAD[] = {
+    FIELD(ReplyState, "0:C0"),
+    FIELD(ReplyMessage, "0:3F"),
+    FIELD(ReplyRedPower, "1:FF"),
+    FIELD(ReplyGreenPower, "2:FF 15:F0"),
+    FIELD(ReplyBluePower, "3:FF 15:0F"),
+    FIELD(ReplyTargetMillis, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(ReplyAchievedMillis, "8:FF 9:FF 10:FF 11:FF"),
+    FIELD(ReplyTargetSubMicros, "12:FF 13:C0"),
+    FIELD(ReplyAchievedSubMicros, "13:3F 14:F0"),
+    FIELD(ReplyStepIndex, "14:0F"),
+    FIELD(AckPayloadCounter, "16:FF"),
+    FIELD(AckPayloadLatency, "17:FF 18:FF"),
+};
+
+static const FieldOps METER_REPLY[] = {
+    FIELD(ReplyState, "0:C0"),
+    FIELD(ReplyMessage, "0:3F"),
+    FIELD(ReplyMeterDose, "4:FF 5:FF 6:FF 7:FF"),
+    FIELD(ReplyMeterDark, "8:FF 9:FF"),
+    FIELD(ReplyMeterLight, "10:FF 11:FF"),
+    FIELD(AckPayloadCounter, "16:FF"),
+};
+
+static const FieldOps LATENCY_REPLY[] = {
+    FIELD(ReplyState, "0:C0"),
+    FIELD(ReplyMessage, "0:3F"),
+    FIELD(ReplyLatency, "4:FF 5:FF"),
+    FIELD(ReplyWorstLatency, "6:FF 7:FF"),
+    FIELD(ReplyReceiveOverflows, "8:FF"),
+    FIELD(AckPayloadCounter, "16:FF"),
+};
+
+#undef FIELD
+
+#define FIELDS(ARRAY) ARRAY, sizeof(ARRAY) / sizeof(ARRAY[0])
+
+
+static int _failures;
+static uint32_t _random_state = 1;
+
+
+static void check(bool ok, const char* name)
+{
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+        _failures++;
+}
+
+
+// xorshift32, so that runs are repeatable
+static uint32_t random32()
+{
+    _random_state ^= _random_state << 13;
+    _random_state ^= _random_state >> 17;
+    _random_state ^= _random_state << 5;
+    return _random_state;
+}
+
+
+static void random_packet(RadioPacket* packet)
+{
+    for (uint8_t i = 0; i < ACK_PAYLOAD_SIZE; i++)
+        packet[i] = uint8_t(random32());
+}
+
+
+// The field's bits from its layout string
+static void layout_mask(const char* layout, RadioPacket* mask)
+{
+    unsigned byte, bits;
+    int used;
+
+    memset(mask, 0, ACK_PAYLOAD_SIZE);
+    while (sscanf(layout, "%u:%x%n", &byte, &bits, &used) == 2)
+    {
+        mask[byte] |= uint8_t(bits);
+        layout += used;
+    }
+}
+
+
+static uint8_t mask_width(const RadioPacket* mask)
+{
+    uint8_t width = 0;
+
+    for (uint8_t i = 0; i < ACK_PAYLOAD_SIZE; i++)
+        for (uint8_t bit = 0; bit < 8; bit++)
+            width += (mask[i] >> bit) & 1;
+
+    return width;
+}
+
+
+// The packet byte and bit of the field's value bit, counting the mask's
+// bits up from the least significant, MSB first across bytes
+static void mask_bit(const RadioPacket* mask, uint8_t value_bit, uint8_t* byte, uint8_t* bit)
+{
+    for (int i = ACK_PAYLOAD_SIZE - 1; i >= 0; i--)
+    {
+        for (uint8_t b = 0; b < 8; b++)
+        {
+            if (!((mask[i] >> b) & 1))
+                continue;
+            if (value_bit-- == 0)
+            {
+                *byte = uint8_t(i);
+                *bit = b;
+                return;
+            }
+        }
+    }
+}
+
+
+// put() of value onto a random packet: reads back, and leaves the rest alone
+static bool field_round_trip(const FieldOps* field, const RadioPacket* mask, uint32_t value)
+{
+    RadioPacket before[ACK_PAYLOAD_SIZE];
+    RadioPacket packet[ACK_PAYLOAD_SIZE];
+
+    random_packet(before);
+    memcpy(packet, before, sizeof(packet));
+    field->put(packet, value);
+
+    if (field->get(packet) != value)
+        return false;
+    for (uint8_t i = 0; i < ACK_PAYLOAD_SIZE; i++)
+    {
+        if ((packet[i] ^ before[i]) & ~mask[i])
+            return false;
+    }
+    return true;
+}
+
+
+static void test_field(const FieldOps* field)
+{
+    RadioPacket mask[ACK_PAYLOAD_SIZE];
+    RadioPacket packet[ACK_PAYLOAD_SIZE];
+    char name[80];
+
+    layout_mask(field->layout, mask);
+    uint8_t width = mask_width(mask);
+    uint32_t max = width >= 32 ? 0xFFFFFFFF : (uint32_t(1) << width) - 1;
+
+    // The layout: all ones sets exactly its bits, zero clears exactly them,
+    // and each value bit lands where lamphouse_shared.h puts it
+    bool layout_ok = true;
+    memset(packet, 0, sizeof(packet));
+    field->put(packet, max);
+    layout_ok = layout_ok && memcmp(packet, mask, sizeof(packet)) == 0;
+
+    memset(packet, 0xFF, sizeof(packet));
+    field->put(packet, 0);
+    for (uint8_t i = 0; i < ACK_PAYLOAD_SIZE; i++)
+        layout_ok = layout_ok && packet[i] == uint8_t(~mask[i]);
+
+    for (uint8_t value_bit = 0; value_bit < width; value_bit++)
+    {
+        uint8_t byte = 0, bit = 0;
+
+        mask_bit(mask, value_bit, &byte, &bit);
+        memset(packet, 0, sizeof(packet));
+        field->put(packet, uint32_t(1) << value_bit);
+        for (uint8_t i = 0; i < ACK_PAYLOAD_SIZE; i++)
+            layout_ok = layout_ok && packet[i] == (i == byte ? uint8_t(1 << bit) : 0);
+    }
+
+    // Values, over random packets
+    static const uint32_t EDGES[] = { 0, 1, 2, 0x55555555, 0xAAAAAAAA, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFE, 0xFFFFFFFF };
+    bool values_ok = true;
+    for (uint8_t i = 0; i < sizeof(EDGES) / sizeof(EDGES[0]); i++)
+        values_ok = values_ok && field_round_trip(field, mask, EDGES[i] & max);
+    for (uint32_t i = 0; i < RANDOM_VALUES; i++)
+        values_ok = values_ok && field_round_trip(field, mask, random32() & max);
+
+    snprintf(name, sizeof(name), "%s: %u bits, layout", field->name, width);
+    check(layout_ok, name);
+    snprintf(name, sizeof(name), "%s: round trip, other bits kept", field->name);
+    check(values_ok, name);
+}
+
+
+// The format's fields don't overlap, and all written in either order read back
+static void test_format(const char* format, const FieldOps* fields, uint8_t count)
+{
+    RadioPacket used[ACK_PAYLOAD_SIZE];
+    bool disjoint = true;
+
+    memset(used, 0, sizeof(used));
+    for (uint8_t f = 0; f < count; f++)
+    {
+        RadioPacket mask[ACK_PAYLOAD_SIZE];
+
+        layout_mask(fields[f].layout, mask);
+        for (uint8_t i = 0; i < ACK_PAYLOAD_SIZE; i++)
+        {
+            disjoint = disjoint && !(used[i] & mask[i]);
+            used[i] |= mask[i];
+        }
+    }
+
+    bool values_ok = true;
+    for (uint32_t round = 0; round < RANDOM_VALUES; round++)
+    {
+        RadioPacket packet[ACK_PAYLOAD_SIZE];
+        uint32_t values[16];
+        bool reverse = round & 1;
+
+        memset(packet, 0, sizeof(packet));
+        for (uint8_t f = 0; f < count; f++)
+        {
+            RadioPacket mask[ACK_PAYLOAD_SIZE];
+
+            layout_mask(fields[f].layout, mask);
+            uint8_t width = mask_width(mask);
+            values[f] = random32() & (width >= 32 ? 0xFFFFFFFF : (uint32_t(1) << width) - 1);
+        }
+        for (uint8_t i = 0; i < count; i++)
+        {
+            uint8_t f = reverse ? count - 1 - i : i;
+            fields[f].put(packet, values[f]);
+        }
+        for (uint8_t f = 0; f < count; f++)
+            values_ok = values_ok && fields[f].get(packet) == values[f];
+    }
+
+    char name[80];
+    snprintf(name, sizeof(name), "Format %s: fields disjoint, read back", format);
+    check(disjoint && values_ok, name);
+}
+
+
+static void test_program_step()
+{
+    bool ok = true;
+
+    for (uint32_t round = 0; round < RANDOM_VALUES; round++)
+    {
+        RadioPacket packet[PACKET_SIZE];
+        ProgramStep step, decoded;
+        uint8_t index = uint8_t(random32());
+
+        step.green_power = uint16_t(random32() & 0xFFF);
+        step.blue_power = uint16_t(random32() & 0xFFF);
+        step.millis = random32();
+        step.sub_micros = uint16_t(random32() % 1000);
+        step.pause_millis = uint16_t(random32());
+
+        memset(packet, 0, sizeof(packet));
+        packet_encode_program_step(packet, index, &step);
+        ok = ok && packet_decode_program_step(packet, &decoded) == index &&
+            decoded.green_power == step.green_power && decoded.blue_power == step.blue_power &&
+            decoded.millis == step.millis && decoded.sub_micros == step.sub_micros &&
+            decoded.pause_millis == step.pause_millis;
+    }
+
+    check(ok, "packet_encode_program_step(), packet_decode_program_step()");
+}
+
+
+// Status replies, packed by hand from lamphouse_shared.h
+static void hand_encode_status(RadioPacket* packet, CommsMessage message, const ControllerExternalStatus* status)
+{
+    packet[0] = uint8_t((status->state << 6) | message);
+    packet[1] = uint8_t(status->channel_power[0] >> 4);
+    packet[2] = uint8_t(status->channel_power[1] >> 4);
+    packet[3] = uint8_t(status->channel_power[2] >> 4);
+    packet[4] = uint8_t(status->target_millis >> 24);
+    packet[5] = uint8_t(status->target_millis >> 16);
+    packet[6] = uint8_t(status->target_millis >> 8);
+    packet[7] = uint8_t(status->target_millis);
+    packet[8] = uint8_t(status->achieved_millis >> 24);
+    packet[9] = uint8_t(status->achieved_millis >> 16);
+    packet[10] = uint8_t(status->achieved_millis >> 8);
+    packet[11] = uint8_t(status->achieved_millis);
+    packet[12] = uint8_t(status->target_sub_micros >> 2);
+    packet[13] = uint8_t((status->target_sub_micros << 6) | (status->achieved_sub_micros >> 4));
+    packet[14] = uint8_t((status->achieved_sub_micros << 4) | (status->step_index & 0x0F));
+    packet[15] = uint8_t((status->channel_power[1] << 4) | (status->channel_power[2] & 0x0F));
+}
+
+
+static CommsMessage hand_decode_status(const RadioPacket* packet, ControllerExternalStatus* status)
+{
+    status->state = ControllerState(packet[0] >> 6);
+    status->channel_power[0] = uint16_t(packet[1]) << 4;
+    status->channel_power[1] = (uint16_t(packet[2]) << 4) | (packet[15] >> 4);
+    status->channel_power[2] = (uint16_t(packet[3]) << 4) | (packet[15] & 0x0F);
+    status->target_millis = (uint32_t(packet[4]) << 24) | (uint32_t(packet[5]) << 16) | (uint32_t(packet[6]) << 8) | packet[7];
+    status->achieved_millis = (uint32_t(packet[8]) << 24) | (uint32_t(packet[9]) << 16) | (uint32_t(packet[10]) << 8) | packet[11];
+    status->target_sub_micros = (uint16_t(packet[12]) << 2) | (packet[13] >> 6);
+    status->achieved_sub_micros = (uint16_t(packet[13] & 0x3F) << 4) | (packet[14] >> 4);
+    status->step_index = packet[14] & 0x0F;
+
+    return CommsMessage(packet[0] & 0x3F);
+}
+
+
+static void codec_encode_status(RadioPacket* packet, CommsMessage message, const ControllerExternalStatus* status)
+{
+    memset(packet, 0, PACKET_SIZE);
+    ReplyState::put(packet, status->state);
+    ReplyMessage::put(packet, message);
+    ReplyRedPower::put(packet, uint8_t(status->channel_power[0] >> 4));
+    ReplyGreenPower::put(packet, status->channel_power[1]);
+    ReplyBluePower::put(packet, status->channel_power[2]);
+    ReplyTargetMillis::put(packet, status->target_millis);
+    ReplyAchievedMillis::put(packet, status->achieved_millis);
+    ReplyTargetSubMicros::put(packet, status->target_sub_micros);
+    ReplyAchievedSubMicros::put(packet, status->achieved_sub_micros);
+    ReplyStepIndex::put(packet, status->step_index);
+}
+
+
+static void random_status(ControllerExternalStatus* status, CommsMessage* message)
+{
+    uint32_t bits = random32();
+
+    status->state = ControllerState(bits & 3);
+    *message = CommsMessage((bits >> 2) & 0x3F);
+    status->channel_power[0] = uint16_t(bits >> 4) & 0xFF0;
+    status->channel_power[1] = uint16_t(bits >> 16) & 0xFFF;
+    status->channel_power[2] = uint16_t(random32() & 0xFFF);
+    status->target_millis = random32();
+    status->achieved_millis = random32();
+    status->target_sub_micros = uint16_t(random32() % 1000);
+    status->achieved_sub_micros = uint16_t(random32() % 1000);
+    status->step_index = uint8_t(random32() & 0x0F);
+    status->latency_micros = 0;
+}
+
+
+static bool status_equal(const ControllerExternalStatus* a, const ControllerExternalStatus* b)
+{
+    return a->state == b->state && a->channel_power[0] == b->channel_power[0] &&
+        a->channel_power[1] == b->channel_power[1] && a->channel_power[2] == b->channel_power[2] &&
+        a->target_millis == b->target_millis && a->achieved_millis == b->achieved_millis &&
+        a->target_sub_micros == b->target_sub_micros && a->achieved_sub_micros == b->achieved_sub_micros &&
+        a->step_index == b->step_index;
+}
+
+
+// Each way encodes and decodes the same statuses, summing the result so
+// that none of it is optimised away
+typedef void (*StatusEncoder)(RadioPacket*, CommsMessage, const ControllerExternalStatus*);
+typedef CommsMessage (*StatusDecoder)(const RadioPacket*, ControllerExternalStatus*);
+
+template <StatusEncoder ENCODE, StatusDecoder DECODE>
+static double time_status(const ControllerExternalStatus* statuses, const CommsMessage* messages, uint32_t count,
+    uint32_t packets, uint32_t* sum)
+{
+    RadioPacket packet[PACKET_SIZE];
+    ControllerExternalStatus decoded;
+
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < packets; i++)
+    {
+        uint32_t n = i & (count - 1);
+
+        ENCODE(packet, messages[n], &statuses[n]);
+        *sum += DECODE(packet, &decoded);
+        *sum += decoded.target_millis + decoded.achieved_sub_micros + decoded.channel_power[2];
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    return std::chrono::duration<double, std::nano>(end - start).count() / packets;
+}
+
+
+static void benchmark(uint32_t packets)
+{
+    const static uint32_t STATUSES = 256;
+    static ControllerExternalStatus statuses[STATUSES];
+    static CommsMessage messages[STATUSES];
+
+    // Both ways agree, byte for byte and field for field
+    bool agree = true;
+    for (uint32_t i = 0; i < STATUSES; i++)
+    {
+        RadioPacket hand[PACKET_SIZE], codec[PACKET_SIZE];
+        ControllerExternalStatus hand_status, codec_status;
+
+        random_status(&statuses[i], &messages[i]);
+        hand_encode_status(hand, messages[i], &statuses[i]);
+        codec_encode_status(codec, messages[i], &statuses[i]);
+        agree = agree && memcmp(hand, codec, PACKET_SIZE) == 0;
+        agree = agree && hand_decode_status(hand, &hand_status) == messages[i] &&
+            packet_decode_status(codec, &codec_status) == messages[i] &&
+            status_equal(&hand_status, &statuses[i]) && status_equal(&codec_status, &statuses[i]);
+    }
+    check(agree, "Status reply: codec and hand-written shifts agree");
+
+    uint32_t hand_sum = 0, codec_sum = 0;
+    double hand_nanos = time_status<hand_encode_status, hand_decode_status>(statuses, messages, STATUSES, packets, &hand_sum);
+    double codec_nanos = time_status<codec_encode_status, packet_decode_status>(statuses, messages, STATUSES, packets, &codec_sum);
+
+    printf("Status reply encode and decode, %u packets: hand-written %.1f ns, codec %.1f ns per packet (%.2fx)\n",
+        unsigned(packets), hand_nanos, codec_nanos, codec_nanos / hand_nanos);
+    check(hand_sum == codec_sum, "Status reply: benchmark results agree");
+}
+
+
+int main(int argc, char** argv)
+{
+    uint32_t packets = argc > 1 ? uint32_t(strtoul(argv[1], 0, 0)) : DEFAULT_BENCHMARK_PACKETS;
+
+    for (uint8_t i = 0; i < sizeof(ALL_FIELDS) / sizeof(ALL_FIELDS[0]); i++)
+        test_field(&ALL_FIELDS[i]);
+
+    test_format("exposure command", FIELDS(EXPOSURE_COMMAND));
+    test_format("program step command", FIELDS(PROGRAM_STEP_COMMAND));
+    test_format("dose command", FIELDS(DOSE_COMMAND));
+    test_format("test strip command", FIELDS(TEST_STRIP_COMMAND));
+    test_format("status ACK payload", FIELDS(STATUS_ACK_PAYLOAD));
+    test_format("meter reply", FIELDS(METER_REPLY));
+    test_format("latency reply", FIELDS(LATENCY_REPLY));
+    test_program_step();
+
+    if (packets > 0)
+        benchmark(packets);
+
+    printf("%s\n", _failures ? "FAIL" : "PASS");
+    return _failures ? 1 : 0;
+}
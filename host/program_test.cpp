@@ -0,0 +1,231 @@
+/* Tests program uploads (upload_program() in interface/comms.cpp) over a
+ * lossy link, with both boards over the simulated link (see sim.h).  Each of
+ * UPLOADS_PER_SETTING uploads, at each of the LOSS_SETTINGS, sends a new
+ * program of PROGRAM_MAX_STEPS random steps, pipelined.  Replies are lost
+ * often enough that steps are resent after the rest of their pass, and the
+ * controller must answer those from its replay cache rather than upload the
+ * step again, which would discard the steps after it.  So whenever
+ * upload_program() returns MESSAGE_OK, the controller must hold exactly the
+ * program sent (see controller_program()).  An upload may still time out.
+ *
+ * Build, from the top of the repository:
+ *   g++ -std=gnu++11 -O2 -Ihost -Ilibraries/LamphouseShared \
+ *       host/sim.cpp host/sim_radio.cpp host/controller_board.cpp \
+ *       host/interface_board.cpp host/program_test.cpp \
+ *       libraries/LamphouseShared/lamphouse_shared.cpp -o program_test
+ * Exits 1 if any check fails.
+ */
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+#include "Arduino.h"
+#include "sim.h"
+#include "sim_boards.h"
+
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+
+
+namespace interface {
+#include "../interface/comms.h"
+}
+
+
+const static uint8_t CONTROLLER_PIN_RADIO_IRQ = 2;
+const static uint8_t INTERFACE_PIN_RADIO_IRQ = PC14;
+
+const static uint32_t SEED = 1;
+const static uint16_t UPLOADS_PER_SETTING = 300;
+
+// Far beyond what the uploads take
+const static SimNanos RUN_NANOS = 600 * 1000 * SIM_NANOS_PER_MILLI;
+const static SimNanos SLICE_NANOS = 100 * SIM_NANOS_PER_MILLI;
+
+// At the heaviest ACK loss, uploads may give up often, but not mostly
+const static uint8_t MIN_OK_PERCENT = 50;
+
+
+struct LossSetting
+{
+    double loss;
+    double ack_loss;
+};
+
+const static LossSetting LOSS_SETTINGS[] = {
+    { 0.2, 0.6 },
+    { 0.3, 0.3 },
+    { 0.1, 0.8 }
+};
+const static uint8_t LOSS_SETTING_COUNT = sizeof(LOSS_SETTINGS) / sizeof(LOSS_SETTINGS[0]);
+
+
+struct SettingResult
+{
+    uint16_t uploads;
+    uint16_t ok;
+    uint16_t mismatched;                // Returned MESSAGE_OK, but the controller holds another program
+    uint8_t shortest;                   // Program length held after one of those
+};
+
+
+static SettingResult _results[LOSS_SETTING_COUNT];
+static uint8_t _setting;
+static bool _done;
+static int _failures;
+
+
+static void script_setup();
+static void script_loop();
+static void upload();
+static void set_loss(uint8_t setting);
+static uint32_t random_between(uint32_t low, uint32_t high);
+static void check(bool ok, const char* name);
+
+
+int main()
+{
+    SimLinkConfig link;
+    SimBoardConfig controller_board, interface_board;
+
+    link.loss = 0;
+    link.ack_loss = 0;
+    link.duplicate = 0;
+    link.latency_nanos = 0;
+    link.jitter_nanos = 0;
+    link.auto_ack = true;
+    link.channel_busy = NULL;
+    sim_init(SEED, &link);
+
+    controller_board.setup = controller_setup;
+    controller_board.loop = controller_loop;
+    controller_board.loop_nanos = 20 * SIM_NANOS_PER_MICRO;
+    controller_board.call_nanos = 1000;
+    controller_board.spi_byte_nanos = 2500;
+    controller_board.radio_irq_pin = CONTROLLER_PIN_RADIO_IRQ;
+    controller_board.avr = true;
+    sim_add_board(SIM_BOARD_CONTROLLER, &controller_board);
+
+    interface_board.setup = script_setup;
+    interface_board.loop = script_loop;
+    interface_board.loop_nanos = 5 * SIM_NANOS_PER_MICRO;
+    interface_board.call_nanos = 200;
+    interface_board.spi_byte_nanos = 1000;
+    interface_board.radio_irq_pin = INTERFACE_PIN_RADIO_IRQ;
+    interface_board.avr = false;
+    sim_add_board(SIM_BOARD_INTERFACE, &interface_board);
+
+    while (!_done && sim_now() < RUN_NANOS)
+        sim_run_until(sim_now() + SLICE_NANOS);
+
+    check(_done, "All uploads finished");
+
+    for (uint8_t setting = 0; setting < LOSS_SETTING_COUNT; setting++)
+    {
+        const SettingResult& result = _results[setting];
+        char name[80];
+
+        snprintf(name, sizeof(name), "Loss %.1f, ACK loss %.1f: %u of %u ok, %u of those wrong", LOSS_SETTINGS[setting].loss,
+            LOSS_SETTINGS[setting].ack_loss, unsigned(result.ok), unsigned(result.uploads), unsigned(result.mismatched));
+        check(result.uploads == UPLOADS_PER_SETTING && result.mismatched == 0 &&
+            result.ok * 100 >= result.uploads * MIN_OK_PERCENT, name);
+        if (result.mismatched != 0)
+            printf("    Shortest program held after an ok upload: %u steps\n", unsigned(result.shortest));
+    }
+
+    printf("%s\n", _failures ? "FAIL" : "PASS");
+    return _failures ? 1 : 0;
+}
+
+
+static void script_setup()
+{
+    interface::initialise_radio();
+    set_loss(0);
+}
+
+
+// comms_poll(), as interface.ino, and an upload each pass until all are done
+static void script_loop()
+{
+    interface::comms_poll();
+
+    if (_done)
+        return;
+
+    if (_results[_setting].uploads == UPLOADS_PER_SETTING)
+    {
+        if (_setting + 1 == LOSS_SETTING_COUNT)
+        {
+            _done = true;
+            return;
+        }
+        set_loss(_setting + 1);
+    }
+
+    upload();
+}
+
+
+static void upload()
+{
+    SettingResult& result = _results[_setting];
+    ProgramStep steps[PROGRAM_MAX_STEPS];
+
+    for (uint8_t i = 0; i < PROGRAM_MAX_STEPS; i++)
+    {
+        steps[i].green_power = random_between(0, POWER_FULL);
+        steps[i].blue_power = random_between(0, POWER_FULL);
+        steps[i].millis = random_between(1, 100000);
+        steps[i].sub_micros = random_between(0, 999);
+        steps[i].pause_millis = random_between(0, 5000);
+    }
+
+    result.uploads++;
+    if (interface::upload_program(&steps[0], PROGRAM_MAX_STEPS) != MESSAGE_OK)
+        return;
+    result.ok++;
+
+    uint8_t length;
+    const ProgramStep* held = controller_program(&length);
+    bool same = length == PROGRAM_MAX_STEPS;
+
+    for (uint8_t i = 0; same && i < PROGRAM_MAX_STEPS; i++)
+    {
+        same = held[i].green_power == steps[i].green_power && held[i].blue_power == steps[i].blue_power &&
+            held[i].millis == steps[i].millis && held[i].sub_micros == steps[i].sub_micros &&
+            held[i].pause_millis == steps[i].pause_millis;
+    }
+
+    if (!same)
+    {
+        result.shortest = result.mismatched == 0 ? length : std::min(result.shortest, length);
+        result.mismatched++;
+    }
+}
+
+
+static void set_loss(uint8_t setting)
+{
+    SimLinkConfig link = *sim_link_config();
+
+    link.loss = LOSS_SETTINGS[setting].loss;
+    link.ack_loss = LOSS_SETTINGS[setting].ack_loss;
+    sim_set_link_config(&link);
+    _setting = setting;
+}
+
+
+static uint32_t random_between(uint32_t low, uint32_t high)
+{
+    return low + uint32_t(sim_random() * (high - low + 1));
+}
+
+
+static void check(bool ok, const char* name)
+{
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+        _failures++;
+}
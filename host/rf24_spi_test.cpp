@@ -0,0 +1,398 @@
+/* Tests the interface's radio driver (interface/RF24_STM32.cpp) on its SPI
+ * bus, without the simulator: the driver is built twice, with RF24_DMA_BURST
+ * as on the Maple Mini and byte-wise as with RF24_NO_DMA_BURST, both with
+ * SPI_CYCLE_COUNT, and run against a register-level mock of the nRF24L01+.
+ * Each build runs begin() and one exchange as comms.cpp makes it (a command
+ * and a fetch, each with an ACK payload).  The two builds must put the same
+ * bytes on the bus, and RF24::spiCycles must count all of each transaction.
+ *
+ * The cycle counter is the mock's, so the cycles are a model of the STM32F1
+ * at 72 MHz with the bus at 18 MHz (SPI_CLOCK_DIV4), from the costs below,
+ * not a measurement; the calls and bytes counted are the driver's own.  On
+ * the board, query_link() reports the DWT's count (see RF24_config_STM32.h).
+ *
+ * Build, from the top of the repository:
+ *   g++ -std=gnu++11 -O2 -Ihost -Iinterface -Ilibraries/LamphouseShared \
+ *       host/rf24_spi_test.cpp -o rf24_spi_test
+ * Exits 1 if any check fails.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "Arduino.h"
+#include "SPI.h"
+
+#include <lamphouse_shared.h>
+
+
+// Modelled costs, in CPU cycles
+const static uint32_t CPU_HZ = 72000000;
+const static uint32_t CYCLES_PER_BYTE = 32;             // 8 bits at 18 MHz
+const static uint32_t CYCLES_PER_TRANSFER = 20;         // transfer()'s call and status polling
+const static uint32_t CYCLES_PER_DMA_SETUP = 200;       // dmaTransfer() setting up both channels and waiting
+const static uint32_t CYCLES_PER_SETUP_CALL = 30;       // setBitOrder(), setDataMode(), setClockDivider()
+const static uint32_t CYCLES_PER_PIN_WRITE = 25;
+const static uint32_t CYCLES_PER_DELAY_CALL = 10;
+
+const static uint8_t PIN_CE = PA3;
+const static uint8_t PIN_CSN = PA4;
+
+
+// The cycle counter and the debug registers enabling it, for the driver
+static uint32_t _cycles;
+static uint32_t _demcr;
+static uint32_t _dwt_ctrl;
+
+#define RF24_DEMCR _demcr
+#define RF24_DWT_CTRL _dwt_ctrl
+#define RF24_DWT_CYCCNT _cycles
+
+#undef __linux
+#define __arm__
+#define __STM32F1__
+#define SPI_CYCLE_COUNT
+
+// The driver's config defines these its own way
+#undef _BV
+#undef pgm_read_byte
+#undef pgm_read_word
+#undef PSTR
+
+namespace burst {
+#include "../interface/RF24_STM32.cpp"
+}
+
+#undef __RF24_H__
+#undef __RF24_CONFIG_H__
+#undef RF24_DMA_BURST
+#undef _BV
+#undef pgm_read_byte
+#undef pgm_read_word
+#undef PSTR
+#define RF24_NO_DMA_BURST
+
+namespace bytewise {
+#include "../interface/RF24_STM32.cpp"
+}
+
+
+// What one build did on the bus
+struct SpiCounts
+{
+    uint32_t transactions;
+    uint32_t bytes;
+    uint32_t transfers;                 // transfer() calls
+    uint32_t dma_transfers;
+    uint32_t long_transactions;         // Over two bytes: payloads and addresses
+    uint32_t setup_calls;
+    uint32_t spi_cycles;                // From CSN low to CSN high, edges included
+};
+
+typedef std::vector<std::vector<uint8_t> > SpiTrace;
+
+
+// The mock radio
+static uint8_t _registers[32][5];
+static uint8_t _status_flags;           // RX_DR, TX_DS and MAX_RT
+static uint8_t _rx_payloads;            // ACK payloads waiting
+static bool _csn_low;
+static bool _last_write_csn;            // So a delay straight after is the CSN's settling
+static std::vector<uint8_t> _transaction;
+
+static SpiCounts _counts;
+static SpiTrace _trace;
+
+
+static void spend(uint32_t cycles, bool spi);
+static uint8_t radio_shift(uint8_t mosi);
+static void radio_end_transaction();
+template <typename Radio> static void run_begin(Radio& radio);
+template <typename Radio> static void run_exchange(Radio& radio, uint32_t* harness_cycles);
+template <typename Radio> static void read_ack_payload(Radio& radio);
+static void print_row(const char* name, uint32_t bytewise_value, uint32_t burst_value);
+static void check(bool ok, const char* name);
+
+
+static int _failures;
+
+
+int main()
+{
+    burst::RF24 burst_radio(PIN_CE, PIN_CSN);
+    bytewise::RF24 bytewise_radio(PIN_CE, PIN_CSN);
+    SpiTrace burst_trace, bytewise_trace;
+    SpiCounts burst_counts, bytewise_counts;
+    uint32_t burst_harness, bytewise_harness;
+
+    run_begin(bytewise_radio);
+    bytewise_trace = _trace;
+    run_exchange(bytewise_radio, &bytewise_harness);
+    bytewise_counts = _counts;
+    bytewise_trace.insert(bytewise_trace.end(), _trace.begin(), _trace.end());
+
+    run_begin(burst_radio);
+    burst_trace = _trace;
+    run_exchange(burst_radio, &burst_harness);
+    burst_counts = _counts;
+    burst_trace.insert(burst_trace.end(), _trace.begin(), _trace.end());
+
+    printf("One exchange, modelled at 72 MHz:    byte-wise      burst\n");
+    print_row("SPI transactions", bytewise_counts.transactions, burst_counts.transactions);
+    print_row("Bytes", bytewise_counts.bytes, burst_counts.bytes);
+    print_row("transfer() calls", bytewise_counts.transfers, burst_counts.transfers);
+    print_row("DMA transfers", bytewise_counts.dma_transfers, burst_counts.dma_transfers);
+    print_row("SPI set-up calls", bytewise_counts.setup_calls, burst_counts.setup_calls);
+    print_row("RF24::spiCycles", bytewise_harness, burst_harness);
+    print_row("Microseconds", bytewise_harness / (CPU_HZ / 1000000), burst_harness / (CPU_HZ / 1000000));
+
+    check(burst_trace == bytewise_trace, "Both builds send the same SPI traffic");
+    check(_demcr & (1UL << 24) && _dwt_ctrl & 1, "begin() enables the cycle counter");
+    check(bytewise_harness == bytewise_counts.spi_cycles, "Byte-wise: spiCycles counts all of each transaction");
+    check(burst_harness == burst_counts.spi_cycles, "Burst: spiCycles counts all of each transaction");
+    check(burst_counts.setup_calls == 0, "Burst: no SPI set-up calls in an exchange");
+    check(burst_counts.dma_transfers == burst_counts.long_transactions,
+        "Burst: each transaction over two bytes is one DMA transfer");
+    check(burst_harness < bytewise_harness, "Burst: fewer SPI cycles than byte-wise");
+
+    printf("%s\n", _failures ? "FAIL" : "PASS");
+    return _failures ? 1 : 0;
+}
+
+
+// As initialise_radio() in comms.cpp
+template <typename Radio> static void run_begin(Radio& radio)
+{
+    memset(_registers, 0, sizeof(_registers));
+    _status_flags = 0;
+    _rx_payloads = 0;
+    _trace.clear();
+
+    radio.begin();
+    radio.csDelay = 0;
+    radio.setAddressWidth(5);
+    radio.enableAckPayload();
+    radio.openWritingPipe(0xF0F0F0F0E1LL);
+    radio.openReadingPipe(1, 0xF0F0F0F0D2LL);
+    radio.flush_rx();
+    radio.startListening();
+}
+
+
+// As exchange_begin() to exchange_finish() in comms.cpp, where the command's
+// ACK carries a stale reply and the fetch's the reply
+template <typename Radio> static void run_exchange(Radio& radio, uint32_t* harness_cycles)
+{
+    RadioPacket packet[PACKET_SIZE];
+    uint8_t pipe;
+    bool tx_ok, tx_fail, rx_ready;
+
+    memset(&_counts, 0, sizeof(_counts));
+    memset(&packet[0], 0x5A, sizeof(packet));
+    _trace.clear();
+
+    radio.spiCycles = 0;
+    radio.stopListening();
+    while (radio.available(&pipe))
+        ;
+
+    for (uint8_t write = 0; write < 2; write++)
+    {
+        radio.startFastWrite(&packet[0], PACKET_SIZE, false);
+        _rx_payloads = 1;
+        radio.whatHappened(tx_ok, tx_fail, rx_ready);
+        radio.observeTx();
+        read_ack_payload(radio);
+    }
+
+    radio.startListening();
+    *harness_cycles = radio.spiCycles;
+}
+
+
+// As read_ack_payload() in comms.cpp
+template <typename Radio> static void read_ack_payload(Radio& radio)
+{
+    RadioPacket reply[32];
+
+    while (radio.isAckPayloadAvailable())
+    {
+        uint8_t size = radio.getDynamicPayloadSize();
+        if (size != 0)
+            radio.read(&reply[0], size);
+    }
+}
+
+
+static void print_row(const char* name, uint32_t bytewise_value, uint32_t burst_value)
+{
+    printf("  %-34s %9u %10u\n", name, unsigned(bytewise_value), unsigned(burst_value));
+}
+
+
+static void check(bool ok, const char* name)
+{
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+        _failures++;
+}
+
+
+static void spend(uint32_t cycles, bool spi)
+{
+    _cycles += cycles;
+    if (spi)
+        _counts.spi_cycles += cycles;
+}
+
+
+// The byte on MISO for mosi, the transaction's next byte.  The first is
+// STATUS, with the pipe of the first RX payload or, with none, RX_P_NO 7.
+static uint8_t radio_shift(uint8_t mosi)
+{
+    uint8_t index = _transaction.size();
+    uint8_t command = index == 0 ? mosi : _transaction[0];
+    uint8_t miso = 0;
+
+    _transaction.push_back(mosi);
+    _counts.bytes++;
+
+    if (index == 0)
+        return _status_flags | (_rx_payloads ? 0 : 0x07 << RX_P_NO);
+
+    if (command < W_REGISTER && (command & REGISTER_MASK) == FIFO_STATUS)
+        miso = _BV(TX_EMPTY) | (_rx_payloads ? 0 : _BV(RX_EMPTY));
+    else if (command < W_REGISTER && (command & REGISTER_MASK) == NRF_STATUS)
+        miso = _status_flags;
+    else if (command < W_REGISTER && index <= 5)
+        miso = _registers[command & REGISTER_MASK][index - 1];
+    else if (command < W_REGISTER + 0x20 && (command & REGISTER_MASK) == NRF_STATUS)
+        _status_flags &= ~mosi;
+    else if (command < W_REGISTER + 0x20 && index <= 5)
+        _registers[command & REGISTER_MASK][index - 1] = mosi;
+    else if (command == R_RX_PL_WID)
+        miso = ACK_PAYLOAD_SIZE;
+    else if (command == R_RX_PAYLOAD)
+        miso = index;
+
+    return miso;
+}
+
+
+static void radio_end_transaction()
+{
+    uint8_t command = _transaction.empty() ? RF24_NOP : _transaction[0];
+
+    if (command == R_RX_PAYLOAD && _rx_payloads > 0)
+    {
+        _rx_payloads--;
+        _status_flags |= _BV(RX_DR);
+    }
+    else if (command == W_TX_PAYLOAD)
+        _status_flags |= _BV(TX_DS);
+
+    if (_transaction.size() > 2)
+        _counts.long_transactions++;
+    _counts.transactions++;
+    _trace.push_back(_transaction);
+    _transaction.clear();
+}
+
+
+// Shims, for the driver
+
+SPIClass SPI;
+
+
+void SPIClass::setBitOrder(uint8_t)
+{
+    _counts.setup_calls++;
+    spend(CYCLES_PER_SETUP_CALL, true);
+}
+
+
+void SPIClass::setDataMode(uint8_t)
+{
+    _counts.setup_calls++;
+    spend(CYCLES_PER_SETUP_CALL, true);
+}
+
+
+void SPIClass::setClockDivider(uint8_t divider)
+{
+    this->divider = divider;
+    _counts.setup_calls++;
+    spend(CYCLES_PER_SETUP_CALL, true);
+}
+
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+    _counts.transfers++;
+    spend(CYCLES_PER_TRANSFER + CYCLES_PER_BYTE, true);
+    return radio_shift(data);
+}
+
+
+uint8_t SPIClass::dmaTransfer(const void* transmit, void* receive, uint16_t length)
+{
+    const uint8_t* out = static_cast<const uint8_t*>(transmit);
+    uint8_t* in = static_cast<uint8_t*>(receive);
+
+    _counts.dma_transfers++;
+    spend(CYCLES_PER_DMA_SETUP + CYCLES_PER_BYTE * length, true);
+    for (uint16_t i = 0; i < length; i++)
+        in[i] = radio_shift(out[i]);
+    return 0;
+}
+
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    _last_write_csn = pin == PIN_CSN;
+    if (pin == PIN_CSN && _csn_low && value == HIGH)
+    {
+        spend(CYCLES_PER_PIN_WRITE, true);
+        radio_end_transaction();
+        _csn_low = false;
+    }
+    else if (pin == PIN_CSN && !_csn_low && value == LOW)
+    {
+        spend(CYCLES_PER_PIN_WRITE, true);
+        _csn_low = true;
+    }
+    else
+        spend(CYCLES_PER_PIN_WRITE, _csn_low);
+}
+
+
+void delayMicroseconds(uint32_t us)
+{
+    spend(CYCLES_PER_DELAY_CALL + us * (CPU_HZ / 1000000), _csn_low || _last_write_csn);
+    _last_write_csn = false;
+}
+
+
+void delay(uint32_t ms)
+{
+    spend(ms * (CPU_HZ / 1000), _csn_low);
+}
+
+
+void pinMode(uint8_t, uint8_t)
+{
+}
+
+
+uint32_t millis()
+{
+    return _cycles / (CPU_HZ / 1000);
+}
+
+
+uint32_t micros()
+{
+    return _cycles / (CPU_HZ / 1000000);
+}
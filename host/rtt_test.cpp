@@ -0,0 +1,297 @@
+/* Tests the round trip time estimator (interface/rtt.cpp) on the host, with
+ * synthetic latency traces:
+ *   - Steady: the median and 99th percentile are the RTT, and the timeout
+ *     settles to the RTT plus the estimator's residual deviation, or
+ *     RTT_MIN_TIMEOUT_MICROS.
+ *   - Step change: the timeout follows a jump in RTT within a few samples,
+ *     and the percentiles move over as the window of samples fills.
+ *   - Outliers: the median ignores occasional slow exchanges, the 99th
+ *     percentile shows them while they are in the window, and the timeout
+ *     jumps at each and recovers before the next.
+ * Throughout, the timeout is checked against the same estimator in floating
+ * point, and the percentiles against a sort of the last RTT_SAMPLE_COUNT
+ * samples.  Backoff, the timeout limits and the radio retry counts are also
+ * checked.
+ *
+ * Build, from the top of the repository:
+ *   g++ -std=gnu++11 -O2 -Ihost host/rtt_test.cpp -o rtt_test
+ * Exits 1 if any check fails.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "../interface/rtt.cpp"
+
+
+// The integer estimator's truncation, against floating point
+const static double TIMEOUT_TOLERANCE_MICROS = 8;
+
+
+// rtt.h's estimator in floating point, and the samples it was given
+struct ReferenceRtt
+{
+    double srtt;
+    double rttvar;
+    std::vector<uint32_t> samples;
+};
+
+
+static int _failures;
+
+
+static void check(bool ok, const char* name)
+{
+    printf("%-60s %s\n", name, ok ? "ok" : "FAILED");
+    if (!ok)
+        _failures++;
+}
+
+
+static void reference_sample(ReferenceRtt* reference, uint32_t rtt_micros)
+{
+    double rtt = std::min(rtt_micros, RTT_MAX_TIMEOUT_MICROS);
+
+    if (reference->samples.empty())
+    {
+        reference->srtt = rtt;
+        reference->rttvar = rtt / 2;
+    }
+    else
+    {
+        double error = rtt - reference->srtt;
+
+        reference->srtt += error / 8;
+        reference->rttvar += (fabs(error) - reference->rttvar) / 4;
+    }
+    reference->samples.push_back(uint32_t(rtt));
+}
+
+
+static double reference_timeout(const ReferenceRtt* reference)
+{
+    double timeout = reference->srtt + 4 * reference->rttvar;
+
+    return std::min(std::max(timeout, double(RTT_MIN_TIMEOUT_MICROS)), double(RTT_MAX_TIMEOUT_MICROS));
+}
+
+
+// Nearest rank, of the last RTT_SAMPLE_COUNT samples
+static uint32_t reference_percentile(const ReferenceRtt* reference, uint8_t percent)
+{
+    size_t count = std::min(reference->samples.size(), size_t(RTT_SAMPLE_COUNT));
+    std::vector<uint32_t> window(reference->samples.end() - count, reference->samples.end());
+
+    std::sort(window.begin(), window.end());
+    size_t rank = std::max(size_t(1), (percent * count + 99) / 100);
+
+    return window[rank - 1];
+}
+
+
+struct TraceResult
+{
+    double worst_timeout_error;         // Against the reference
+    bool percentiles_match;
+    std::vector<uint32_t> timeouts;     // After each sample
+    std::vector<uint32_t> medians;
+    std::vector<uint32_t> p99s;
+};
+
+
+static void run_trace(const std::vector<uint32_t>& trace, TraceResult* result)
+{
+    ReferenceRtt reference;
+
+    rtt_init();
+    result->worst_timeout_error = 0;
+    result->percentiles_match = true;
+    result->timeouts.clear();
+    result->medians.clear();
+    result->p99s.clear();
+
+    for (size_t i = 0; i < trace.size(); i++)
+    {
+        rtt_sample(trace[i]);
+        reference_sample(&reference, trace[i]);
+
+        uint32_t timeout = rtt_timeout_micros();
+        uint32_t median = rtt_percentile_micros(50);
+        uint32_t p99 = rtt_percentile_micros(99);
+
+        result->worst_timeout_error = std::max(result->worst_timeout_error, fabs(timeout - reference_timeout(&reference)));
+        result->percentiles_match = result->percentiles_match && median == reference_percentile(&reference, 50) &&
+            p99 == reference_percentile(&reference, 99) && rtt_sample_count() == std::min(i + 1, size_t(RTT_SAMPLE_COUNT));
+        result->timeouts.push_back(timeout);
+        result->medians.push_back(median);
+        result->p99s.push_back(p99);
+    }
+}
+
+
+static void check_reference(const TraceResult* result, const char* trace)
+{
+    char name[80];
+
+    snprintf(name, sizeof(name), "%s: timeout within %.0f us of reference (%.1f)", trace, TIMEOUT_TOLERANCE_MICROS,
+        result->worst_timeout_error);
+    check(result->worst_timeout_error <= TIMEOUT_TOLERANCE_MICROS, name);
+    snprintf(name, sizeof(name), "%s: median and p99 of the window", trace);
+    check(result->percentiles_match, name);
+}
+
+
+static void test_steady()
+{
+    TraceResult result;
+    char name[80];
+
+    for (uint32_t rtt : { 1500u, 5000u, 25000u })
+    {
+        std::vector<uint32_t> trace(200, rtt);
+
+        run_trace(trace, &result);
+        snprintf(name, sizeof(name), "Steady %u us", unsigned(rtt));
+        check_reference(&result, name);
+
+        // The deviation decays to the integer estimator's floor of a few us
+        uint32_t settled = std::max(rtt, RTT_MIN_TIMEOUT_MICROS);
+        snprintf(name, sizeof(name), "Steady %u us: median %u, p99 %u, timeout %u", unsigned(rtt),
+            unsigned(result.medians.back()), unsigned(result.p99s.back()), unsigned(result.timeouts.back()));
+        check(result.medians.back() == rtt && result.p99s.back() == rtt &&
+            result.timeouts.back() >= settled && result.timeouts.back() <= settled + 4, name);
+    }
+}
+
+
+static void test_step()
+{
+    const static uint32_t BEFORE = 2000;
+    const static uint32_t AFTER = 6000;
+    const static size_t STEP = 100;
+    TraceResult result;
+    char name[80];
+
+    std::vector<uint32_t> trace(STEP, BEFORE);
+    trace.resize(STEP + 200, AFTER);
+    run_trace(trace, &result);
+    check_reference(&result, "Step up");
+
+    // Samples after the step until the timeout covers the new RTT
+    size_t behind = 0;
+    while (result.timeouts[STEP + behind] < AFTER)
+        behind++;
+    snprintf(name, sizeof(name), "Step up: timeout covers it by sample %u after", unsigned(behind + 1));
+    check(behind < 3, name);
+
+    // Half the window each side: the median is still the lower, p99 the higher
+    check(result.medians[STEP + RTT_SAMPLE_COUNT / 2 - 1] == BEFORE && result.p99s[STEP] == AFTER &&
+        result.medians[STEP + RTT_SAMPLE_COUNT / 2] == AFTER && result.p99s.back() == AFTER &&
+        result.medians.back() == AFTER, "Step up: median moves at half the window, p99 at once");
+
+    // Back down: the timeout comes down with the estimate, and p99 only as
+    // the higher samples leave the window
+    std::vector<uint32_t> down(STEP, AFTER);
+    down.resize(STEP + 200, BEFORE);
+    run_trace(down, &result);
+    check_reference(&result, "Step down");
+    check(result.p99s[STEP + RTT_SAMPLE_COUNT - 2] == AFTER && result.p99s[STEP + RTT_SAMPLE_COUNT - 1] == BEFORE &&
+        result.timeouts.back() <= BEFORE + 4, "Step down: p99 after a full window, timeout settles");
+}
+
+
+static void test_outliers()
+{
+    const static uint32_t BASE = 1500;
+    const static uint32_t OUTLIER = 30000;
+    const static size_t EVERY = 50;
+    TraceResult result;
+    char name[80];
+
+    std::vector<uint32_t> trace;
+    for (size_t i = 0; i < 400; i++)
+        trace.push_back(i % EVERY == EVERY - 1 ? OUTLIER : BASE);
+    run_trace(trace, &result);
+    check_reference(&result, "Outliers");
+
+    bool medians_ok = true;
+    for (size_t i = 0; i < trace.size(); i++)
+        medians_ok = medians_ok && result.medians[i] == BASE;
+    check(medians_ok, "Outliers: median stays at the base RTT");
+
+    // The window always holds one outlier once it's full, so that's p99
+    check(result.p99s.back() == OUTLIER, "Outliers: p99 shows them");
+
+    // The timeout jumps most of the way to an outlier, and is back within
+    // twice the minimum before the next
+    size_t last = trace.size() - 1;
+    uint32_t at_outlier = result.timeouts[last - EVERY + 1];
+    uint32_t before_next = result.timeouts[last - 1];
+    snprintf(name, sizeof(name), "Outliers: timeout %u us at one, %u us before the next", unsigned(at_outlier),
+        unsigned(before_next));
+    check(at_outlier >= OUTLIER * 3 / 4 && before_next <= 2 * RTT_MIN_TIMEOUT_MICROS, name);
+}
+
+
+static void test_backoff_and_limits()
+{
+    rtt_init();
+    bool initial = rtt_timeout_micros() == RTT_INITIAL_TIMEOUT_MICROS && rtt_percentile_micros(50) == 0 &&
+        rtt_sample_count() == 0;
+    check(initial, "No samples: initial timeout, no percentiles");
+
+    for (uint8_t i = 0; i < 50; i++)
+        rtt_sample(3000);
+    uint32_t settled = rtt_timeout_micros();
+
+    rtt_backoff();
+    uint32_t once = rtt_timeout_micros();
+    rtt_backoff();
+    uint32_t twice = rtt_timeout_micros();
+    for (uint8_t i = 0; i < 20; i++)
+        rtt_backoff();
+    uint32_t limit = rtt_timeout_micros();
+    rtt_sample(3000);
+    uint32_t after = rtt_timeout_micros();
+
+    check(once == 2 * settled && twice == 4 * settled && limit == RTT_MAX_TIMEOUT_MICROS && after <= settled + 4,
+        "Backoff doubles to the maximum, and a sample resets it");
+
+    rtt_init();
+    rtt_sample(1000000);
+    check(rtt_percentile_micros(50) == RTT_MAX_TIMEOUT_MICROS && rtt_timeout_micros() == RTT_MAX_TIMEOUT_MICROS,
+        "A sample beyond the maximum is held to it");
+
+    // ARD 500 us (delay 1): the retries span the timeout, within limits
+    uint8_t count;
+    rtt_init();
+    for (uint8_t i = 0; i < 50; i++)
+        rtt_sample(3000);
+    rtt_radio_retries(1, &count);
+    bool retries_ok = count == (rtt_timeout_micros() + 499) / 500;
+    rtt_init();
+    for (uint8_t i = 0; i < 50; i++)
+        rtt_sample(100);
+    rtt_radio_retries(15, &count);
+    retries_ok = retries_ok && count == RTT_MIN_RADIO_RETRIES;
+    rtt_init();
+    rtt_sample(40000);
+    rtt_radio_retries(0, &count);
+    retries_ok = retries_ok && count == RTT_MAX_RADIO_RETRIES;
+    check(retries_ok, "Radio retries span the timeout, within limits");
+}
+
+
+int main()
+{
+    test_steady();
+    test_step();
+    test_outliers();
+    test_backoff_and_limits();
+
+    printf("%s\n", _failures ? "FAIL" : "PASS");
+    return _failures ? 1 : 0;
+}
@@ -0,0 +1,637 @@
+#include <ucontext.h>
+
+#include <queue>
+#include <vector>
+
+#include "Arduino.h"
+#include "SPI.h"
+#include "sim.h"
+
+
+const static size_t SIM_STACK_BYTES = 1 << 20;
+
+// Each SPI transaction's chip select and set-up, besides its bytes
+const static SimNanos SIM_SPI_TRANSACTION_NANOS = 1000;
+
+// An ATmega ADC conversion
+const static SimNanos SIM_ANALOG_READ_NANOS = 104 * SIM_NANOS_PER_MICRO;
+
+// The Maple Mini's SPI bus clocks, before the divider: APB2 for bus 1, APB1 for bus 2
+const static uint32_t SIM_SPI_BUS_KHZ[SIM_SPI_BUSES] = { 72000, 36000 };
+
+
+struct SimEvent
+{
+    SimNanos at;
+    uint64_t order;                     // Events at the same time run in the order scheduled
+    std::function<void()> run;
+};
+
+
+struct SimEventLater
+{
+    bool operator()(const SimEvent& a, const SimEvent& b) const
+    {
+        return a.at != b.at ? a.at > b.at : a.order > b.order;
+    }
+};
+
+
+struct SimBoardState
+{
+    SimBoardConfig config;
+    bool present;
+    ucontext_t context;
+    char* stack;
+    SimNanos time;                      // When it next runs: the end of the time it's spending
+    bool interrupts_enabled;
+    uint8_t eimsk;
+    bool pending[SIM_IRQ_COUNT];
+    void (*handlers[SIM_IRQ_COUNT])();
+    bool radio_irq_low;
+    SimSpiDevice spi_devices[SIM_SPI_BUSES];
+    bool spi_attached[SIM_SPI_BUSES];
+    bool spi_selected[SIM_SPI_BUSES];
+};
+
+
+static SimBoardState _boards[SIM_BOARD_COUNT];
+static int _current = -1;               // The board running, or -1 for the scheduler
+static ucontext_t _scheduler;
+static SimNanos _now = 0;
+static SimNanos _run_end = 0;
+static std::priority_queue<SimEvent, std::vector<SimEvent>, SimEventLater> _events;
+static uint64_t _event_order = 0;
+static uint64_t _random_state;
+
+static SimLinkConfig _link;
+static SimLinkStats _link_stats;
+
+static SimLightObserver _light_observer = NULL;
+static uint16_t _light[3] = { 0, 0, 0 };
+
+SimSerial Serial;
+SPIClass SPI;
+
+
+static void board_main();
+static void take_interrupts(SimBoardState* b);
+static bool interrupt_deliverable(const SimBoardState* b, int irq);
+static bool runs_next(const SimBoardState* b);
+
+
+void sim_init(uint32_t seed, const SimLinkConfig* link)
+{
+    _random_state = 0x9E3779B97F4A7C15ull ^ seed;
+    _link = *link;
+    memset(&_link_stats, 0, sizeof(_link_stats));
+}
+
+
+void sim_add_board(uint8_t board, const SimBoardConfig* config)
+{
+    SimBoardState* b = &_boards[board];
+
+    b->config = *config;
+    b->present = true;
+    b->stack = new char[SIM_STACK_BYTES];
+    b->time = 0;
+    b->interrupts_enabled = true;
+    b->eimsk = _BV(INT0);
+    b->radio_irq_low = false;
+    for (uint8_t i = 0; i < SIM_IRQ_COUNT; i++)
+    {
+        b->pending[i] = false;
+        b->handlers[i] = NULL;
+    }
+    for (uint8_t i = 0; i < SIM_SPI_BUSES; i++)
+    {
+        b->spi_attached[i] = false;
+        b->spi_selected[i] = false;
+    }
+
+    getcontext(&b->context);
+    b->context.uc_stack.ss_sp = b->stack;
+    b->context.uc_stack.ss_size = SIM_STACK_BYTES;
+    b->context.uc_link = NULL;
+    makecontext(&b->context, board_main, 0);
+}
+
+
+/* Runs the boards and events in time order until end.  Events at the same
+ * time as a board run first.
+ */
+void sim_run_until(SimNanos end)
+{
+    _run_end = end;
+
+    for (;;)
+    {
+        int next_board = -1;
+
+        for (uint8_t i = 0; i < SIM_BOARD_COUNT; i++)
+        {
+            if (_boards[i].present && (next_board < 0 || _boards[i].time < _boards[next_board].time))
+                next_board = i;
+        }
+
+        SimNanos board_at = next_board < 0 ? UINT64_MAX : _boards[next_board].time;
+        SimNanos event_at = _events.empty() ? UINT64_MAX : _events.top().at;
+
+        if (board_at > end && event_at > end)
+        {
+            _now = end;
+            return;
+        }
+
+        if (event_at <= board_at)
+        {
+            SimEvent event = _events.top();
+            _events.pop();
+            _now = event.at;
+            event.run();
+        }
+        else
+        {
+            _now = board_at;
+            _current = next_board;
+            swapcontext(&_scheduler, &_boards[next_board].context);
+            _current = -1;
+        }
+    }
+}
+
+
+SimNanos sim_now()
+{
+    return _now;
+}
+
+
+// Uniform in [0, 1), from xorshift64*
+double sim_random()
+{
+    _random_state ^= _random_state >> 12;
+    _random_state ^= _random_state << 25;
+    _random_state ^= _random_state >> 27;
+
+    return double((_random_state * 0x2545F4914F6CDD1Dull) >> 11) / double(1ull << 53);
+}
+
+
+uint8_t sim_board()
+{
+    return uint8_t(_current);
+}
+
+
+const SimBoardConfig* sim_board_config()
+{
+    return &_boards[_current].config;
+}
+
+
+/* The current board spends nanos, while everything else runs.  An interrupt
+ * cuts in, and its handler's time doesn't count towards nanos.  If nothing
+ * else is due first, the board carries on without a switch to the scheduler,
+ * as there's nothing for it to run: the byte at a time SPI devices spend
+ * time in small steps.
+ */
+void sim_spend(SimNanos nanos)
+{
+    if (_current < 0)
+        return;
+
+    SimBoardState* b = &_boards[_current];
+    SimNanos remaining = nanos;
+
+    for (;;)
+    {
+        SimNanos start = _now;
+
+        b->time = _now + remaining;
+        if (runs_next(b))
+            _now = b->time;
+        else
+            swapcontext(&b->context, &_scheduler);
+        remaining -= _now - start;
+
+        take_interrupts(b);
+        if (remaining == 0)
+            return;
+    }
+}
+
+
+void sim_spend_spi(uint8_t transactions, uint8_t bytes)
+{
+    if (_current >= 0)
+        sim_spend(transactions * SIM_SPI_TRANSACTION_NANOS + bytes * _boards[_current].config.spi_byte_nanos);
+}
+
+
+void sim_schedule(SimNanos at, const std::function<void()>& event)
+{
+    SimEvent e;
+
+    e.at = at < _now ? _now : at;
+    e.order = _event_order++;
+    e.run = event;
+    _events.push(e);
+}
+
+
+void sim_attach_irq(uint8_t board, SimIrq irq, void (*handler)())
+{
+    _boards[board].handlers[irq] = handler;
+}
+
+
+// Takes effect at once if the board can take it, even if it's spending time
+void sim_raise_irq(uint8_t board, SimIrq irq)
+{
+    SimBoardState* b = &_boards[board];
+
+    if (b->handlers[irq] == NULL)
+        return;
+
+    b->pending[irq] = true;
+    if (board != _current && b->interrupts_enabled && interrupt_deliverable(b, irq) && b->time > _now)
+        b->time = _now;
+}
+
+
+void sim_clear_irq(uint8_t board, SimIrq irq)
+{
+    _boards[board].pending[irq] = false;
+}
+
+
+bool sim_irq_pending(uint8_t board, SimIrq irq)
+{
+    return _boards[board].pending[irq];
+}
+
+
+// Returns whether interrupts were enabled, for sim_unlock()
+bool sim_lock()
+{
+    bool enabled = _boards[_current].interrupts_enabled;
+
+    _boards[_current].interrupts_enabled = false;
+    return enabled;
+}
+
+
+void sim_unlock(bool enabled)
+{
+    _boards[_current].interrupts_enabled = enabled;
+    if (enabled)
+        take_interrupts(&_boards[_current]);
+}
+
+
+uint8_t& sim_eimsk()
+{
+    return _boards[_current].eimsk;
+}
+
+
+// The radio's IRQ pin, which interrupts on falling
+void sim_radio_irq(uint8_t board, bool low)
+{
+    SimBoardState* b = &_boards[board];
+
+    if (low && !b->radio_irq_low)
+        sim_raise_irq(board, SIM_IRQ_PIN);
+    b->radio_irq_low = low;
+}
+
+
+void sim_attach_spi(uint8_t board, uint8_t bus, const SimSpiDevice* device)
+{
+    SimBoardState* b = &_boards[board];
+
+    b->spi_devices[bus - 1] = *device;
+    b->spi_attached[bus - 1] = true;
+    b->spi_selected[bus - 1] = false;
+}
+
+
+void sim_set_light_observer(SimLightObserver observer)
+{
+    _light_observer = observer;
+}
+
+
+void sim_light(uint16_t red, uint16_t green, uint16_t blue)
+{
+    _light[0] = red;
+    _light[1] = green;
+    _light[2] = blue;
+
+    if (_light_observer != NULL)
+        _light_observer(_now, red, green, blue);
+}
+
+
+void sim_current_light(uint16_t* red, uint16_t* green, uint16_t* blue)
+{
+    *red = _light[0];
+    *green = _light[1];
+    *blue = _light[2];
+}
+
+
+const SimLinkConfig* sim_link_config()
+{
+    return &_link;
+}
+
+
+// From the next transmission on, for a link that changes during a run
+void sim_set_link_config(const SimLinkConfig* link)
+{
+    _link = *link;
+}
+
+
+SimLinkStats* sim_link_stats()
+{
+    return &_link_stats;
+}
+
+
+static void board_main()
+{
+    SimBoardState* b = &_boards[_current];
+
+    b->config.setup();
+    for (;;)
+    {
+        b->config.loop();
+        sim_spend(b->config.loop_nanos);
+    }
+}
+
+
+// Whether the scheduler would run b again next, at its time, within this run
+static bool runs_next(const SimBoardState* b)
+{
+    if (b->time > _run_end || (!_events.empty() && _events.top().at <= b->time))
+        return false;
+
+    for (uint8_t i = 0; i < SIM_BOARD_COUNT; i++)
+    {
+        if (&_boards[i] != b && _boards[i].present && _boards[i].time <= b->time)
+            return false;
+    }
+
+    return true;
+}
+
+
+// As the MCU would on returning from whatever it was doing
+static void take_interrupts(SimBoardState* b)
+{
+    while (b->interrupts_enabled)
+    {
+        int irq = 0;
+
+        while (irq < SIM_IRQ_COUNT && !interrupt_deliverable(b, irq))
+            irq++;
+        if (irq == SIM_IRQ_COUNT)
+            return;
+
+        b->pending[irq] = false;
+        b->interrupts_enabled = false;
+        b->handlers[irq]();
+        b->interrupts_enabled = true;
+    }
+}
+
+
+static bool interrupt_deliverable(const SimBoardState* b, int irq)
+{
+    return b->pending[irq] && b->handlers[irq] != NULL && (irq != SIM_IRQ_PIN || (b->eimsk & _BV(INT0)));
+}
+
+
+// Arduino
+
+static void spend_call()
+{
+    if (_current >= 0)
+        sim_spend(_boards[_current].config.call_nanos);
+}
+
+
+uint32_t millis()
+{
+    spend_call();
+    return uint32_t(_now / SIM_NANOS_PER_MILLI);
+}
+
+
+uint32_t micros()
+{
+    spend_call();
+    return uint32_t(_now / SIM_NANOS_PER_MICRO);
+}
+
+
+void delay(uint32_t ms)
+{
+    sim_spend(ms * SIM_NANOS_PER_MILLI);
+}
+
+
+void delayMicroseconds(uint32_t us)
+{
+    sim_spend(us * SIM_NANOS_PER_MICRO);
+}
+
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    spend_call();
+}
+
+
+// Selects or deselects any SPI device with its chip select on pin
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    spend_call();
+
+    if (_current < 0)
+        return;
+
+    SimBoardState* b = &_boards[_current];
+
+    for (uint8_t i = 0; i < SIM_SPI_BUSES; i++)
+    {
+        if (b->spi_attached[i] && b->spi_devices[i].cs_pin == pin && b->spi_selected[i] != (value == LOW))
+        {
+            b->spi_selected[i] = value == LOW;
+            b->spi_devices[i].select(b->spi_selected[i]);
+        }
+    }
+}
+
+
+int digitalRead(uint8_t pin)
+{
+    spend_call();
+
+    if (_current >= 0 && pin == _boards[_current].config.radio_irq_pin)
+        return _boards[_current].radio_irq_low ? LOW : HIGH;
+    return LOW;
+}
+
+
+// The controller's channels are written through its exposure hooks instead
+void analogWrite(uint8_t pin, int value)
+{
+    spend_call();
+}
+
+
+int analogRead(uint8_t pin)
+{
+    sim_spend(SIM_ANALOG_READ_NANOS);
+    return 0;
+}
+
+
+// Only the radio's IRQ pin, falling, is wired
+void attachInterrupt(uint8_t pin, void (*handler)(), int mode)
+{
+    spend_call();
+
+    if (_current >= 0 && pin == _boards[_current].config.radio_irq_pin && mode == FALLING)
+        sim_attach_irq(_current, SIM_IRQ_PIN, handler);
+}
+
+
+void detachInterrupt(uint8_t pin)
+{
+    if (_current >= 0 && pin == _boards[_current].config.radio_irq_pin)
+        sim_attach_irq(_current, SIM_IRQ_PIN, NULL);
+}
+
+
+void interrupts()
+{
+    if (_current >= 0)
+        sim_unlock(true);
+}
+
+
+void noInterrupts()
+{
+    if (_current >= 0)
+        sim_lock();
+}
+
+
+void SPIClass::setBitOrder(uint8_t)
+{
+}
+
+
+void SPIClass::setDataMode(uint8_t)
+{
+}
+
+
+void SPIClass::setClockDivider(uint8_t divider)
+{
+    this->divider = divider;
+}
+
+
+// The byte's time, then the device, if it's selected, takes it and answers
+uint8_t SPIClass::transfer(uint8_t data)
+{
+    if (_current < 0)
+        return 0xFF;
+
+    SimBoardState* b = &_boards[_current];
+    uint8_t i = bus - 1;
+
+    sim_spend(b->config.call_nanos + 8 * (2u << divider) * SIM_NANOS_PER_MILLI / SIM_SPI_BUS_KHZ[i]);
+
+    if (!b->spi_attached[i] || !b->spi_selected[i])
+        return 0xFF;
+    return b->spi_devices[i].transfer(data);
+}
+
+
+// As transfer(), but one call for all the bytes, back to back
+uint8_t SPIClass::dmaTransfer(const void* transmit, void* receive, uint16_t length)
+{
+    const uint8_t* mosi = (const uint8_t*)transmit;
+    uint8_t* miso = (uint8_t*)receive;
+
+    if (_current < 0)
+        return 0;
+
+    SimBoardState* b = &_boards[_current];
+    uint8_t i = bus - 1;
+
+    sim_spend(b->config.call_nanos + length * 8 * (2u << divider) * SIM_NANOS_PER_MILLI / SIM_SPI_BUS_KHZ[i]);
+
+    for (uint16_t j = 0; j < length; j++)
+        miso[j] = b->spi_attached[i] && b->spi_selected[i] ? b->spi_devices[i].transfer(mosi[j]) : 0xFF;
+
+    return 0;
+}
+
+
+void SimSerial::print(const char* s)
+{
+    fputs(s, stdout);
+}
+
+
+void SimSerial::print(char c)
+{
+    fputc(c, stdout);
+}
+
+
+void SimSerial::print(long value, int base)
+{
+    if (base == DEC)
+        printf("%ld", value);
+    else
+        print((unsigned long)value, base);
+}
+
+
+void SimSerial::print(unsigned long value, int base)
+{
+    if (base == HEX)
+        printf("%lX", value);
+    else if (base == BIN)
+    {
+        char digits[33];
+        int i = 32;
+
+        digits[i] = '\0';
+        do
+        {
+            digits[--i] = '0' + (value & 1);
+            value >>= 1;
+        } while (value != 0);
+        fputs(&digits[i], stdout);
+    }
+    else
+        printf("%lu", value);
+}
+
+
+void SimSerial::print(double value, int digits)
+{
+    printf("%.*f", digits, value);
+}
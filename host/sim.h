@@ -0,0 +1,161 @@
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdint.h>
+
+#include <functional>
+
+/* Host simulator.
+ *
+ * Runs the controller and interface sketches together in one Linux process,
+ * talking over a simulated radio link, so that protocol timing can be
+ * measured without two boards on a bench.  The sketches build unchanged
+ * against the shims in this directory: Arduino.h and SPI.h, RF24.h (a
+ * simulated radio, standing in for both the Arduino RF24 library and the
+ * interface's RF24_STM32), and the controller's exposure and meter hardware
+ * hooks (see exposure.h and meter.h).  lamphouse_sim.cpp replaces the
+ * interface's touch screen and display with a script; tft_sim.cpp runs the
+ * whole interface sketch, its display on an emulated FT81x (see ft81x.h).
+ *
+ * Time is virtual, in nanoseconds, and the simulation is deterministic for a
+ * given seed and SimLinkConfig.  Each board runs as a coroutine with its own
+ * clock, which is advanced only by sim_spend(): every shim call spends the
+ * time it would take on the board, and a board's loop() spends
+ * SimBoardConfig.loop_nanos each pass on top.  The scheduler always runs whichever board or event is
+ * earliest, so the two boards run side by side in virtual time.
+ *
+ * Each board has interrupt sources (SimIrq), which are raised by the
+ * simulated hardware and taken by the board as its MCU would: at once,
+ * cutting into any time it's spending, unless its interrupts are disabled
+ * (noInterrupts(), exposure_hw_lock()) or, for the radio pin, masked by
+ * EIMSK.
+ *
+ * Build, from the top of the repository:
+ *   g++ -std=gnu++11 -O2 -Ihost -Ilibraries/LamphouseShared \
+ *       host/sim.cpp host/sim_radio.cpp host/controller_board.cpp \
+ *       host/interface_board.cpp host/lamphouse_sim.cpp \
+ *       libraries/LamphouseShared/lamphouse_shared.cpp -o lamphouse_sim
+ * and run, for example:
+ *   ./lamphouse_sim --loss 0.1 --jitter-us 200 --max-latency-ms 20 --max-error-us 50
+ * (--help lists the options).  For tft_sim, build interface_display.cpp,
+ * interface_ft8.cpp, ft81x.cpp and tft_sim.cpp in place of lamphouse_sim.cpp.
+ * exposure_test.cpp, packet_test.cpp and rtt_test.cpp test the exposure
+ * engine and meter, the packet codec and the round trip estimator without
+ * the simulator, and each build on their own.  link_test.cpp tests the
+ * interface's link monitor and channel survey with both boards, building in
+ * place of lamphouse_sim.cpp, and changes the link's loss and busy channels
+ * as it runs (sim_set_link_config()).  program_test.cpp likewise uploads
+ * programs over a lossy link, and checks what the controller holds.
+ * rf24_spi_test.cpp builds the interface's radio driver itself, without the
+ * simulator, against a mock nRF24L01+ on the SPI bus.
+ */
+
+
+typedef uint64_t SimNanos;
+
+const static SimNanos SIM_NANOS_PER_MICRO = 1000;
+const static SimNanos SIM_NANOS_PER_MILLI = 1000000;
+
+const static uint8_t SIM_BOARD_CONTROLLER = 0;
+const static uint8_t SIM_BOARD_INTERFACE = 1;
+const static uint8_t SIM_BOARD_COUNT = 2;
+
+const static uint8_t SIM_SPI_BUSES = 2;     // SPIClass buses 1 and 2
+const static uint8_t SIM_RADIO_CHANNELS = 126;
+
+
+// Highest priority first, as the ATmega's vectors
+enum SimIrq {
+    SIM_IRQ_PIN,                        // The radio's IRQ pin, falling
+    SIM_IRQ_TIMER_COMPARE,
+    SIM_IRQ_TIMER_PERIOD,
+    SIM_IRQ_ADC,
+    SIM_IRQ_COUNT
+};
+
+
+struct SimBoardConfig
+{
+    void (*setup)();
+    void (*loop)();
+    SimNanos loop_nanos;                // Each pass of loop(), besides its calls
+    SimNanos call_nanos;                // Each millis(), micros(), digitalRead() and so on
+    SimNanos spi_byte_nanos;            // Each byte to or from the radio
+    uint8_t radio_irq_pin;
+    bool avr;                           // The Arduino RF24 library's timings, rather than RF24_STM32's
+};
+
+
+// A device on one of a board's SPI buses, other than the radio, which is
+// simulated above the bus (see RF24.h).  SPIClass::transfer() on the bus
+// reaches it while digitalWrite() holds its chip select pin low.
+struct SimSpiDevice
+{
+    uint8_t cs_pin;
+    void (*select)(bool selected);
+    uint8_t (*transfer)(uint8_t mosi);  // Full duplex: a byte each way
+};
+
+
+// The radio link between the boards
+struct SimLinkConfig
+{
+    double loss;                        // Probability that a packet isn't received
+    double ack_loss;                    // That its ACK isn't
+    double duplicate;                   // That a packet received is received twice
+    SimNanos latency_nanos;             // Added each way, to the airtime
+    SimNanos jitter_nanos;              // Up to this added at random, each way
+    bool auto_ack;                      // Otherwise no ACKs are sent, so every write fails
+    const double* channel_busy;         // SIM_RADIO_CHANNELS of them, that testRPD() finds a signal; NULL for none
+};
+
+
+struct SimLinkStats
+{
+    uint32_t transmissions;             // Including retransmits
+    uint32_t received;
+    uint32_t lost;
+    uint32_t acks_lost;
+    uint32_t duplicates;
+    uint32_t rx_full;                   // Dropped, and not ACKed, as the receiver's FIFO was full
+    uint32_t late_acks;                 // Came after the sender had stopped waiting (ARD too short)
+    uint32_t max_retries;               // MAX_RT
+};
+
+
+void sim_init(uint32_t seed, const SimLinkConfig* link);
+void sim_add_board(uint8_t board, const SimBoardConfig* config);
+void sim_run_until(SimNanos end);
+SimNanos sim_now();
+double sim_random();
+
+// For the current board
+uint8_t sim_board();
+const SimBoardConfig* sim_board_config();
+void sim_spend(SimNanos nanos);
+void sim_spend_spi(uint8_t transactions, uint8_t bytes);
+
+// Hardware
+void sim_schedule(SimNanos at, const std::function<void()>& event);
+void sim_attach_irq(uint8_t board, SimIrq irq, void (*handler)());
+void sim_raise_irq(uint8_t board, SimIrq irq);
+void sim_clear_irq(uint8_t board, SimIrq irq);
+bool sim_irq_pending(uint8_t board, SimIrq irq);
+bool sim_lock();
+void sim_unlock(bool enabled);
+uint8_t& sim_eimsk();
+void sim_radio_irq(uint8_t board, bool low);
+void sim_attach_spi(uint8_t board, uint8_t bus, const SimSpiDevice* device);
+void sim_radio_settings(uint8_t board, uint8_t* channel, uint8_t* data_rate, uint8_t* pa_level);
+
+// The controller's outputs, as written through its hardware hooks
+typedef void (*SimLightObserver)(SimNanos at, uint16_t red, uint16_t green, uint16_t blue);
+void sim_set_light_observer(SimLightObserver observer);
+void sim_light(uint16_t red, uint16_t green, uint16_t blue);
+void sim_current_light(uint16_t* red, uint16_t* green, uint16_t* blue);
+
+const SimLinkConfig* sim_link_config();
+void sim_set_link_config(const SimLinkConfig* link);
+SimLinkStats* sim_link_stats();
+
+#endif
@@ -0,0 +1,21 @@
+#ifndef _SIM_BOARDS_H
+#define _SIM_BOARDS_H
+
+#include <stdint.h>
+
+/* The sketches' entry points, as built for the host: the controller's (see
+ * controller_board.cpp), and the interface's with its display emulated (see
+ * interface_display.cpp).  lamphouse_sim.cpp has its own interface loop in
+ * their place, which scripts the touch screen above the display code.
+ * controller_program() lets a test check the program the controller holds.
+ */
+
+struct ProgramStep;
+
+void controller_setup();
+void controller_loop();
+const ProgramStep* controller_program(uint8_t* length);
+void interface_setup();
+void interface_loop();
+
+#endif
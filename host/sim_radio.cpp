@@ -0,0 +1,826 @@
+#include <deque>
+
+#include "Arduino.h"
+#include "RF24.h"
+#include "sim.h"
+
+/* The simulated nRF24L01+ (see RF24.h).
+ *
+ * A write is modelled from the sender's side as a series of attempts, each
+ * an event.  An attempt decides whether the packet reaches the other radio,
+ * and if it does, the receiver decides on arrival whether to ACK it, and
+ * when the ACK would get back.  Exactly one outcome event follows each
+ * attempt: the ACK, or the sender giving up waiting for it at the end of ARD.
+ * Anything that abandons a write (flush_tx(), powerDown()) bumps the radio's
+ * generation, which the events carry, so that those still to come are
+ * ignored.
+ */
+
+
+const static uint8_t SIM_RADIO_FIFO_LENGTH = 3;
+const static uint8_t SIM_RADIO_MAX_PAYLOAD = 32;
+const static uint8_t SIM_RADIO_PIPES = 6;
+
+// TX and RX settling, from standby
+const static SimNanos SIM_RADIO_SETTLE_NANOS = 130 * SIM_NANOS_PER_MICRO;
+
+// The received power detector, after RX settling: 170 us from entering
+// receive mode in all
+const static SimNanos SIM_RADIO_RPD_NANOS = 40 * SIM_NANOS_PER_MICRO;
+
+// Crystal start-up, from power down, as RF24::powerUp() waits
+const static uint32_t SIM_RADIO_POWER_UP_MILLIS = 5;
+
+// Packet overhead, in bits: preamble, packet control field and 16-bit CRC
+const static uint16_t SIM_RADIO_OVERHEAD_BITS = 8 + 9 + 16;
+
+// The status register as returned by flush_tx() and so on
+const static uint8_t SIM_RADIO_STATUS_RX_DR = 0x40;
+const static uint8_t SIM_RADIO_STATUS_TX_DS = 0x20;
+const static uint8_t SIM_RADIO_STATUS_MAX_RT = 0x10;
+const static uint8_t SIM_RADIO_STATUS_TX_FULL = 0x01;
+
+
+struct SimPacket
+{
+    uint8_t data[SIM_RADIO_MAX_PAYLOAD];
+    uint8_t size;
+    uint8_t pipe;                       // Received on
+    uint8_t pid;                        // Packet ID, for duplicate detection
+};
+
+
+struct SimRadio
+{
+    int8_t board;                       // Set by begin()
+    bool powered;
+    bool prim_rx;
+    bool ce;
+    SimNanos rx_ready_at;               // RX settling finishes
+    uint8_t channel;
+    rf24_datarate_e data_rate;
+    uint8_t pa_level;
+    uint8_t address_width;
+    uint8_t retry_delay;                // ARD, as RF24::setRetries()
+    uint8_t retry_count;                // ARC
+    uint8_t tx_address[5];
+    uint8_t rx_address[SIM_RADIO_PIPES][5];
+    bool pipe_enabled[SIM_RADIO_PIPES];
+    bool ack_payloads;
+    bool tx_ds, max_rt, rx_dr;
+    bool mask_tx_ds, mask_max_rt, mask_rx_dr;
+
+    // As PTX, the packets to send; as PRX, the ACK payloads
+    std::deque<SimPacket> tx_fifo;
+    std::deque<SimPacket> rx_fifo;
+
+    // PTX
+    bool sending;                       // Attempts are under way for the packet at the front of tx_fifo
+    uint32_t generation;
+    uint8_t next_pid;
+    uint8_t arc_cnt;
+    uint8_t plos_cnt;
+
+    // PRX: the last packet received on each pipe, and whether the ACK
+    // payload at the front of tx_fifo has been sent with its ACK
+    SimPacket last_received[SIM_RADIO_PIPES];
+    bool have_received[SIM_RADIO_PIPES];
+    bool ack_payload_sent;
+};
+
+
+static SimRadio* _radios[SIM_BOARD_COUNT];
+
+
+static SimNanos airtime_nanos(const SimRadio* radio, uint8_t size);
+static SimNanos link_delay_nanos();
+static void update_irq(SimRadio* radio);
+static void start_sending(SimRadio* radio);
+static void attempt(SimRadio* radio, uint32_t generation);
+static void arrive(SimRadio* receiver, SimRadio* sender, uint32_t generation, SimPacket packet, SimNanos deadline);
+static void acked(SimRadio* radio, uint32_t generation, bool has_payload, SimPacket payload);
+static void not_acked(SimRadio* radio, uint32_t generation, SimNanos next_attempt);
+static bool tx_fifo_full(const SimRadio* radio);
+
+
+RF24::RF24(uint16_t ce_pin, uint16_t csn_pin) : txDelay(85), csDelay(5)
+{
+    sim = new SimRadio();
+    sim->board = -1;
+}
+
+
+// Each transaction spends csDelay, as the drivers' csn() does
+void RF24::spi(uint8_t transactions, uint8_t bytes)
+{
+    sim_spend_spi(transactions, bytes);
+    sim_spend(uint64_t(transactions) * csDelay * SIM_NANOS_PER_MICRO);
+}
+
+
+bool RF24::begin(void)
+{
+    SimRadio* r = sim;
+
+    r->board = sim_board();
+    _radios[r->board] = r;
+
+    r->powered = false;
+    r->prim_rx = false;
+    r->ce = false;
+    r->rx_ready_at = 0;
+    r->channel = 76;
+    r->data_rate = RF24_1MBPS;
+    r->pa_level = RF24_PA_MAX;
+    r->address_width = 5;
+    r->retry_delay = 5;
+    r->retry_count = 15;
+    memset(r->tx_address, 0, sizeof(r->tx_address));
+    memset(r->rx_address, 0, sizeof(r->rx_address));
+    for (uint8_t i = 0; i < SIM_RADIO_PIPES; i++)
+    {
+        r->pipe_enabled[i] = i < 2;
+        r->have_received[i] = false;
+    }
+    r->ack_payloads = false;
+    r->tx_ds = r->max_rt = r->rx_dr = false;
+    r->mask_tx_ds = r->mask_max_rt = r->mask_rx_dr = false;
+    r->tx_fifo.clear();
+    r->rx_fifo.clear();
+    r->sending = false;
+    r->generation++;
+    r->next_pid = 0;
+    r->arc_cnt = 0;
+    r->plos_cnt = 0;
+    r->ack_payload_sent = false;
+
+    txDelay = sim_board_config()->avr ? 85 : 250;
+    delay(5);
+    spi(16, 40);
+    update_irq(r);
+
+    return true;
+}
+
+
+void RF24::startListening(void)
+{
+    powerUp();
+    sim->prim_rx = true;
+    sim->rx_dr = sim->tx_ds = sim->max_rt = false;
+    sim->ce = true;
+    sim->rx_ready_at = sim_now() + SIM_RADIO_SETTLE_NANOS;
+    spi(3, 6);
+
+    if (sim->ack_payloads)
+        flush_tx();
+    update_irq(sim);
+}
+
+
+void RF24::stopListening(void)
+{
+    sim->ce = false;
+    delayMicroseconds(txDelay);
+
+    if (sim->ack_payloads)
+    {
+        delayMicroseconds(txDelay);
+        flush_tx();
+    }
+
+    sim->prim_rx = false;
+    sim->pipe_enabled[0] = true;
+    spi(2, 4);
+}
+
+
+bool RF24::available(void)
+{
+    return available(NULL);
+}
+
+
+bool RF24::available(uint8_t* pipe_num)
+{
+    spi(pipe_num != NULL ? 2 : 1, pipe_num != NULL ? 3 : 2);
+
+    if (sim->rx_fifo.empty())
+        return false;
+
+    if (pipe_num != NULL)
+        *pipe_num = sim->rx_fifo.front().pipe;
+    return true;
+}
+
+
+// Clears all three flags, as both drivers do
+void RF24::read(void* buf, uint8_t len)
+{
+    spi(2, len + 3);
+
+    if (!sim->rx_fifo.empty())
+    {
+        const SimPacket& packet = sim->rx_fifo.front();
+        memset(buf, 0, len);
+        memcpy(buf, packet.data, len < packet.size ? len : packet.size);
+        sim->rx_fifo.pop_front();
+    }
+
+    sim->rx_dr = sim->tx_ds = sim->max_rt = false;
+    update_irq(sim);
+    start_sending(sim);
+}
+
+
+bool RF24::write(const void* buf, uint8_t len)
+{
+    return write(buf, len, false);
+}
+
+
+bool RF24::write(const void* buf, uint8_t len, const bool multicast)
+{
+    startFastWrite(buf, len, multicast);
+
+    for (;;)
+    {
+        spi(1, 1);
+        if (sim->tx_ds || sim->max_rt)
+            break;
+    }
+
+    sim->ce = false;
+    bool failed = sim->max_rt;
+    sim->rx_dr = sim->tx_ds = sim->max_rt = false;
+    spi(1, 2);
+    update_irq(sim);
+
+    if (failed)
+    {
+        flush_tx();
+        return false;
+    }
+
+    return true;
+}
+
+
+bool RF24::writeFast(const void* buf, uint8_t len)
+{
+    return writeFast(buf, len, false);
+}
+
+
+bool RF24::writeFast(const void* buf, uint8_t len, const bool multicast)
+{
+    for (;;)
+    {
+        spi(1, 1);
+        if (!tx_fifo_full(sim))
+            break;
+
+        if (sim->max_rt)
+        {
+            sim->max_rt = false;
+            spi(1, 2);
+            update_irq(sim);
+            start_sending(sim);
+            return false;
+        }
+    }
+
+    startFastWrite(buf, len, multicast);
+    return true;
+}
+
+
+// Multicast (no ACK) isn't simulated; the sketches don't use it
+void RF24::startFastWrite(const void* buf, uint8_t len, const bool multicast, bool startTx)
+{
+    SimPacket packet;
+
+    spi(1, len + 1);
+
+    if (!tx_fifo_full(sim))
+    {
+        memset(packet.data, 0, sizeof(packet.data));
+        memcpy(packet.data, buf, len);
+        packet.size = len;
+        packet.pipe = 0;
+        packet.pid = 0;
+        sim->tx_fifo.push_back(packet);
+    }
+
+    if (startTx)
+        sim->ce = true;
+    start_sending(sim);
+}
+
+
+bool RF24::txStandBy()
+{
+    for (;;)
+    {
+        spi(1, 2);
+        if (sim->tx_fifo.empty())
+            break;
+
+        spi(1, 1);
+        if (sim->max_rt)
+        {
+            sim->max_rt = false;
+            spi(1, 2);
+            update_irq(sim);
+            sim->ce = false;
+            flush_tx();
+            return false;
+        }
+    }
+
+    sim->ce = false;
+    return true;
+}
+
+
+bool RF24::txFifoEmpty()
+{
+    spi(1, 2);
+    return sim->tx_fifo.empty();
+}
+
+
+void RF24::writeAckPayload(uint8_t pipe, const void* buf, uint8_t len)
+{
+    SimPacket packet;
+
+    spi(1, len + 1);
+
+    if (tx_fifo_full(sim))
+        return;
+
+    memset(packet.data, 0, sizeof(packet.data));
+    memcpy(packet.data, buf, len);
+    packet.size = len;
+    packet.pipe = pipe;
+    packet.pid = 0;
+    sim->tx_fifo.push_back(packet);
+}
+
+
+bool RF24::isAckPayloadAvailable(void)
+{
+    spi(1, 2);
+    return !sim->rx_fifo.empty();
+}
+
+
+uint8_t RF24::getDynamicPayloadSize(void)
+{
+    spi(1, 2);
+    return sim->rx_fifo.empty() ? 0 : sim->rx_fifo.front().size;
+}
+
+
+void RF24::whatHappened(bool& tx_ok, bool& tx_fail, bool& rx_ready)
+{
+    spi(1, 2);
+
+    tx_ok = sim->tx_ds;
+    tx_fail = sim->max_rt;
+    rx_ready = sim->rx_dr;
+
+    sim->rx_dr = sim->tx_ds = sim->max_rt = false;
+    update_irq(sim);
+    start_sending(sim);
+}
+
+
+void RF24::maskIRQ(bool tx_ok, bool tx_fail, bool rx_ready)
+{
+    spi(1, 2);
+
+    sim->mask_tx_ds = tx_ok;
+    sim->mask_max_rt = tx_fail;
+    sim->mask_rx_dr = rx_ready;
+    update_irq(sim);
+}
+
+
+void RF24::openWritingPipe(const uint8_t* address)
+{
+    spi(3, 8 + 2 * sim->address_width);
+
+    memcpy(sim->tx_address, address, 5);
+    memcpy(sim->rx_address[0], address, 5);
+}
+
+
+void RF24::openReadingPipe(uint8_t number, const uint8_t* address)
+{
+    if (number >= SIM_RADIO_PIPES)
+        return;
+
+    spi(2, 3 + sim->address_width);
+
+    memcpy(sim->rx_address[number], address, 5);
+    sim->pipe_enabled[number] = true;
+}
+
+
+void RF24::closeReadingPipe(uint8_t pipe)
+{
+    if (pipe >= SIM_RADIO_PIPES)
+        return;
+
+    spi(1, 2);
+    sim->pipe_enabled[pipe] = false;
+}
+
+
+void RF24::setAddressWidth(uint8_t a_width)
+{
+    spi(1, 2);
+    if (a_width >= 3 && a_width <= 5)
+        sim->address_width = a_width;
+}
+
+
+void RF24::setRetries(uint8_t delay, uint8_t count)
+{
+    spi(1, 2);
+    sim->retry_delay = delay & 0x0F;
+    sim->retry_count = count & 0x0F;
+}
+
+
+// Also clears PLOS_CNT, as writing RF_CH does
+void RF24::setChannel(uint8_t channel)
+{
+    spi(1, 2);
+    sim->channel = channel >= SIM_RADIO_CHANNELS ? SIM_RADIO_CHANNELS - 1 : channel;
+    sim->plos_cnt = 0;
+}
+
+
+uint8_t RF24::getChannel(void)
+{
+    spi(1, 2);
+    return sim->channel;
+}
+
+
+void RF24::setPALevel(uint8_t level)
+{
+    spi(1, 2);
+    sim->pa_level = level > RF24_PA_MAX ? RF24_PA_MAX : level;
+}
+
+
+uint8_t RF24::getPALevel(void)
+{
+    return sim->pa_level;
+}
+
+
+// txDelay as the drivers set it, for the board's MCU
+bool RF24::setDataRate(rf24_datarate_e speed)
+{
+    const static uint32_t AVR_TX_DELAYS[] = { 85, 65, 155 };
+    const static uint32_t ARM_TX_DELAYS[] = { 250, 190, 450 };
+
+    spi(2, 4);
+    sim->data_rate = speed;
+    txDelay = sim_board_config()->avr ? AVR_TX_DELAYS[speed] : ARM_TX_DELAYS[speed];
+
+    return true;
+}
+
+
+rf24_datarate_e RF24::getDataRate(void)
+{
+    return sim->data_rate;
+}
+
+
+void RF24::enableAckPayload(void)
+{
+    spi(3, 6);
+    sim->ack_payloads = true;
+    sim->pipe_enabled[0] = true;
+}
+
+
+void RF24::enableDynamicPayloads(void)
+{
+    spi(2, 4);
+}
+
+
+void RF24::powerDown(void)
+{
+    spi(1, 2);
+    sim->ce = false;
+    sim->powered = false;
+    sim->sending = false;
+    sim->generation++;
+}
+
+
+void RF24::powerUp(void)
+{
+    if (sim->powered)
+        return;
+
+    spi(1, 2);
+    sim->powered = true;
+    delay(SIM_RADIO_POWER_UP_MILLIS);
+}
+
+
+uint8_t RF24::flush_tx(void)
+{
+    spi(1, 1);
+
+    uint8_t status = (sim->rx_dr ? SIM_RADIO_STATUS_RX_DR : 0) | (sim->tx_ds ? SIM_RADIO_STATUS_TX_DS : 0) |
+        (sim->max_rt ? SIM_RADIO_STATUS_MAX_RT : 0) | (tx_fifo_full(sim) ? SIM_RADIO_STATUS_TX_FULL : 0);
+
+    sim->tx_fifo.clear();
+    sim->sending = false;
+    sim->generation++;
+    sim->ack_payload_sent = false;
+
+    return status;
+}
+
+
+uint8_t RF24::flush_rx(void)
+{
+    spi(1, 1);
+
+    uint8_t status = (sim->rx_dr ? SIM_RADIO_STATUS_RX_DR : 0) | (sim->tx_ds ? SIM_RADIO_STATUS_TX_DS : 0) |
+        (sim->max_rt ? SIM_RADIO_STATUS_MAX_RT : 0);
+
+    sim->rx_fifo.clear();
+
+    return status;
+}
+
+
+bool RF24::testRPD(void)
+{
+    const double* busy = sim_link_config()->channel_busy;
+
+    spi(1, 2);
+    if (busy == NULL || !sim->prim_rx || !sim->ce || sim_now() < sim->rx_ready_at + SIM_RADIO_RPD_NANOS)
+        return false;
+
+    return sim_random() < busy[sim->channel];
+}
+
+
+uint8_t RF24::observeTx(void)
+{
+    spi(1, 2);
+    return (sim->plos_cnt << 4) | sim->arc_cnt;
+}
+
+
+// A board's radio as last set, for checking that the two ends agree
+void sim_radio_settings(uint8_t board, uint8_t* channel, uint8_t* data_rate, uint8_t* pa_level)
+{
+    const SimRadio* radio = _radios[board];
+
+    *channel = radio->channel;
+    *data_rate = radio->data_rate;
+    *pa_level = radio->pa_level;
+}
+
+
+static SimNanos airtime_nanos(const SimRadio* radio, uint8_t size)
+{
+    const static SimNanos BIT_NANOS[] = { 1000, 500, 4000 };
+
+    return (SIM_RADIO_OVERHEAD_BITS + 8 * (radio->address_width + size)) * BIT_NANOS[radio->data_rate];
+}
+
+
+// One way, besides the airtime
+static SimNanos link_delay_nanos()
+{
+    const SimLinkConfig* link = sim_link_config();
+
+    return link->latency_nanos + SimNanos(sim_random() * link->jitter_nanos);
+}
+
+
+static void update_irq(SimRadio* radio)
+{
+    if (radio->board < 0)
+        return;
+
+    sim_radio_irq(radio->board, (radio->tx_ds && !radio->mask_tx_ds) || (radio->max_rt && !radio->mask_max_rt) ||
+        (radio->rx_dr && !radio->mask_rx_dr));
+}
+
+
+// The packet at the front of the TX FIFO goes once CE is high in TX mode, and
+// MAX_RT is clear.
+static void start_sending(SimRadio* radio)
+{
+    if (radio->sending || !radio->powered || radio->prim_rx || !radio->ce || radio->max_rt || radio->tx_fifo.empty())
+        return;
+
+    radio->sending = true;
+    radio->arc_cnt = 0;
+    radio->tx_fifo.front().pid = radio->next_pid;
+    radio->next_pid = (radio->next_pid + 1) & 0x03;
+
+    uint32_t generation = radio->generation;
+    sim_schedule(sim_now() + SIM_RADIO_SETTLE_NANOS, [radio, generation]() { attempt(radio, generation); });
+}
+
+
+static void attempt(SimRadio* radio, uint32_t generation)
+{
+    if (generation != radio->generation)
+        return;
+
+    // Switched to RX or powered down mid-write
+    if (radio->prim_rx || !radio->powered)
+    {
+        radio->sending = false;
+        return;
+    }
+
+    SimLinkStats* stats = sim_link_stats();
+    const SimPacket packet = radio->tx_fifo.front();
+    SimNanos tx_end = sim_now() + airtime_nanos(radio, packet.size);
+    SimNanos deadline = tx_end + 250 * SIM_NANOS_PER_MICRO * (radio->retry_delay + 1);
+    SimRadio* receiver = NULL;
+
+    stats->transmissions++;
+
+    for (uint8_t i = 0; i < SIM_BOARD_COUNT; i++)
+    {
+        if (_radios[i] != NULL && _radios[i] != radio)
+            receiver = _radios[i];
+    }
+
+    if (receiver == NULL || sim_random() < sim_link_config()->loss)
+    {
+        stats->lost++;
+        sim_schedule(deadline, [radio, generation, deadline]() { not_acked(radio, generation, deadline); });
+        return;
+    }
+
+    sim_schedule(tx_end + link_delay_nanos(), [receiver, radio, generation, packet, deadline]() {
+        arrive(receiver, radio, generation, packet, deadline);
+    });
+}
+
+
+/* The receiver takes the packet if it's listening at the sender's settings
+ * on a pipe with its address, and ACKs it unless its RX FIFO is full.  A
+ * packet with the same PID and payload as the last on its pipe is a
+ * retransmit whose ACK was lost, so is ACKed but dropped, unless the link
+ * duplicates it.
+ */
+static void arrive(SimRadio* receiver, SimRadio* sender, uint32_t generation, SimPacket packet, SimNanos deadline)
+{
+    SimLinkStats* stats = sim_link_stats();
+    int8_t pipe = -1;
+
+    if (receiver->powered && receiver->prim_rx && receiver->ce && sim_now() >= receiver->rx_ready_at &&
+        receiver->channel == sender->channel && receiver->data_rate == sender->data_rate)
+    {
+        for (uint8_t i = 0; i < SIM_RADIO_PIPES && pipe < 0; i++)
+        {
+            if (receiver->pipe_enabled[i] && memcmp(receiver->rx_address[i], sender->tx_address, sender->address_width) == 0)
+                pipe = i;
+        }
+    }
+
+    if (pipe < 0)
+    {
+        stats->lost++;
+        sim_schedule(deadline, [sender, generation, deadline]() { not_acked(sender, generation, deadline); });
+        return;
+    }
+
+    const SimPacket& last = receiver->last_received[pipe];
+    bool retransmit = receiver->have_received[pipe] && last.pid == packet.pid && last.size == packet.size &&
+        memcmp(last.data, packet.data, packet.size) == 0;
+
+    if (retransmit && sim_random() < sim_link_config()->duplicate)
+    {
+        stats->duplicates++;
+        retransmit = false;
+    }
+
+    if (!retransmit)
+    {
+        if (receiver->rx_fifo.size() >= SIM_RADIO_FIFO_LENGTH)
+        {
+            stats->rx_full++;
+            sim_schedule(deadline, [sender, generation, deadline]() { not_acked(sender, generation, deadline); });
+            return;
+        }
+
+        // The sender got the last ACK payload, as it has moved on
+        if (receiver->ack_payload_sent && !receiver->tx_fifo.empty())
+        {
+            receiver->tx_fifo.pop_front();
+            receiver->tx_ds = true;
+        }
+        receiver->ack_payload_sent = false;
+
+        packet.pipe = pipe;
+        receiver->rx_fifo.push_back(packet);
+        receiver->last_received[pipe] = packet;
+        receiver->have_received[pipe] = true;
+        receiver->rx_dr = true;
+        stats->received++;
+        update_irq(receiver);
+    }
+
+    if (!sim_link_config()->auto_ack)
+    {
+        sim_schedule(deadline, [sender, generation, deadline]() { not_acked(sender, generation, deadline); });
+        return;
+    }
+
+    bool has_payload = receiver->ack_payloads && !receiver->tx_fifo.empty() && receiver->tx_fifo.front().pipe == pipe;
+    SimPacket payload;
+
+    if (has_payload)
+    {
+        payload = receiver->tx_fifo.front();
+        receiver->ack_payload_sent = true;
+    }
+
+    SimNanos ack_at = sim_now() + SIM_RADIO_SETTLE_NANOS + airtime_nanos(receiver, has_payload ? payload.size : 0) +
+        link_delay_nanos();
+
+    if (sim_random() < sim_link_config()->ack_loss)
+    {
+        stats->acks_lost++;
+        sim_schedule(deadline, [sender, generation, deadline]() { not_acked(sender, generation, deadline); });
+    }
+    else if (ack_at > deadline)
+    {
+        stats->late_acks++;
+        sim_schedule(deadline, [sender, generation, deadline]() { not_acked(sender, generation, deadline); });
+    }
+    else
+        sim_schedule(ack_at, [sender, generation, has_payload, payload]() { acked(sender, generation, has_payload, payload); });
+}
+
+
+static void acked(SimRadio* radio, uint32_t generation, bool has_payload, SimPacket payload)
+{
+    if (generation != radio->generation)
+        return;
+
+    radio->tx_fifo.pop_front();
+    radio->tx_ds = true;
+    radio->sending = false;
+
+    if (has_payload && radio->rx_fifo.size() < SIM_RADIO_FIFO_LENGTH)
+    {
+        payload.pipe = 0;
+        radio->rx_fifo.push_back(payload);
+        radio->rx_dr = true;
+    }
+
+    update_irq(radio);
+    start_sending(radio);
+}
+
+
+// Retransmits ARD after the end of the last attempt, or gives up
+static void not_acked(SimRadio* radio, uint32_t generation, SimNanos next_attempt)
+{
+    if (generation != radio->generation)
+        return;
+
+    if (radio->arc_cnt < radio->retry_count)
+    {
+        radio->arc_cnt++;
+        sim_schedule(next_attempt, [radio, generation]() { attempt(radio, generation); });
+        return;
+    }
+
+    radio->sending = false;
+    radio->max_rt = true;
+    if (radio->plos_cnt < 15)
+        radio->plos_cnt++;
+    sim_link_stats()->max_retries++;
+    update_irq(radio);
+}
+
+
+static bool tx_fifo_full(const SimRadio* radio)
+{
+    return radio->tx_fifo.size() >= SIM_RADIO_FIFO_LENGTH;
+}
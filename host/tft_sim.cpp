@@ -0,0 +1,619 @@
+/* Runs the controller and the whole interface sketch, its display on the
+ * emulated FT81x (see ft81x.h), and touches the screen as a user would:
+ * switches HC and LC, picks a power, turns the dial, makes an exposure and
+ * opens the radio diagnostics.  It measures:
+ *   - Each frame's cost: its bytes on SPI and in RAM_CMD, its display list,
+ *     and the co-processor's time, and the host's from its first byte to the
+ *     co-processor reaching its swap.
+ *   - Touch to display: from each tap to the co-processor finishing the
+ *     first frame showing its effect.
+ *   - Touch to light: from the tap on START to the controller's outputs.
+ * and checks each frame's layout: every widget on the screen, each tagged
+ * widget and key touchable at its middle, and the display list within
+ * RAM_DL.
+ *
+ * Exits 1 if a step of the script didn't take effect, a layout check failed,
+ * the co-processor faulted or a --max threshold was exceeded.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Arduino.h"
+#include "sim.h"
+#include "sim_boards.h"
+#include "ft81x.h"
+
+#include "../interface/FT8.h"
+
+
+const static uint8_t CONTROLLER_PIN_RADIO_IRQ = 2;
+const static uint8_t INTERFACE_PIN_RADIO_IRQ = PC14;
+
+const static SimNanos SCRIPT_STEP_NANOS = 10 * SIM_NANOS_PER_MILLI;
+const static SimNanos TAP_HOLD_NANOS = 150 * SIM_NANOS_PER_MILLI;
+const static SimNanos STEP_GAP_NANOS = 300 * SIM_NANOS_PER_MILLI;
+
+// The dial (see tft.cpp), turned a quarter clockwise from the top, where its
+// angle starts, a little at a time as a finger would
+const static uint8_t DIAL_TAG = 5;
+const static int16_t DIAL_TOUCH_RADIUS = 80;
+const static uint16_t SWEEP_START_ANGLE = 0x8000;
+const static uint16_t SWEEP_ANGLE = 0x4000;
+const static uint16_t SWEEP_STEP_ANGLE = 0x400;
+const static SimNanos SWEEP_STEP_NANOS = 20 * SIM_NANOS_PER_MILLI;
+const static uint16_t SWEEP_TENTHS = (SWEEP_ANGLE >> 4) >> 6;     // As tft.cpp counts it, less a tenth for rounding
+
+const static uint8_t BIG_TEXT_FONT = 1;
+const static char POWER_KEY = '1';
+const static SimNanos EXPOSURE_TOLERANCE_NANOS = 1 * SIM_NANOS_PER_MILLI;
+const static SimNanos EXPOSURE_TIMEOUT_NANOS = 3000 * SIM_NANOS_PER_MILLI;     // Beyond the set time
+const static SimNanos STEP_TIMEOUT_NANOS = 3000 * SIM_NANOS_PER_MILLI;
+const static SimNanos CONNECT_TIMEOUT_NANOS = 5000 * SIM_NANOS_PER_MILLI;
+
+const static uint8_t LAYOUT_ERRORS_SHOWN = 10;
+
+
+enum ScriptAction {
+    ACTION_NONE,
+    ACTION_TAP,
+    ACTION_SWEEP
+};
+
+
+struct ScriptStep
+{
+    const char* name;
+    ScriptAction action;
+    uint8_t tag;                        // Tapped or swept
+    bool (*done)(const Ft81xFrame* frame);
+    SimNanos timeout_nanos;
+};
+
+
+struct ScriptConfig
+{
+    uint32_t seed;
+    bool log;
+    uint32_t max_frame_bytes;           // 0 for none
+    double max_frame_micros;            // Co-processor; 0 for none
+};
+
+
+struct Script
+{
+    uint8_t step;
+    bool acted;                         // The step's touch has been made
+    bool touching;
+    bool failed;
+    SimNanos step_at;
+    SimNanos next_at;
+    SimNanos touch_at;
+    uint16_t sweep_angle;
+    int16_t dial_x, dial_y;
+
+    std::vector<SimNanos> touch_to_display;
+    SimNanos start_touch_at;
+    SimNanos light_on_at;               // 0 until the exposure's lights come on
+    SimNanos light_off_at;
+    uint16_t set_tenths;                // As displayed when the exposure started
+
+    size_t frames_checked;
+    uint32_t layout_errors;
+    size_t logged_number;
+};
+
+
+static bool connected(const Ft81xFrame* frame);
+static bool showing_hc(const Ft81xFrame* frame);
+static bool showing_lc(const Ft81xFrame* frame);
+static bool power_set(const Ft81xFrame* frame);
+static bool dial_set(const Ft81xFrame* frame);
+static bool exposing(const Ft81xFrame* frame);
+static bool exposed(const Ft81xFrame* frame);
+static bool showing_diagnostics(const Ft81xFrame* frame);
+static bool showing_controls(const Ft81xFrame* frame);
+
+
+const static ScriptStep SCRIPT[] = {
+    { "connect",        ACTION_NONE,  0,          connected,           CONNECT_TIMEOUT_NANOS },
+    { "HC",             ACTION_TAP,   1,          showing_hc,          STEP_TIMEOUT_NANOS },
+    { "LC",             ACTION_TAP,   1,          showing_lc,          STEP_TIMEOUT_NANOS },
+    { "power",          ACTION_TAP,   POWER_KEY,  power_set,           STEP_TIMEOUT_NANOS },
+    { "dial",           ACTION_SWEEP, DIAL_TAG,   dial_set,            STEP_TIMEOUT_NANOS },
+    { "start",          ACTION_TAP,   3,          exposing,            STEP_TIMEOUT_NANOS },
+    { "expose",         ACTION_NONE,  0,          exposed,             SWEEP_TENTHS * 100 * SIM_NANOS_PER_MILLI + EXPOSURE_TIMEOUT_NANOS },
+    { "diagnostics",    ACTION_TAP,   7,          showing_diagnostics, STEP_TIMEOUT_NANOS },
+    { "controls",       ACTION_TAP,   7,          showing_controls,    STEP_TIMEOUT_NANOS },
+};
+
+const static uint8_t SCRIPT_STEPS = sizeof(SCRIPT) / sizeof(SCRIPT[0]);
+
+
+static ScriptConfig _config;
+static Script _script;
+
+
+static void run_script();
+static void touch_dial(uint16_t angle);
+static void fail(const char* reason);
+static void check_frames();
+static void layout_error(const Ft81xFrame* frame, const Ft81xWidget* widget, const char* problem);
+static const Ft81xWidget* find_widget(const Ft81xFrame* frame, uint32_t command, uint8_t tag);
+static bool button_says(const Ft81xFrame* frame, uint8_t tag, const char* text);
+static bool set_tenths(const Ft81xFrame* frame, uint16_t* tenths);
+static void light_changed(SimNanos at, uint16_t red, uint16_t green, uint16_t blue);
+static bool parse_options(int argc, char** argv);
+static void report(uint32_t* max_frame_bytes, double* max_frame_micros);
+static double percentile(std::vector<double> values, uint8_t percent);
+
+
+int main(int argc, char** argv)
+{
+    SimLinkConfig link;
+    SimBoardConfig controller_board, interface_board;
+
+    if (!parse_options(argc, argv))
+        return 2;
+
+    link.loss = 0;
+    link.ack_loss = 0;
+    link.duplicate = 0;
+    link.latency_nanos = 0;
+    link.jitter_nanos = 0;
+    link.auto_ack = true;
+    link.channel_busy = NULL;
+
+    sim_init(_config.seed, &link);
+    sim_set_light_observer(light_changed);
+
+    controller_board.setup = controller_setup;
+    controller_board.loop = controller_loop;
+    controller_board.loop_nanos = 20 * SIM_NANOS_PER_MICRO;
+    controller_board.call_nanos = 1000;
+    controller_board.spi_byte_nanos = 2500;
+    controller_board.radio_irq_pin = CONTROLLER_PIN_RADIO_IRQ;
+    controller_board.avr = true;
+    sim_add_board(SIM_BOARD_CONTROLLER, &controller_board);
+
+    interface_board.setup = interface_setup;
+    interface_board.loop = interface_loop;
+    interface_board.loop_nanos = 5 * SIM_NANOS_PER_MICRO;
+    interface_board.call_nanos = 200;
+    interface_board.spi_byte_nanos = 1000;
+    interface_board.radio_irq_pin = INTERFACE_PIN_RADIO_IRQ;
+    interface_board.avr = false;
+    sim_add_board(SIM_BOARD_INTERFACE, &interface_board);
+
+    SimNanos limit = 0;
+    for (uint8_t i = 0; i < SCRIPT_STEPS; i++)
+        limit += SCRIPT[i].timeout_nanos + STEP_GAP_NANOS;
+
+    while (_script.step < SCRIPT_STEPS && !_script.failed && !ft81x_stats()->fault && sim_now() < limit)
+    {
+        sim_run_until(sim_now() + SCRIPT_STEP_NANOS);
+        check_frames();
+        run_script();
+    }
+
+    uint32_t max_frame_bytes;
+    double max_frame_micros;
+    report(&max_frame_bytes, &max_frame_micros);
+
+    bool failed = _script.failed || _script.step < SCRIPT_STEPS || _script.layout_errors != 0 || ft81x_stats()->fault ||
+        (_config.max_frame_bytes > 0 && max_frame_bytes > _config.max_frame_bytes) ||
+        (_config.max_frame_micros > 0 && max_frame_micros > _config.max_frame_micros);
+
+    printf("%s\n", failed ? "FAIL" : "PASS");
+    return failed ? 1 : 0;
+}
+
+
+// Each SCRIPT_STEP_NANOS: the step's touch, then waiting for the frame shown
+// to have its effect
+static void run_script()
+{
+    Script& s = _script;
+    const ScriptStep& step = SCRIPT[s.step];
+    const Ft81xFrame* frame = ft81x_shown_frame();
+    SimNanos now = sim_now();
+    int16_t x, y;
+
+    if (now < s.next_at)
+        return;
+
+    if (s.touching)
+    {
+        if (step.action == ACTION_SWEEP && uint16_t(s.sweep_angle - SWEEP_START_ANGLE) < SWEEP_ANGLE)
+        {
+            s.sweep_angle += SWEEP_STEP_ANGLE;
+            touch_dial(s.sweep_angle);
+            s.next_at = now + (s.sweep_angle == SWEEP_START_ANGLE + SWEEP_ANGLE ? TAP_HOLD_NANOS : SWEEP_STEP_NANOS);
+            return;
+        }
+
+        ft81x_release();
+        s.touching = false;
+    }
+
+    if (!s.acted)
+    {
+        s.acted = true;
+        s.step_at = now;
+        if (step.action == ACTION_NONE)
+            return;
+
+        if (frame == NULL || !ft81x_find_tag(frame, step.tag, &x, &y))
+        {
+            fail("its tag isn't on the screen");
+            return;
+        }
+
+        s.touch_at = now;
+        s.touching = true;
+        if (step.action == ACTION_SWEEP)
+        {
+            s.dial_x = x;
+            s.dial_y = y;
+            s.sweep_angle = SWEEP_START_ANGLE;
+            touch_dial(s.sweep_angle);
+            s.next_at = now + SWEEP_STEP_NANOS;
+        }
+        else
+        {
+            ft81x_touch(x, y);
+            s.next_at = now + TAP_HOLD_NANOS;
+        }
+        return;
+    }
+
+    if (frame != NULL && step.done(frame))
+    {
+        if (step.action != ACTION_NONE)
+            s.touch_to_display.push_back(frame->finished - s.touch_at);
+        if (step.done == exposing)
+        {
+            s.start_touch_at = s.touch_at;
+            set_tenths(frame, &s.set_tenths);
+        }
+
+        s.step++;
+        s.acted = false;
+        s.next_at = now + STEP_GAP_NANOS;
+        return;
+    }
+
+    if (now - s.step_at > step.timeout_nanos)
+        fail("it timed out");
+}
+
+
+// Clockwise from straight down, as the dial's tracker measures it
+static void touch_dial(uint16_t angle)
+{
+    double radians = 2 * M_PI * angle / 65536;
+
+    ft81x_touch(_script.dial_x - int16_t(lround(DIAL_TOUCH_RADIUS * sin(radians))),
+        _script.dial_y + int16_t(lround(DIAL_TOUCH_RADIUS * cos(radians))));
+}
+
+
+static void fail(const char* reason)
+{
+    printf("Step %s failed at %.3f s: %s\n", SCRIPT[_script.step].name, double(sim_now()) / (1000 * SIM_NANOS_PER_MILLI),
+        reason);
+    _script.failed = true;
+}
+
+
+// The frames finished since the last check, and --log
+static void check_frames()
+{
+    Script& s = _script;
+    const std::vector<Ft81xFrame>& frames = ft81x_frames();
+    int16_t width, height;
+
+    ft81x_screen_size(&width, &height);
+
+    for (; s.frames_checked < frames.size(); s.frames_checked++)
+    {
+        const Ft81xFrame* frame = &frames[s.frames_checked];
+
+        if (frame->dl_bytes > FT8_RAM_DL_SIZE)
+            layout_error(frame, NULL, "display list is too long for RAM_DL");
+
+        for (size_t i = 0; i < frame->widgets.size(); i++)
+        {
+            const Ft81xWidget* w = &frame->widgets[i];
+            int16_t x, y;
+
+            if (w->x < 0 || w->y < 0 || w->x + w->w > width || w->y + w->h > height)
+                layout_error(frame, w, "is off the screen");
+
+            if (w->command == CMD_KEYS)
+            {
+                for (size_t key = 0; key < w->text.size(); key++)
+                {
+                    if (!ft81x_find_tag(frame, uint8_t(w->text[key]), &x, &y))
+                        layout_error(frame, w, "has a key that can't be touched");
+                }
+            }
+            else if (w->tag != 0 && w->tag != 255 && !ft81x_find_tag(frame, w->tag, &x, &y))
+                layout_error(frame, w, "can't be touched");
+        }
+
+        if (_config.log && (s.frames_checked == 0 || !ft81x_same_widgets(&frames[s.logged_number], frame)))
+        {
+            ft81x_print_frame(stdout, frame);
+            s.logged_number = s.frames_checked;
+        }
+    }
+}
+
+
+static void layout_error(const Ft81xFrame* frame, const Ft81xWidget* widget, const char* problem)
+{
+    if (_script.layout_errors++ >= LAYOUT_ERRORS_SHOWN)
+        return;
+
+    if (widget == NULL)
+        printf("Layout: frame %u's %s\n", frame->number, problem);
+    else
+        printf("Layout: frame %u's %s at %d,%d %dx%d \"%s\" %s\n", frame->number, ft81x_command_name(widget->command),
+            widget->x, widget->y, widget->w, widget->h, widget->text.c_str(), problem);
+}
+
+
+// The first with tag, or any tag for 0
+static const Ft81xWidget* find_widget(const Ft81xFrame* frame, uint32_t command, uint8_t tag)
+{
+    for (size_t i = 0; i < frame->widgets.size(); i++)
+    {
+        const Ft81xWidget& w = frame->widgets[i];
+
+        if (w.command == command && (tag == 0 || w.tag == tag))
+            return &w;
+    }
+
+    return NULL;
+}
+
+
+static bool button_says(const Ft81xFrame* frame, uint8_t tag, const char* text)
+{
+    const Ft81xWidget* button = find_widget(frame, CMD_BUTTON, tag);
+
+    return button != NULL && button->text == text;
+}
+
+
+// The set time, in tenths of a second, from the big "current/set" text
+static bool set_tenths(const Ft81xFrame* frame, uint16_t* tenths)
+{
+    for (size_t i = 0; i < frame->widgets.size(); i++)
+    {
+        const Ft81xWidget& w = frame->widgets[i];
+        int current_s, current_ds, set_s, set_ds;
+
+        if (w.command == CMD_TEXT && w.font == BIG_TEXT_FONT &&
+            sscanf(w.text.c_str(), "%d.%d/%d.%d", &current_s, &current_ds, &set_s, &set_ds) == 4)
+        {
+            *tenths = uint16_t(set_s * 10 + set_ds);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static bool connected(const Ft81xFrame* frame)
+{
+    for (size_t i = 0; i < frame->widgets.size(); i++)
+    {
+        if (frame->widgets[i].command == CMD_TEXT && frame->widgets[i].text == "CON")
+            return true;
+    }
+
+    return false;
+}
+
+
+static bool showing_hc(const Ft81xFrame* frame)
+{
+    return button_says(frame, 1, "HC");
+}
+
+
+static bool showing_lc(const Ft81xFrame* frame)
+{
+    return button_says(frame, 1, "LC");
+}
+
+
+// The key shown pressed
+static bool power_set(const Ft81xFrame* frame)
+{
+    const Ft81xWidget* keys = find_widget(frame, CMD_KEYS, 0);
+
+    return keys != NULL && (keys->options & 0xFF) == POWER_KEY;
+}
+
+
+static bool dial_set(const Ft81xFrame* frame)
+{
+    uint16_t tenths;
+
+    return set_tenths(frame, &tenths) && tenths + 1 >= SWEEP_TENTHS && tenths <= SWEEP_TENTHS;
+}
+
+
+static bool exposing(const Ft81xFrame* frame)
+{
+    return button_says(frame, 3, "STOP") && _script.light_on_at != 0;
+}
+
+
+// And for as long as the set time
+static bool exposed(const Ft81xFrame* frame)
+{
+    const Script& s = _script;
+
+    if (!button_says(frame, 3, "START") || s.light_off_at == 0)
+        return false;
+
+    int64_t error = int64_t(s.light_off_at - s.light_on_at) - int64_t(s.set_tenths * 100 * SIM_NANOS_PER_MILLI);
+
+    if (error > int64_t(EXPOSURE_TOLERANCE_NANOS) || error < -int64_t(EXPOSURE_TOLERANCE_NANOS))
+        fail("the exposure was out by more than its tolerance");
+    return true;
+}
+
+
+static bool showing_diagnostics(const Ft81xFrame* frame)
+{
+    return button_says(frame, 8, "SURVEY");
+}
+
+
+static bool showing_controls(const Ft81xFrame* frame)
+{
+    return find_widget(frame, CMD_DIAL, 0) != NULL;
+}
+
+
+// From the controller's exposure hooks.  Only the exposure lights green.
+static void light_changed(SimNanos at, uint16_t red, uint16_t green, uint16_t blue)
+{
+    if (green != 0 && _script.light_on_at == 0)
+        _script.light_on_at = at;
+    else if (green == 0 && _script.light_on_at != 0 && _script.light_off_at == 0)
+        _script.light_off_at = at;
+}
+
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --seed N              Random seed (1)\n"
+        "  --log                 Print each frame whose widgets changed\n"
+        "  --max-frame-bytes N   Fail if a frame takes more than N bytes on SPI\n"
+        "  --max-frame-us X      Fail if a frame takes the co-processor more than X\n",
+        program);
+}
+
+
+static bool parse_options(int argc, char** argv)
+{
+    _config.seed = 1;
+    _config.log = false;
+    _config.max_frame_bytes = 0;
+    _config.max_frame_micros = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const char* option = argv[i];
+
+        if (strcmp(option, "--log") == 0)
+        {
+            _config.log = true;
+            continue;
+        }
+
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+            return false;
+        }
+        double value = atof(argv[++i]);
+
+        if (strcmp(option, "--seed") == 0)
+            _config.seed = uint32_t(value);
+        else if (strcmp(option, "--max-frame-bytes") == 0)
+            _config.max_frame_bytes = uint32_t(value);
+        else if (strcmp(option, "--max-frame-us") == 0)
+            _config.max_frame_micros = value;
+        else
+        {
+            usage(argv[0]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+static void report(uint32_t* max_frame_bytes, double* max_frame_micros)
+{
+    const Script& s = _script;
+    const Ft81xStats* stats = ft81x_stats();
+    const std::vector<Ft81xFrame>& frames = ft81x_frames();
+    std::vector<double> spi_bytes, command_bytes, dl_bytes, coprocessor_micros, host_micros, touch_millis;
+    const char* traffic_names[FT81X_TRAFFIC_COUNT] = { "commands", "starts", "polls", "touch", "other" };
+    double seconds = double(sim_now()) / (1000 * SIM_NANOS_PER_MILLI);
+
+    *max_frame_bytes = 0;
+    for (size_t i = 0; i < frames.size(); i++)
+    {
+        spi_bytes.push_back(frames[i].spi_bytes);
+        command_bytes.push_back(frames[i].command_bytes);
+        dl_bytes.push_back(frames[i].dl_bytes);
+        coprocessor_micros.push_back(double(frames[i].coprocessor_nanos) / SIM_NANOS_PER_MICRO);
+        host_micros.push_back(double(frames[i].finished - frames[i].started) / SIM_NANOS_PER_MICRO);
+        *max_frame_bytes = std::max(*max_frame_bytes, frames[i].spi_bytes);
+    }
+    *max_frame_micros = percentile(coprocessor_micros, 100);
+
+    for (size_t i = 0; i < s.touch_to_display.size(); i++)
+        touch_millis.push_back(double(s.touch_to_display[i]) / SIM_NANOS_PER_MILLI);
+
+    printf("Simulated: %.3f s; script %u of %u steps; seed %u\n", seconds, s.step, SCRIPT_STEPS, _config.seed);
+    printf("Frames: %u, %.1f per second\n", unsigned(frames.size()), frames.size() / seconds);
+    printf("  SPI bytes:          median %.0f, max %.0f\n", percentile(spi_bytes, 50), percentile(spi_bytes, 100));
+    printf("  RAM_CMD bytes:      median %.0f, max %.0f\n", percentile(command_bytes, 50), percentile(command_bytes, 100));
+    printf("  Display list bytes: median %.0f, max %.0f (estimated)\n", percentile(dl_bytes, 50), percentile(dl_bytes, 100));
+    printf("  Co-processor:       median %.1f us, max %.1f us (estimated)\n", percentile(coprocessor_micros, 50),
+        *max_frame_micros);
+    printf("  First byte to swap: median %.1f us, max %.1f us\n", percentile(host_micros, 50), percentile(host_micros, 100));
+
+    printf("SPI:");
+    for (uint8_t i = 0; i < FT81X_TRAFFIC_COUNT; i++)
+        printf(" %s %u bytes in %u%s", traffic_names[i], stats->bytes[i], stats->transactions[i],
+            i + 1 < FT81X_TRAFFIC_COUNT ? "," : " transactions\n");
+    printf("FT81x: %u host commands, %u unmapped accesses, %s%s\n", stats->host_commands, stats->unmapped,
+        stats->fault ? "fault: " : "no fault", stats->fault ? stats->fault_reason : "");
+
+    printf("Touch to display: %u taps, median %.2f ms, worst %.2f ms\n", unsigned(touch_millis.size()),
+        percentile(touch_millis, 50), percentile(touch_millis, 100));
+    if (s.light_on_at != 0)
+        printf("Touch to light: %.2f ms\n", double(s.light_on_at - s.start_touch_at) / SIM_NANOS_PER_MILLI);
+    if (s.light_off_at != 0)
+    {
+        SimNanos target = s.set_tenths * 100 * SIM_NANOS_PER_MILLI;
+        int64_t error = int64_t(s.light_off_at - s.light_on_at) - int64_t(target);
+
+        printf("Exposure: set %u.%u s, error %.1f us\n", s.set_tenths / 10, s.set_tenths % 10,
+            double(error) / SIM_NANOS_PER_MICRO);
+    }
+    printf("Layout: %u frames checked, %u problems\n", unsigned(s.frames_checked), s.layout_errors);
+}
+
+
+// Nearest rank; 0 if there are none
+static double percentile(std::vector<double> values, uint8_t percent)
+{
+    if (values.empty())
+        return 0;
+
+    std::sort(values.begin(), values.end());
+    size_t rank = (values.size() * percent + 99) / 100;
+
+    return values[rank == 0 ? 0 : rank - 1];
+}
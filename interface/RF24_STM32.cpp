@@ -32,7 +32,7 @@ void RF24::csn(bool mode)
     // Return, CSN toggle complete
     return;
     
-#elif defined(ARDUINO) && !defined (RF24_SPI_TRANSACTIONS)
+#elif defined(ARDUINO) && !defined (RF24_SPI_TRANSACTIONS) && !defined (RF24_DMA_BURST)
     // Minimum ideal SPI bus speed is 2x data rate
     // If we assume 2Mbs data rate and 16Mhz clock, a
     // divider of 4 is the minimum we want.
@@ -66,7 +66,17 @@ void RF24::ce(bool level)
 
 /****************************************************************************/
 
+#if defined (SPI_CYCLE_COUNT) && !defined (RF24_DWT_CYCCNT)
+  // Cortex-M3 debug registers.  A host build may define its own.
+  #define RF24_DEMCR      (*(volatile uint32_t*)0xE000EDFC)
+  #define RF24_DWT_CTRL   (*(volatile uint32_t*)0xE0001000)
+  #define RF24_DWT_CYCCNT (*(volatile uint32_t*)0xE0001004)
+#endif
+
   inline void RF24::beginTransaction() {
+    #if defined (SPI_CYCLE_COUNT)
+    spi_cycles_start = RF24_DWT_CYCCNT;
+    #endif
     #if defined (RF24_SPI_TRANSACTIONS)
     _SPI.beginTransaction(SPISettings(RF24_SPI_SPEED, MSBFIRST, SPI_MODE0));
     #endif
@@ -80,6 +90,19 @@ void RF24::ce(bool level)
     #if defined (RF24_SPI_TRANSACTIONS)
     _SPI.endTransaction();
     #endif
+    #if defined (SPI_CYCLE_COUNT)
+    spiCycles += RF24_DWT_CYCCNT - spi_cycles_start;
+    #endif
+  }
+
+/****************************************************************************/
+
+  inline void RF24::spiBurst(uint8_t size) {
+    #if defined (RF24_DMA_BURST)
+    _SPI.dmaTransfer(spi_txbuff, spi_rxbuff, size);
+    #elif defined (RF24_LINUX) || defined (XMEGA_D3)
+    _SPI.transfernb( (char *) spi_txbuff, (char *) spi_rxbuff, size);
+    #endif
   }
 
 /****************************************************************************/
@@ -88,7 +111,7 @@ uint8_t RF24::read_register(uint8_t reg, uint8_t* buf, uint8_t len)
 {
   uint8_t status;
 
-  #if defined (RF24_LINUX)
+  #if defined (RF24_LINUX) || defined (RF24_DMA_BURST)
   beginTransaction(); //configures the spi settings for RPi, locks mutex and setting csn low
   uint8_t * prx = spi_rxbuff;
   uint8_t * ptx = spi_txbuff;
@@ -98,7 +121,7 @@ uint8_t RF24::read_register(uint8_t reg, uint8_t* buf, uint8_t len)
 
   while (len--){ *ptx++ = RF24_NOP; } // Dummy operation, just for reading
   
-  _SPI.transfernb( (char *) spi_txbuff, (char *) spi_rxbuff, size);
+  spiBurst(size);
   
   status = *prx++; // status is 1st byte of receive buffer
 
@@ -157,7 +180,7 @@ uint8_t RF24::write_register(uint8_t reg, const uint8_t* buf, uint8_t len)
 {
   uint8_t status;
 
-  #if defined (RF24_LINUX) 
+  #if defined (RF24_LINUX) || defined (RF24_DMA_BURST)
   beginTransaction();
   uint8_t * prx = spi_rxbuff;
   uint8_t * ptx = spi_txbuff;
@@ -167,7 +190,7 @@ uint8_t RF24::write_register(uint8_t reg, const uint8_t* buf, uint8_t len)
   while ( len-- )
     *ptx++ = *buf++;
   
-  _SPI.transfernb( (char *) spi_txbuff, (char *) spi_rxbuff, size);
+  spiBurst(size);
   status = *prx; // status is 1st byte of receive buffer
   endTransaction();
   #else
@@ -191,6 +214,17 @@ uint8_t RF24::write_register(uint8_t reg, uint8_t value)
 
   IF_SERIAL_DEBUG(printf_P(PSTR("write_register(%02x,%02x)\r\n"),reg,value));
 
+  // Keep the shadows of the registers this driver owns, so that changing
+  // them needs no read first
+  if (reg == NRF_CONFIG)
+    config_reg = value;
+  else if (reg == EN_RXADDR)
+    en_rxaddr_reg = value;
+  else if (reg == FEATURE)
+    feature_reg = value;
+  else if (reg == RF_SETUP)
+    rf_setup_reg = value;
+
   #if defined (RF24_LINUX)
     beginTransaction();
     uint8_t * prx = spi_rxbuff;
@@ -226,7 +260,7 @@ uint8_t RF24::write_payload(const void* buf, uint8_t data_len, const uint8_t wri
   //printf("[Writing %u bytes %u blanks]",data_len,blank_len);
   IF_SERIAL_DEBUG( printf("[Writing %u bytes %u blanks]\n",data_len,blank_len); );
   
- #if defined (RF24_LINUX)
+ #if defined (RF24_LINUX) || defined (RF24_DMA_BURST)
     beginTransaction();
     uint8_t * prx = spi_rxbuff;
     uint8_t * ptx = spi_txbuff;
@@ -239,7 +273,7 @@ uint8_t RF24::write_payload(const void* buf, uint8_t data_len, const uint8_t wri
     while ( blank_len-- )
       *ptx++ =  0;
     
-    _SPI.transfernb( (char *) spi_txbuff, (char *) spi_rxbuff, size);
+    spiBurst(size);
     status = *prx; // status is 1st byte of receive buffer
     endTransaction();
 
@@ -274,7 +308,7 @@ uint8_t RF24::read_payload(void* buf, uint8_t data_len)
 
   IF_SERIAL_DEBUG( printf("[Reading %u bytes %u blanks]\n",data_len,blank_len); );
   
-  #if defined (RF24_LINUX)
+  #if defined (RF24_LINUX) || defined (RF24_DMA_BURST)
     beginTransaction();
     uint8_t * prx = spi_rxbuff;
     uint8_t * ptx = spi_txbuff;
@@ -287,7 +321,7 @@ uint8_t RF24::read_payload(void* buf, uint8_t data_len)
         
     size = data_len + blank_len + 1; // Size has been lost during while, re affect
     
-    _SPI.transfernb( (char *) spi_txbuff, (char *) spi_rxbuff, size);
+    spiBurst(size);
     
     status = *prx++; // 1st byte is status  
     
@@ -575,6 +609,12 @@ bool RF24::begin(void)
 
   uint8_t setup=0;
 
+  #if defined (SPI_CYCLE_COUNT)
+    RF24_DEMCR |= 1UL << 24;      // TRCENA
+    RF24_DWT_CTRL |= 1;           // CYCCNTENA
+    spiCycles = 0;
+  #endif
+
   #if defined (RF24_LINUX)
 
     #if defined (MRAA)
@@ -620,6 +660,12 @@ bool RF24::begin(void)
         pinMode(csn_pin,OUTPUT);
     
     _SPI.begin();
+    #if defined (RF24_DMA_BURST)
+    // Once, rather than on every CSN edge
+    _SPI.setBitOrder(MSBFIRST);
+    _SPI.setDataMode(SPI_MODE0);
+    _SPI.setClockDivider(SPI_CLOCK_DIV4);
+    #endif
     ce(LOW);
     csn(HIGH);
     #if defined (__ARDUINO_X86__)
@@ -638,6 +684,10 @@ bool RF24::begin(void)
   // Reset NRF_CONFIG and enable 16-bit CRC.
   write_register( NRF_CONFIG, 0x0C ) ;
 
+  // The chip isn't reset with the MCU, so start the other shadows from it
+  en_rxaddr_reg = read_register(EN_RXADDR);
+  rf_setup_reg = read_register(RF_SETUP);
+
   // Set 1500uS (minimum for 32B payload in ESB@250KBPS) timeouts, to make testing a little easier
   // WARNING: If this is ever lowered, either 250KBS mode with AA is broken or maximum packet
   // sizes must never be used. See documentation for a more complete explanation.
@@ -688,7 +738,7 @@ bool RF24::begin(void)
 
   // Enable PTX, do not write CE high so radio will remain in standby I mode ( 130us max to transition to RX or TX instead of 1500us from powerUp )
   // PTX should use only 22uA of power
-  write_register(NRF_CONFIG, ( read_register(NRF_CONFIG) ) & ~_BV(PRIM_RX) );
+  write_register(NRF_CONFIG, ( config_reg ) & ~_BV(PRIM_RX) );
 
   // if setup is 0 or ff then there was no response from module
   return ( setup != 0 && setup != 0xff );
@@ -714,7 +764,7 @@ void RF24::startListening(void)
  #if !defined (RF24_TINY) && ! defined(LITTLEWIRE)
   powerUp();
  #endif
-  write_register(NRF_CONFIG, read_register(NRF_CONFIG) | _BV(PRIM_RX));
+  write_register(NRF_CONFIG, config_reg | _BV(PRIM_RX));
   write_register(NRF_STATUS, _BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT) );
   ce(HIGH);
   // Restore the pipe0 adddress, if exists
@@ -726,7 +776,7 @@ void RF24::startListening(void)
 
   // Flush buffers
   //flush_rx();
-  if(read_register(FEATURE) & _BV(EN_ACK_PAY)){
+  if(feature_reg & _BV(EN_ACK_PAY)){
     flush_tx();
   }
 
@@ -746,12 +796,12 @@ void RF24::stopListening(void)
 
   delayMicroseconds(txDelay);
   
-  if(read_register(FEATURE) & _BV(EN_ACK_PAY)){
+  if(feature_reg & _BV(EN_ACK_PAY)){
     delayMicroseconds(txDelay); //200
     flush_tx();
   }
   //flush_rx();
-  write_register(NRF_CONFIG, ( read_register(NRF_CONFIG) ) & ~_BV(PRIM_RX) );
+  write_register(NRF_CONFIG, ( config_reg ) & ~_BV(PRIM_RX) );
  
   #if defined (RF24_TINY) || defined (LITTLEWIRE)
   // for 3 pins solution TX mode is only left with additonal powerDown/powerUp cycle
@@ -760,7 +810,7 @@ void RF24::stopListening(void)
     powerUp();
   }
   #endif
-  write_register(EN_RXADDR,read_register(EN_RXADDR) | _BV(pgm_read_byte(&child_pipe_enable[0]))); // Enable RX on pipe0
+  write_register(EN_RXADDR,en_rxaddr_reg | _BV(pgm_read_byte(&child_pipe_enable[0]))); // Enable RX on pipe0
   
   //delayMicroseconds(100);
 
@@ -771,7 +821,7 @@ void RF24::stopListening(void)
 void RF24::powerDown(void)
 {
   ce(LOW); // Guarantee CE is low on powerDown
-  write_register(NRF_CONFIG,read_register(NRF_CONFIG) & ~_BV(PWR_UP));
+  write_register(NRF_CONFIG,config_reg & ~_BV(PWR_UP));
 }
 
 /****************************************************************************/
@@ -779,7 +829,7 @@ void RF24::powerDown(void)
 //Power up now. Radio will not power down unless instructed by MCU for config changes etc.
 void RF24::powerUp(void)
 {
-   uint8_t cfg = read_register(NRF_CONFIG);
+   uint8_t cfg = config_reg;
 
    // if not powered up then power up and wait for the radio to initialize
    if (!(cfg & _BV(PWR_UP))){
@@ -974,6 +1024,11 @@ bool RF24::rxFifoFull(){
 }
 /****************************************************************************/
 
+bool RF24::txFifoEmpty(){
+    return read_register(FIFO_STATUS) & _BV(TX_EMPTY);
+}
+/****************************************************************************/
+
 bool RF24::txStandBy(){
 
     #if defined (FAILURE_HANDLING) || defined (RF24_LINUX)
@@ -1039,7 +1094,7 @@ bool RF24::txStandBy(uint32_t timeout, bool startTx){
 
 void RF24::maskIRQ(bool tx, bool fail, bool rx){
 
-    uint8_t config = read_register(NRF_CONFIG);
+    uint8_t config = config_reg;
     /* clear the interrupt flags */
     config &= ~(1 << MASK_MAX_RT | 1 << MASK_TX_DS | 1 << MASK_RX_DR);
     /* set the specified interrupt flags */
@@ -1187,7 +1242,7 @@ void RF24::openReadingPipe(uint8_t child, uint64_t address)
     // Note it would be more efficient to set all of the bits for all open
     // pipes at once.  However, I thought it would make the calling code
     // more simple to do it this way.
-    write_register(EN_RXADDR,read_register(EN_RXADDR) | _BV(pgm_read_byte(&child_pipe_enable[child])));
+    write_register(EN_RXADDR,en_rxaddr_reg | _BV(pgm_read_byte(&child_pipe_enable[child])));
   }
 }
 
@@ -1227,7 +1282,7 @@ void RF24::openReadingPipe(uint8_t child, const uint8_t *address)
     // Note it would be more efficient to set all of the bits for all open
     // pipes at once.  However, I thought it would make the calling code
     // more simple to do it this way.
-    write_register(EN_RXADDR,read_register(EN_RXADDR) | _BV(pgm_read_byte(&child_pipe_enable[child])));
+    write_register(EN_RXADDR,en_rxaddr_reg | _BV(pgm_read_byte(&child_pipe_enable[child])));
 
   }
 }
@@ -1236,7 +1291,7 @@ void RF24::openReadingPipe(uint8_t child, const uint8_t *address)
 
 void RF24::closeReadingPipe( uint8_t pipe )
 {
-  write_register(EN_RXADDR,read_register(EN_RXADDR) & ~_BV(pgm_read_byte(&child_pipe_enable[pipe])));
+  write_register(EN_RXADDR,en_rxaddr_reg & ~_BV(pgm_read_byte(&child_pipe_enable[pipe])));
 }
 
 /****************************************************************************/
@@ -1256,7 +1311,7 @@ void RF24::enableDynamicPayloads(void)
   // Enable dynamic payload throughout the system
 
     //toggle_features();
-    write_register(FEATURE,read_register(FEATURE) | _BV(EN_DPL) );
+    write_register(FEATURE,feature_reg | _BV(EN_DPL) );
 
 
   IF_SERIAL_DEBUG(printf("FEATURE=%i\r\n",read_register(FEATURE)));
@@ -1299,7 +1354,7 @@ void RF24::enableAckPayload(void)
   //
 
     //toggle_features();
-    write_register(FEATURE,read_register(FEATURE) | _BV(EN_ACK_PAY) | _BV(EN_DPL) );
+    write_register(FEATURE,feature_reg | _BV(EN_ACK_PAY) | _BV(EN_DPL) );
 
   IF_SERIAL_DEBUG(printf("FEATURE=%i\r\n",read_register(FEATURE)));
 
@@ -1318,7 +1373,7 @@ void RF24::enableDynamicAck(void){
   // enable dynamic ack features
   //
     //toggle_features();
-    write_register(FEATURE,read_register(FEATURE) | _BV(EN_DYN_ACK) );
+    write_register(FEATURE,feature_reg | _BV(EN_DYN_ACK) );
 
   IF_SERIAL_DEBUG(printf("FEATURE=%i\r\n",read_register(FEATURE)));
 
@@ -1415,10 +1470,37 @@ bool RF24::testRPD(void)
 
 /****************************************************************************/
 
+uint8_t RF24::observeTx(void)
+{
+  return read_register(OBSERVE_TX);
+}
+
+/****************************************************************************/
+
+bool RF24::verifyShadowRegisters(void)
+{
+  bool ok = true;
+  uint8_t value;
+
+  // Read into the shadows directly, rather than through write_register()
+  value = read_register(NRF_CONFIG);
+  if ( value != config_reg ) { config_reg = value; ok = false; }
+  value = read_register(EN_RXADDR);
+  if ( value != en_rxaddr_reg ) { en_rxaddr_reg = value; ok = false; }
+  value = read_register(FEATURE);
+  if ( value != feature_reg ) { feature_reg = value; ok = false; }
+  value = read_register(RF_SETUP);
+  if ( value != rf_setup_reg ) { rf_setup_reg = value; ok = false; }
+
+  return ok;
+}
+
+/****************************************************************************/
+
 void RF24::setPALevel(uint8_t level)
 {
 
-  uint8_t setup = read_register(RF_SETUP) & 0xF8;
+  uint8_t setup = rf_setup_reg & 0xF8;
 
   if(level > 3){                        // If invalid level, go to max PA
       level = (RF24_PA_MAX << 1) + 1;       // +1 to support the SI24R1 chip extra bit
@@ -1435,7 +1517,7 @@ void RF24::setPALevel(uint8_t level)
 uint8_t RF24::getPALevel(void)
 {
 
-  return (read_register(RF_SETUP) & (_BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH))) >> 1 ;
+  return (rf_setup_reg & (_BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH))) >> 1 ;
 }
 
 /****************************************************************************/
@@ -1443,7 +1525,7 @@ uint8_t RF24::getPALevel(void)
 bool RF24::setDataRate(rf24_datarate_e speed)
 {
   bool result = false;
-  uint8_t setup = read_register(RF_SETUP) ;
+  uint8_t setup = rf_setup_reg ;
 
   // HIGH and LOW '00' is 1Mbs - our default
   setup &= ~(_BV(RF_DR_LOW) | _BV(RF_DR_HIGH)) ;
@@ -1480,8 +1562,9 @@ bool RF24::setDataRate(rf24_datarate_e speed)
   }
   write_register(RF_SETUP,setup);
 
-  // Verify our result
-  if ( read_register(RF_SETUP) == setup )
+  // Verify our result, and keep what the chip took: a non-P chip has no 250KBPS
+  rf_setup_reg = read_register(RF_SETUP);
+  if ( rf_setup_reg == setup )
   {
     result = true;
   }
@@ -1493,7 +1576,7 @@ bool RF24::setDataRate(rf24_datarate_e speed)
 rf24_datarate_e RF24::getDataRate( void )
 {
   rf24_datarate_e result ;
-  uint8_t dr = read_register(RF_SETUP) & (_BV(RF_DR_LOW) | _BV(RF_DR_HIGH));
+  uint8_t dr = rf_setup_reg & (_BV(RF_DR_LOW) | _BV(RF_DR_HIGH));
 
   // switch uses RAM (evil!)
   // Order matters in our case below
@@ -1519,7 +1602,7 @@ rf24_datarate_e RF24::getDataRate( void )
 
 void RF24::setCRCLength(rf24_crclength_e length)
 {
-  uint8_t config = read_register(NRF_CONFIG) & ~( _BV(CRCO) | _BV(EN_CRC)) ;
+  uint8_t config = config_reg & ~( _BV(CRCO) | _BV(EN_CRC)) ;
 
   // switch uses RAM (evil!)
   if ( length == RF24_CRC_DISABLED )
@@ -1544,7 +1627,7 @@ rf24_crclength_e RF24::getCRCLength(void)
 {
   rf24_crclength_e result = RF24_CRC_DISABLED;
   
-  uint8_t config = read_register(NRF_CONFIG) & ( _BV(CRCO) | _BV(EN_CRC)) ;
+  uint8_t config = config_reg & ( _BV(CRCO) | _BV(EN_CRC)) ;
   uint8_t AA = read_register(EN_AA);
   
   if ( config & _BV(EN_CRC ) || AA)
@@ -1562,7 +1645,7 @@ rf24_crclength_e RF24::getCRCLength(void)
 
 void RF24::disableCRC( void )
 {
-  uint8_t disable = read_register(NRF_CONFIG) & ~_BV(EN_CRC) ;
+  uint8_t disable = config_reg & ~_BV(EN_CRC) ;
   write_register( NRF_CONFIG, disable ) ;
 }
 
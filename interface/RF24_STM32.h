@@ -67,11 +67,18 @@ private:
   uint16_t ce_pin; /**< "Chip Enable" pin, activates the RX or TX role */
   uint16_t csn_pin; /**< SPI Chip select */
   uint16_t spi_speed; /**< SPI Bus Speed */
-#if defined (RF24_LINUX) || defined (XMEGA_D3)
+#if defined (RF24_LINUX) || defined (XMEGA_D3) || defined (RF24_DMA_BURST)
   uint8_t spi_rxbuff[32+1] ; //SPI receive buffer (payload max 32 bytes)
   uint8_t spi_txbuff[32+1] ; //SPI transmit buffer (payload max 32 bytes + 1 byte for the command)
 #endif  
+#if defined (SPI_CYCLE_COUNT)
+  uint32_t spi_cycles_start; /**< DWT cycle count at beginTransaction() */
+#endif
   bool p_variant; /* False for RF24L01 and true for RF24L01P */
+  uint8_t config_reg; /**< Shadow of NRF_CONFIG, as last written */
+  uint8_t en_rxaddr_reg; /**< Shadow of EN_RXADDR */
+  uint8_t feature_reg; /**< Shadow of FEATURE */
+  uint8_t rf_setup_reg; /**< Shadow of RF_SETUP */
   uint8_t payload_size; /**< Fixed size of payloads */
   bool dynamic_payloads_enabled; /**< Whether dynamic payloads are enabled. */
   uint8_t pipe0_reading_address[5]; /**< Last address set on pipe 0 for reading. */
@@ -89,6 +96,13 @@ protected:
 
   inline void endTransaction();
 
+  /**
+   * Burst transfer of the first @a size bytes of spi_txbuff, in one SPI
+   * transaction, receiving into spi_rxbuff.  Call between beginTransaction()
+   * and endTransaction().
+   */
+  inline void spiBurst(uint8_t size);
+
 public:
 
   /**
@@ -334,6 +348,12 @@ s   *
    */
   bool rxFifoFull();
 
+  /**
+   * Check whether everything written has been sent, or flushed
+   * @return True if the three transmit buffers are empty
+   */
+  bool txFifoEmpty();
+
   /**
    * Enter low-power mode
    *
@@ -638,6 +658,30 @@ s   *
    */
   bool testRPD(void) ;
 
+  /**
+   * Read the transmit observation register, for monitoring link quality.
+   *
+   * The lower nibble (ARC_CNT) is the number of retransmits of the last
+   * packet sent, reset when a new packet is sent.  The upper nibble
+   * (PLOS_CNT) is the number of packets lost, up to 15, reset by setChannel().
+   *
+   * @return Current value of OBSERVE_TX
+   */
+  uint8_t observeTx(void);
+
+  /**
+   * Check the driver's shadow copies of the registers it owns against the chip.
+   *
+   * NRF_CONFIG, EN_RXADDR, FEATURE and RF_SETUP are only ever changed by this
+   * driver, so it keeps a copy of each as last written, and changes them
+   * without reading them first.  This reads them back, for a debug build to
+   * call now and then: a mismatch means the chip was reset, or written behind
+   * the driver's back.  The shadows are reloaded from the chip either way.
+   *
+   * @return true if all the shadows matched the chip
+   */
+  bool verifyShadowRegisters(void);
+
   /**
    * Test whether this is a real radio, or a mock shim for
    * debugging.  Setting either pin to 0xff is the way to
@@ -945,6 +989,14 @@ s   *
   */
   
   uint32_t csDelay;
+
+#if defined (SPI_CYCLE_COUNT)
+  /**
+  * CPU cycles spent in SPI transactions, CSN edges included, since last
+  * cleared.  Only with SPI_CYCLE_COUNT defined in RF24_config_STM32.h.
+  */
+  uint32_t spiCycles;
+#endif
   
   /**@}*/
   /**
@@ -20,6 +20,8 @@
   //#define MINIMAL
   //#define SPI_UART  // Requires library from https://github.com/TMRh20/Sketches/tree/master/SPI_UART
   //#define SOFTSPI   // Requires library from https://github.com/greiman/DigitalIO
+  //#define SPI_CYCLE_COUNT // Count CPU cycles spent in SPI transactions in RF24::spiCycles (Cortex-M3 DWT)
+  //#define RF24_NO_DMA_BURST // Byte-wise SPI on the STM32F1, to compare with RF24_DMA_BURST
   
   /**********************/
   #define rf24_max(a,b) (a>b?a:b)
@@ -28,6 +30,13 @@
   #if defined SPI_HAS_TRANSACTION && !defined SPI_UART && !defined SOFTSPI
     #define RF24_SPI_TRANSACTIONS
   #endif
+
+  // STM32F1: the radio has its SPI port to itself, so the SPI settings are
+  // applied once in begin(), and payloads and multi-byte registers are moved
+  // as one DMA transaction, command byte included.
+  #if defined (__STM32F1__) && !defined RF24_SPI_TRANSACTIONS && !defined SPI_UART && !defined SOFTSPI && !defined RF24_NO_DMA_BURST
+    #define RF24_DMA_BURST
+  #endif
   
 //Generic Linux/ARM and //http://iotdk.intel.com/docs/master/mraa/
 #if ( defined (__linux) || defined (LINUX) ) && defined( __arm__ ) || defined(MRAA) // BeagleBone Black running GNU/Linux or any other ARM-based linux device
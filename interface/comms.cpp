@@ -3,128 +3,1380 @@
 #include "RF24_STM32.h"
 
 #include "comms.h"
-#include "shared.h"
+#include "rtt.h"
+#include <lamphouse_shared.h>
+#include <lamphouse_radio_irq.h>
 
 const static uint8_t PIN_RADIO_CE = PA15;
 const static uint8_t PIN_RADIO_CSN = PC15;
+const static uint8_t PIN_RADIO_IRQ = PC14;
+
+// Between attempts to fetch a reply
+const static uint16_t REPLY_FETCH_INTERVAL_MICROS = 250;
+
+// The controller doesn't act on a retried command twice (see lamphouse_shared.h), so
+// a lost reply is retried quickly, after a timeout set from the measured
+// round trip time (see rtt.h), rather than waited out.
+const static uint8_t EXCHANGE_ATTEMPTS = 4;
+
+// Commands sent together by communicate_pipelined(): as many as the
+// controller's receive queue holds, and both radios' FIFOs.
+const static uint8_t PIPELINE_BURST = 3;
+
+// Long enough for the received power detector (RPD) to settle, which takes
+// 170 us from entering receive mode
+const static uint16_t SURVEY_LISTEN_MICROS = 200;
+
+#ifdef DEBUG
+// Between checks of the radio driver's shadow registers against the chip
+const static uint16_t SHADOW_CHECK_INTERVAL_MILLIS = 1000;
+#endif
 
 static RF24 _radio(PIN_RADIO_CE, PIN_RADIO_CSN);
 
+// The radio's interrupts, latched by radio_isr() and dispatched by
+// comms_poll() (see lamphouse_radio_irq.h)
+static RadioIrqQueue _radio_irq;
+
+// The link level and channel the radio is set to (see link.h), and those a
+// COMMAND_SET_RADIO or COMMAND_SET_CHANNEL exchange is switching to
+static uint8_t _radio_level;
+static uint8_t _radio_switch_level;
+static uint8_t _radio_channel;
+static uint8_t _radio_switch_channel;
+
+// The latest event received (see lamphouse_shared.h), until receive_event() takes it
+static RadioPacket _event[ACK_PAYLOAD_SIZE];
+static bool _event_received = false;
+
+#ifdef DEBUG
+static uint32_t _shadow_check_millis = 0;
+#endif
+
+
+enum ExchangeState {
+    EXCHANGE_IDLE,
+    EXCHANGE_SENDING_COMMAND,
+    EXCHANGE_WAITING,                   // Between fetches
+    EXCHANGE_SENDING_FETCH,
+    EXCHANGE_SENDING_BURST,             // Pipelined (see communicate_pipelined()): commands in the TX FIFO
+    EXCHANGE_WAITING_BURST,             // Between fetches of their replies
+    EXCHANGE_SENDING_BURST_FETCH
+};
+
+
+struct CommsRequest
+{
+    RadioPacket packet[PACKET_SIZE];
+    CommsCallback callback;
+    CommsPriority priority;
+    uint32_t order;                     // Queued order, to keep requests of a priority first in first out
+};
+
+
+// The packets of a pipelined exchange
+struct Pipeline
+{
+    const RadioPacket* out_packets;
+    RadioPacket* returned_packets;
+    uint8_t count;
+    uint8_t first_counter;
+    uint8_t next;                       // From which the next burst is sent
+    uint32_t burst;                     // Bit i set if packet i is in the burst under way
+    uint32_t replied;                   // Bit i set once packet i's reply is in
+    uint8_t received;
+};
+
+
+// A survey of the channels, run from comms_poll() between exchanges
+struct ChannelSurvey
+{
+    bool active;
+    bool listening;                     // On channel, since listen_micros
+    uint8_t sweep;
+    uint8_t channel;
+    uint32_t listen_micros;
+    uint8_t busy_counts[LINK_CHANNEL_COUNT];
+};
+
+
+// Requests waiting to be sent, in no particular order
+struct CommsQueue
+{
+    CommsRequest entries[COMMS_QUEUE_LENGTH];
+    bool used[COMMS_QUEUE_LENGTH];
+    uint32_t next_order;
+};
+
+
+// The request being exchanged with the controller
+struct Exchange
+{
+    ExchangeState state;
+    CommsRequest request;
+    uint8_t counter;                    // Packet counter
+    uint8_t attempt;
+    uint32_t attempt_micros;            // Start of the attempt
+    uint32_t timeout_micros;
+    uint32_t write_micros;              // End of the last write
+    bool switch_acked;                  // The controller has had the radio or channel switch
+};
+
+
+static CommsQueue _queue;
+static Exchange _exchange;
+static Pipeline _pipeline;
+static ChannelSurvey _survey;
+static uint8_t _packet_counter = 0;
+
+// Result of the blocking exchange, as passed to its callback, or of the
+// pipelined one
+static CommsMessage _blocking_message;
+static RadioPacket _blocking_reply[ACK_PAYLOAD_SIZE];
+
+// CPU cycles in the radio's SPI transactions, with SPI_CYCLE_COUNT (see
+// RF24_config_STM32.h), over all exchanges and the last
+static uint32_t _spi_cycles;
+static uint32_t _last_exchange_spi_cycles;
+
+
+static bool survey_poll();
+static void survey_pause();
+static bool comms_enqueue(const RadioPacket* packet, CommsCallback callback);
+static bool comms_dequeue(CommsRequest* request, CommsPriority lowest);
+static CommsPriority comms_priority(CommsCommand command);
+static void exchange_begin(const CommsRequest* request);
+static void exchange_send_command();
+static void exchange_write_done(bool tx_fail, uint32_t irq_micros);
+static void exchange_fail_attempt(CommsMessage message);
+static void exchange_switch_settings();
+static void exchange_finish(CommsMessage message, const RadioPacket* reply);
+static void blocking_exchange_done(CommsCommand, CommsMessage message, const RadioPacket* reply);
+static void pipeline_send_burst();
+static void pipeline_write_done(bool tx_fail, uint32_t irq_micros);
+static void pipeline_wait();
+static void pipeline_finish();
+static bool read_ack_payload(RadioPacket* reply);
+static uint8_t read_pipelined_replies(uint8_t first_counter, uint8_t count, RadioPacket* returned_packets, uint32_t* replied);
+static void read_events();
+static void radio_isr();
+static uint8_t radio_read_irq_flags();
+static void radio_poll_irq();
+static void radio_tx_done(uint32_t irq_micros);
+static void radio_tx_failed(uint32_t irq_micros);
+static void radio_rx_ready(uint32_t);
+static void update_radio_retries();
+static bool link_switch_request(CommsRequest* request);
+static void record_link_packet(bool lost);
+static void set_radio_level(uint8_t level);
+static void set_radio_channel(uint8_t channel);
+static void update_radio_settings();
+static void record_spi_cycles();
+#ifdef DEBUG
+static void check_shadow_registers();
+#endif
+static CommsMessage unpack_history_page(const RadioPacket* returned_packet, ExposureHistoryRecord* records, uint8_t* record_count);
+static void pack_channel_power(RadioPacket* out_packet, uint8_t red_power, uint16_t green_power, uint16_t blue_power);
+static void pack_expose(RadioPacket* out_packet, uint8_t red_power, uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros, bool by_dose);
+static void pack_test_strip(RadioPacket* out_packet, uint16_t green_power, uint16_t blue_power, uint32_t base_millis, uint16_t base_sub_micros, uint8_t stop_divisor, uint8_t strip_count, uint16_t pause_millis);
+
+
+void initialise_radio()
+{
+    digitalWrite(PIN_RADIO_CSN, HIGH);
+    pinMode(PIN_RADIO_CSN, OUTPUT);
+    digitalWrite(PIN_RADIO_CE, HIGH);
+    pinMode(PIN_RADIO_CE, OUTPUT);
+    
+    SPI.begin();
+    SPI.setDataMode(SPI_MODE0);
+    SPI.setBitOrder(MSBFIRST);
+
+    _radio.begin();
+    _radio.csDelay = 0;                 // Exchanges are polled from comms_poll(), which paces the SPI itself
+    rtt_init();
+    link_init();
+    set_radio_level(link_level());
+    set_radio_channel(link_channel());
+    _radio.setAddressWidth(5);
+    _radio.enableAckPayload();
+    _radio.openWritingPipe(RADIO_ADDRESS_CONTROLLER);
+    _radio.openReadingPipe(1, RADIO_ADDRESS_INTERFACE);
+    _radio.flush_rx();
+    _radio.startListening();            // For events, between exchanges
+
+    // The radio interrupts on all of TX_DS, MAX_RT and RX_DR, as begin() leaves it
+    radio_irq_init(&_radio_irq);
+    radio_irq_register(&_radio_irq, RADIO_IRQ_TX_DONE, radio_tx_done);
+    radio_irq_register(&_radio_irq, RADIO_IRQ_TX_FAILED, radio_tx_failed);
+    radio_irq_register(&_radio_irq, RADIO_IRQ_RX_READY, radio_rx_ready);
+    pinMode(PIN_RADIO_IRQ, INPUT);
+    attachInterrupt(PIN_RADIO_IRQ, radio_isr, FALLING);
+
+    for (uint8_t i = 0; i < COMMS_QUEUE_LENGTH; i++)
+        _queue.used[i] = false;
+    _queue.next_order = 0;
+    _exchange.state = EXCHANGE_IDLE;
+    _survey.active = false;
+    _survey.listening = false;
+
+    comms_survey_channels();
+}
+
+
+/* Starts a survey, which listens on each channel in turn, LINK_SURVEY_SWEEPS
+ * times, counting those with a signal above -64 dBm on them, and has the
+ * link monitor choose the quietest (see link.h).  The switch to it is made
+ * by comms_poll(), ahead of any queries waiting.
+ *
+ * The survey is run by comms_poll(), a channel at a time, whenever there's
+ * no exchange under way and nothing waiting, so it doesn't hold up loop(),
+ * and requests go ahead of it.  A sweep is about 30 ms of listening, during
+ * which events are missed.  Starting a survey while one is under way starts
+ * it again.
+ */
+void comms_survey_channels()
+{
+    survey_pause();
+
+    memset(&_survey.busy_counts[0], 0, LINK_CHANNEL_COUNT);
+    _survey.sweep = 0;
+    _survey.channel = 0;
+    _survey.active = true;
+}
+
+
+/* Steps the survey, between exchanges: takes the reading for the channel
+ * listened on, once the RPD has settled, and listens on the next, unless a
+ * request is waiting.  Returns true while it has the radio on a channel other
+ * than the link's.
+ */
+static bool survey_poll()
+{
+    if (!_survey.active)
+        return false;
+
+    if (_survey.listening)
+    {
+        if (micros() - _survey.listen_micros < SURVEY_LISTEN_MICROS)
+            return true;
+
+        if (_radio.testRPD())
+            _survey.busy_counts[_survey.channel]++;
+        if (++_survey.channel == LINK_CHANNEL_COUNT)
+        {
+            _survey.channel = 0;
+            _survey.sweep++;
+        }
+    }
+
+    if (_survey.sweep < LINK_SURVEY_SWEEPS)
+    {
+        if (!comms_idle())
+        {
+            survey_pause();
+            return false;
+        }
+
+        _radio.stopListening();
+        _radio.setChannel(_survey.channel);
+        _radio.startListening();
+        _survey.listen_micros = micros();
+        _survey.listening = true;
+        return true;
+    }
+
+    survey_pause();
+    _survey.active = false;
+
+    uint8_t channel = link_choose_channel(&_survey.busy_counts[0]);
+
+#ifdef DEBUG
+    Serial.print("Interface: Quietest channel ");
+    Serial.print(channel);
+    Serial.print(", busy ");
+    Serial.println(_survey.busy_counts[channel]);
+#else
+    (void)channel;
+#endif
+
+    return false;
+}
+
+
+// Puts the radio back on the link's channel, if the survey has it on
+// another.  The channel it was on is listened on again when the survey goes
+// on.
+static void survey_pause()
+{
+    if (!_survey.listening)
+        return;
+
+    _radio.stopListening();
+    _radio.setChannel(_radio_channel);
+    _radio.startListening();
+    _survey.listening = false;
+}
+
+
+/* Exchanges with the controller run as a state machine, advanced by
+ * comms_poll() from loop(), so that the display and touch are serviced while
+ * the radio waits.  Each step only starts a write or checks on one, which
+ * takes tens of microseconds.
+ *
+ * A write is finished by the radio's interrupt, dispatched to radio_tx_done()
+ * or radio_tx_failed(), rather than by polling its status.
+ *
+ * Replies come back in ACK payloads (see lamphouse_shared.h), so the radio stays in
+ * transmit mode throughout an exchange, and listens for events between them.
+ * The ACK to the command itself carries the controller's reply to whatever
+ * came before, so it's discarded, and the reply is fetched with
+ * COMMAND_FETCH_REPLY until one comes back marked with the command's packet
+ * counter.  A failed attempt is retried with the same packet counter, so
+ * that the controller recognises a retry of a command it has already acted
+ * on.
+ */
+void comms_poll()
+{
+    radio_poll_irq();
+
+    switch (_exchange.state)
+    {
+        case EXCHANGE_IDLE:
+        {
+            CommsRequest request;
+
+            if (survey_poll())
+                break;
+
+            // A link channel or level switch goes after any stop or control
+            // requests waiting, but ahead of queries, as a steady stream of
+            // them would otherwise hold it off for good.
+            if (comms_dequeue(&request, COMMS_PRIORITY_CONTROL) || link_switch_request(&request) ||
+                comms_dequeue(&request, COMMS_PRIORITY_QUERY))
+                exchange_begin(&request);
+#ifdef DEBUG
+            else
+                check_shadow_registers();
+#endif
+            break;
+        }
+        case EXCHANGE_SENDING_COMMAND:
+        case EXCHANGE_SENDING_FETCH:
+        case EXCHANGE_SENDING_BURST:
+        case EXCHANGE_SENDING_BURST_FETCH:
+            break;                      // Until the radio interrupts
+        case EXCHANGE_WAITING:
+        {
+            if (micros() - _exchange.attempt_micros >= _exchange.timeout_micros)
+            {
+                exchange_fail_attempt(MESSAGE_TIMEOUT);
+                break;
+            }
+
+            // Give the controller time to act on the command
+            if (micros() - _exchange.write_micros < REPLY_FETCH_INTERVAL_MICROS)
+                break;
+
+            RadioPacket fetch_packet[PACKET_SIZE];
+            memset(&fetch_packet[0], 0, PACKET_SIZE);
+            PacketCommand::put(fetch_packet, COMMAND_FETCH_REPLY);
+            PacketCounter::put(fetch_packet, _exchange.counter);
+            _radio.startFastWrite(&fetch_packet[0], PACKET_SIZE, false);
+            _exchange.state = EXCHANGE_SENDING_FETCH;
+            break;
+        }
+        case EXCHANGE_WAITING_BURST:
+            pipeline_wait();
+            break;
+    }
+}
+
+
+// No exchange is under way, and none are queued.
+bool comms_idle()
+{
+    if (_exchange.state != EXCHANGE_IDLE)
+        return false;
+
+    for (uint8_t i = 0; i < COMMS_QUEUE_LENGTH; i++)
+    {
+        if (_queue.used[i])
+            return false;
+    }
+
+    return true;
+}
+
+
+/* Queues a request to send out_packet, calling callback (if not NULL) when
+ * it completes.  Requests are sent in order of priority (see
+ * comms_priority()), and then in the order queued.  They're coalesced:
+ *   - A query queued with the same callback as one already waiting is
+ *     dropped, as the reply to the one waiting will do for both.
+ *   - COMMAND_STOP_EXPOSURE is dropped if one is already waiting.
+ *   - COMMAND_SET_CHANNEL_POWER replaces one already waiting with the same
+ *     callback, whose callback is then not called.
+ * If the queue is full, the newest of the lowest priority requests waiting
+ * is dropped, without its callback being called, to make room for one of
+ * higher priority.  Returns false if the request couldn't be queued.
+ */
+static bool comms_enqueue(const RadioPacket* packet, CommsCallback callback)
+{
+    CommsCommand command = CommsCommand(PacketCommand::get(packet));
+    CommsPriority priority = comms_priority(command);
+    int8_t free_index = -1, evict_index = -1;
+
+    for (uint8_t i = 0; i < COMMS_QUEUE_LENGTH; i++)
+    {
+        if (!_queue.used[i])
+        {
+            free_index = i;
+            continue;
+        }
+
+        CommsRequest& queued = _queue.entries[i];
+        if (CommsCommand(PacketCommand::get(queued.packet)) == command)
+        {
+            if (command == COMMAND_STOP_EXPOSURE || (priority == COMMS_PRIORITY_QUERY && queued.callback == callback))
+                return true;
+            if (command == COMMAND_SET_CHANNEL_POWER && queued.callback == callback)
+            {
+                memcpy(&queued.packet[0], packet, PACKET_SIZE);
+                return true;
+            }
+        }
+
+        if (queued.priority > priority &&
+            (evict_index < 0 || queued.priority > _queue.entries[evict_index].priority ||
+                (queued.priority == _queue.entries[evict_index].priority && queued.order > _queue.entries[evict_index].order)))
+            evict_index = i;
+    }
+
+    if (free_index < 0)
+    {
+        if (evict_index < 0)
+            return false;
+        free_index = evict_index;
+    }
+
+    CommsRequest& request = _queue.entries[free_index];
+    memcpy(&request.packet[0], packet, PACKET_SIZE);
+    request.callback = callback;
+    request.priority = priority;
+    request.order = _queue.next_order++;
+    _queue.used[free_index] = true;
+
+    return true;
+}
+
+
+// Takes the next request to send of priority lowest or higher, if any.
+static bool comms_dequeue(CommsRequest* request, CommsPriority lowest)
+{
+    int8_t next_index = -1;
+
+    for (uint8_t i = 0; i < COMMS_QUEUE_LENGTH; i++)
+    {
+        if (!_queue.used[i])
+            continue;
+
+        const CommsRequest& queued = _queue.entries[i];
+        if (next_index < 0 || queued.priority < _queue.entries[next_index].priority ||
+            (queued.priority == _queue.entries[next_index].priority && queued.order < _queue.entries[next_index].order))
+            next_index = i;
+    }
+
+    if (next_index < 0 || _queue.entries[next_index].priority > lowest)
+        return false;
+
+    *request = _queue.entries[next_index];
+    _queue.used[next_index] = false;
+
+    return true;
+}
+
+
+static CommsPriority comms_priority(CommsCommand command)
+{
+    switch (command)
+    {
+        case COMMAND_STOP_EXPOSURE:
+            return COMMS_PRIORITY_STOP;
+        case COMMAND_REPORT_STATUS:
+        case COMMAND_REPORT_DOSE:
+        case COMMAND_REPORT_METER:
+        case COMMAND_REPORT_LATENCY:
+        case COMMAND_REPORT_HISTORY:
+        case COMMAND_SET_RADIO:
+        case COMMAND_SET_CHANNEL:
+            return COMMS_PRIORITY_QUERY;
+        default:
+            return COMMS_PRIORITY_CONTROL;
+    }
+}
+
+
+static void exchange_begin(const CommsRequest* request)
+{
+    _exchange.request = *request;
+    _exchange.counter = _packet_counter++;
+    _exchange.attempt = 0;
+    _exchange.switch_acked = false;
+
+    if (CommsCommand(PacketCommand::get(request->packet)) == COMMAND_SET_RADIO)
+        link_switch_started(_radio_switch_level);
+    else if (CommsCommand(PacketCommand::get(request->packet)) == COMMAND_SET_CHANNEL)
+        link_channel_switch_started(_radio_switch_channel);
+
+    survey_pause();
+#if defined (SPI_CYCLE_COUNT)
+    _radio.spiCycles = 0;
+#endif
+    _radio.stopListening();
+    read_events();                      // Any received before the change, so they're not taken for ACK payloads
+
+    exchange_send_command();
+}
+
+
+static void exchange_send_command()
+{
+    PacketCounter::put(_exchange.request.packet, _exchange.counter);
+    _exchange.attempt_micros = micros();
+    _exchange.timeout_micros = rtt_timeout_micros();
+
+#ifdef DEBUG
+    Serial.println("Interface: Sending packet:");
+    print_packet(&_exchange.request.packet[0]);
+#endif
+
+    // Leaves CE high, as RF24::write() does, until startListening()
+    _radio.startFastWrite(&_exchange.request.packet[0], PACKET_SIZE, false);
+    _exchange.state = EXCHANGE_SENDING_COMMAND;
+}
+
+
+// Completes a write once the radio has had its ACK, or given up.  irq_micros
+// is when it interrupted, which loop() may have been slow to get to.
+static void exchange_write_done(bool tx_fail, uint32_t irq_micros)
+{
+    RadioPacket reply[ACK_PAYLOAD_SIZE];
+
+    record_link_packet(tx_fail);
+
+    if (tx_fail)
+    {
+        _radio.flush_tx();
+        exchange_fail_attempt(MESSAGE_NO_RECEIVER);
+        return;
+    }
+
+    // The controller has the command, and replies at the new settings
+    if (_exchange.state == EXCHANGE_SENDING_COMMAND)
+    {
+        _exchange.switch_acked = true;
+        if (CommsCommand(PacketCommand::get(_exchange.request.packet)) == COMMAND_SET_RADIO)
+            set_radio_level(_radio_switch_level);
+        else if (CommsCommand(PacketCommand::get(_exchange.request.packet)) == COMMAND_SET_CHANNEL)
+            set_radio_channel(_radio_switch_channel);
+    }
+
+    bool received = read_ack_payload(&reply[0]);
+
+    if (_exchange.state == EXCHANGE_SENDING_FETCH && received && AckPayloadCounter::get(reply) == _exchange.counter)
+    {
+        // Karn's rule: the reply to a retry may be to any attempt
+        if (_exchange.attempt == 0)
+            rtt_sample(irq_micros - _exchange.attempt_micros);
+        update_radio_retries();
+        exchange_finish(MESSAGE_OK, &reply[0]);
+        return;
+    }
+
+    _exchange.write_micros = irq_micros;
+    _exchange.state = EXCHANGE_WAITING;
+}
+
+
+static void exchange_fail_attempt(CommsMessage message)
+{
+    rtt_backoff();
+    update_radio_retries();
+
+    if (++_exchange.attempt < EXCHANGE_ATTEMPTS)
+    {
+        exchange_switch_settings();
+        exchange_send_command();
+    }
+    else
+        exchange_finish(message, NULL);
+}
+
+
+/* For COMMAND_SET_RADIO and COMMAND_SET_CHANNEL, sets the radio up for the
+ * next attempt.  Once the command has been ACKed the controller has switched,
+ * so the rest go at the new settings.  Until then, a write that failed may
+ * still have reached the controller with only its ACK lost, leaving it
+ * switched and deaf to the old settings, so the attempts alternate between
+ * the old settings and the new.
+ */
+static void exchange_switch_settings()
+{
+    CommsCommand command = CommsCommand(PacketCommand::get(_exchange.request.packet));
+    bool new_settings = _exchange.switch_acked || (_exchange.attempt & 1);
+
+    if (command == COMMAND_SET_RADIO)
+        set_radio_level(new_settings ? _radio_switch_level : link_level());
+    else if (command == COMMAND_SET_CHANNEL)
+        set_radio_channel(new_settings ? _radio_switch_channel : link_channel());
+}
+
+
+static void exchange_finish(CommsMessage message, const RadioPacket* reply)
+{
+    CommsCallback callback = _exchange.request.callback;
+
+    if (CommsCommand(PacketCommand::get(_exchange.request.packet)) == COMMAND_SET_RADIO)
+        link_switch_finished(message == MESSAGE_OK);
+    else if (CommsCommand(PacketCommand::get(_exchange.request.packet)) == COMMAND_SET_CHANNEL)
+        link_channel_switch_finished(message == MESSAGE_OK);
+    link_record_exchange(message == MESSAGE_OK);
+    update_radio_settings();
+
+#ifdef DEBUG
+    if (reply != NULL)
+    {
+        Serial.println("Interface: Received packet:");
+        print_packet(reply);
+    }
+#endif
+
+    _radio.startListening();
+    record_spi_cycles();
+    _exchange.state = EXCHANGE_IDLE;
+
+    // Last, as it may queue another request
+    if (callback != NULL)
+        callback(CommsCommand(PacketCommand::get(_exchange.request.packet)), message, reply);
+}
+
+
+// Sends out_packet and waits for the reply, a whole ACK payload, after the
+// exchange under way but ahead of any queued.
+CommsMessage communicate_with_slave(const RadioPacket* out_packet, RadioPacket* returned_packet)
+{
+    CommsRequest request;
+
+    while (_exchange.state != EXCHANGE_IDLE)
+        comms_poll();
+
+    memcpy(&request.packet[0], out_packet, PACKET_SIZE);
+    request.callback = blocking_exchange_done;
+    exchange_begin(&request);
+
+    while (_exchange.state != EXCHANGE_IDLE)
+        comms_poll();
+
+    if (_blocking_message == MESSAGE_OK)
+        memcpy(returned_packet, &_blocking_reply[0], ACK_PAYLOAD_SIZE);
+
+    return _blocking_message;
+}
+
+
+static void blocking_exchange_done(CommsCommand, CommsMessage message, const RadioPacket* reply)
+{
+    _blocking_message = message;
+    if (reply != NULL)
+        memcpy(&_blocking_reply[0], reply, ACK_PAYLOAD_SIZE);
+}
+
+
+/* Sends count packets (up to COMMS_PIPELINE_MAX) from out_packets, each
+ * PACKET_SIZE bytes, and waits for all their replies, which go in the same
+ * order in returned_packets, each ACK_PAYLOAD_SIZE bytes.  Rather than waiting for each reply in turn,
+ * the packets are sent PIPELINE_BURST at a time, back to back through the
+ * radio's FIFO, and the controller queues its replies to them (see
+ * lamphouse_shared.h), which are fetched and matched by packet counter.  Packets whose
+ * replies don't come are resent, with the same packet counters, up to
+ * EXCHANGE_ATTEMPTS times.  A pass of COMMS_PIPELINE_MAX fits the controller's
+ * replay window, so one it acted on but whose reply was lost is answered
+ * again rather than acted on twice.
+ *
+ * This is for bulk operations, such as uploading a program, where the
+ * packets don't depend on each other's replies.  The bursts and fetches are
+ * run by comms_poll(), as an exchange, so like communicate_with_slave(), it
+ * goes after the exchange under way but ahead of any queued.
+ */
+CommsMessage communicate_pipelined(const RadioPacket* out_packets, uint8_t count, RadioPacket* returned_packets)
+{
+    if (count > COMMS_PIPELINE_MAX)
+        return MESSAGE_INVALID_COMMAND;
+
+    while (_exchange.state != EXCHANGE_IDLE)
+        comms_poll();
+
+    _pipeline.out_packets = out_packets;
+    _pipeline.returned_packets = returned_packets;
+    _pipeline.count = count;
+    _pipeline.first_counter = _packet_counter;
+    _pipeline.next = 0;
+    _pipeline.replied = 0;
+    _pipeline.received = 0;
+    _packet_counter += count;
+    _exchange.attempt = 0;
+
+    survey_pause();
+#if defined (SPI_CYCLE_COUNT)
+    _radio.spiCycles = 0;
+#endif
+    _radio.stopListening();
+    read_events();
+    pipeline_send_burst();
+
+    while (_exchange.state != EXCHANGE_IDLE)
+        comms_poll();
+
+    return _blocking_message;
+}
+
+
+/* Writes the next PIPELINE_BURST packets still without replies into the TX
+ * FIFO, which has room for them all, so the radio sends them back to back.
+ * Once a pass over the packets is done, those still without replies are
+ * sent again on the next attempt.
+ */
+static void pipeline_send_burst()
+{
+    RadioPacket out_packet[PACKET_SIZE];
+    uint8_t sent = 0;
+
+    _pipeline.burst = 0;
+
+    for (; _pipeline.next < _pipeline.count && sent < PIPELINE_BURST; _pipeline.next++)
+    {
+        if (_pipeline.replied & (uint32_t(1) << _pipeline.next))
+            continue;
+
+        memcpy(&out_packet[0], &_pipeline.out_packets[_pipeline.next * PACKET_SIZE], PACKET_SIZE);
+        PacketCounter::put(out_packet, _pipeline.first_counter + _pipeline.next);
+        _radio.writeFast(&out_packet[0], PACKET_SIZE);
+        _pipeline.burst |= uint32_t(1) << _pipeline.next;
+        sent++;
+    }
+
+    if (_pipeline.burst != 0)
+    {
+        _exchange.attempt_micros = micros();
+        _exchange.timeout_micros = rtt_timeout_micros();
+        _exchange.state = EXCHANGE_SENDING_BURST;
+        return;
+    }
+
+    if (_pipeline.received < _pipeline.count)
+    {
+        rtt_backoff();
+        update_radio_retries();
+
+        if (++_exchange.attempt < EXCHANGE_ATTEMPTS)
+        {
+            _pipeline.next = 0;
+            pipeline_send_burst();
+            return;
+        }
+    }
+
+    pipeline_finish();
+}
+
+
+// Takes the replies that came back with the burst or a fetch.  The radio
+// interrupts as each packet of a burst goes, and the burst is done once the
+// FIFO is empty, or when one fails, which flushes the rest, so their replies
+// won't come.
+static void pipeline_write_done(bool tx_fail, uint32_t irq_micros)
+{
+    if (_exchange.state == EXCHANGE_SENDING_BURST && !tx_fail && !_radio.txFifoEmpty())
+    {
+        _pipeline.received += read_pipelined_replies(_pipeline.first_counter, _pipeline.count,
+            _pipeline.returned_packets, &_pipeline.replied);
+        return;
+    }
+
+    record_link_packet(tx_fail);
+
+    if (tx_fail)
+        _radio.flush_tx();
+    _pipeline.received += read_pipelined_replies(_pipeline.first_counter, _pipeline.count,
+        _pipeline.returned_packets, &_pipeline.replied);
+
+    _exchange.write_micros = irq_micros;
+    _exchange.state = EXCHANGE_WAITING_BURST;
+}
+
+
+// Between the burst and the fetches for its replies: sends the next burst
+// once all the replies are in or the burst has timed out, and otherwise a
+// fetch every REPLY_FETCH_INTERVAL_MICROS.
+static void pipeline_wait()
+{
+    RadioPacket fetch_packet[PACKET_SIZE];
+
+    if ((_pipeline.burst & ~_pipeline.replied) == 0 || micros() - _exchange.attempt_micros >= _exchange.timeout_micros)
+    {
+        pipeline_send_burst();
+        return;
+    }
+
+    if (micros() - _exchange.write_micros < REPLY_FETCH_INTERVAL_MICROS)
+        return;
+
+    memset(&fetch_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(fetch_packet, COMMAND_FETCH_REPLY);
+    PacketCounter::put(fetch_packet, _pipeline.first_counter + _pipeline.next - 1);
+    _radio.startFastWrite(&fetch_packet[0], PACKET_SIZE, false);
+    _exchange.state = EXCHANGE_SENDING_BURST_FETCH;
+}
+
+
+static void pipeline_finish()
+{
+    bool ok = _pipeline.received == _pipeline.count;
+
+    link_record_exchange(ok);
+    update_radio_settings();
+    _radio.startListening();
+    record_spi_cycles();
+    _exchange.state = EXCHANGE_IDLE;
+    _blocking_message = ok ? MESSAGE_OK : MESSAGE_TIMEOUT;
+}
+
+
+bool request_command(CommsCommand command, CommsCallback callback)
+{
+    RadioPacket out_packet[PACKET_SIZE];
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, command);
+
+    return comms_enqueue(&out_packet[0], callback);
+}
+
+
+bool request_channel_power(uint8_t red_power, uint16_t green_power, uint16_t blue_power, CommsCallback callback)
+{
+    RadioPacket out_packet[PACKET_SIZE];
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    pack_channel_power(&out_packet[0], red_power, green_power, blue_power);
+
+    return comms_enqueue(&out_packet[0], callback);
+}
+
+
+bool request_expose(uint8_t red_power, uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros, bool by_dose, CommsCallback callback)
+{
+    RadioPacket out_packet[PACKET_SIZE];
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    pack_expose(&out_packet[0], red_power, green_power, blue_power, target_millis, target_sub_micros, by_dose);
+
+    return comms_enqueue(&out_packet[0], callback);
+}
+
+
+bool request_test_strip(uint16_t green_power, uint16_t blue_power, uint32_t base_millis, uint16_t base_sub_micros, uint8_t stop_divisor, uint8_t strip_count, uint16_t pause_millis, CommsCallback callback)
+{
+    RadioPacket out_packet[PACKET_SIZE];
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    pack_test_strip(&out_packet[0], green_power, blue_power, base_millis, base_sub_micros, stop_divisor, strip_count, pause_millis);
+
+    return comms_enqueue(&out_packet[0], callback);
+}
+
+
+// Reads the ACK payload of the last write, if it had one.  Any earlier ones
+// are stale, so only the last is kept.
+static bool read_ack_payload(RadioPacket* reply)
+{
+    bool received = false;
+
+    while (_radio.isAckPayloadAvailable())
+    {
+        uint8_t size = _radio.getDynamicPayloadSize();
+
+        if (size == ACK_PAYLOAD_SIZE)
+        {
+            _radio.read(reply, ACK_PAYLOAD_SIZE);
+            received = true;
+        }
+        else
+        {
+            // Malformed, or flushed by getDynamicPayloadSize()
+            RadioPacket discard[32];
+            if (size != 0)
+                _radio.read(&discard[0], size);
+            received = false;
+        }
+    }
+
+    return received;
+}
+
+
+// Reads all the ACK payloads waiting, keeping those that are replies to
+// packets first_counter to first_counter + count - 1.  Returns how many new
+// replies there were.
+static uint8_t read_pipelined_replies(uint8_t first_counter, uint8_t count, RadioPacket* returned_packets, uint32_t* replied)
+{
+    RadioPacket reply[ACK_PAYLOAD_SIZE];
+    uint8_t received = 0;
+
+    while (_radio.isAckPayloadAvailable())
+    {
+        uint8_t size = _radio.getDynamicPayloadSize();
+
+        if (size != ACK_PAYLOAD_SIZE)
+        {
+            // Malformed, or flushed by getDynamicPayloadSize()
+            RadioPacket discard[32];
+            if (size != 0)
+                _radio.read(&discard[0], size);
+            continue;
+        }
+
+        _radio.read(&reply[0], ACK_PAYLOAD_SIZE);
+
+        uint8_t index = AckPayloadCounter::get(reply) - first_counter;
+        if (index >= count || (*replied & (uint32_t(1) << index)))
+            continue;
+
+        memcpy(&returned_packets[index * ACK_PAYLOAD_SIZE], &reply[0], ACK_PAYLOAD_SIZE);
+        *replied |= uint32_t(1) << index;
+        received++;
+    }
+
+    return received;
+}
+
+
+static void update_radio_retries()
+{
+    static uint8_t current_delay = 0, current_count = 0;
+    uint8_t delay = LINK_LEVELS[_radio_level].retry_delay;
+    uint8_t count;
+
+    rtt_radio_retries(delay, &count);
+    if (delay == current_delay && count == current_count)
+        return;
+
+    _radio.setRetries(delay, count);
+    current_delay = delay;
+    current_count = count;
+}
+
+
+// Makes a COMMAND_SET_CHANNEL or COMMAND_SET_RADIO request if the link
+// monitor wants another channel or level.
+static bool link_switch_request(CommsRequest* request)
+{
+    uint8_t channel, level;
+
+    memset(&request->packet[0], 0, PACKET_SIZE);
+    request->callback = NULL;
+    request->priority = COMMS_PRIORITY_QUERY;
+
+    if (link_wanted_channel(&channel))
+    {
+        PacketCommand::put(request->packet, COMMAND_SET_CHANNEL);
+        CommandRadioChannel::put(request->packet, channel);
+        _radio_switch_channel = channel;
+        return true;
+    }
+
+    if (link_wanted_level(&level))
+    {
+        PacketCommand::put(request->packet, COMMAND_SET_RADIO);
+        CommandRadioDataRate::put(request->packet, LINK_LEVELS[level].data_rate);
+        CommandRadioPaLevel::put(request->packet, LINK_LEVELS[level].pa_level);
+        _radio_switch_level = level;
+        return true;
+    }
+
+    return false;
+}
+
+
+// After each write, once the radio has had its ACK or given up
+static void record_link_packet(bool lost)
+{
+    link_record_packet(_radio.observeTx() & 0x0F, lost);      // ARC_CNT
+}
+
+
+static void set_radio_level(uint8_t level)
+{
+    _radio.setDataRate(rf24_datarate_e(LINK_LEVELS[level].data_rate));
+    _radio.setPALevel(LINK_LEVELS[level].pa_level);
+    _radio_level = level;
+    update_radio_retries();
+}
+
+
+static void set_radio_channel(uint8_t channel)
+{
+    _radio.setChannel(channel);
+    _radio_channel = channel;
+}
+
+
+// The SPI time of the exchange just finished, from stopListening() to
+// startListening()
+static void record_spi_cycles()
+{
+#if defined (SPI_CYCLE_COUNT)
+    _last_exchange_spi_cycles = _radio.spiCycles;
+    _spi_cycles += _radio.spiCycles;
+#endif
+}
+
+
+// Follows the link monitor's level and channel once an exchange is over,
+// whether the switch was confirmed, failed, or the link fell back to the
+// defaults.
+static void update_radio_settings()
+{
+    if (link_level() != _radio_level)
+        set_radio_level(link_level());
+    if (link_channel() != _radio_channel)
+        set_radio_channel(link_channel());
+}
+
+
+#ifdef DEBUG
+// The radio driver changes the registers it owns from shadow copies rather
+// than reading them first, so check now and then that they still match.
+static void check_shadow_registers()
+{
+    if (millis() - _shadow_check_millis < SHADOW_CHECK_INTERVAL_MILLIS)
+        return;
+    _shadow_check_millis = millis();
+
+    if (!_radio.verifyShadowRegisters())
+        Serial.println("Interface: Radio registers didn't match their shadows");
+}
+#endif
+
+
+static void radio_isr()
+{
+    // loop() uses the radio unmasked, so the flags are read by comms_poll()
+    radio_irq_latch(&_radio_irq, RADIO_IRQ_FLAGS_UNKNOWN, micros());
+}
+
+
+static uint8_t radio_read_irq_flags()
+{
+    bool tx_ok, tx_fail, rx_ready;
+
+    // Clears the IRQ, so that the next event gives a new edge
+    _radio.whatHappened(tx_ok, tx_fail, rx_ready);
+
+    return radio_irq_flags(tx_ok, tx_fail, rx_ready);
+}
+
+
+// Dispatches the radio's interrupts.  The IRQ stays low while any flag is
+// set, so if it's low with none latched, an edge was missed, such as one
+// during a clear, and the flags are dispatched anyway.
+static void radio_poll_irq()
+{
+    if (radio_irq_dispatch(&_radio_irq, radio_read_irq_flags) == 0 && digitalRead(PIN_RADIO_IRQ) == LOW)
+        radio_irq_call(&_radio_irq, radio_read_irq_flags(), micros());
+}
+
+
+static void radio_tx_done(uint32_t irq_micros)
+{
+    if (_exchange.state == EXCHANGE_SENDING_COMMAND || _exchange.state == EXCHANGE_SENDING_FETCH)
+        exchange_write_done(false, irq_micros);
+    else if (_exchange.state == EXCHANGE_SENDING_BURST || _exchange.state == EXCHANGE_SENDING_BURST_FETCH)
+        pipeline_write_done(false, irq_micros);
+}
+
+
+static void radio_tx_failed(uint32_t irq_micros)
+{
+    if (_exchange.state == EXCHANGE_SENDING_COMMAND || _exchange.state == EXCHANGE_SENDING_FETCH)
+        exchange_write_done(true, irq_micros);
+    else if (_exchange.state == EXCHANGE_SENDING_BURST || _exchange.state == EXCHANGE_SENDING_BURST_FETCH)
+        pipeline_write_done(true, irq_micros);
+}
+
+
+// During an exchange, RX_DR is for an ACK payload, which the exchange reads
+// itself.  Events carry no timing, so the interrupt time isn't needed.
+static void radio_rx_ready(uint32_t)
+{
+    if (_exchange.state == EXCHANGE_IDLE)
+        read_events();
+}
+
+
+// Reads any events waiting in the radio, keeping the latest.
+static void read_events()
+{
+    uint8_t pipe;
+
+    while (_radio.available(&pipe))
+    {
+        uint8_t size = _radio.getDynamicPayloadSize();
+
+        if (pipe == 1 && size == ACK_PAYLOAD_SIZE)
+        {
+            _radio.read(&_event[0], ACK_PAYLOAD_SIZE);
+            _event_received = true;
+        }
+        else
+        {
+            // Malformed, a stale ACK payload, or flushed by getDynamicPayloadSize()
+            RadioPacket discard[32];
+            if (size != 0)
+                _radio.read(&discard[0], size);
+        }
+    }
+}
+
+
+// Takes the latest event from the controller since the last call, if there
+// is one.  For a dose exposure, dose_reply is set and the status is as
+// query_dose(); otherwise the doses are zero.
+bool receive_event(ControllerExternalStatus* controller_status, bool* dose_reply, uint32_t* green_dose, uint32_t* blue_dose)
+{
+    // Events are read as they arrive, by radio_rx_ready()
+    if (!_event_received)
+        return false;
+    _event_received = false;
+
+#ifdef DEBUG
+    Serial.println("Interface: Received event:");
+    print_packet(&_event[0]);
+#endif
+
+    *dose_reply = CommsCommand(AckPayloadCounter::get(_event)) == COMMAND_REPORT_DOSE;
+    if (*dose_reply)
+        interpret_dose_packet(&_event[0], controller_status, green_dose, blue_dose);
+    else
+    {
+        interpret_return_packet(&_event[0], controller_status);
+        *green_dose = 0;
+        *blue_dose = 0;
+    }
+
+    return true;
+}
+
+
+// Round trip times of recent exchanges, which are zero until one has been
+// timed, and the current reply timeout.
+void query_round_trip(uint32_t* median_micros, uint32_t* p99_micros, uint32_t* timeout_micros)
+{
+    *median_micros = rtt_percentile_micros(50);
+    *p99_micros = rtt_percentile_micros(99);
+    *timeout_micros = rtt_timeout_micros();
+}
+
+
+void query_link(LinkStats* stats)
+{
+    link_stats(stats);
+    stats->spi_cycles = _spi_cycles;
+    stats->last_exchange_spi_cycles = _last_exchange_spi_cycles;
+}
+
+
+// returned_packet is a whole ACK payload, as the replies and events are.
+CommsMessage interpret_return_packet(const uint8_t* returned_packet, ControllerExternalStatus* controller_status)
+{
+    controller_status->latency_micros = AckPayloadLatency::get(returned_packet);
+
+    return packet_decode_status(returned_packet, controller_status);
+}
+
+
+CommsMessage set_controller_exposure(uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
+    ControllerExternalStatus controller_status;
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, COMMAND_SET_EXPOSURE);
+    CommandGreenPower::put(out_packet, green_power);
+    CommandBluePower::put(out_packet, blue_power);
+    CommandTargetMillis::put(out_packet, target_millis);
+    CommandTargetSubMicros::put(out_packet, target_sub_micros);
+
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    comms_message = interpret_return_packet(&returned_packet[0], &controller_status);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+#ifdef DEBUG
+    print_paired_status(0, green_power, blue_power, target_millis, target_sub_micros, &controller_status);
+#endif
+
+    if (
+        controller_status.channel_power[1] == green_power &&
+        controller_status.channel_power[2] == blue_power &&
+        controller_status.target_millis == target_millis &&
+        controller_status.target_sub_micros == target_sub_micros)
+        return MESSAGE_OK;
+
+    return MESSAGE_SET_FAILED;
+}
+
+
+CommsMessage set_controller_dose(uint16_t green_power, uint16_t blue_power, uint32_t green_dose, uint32_t blue_dose)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
+    ControllerExternalStatus controller_status;
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, COMMAND_SET_DOSE);
+    CommandGreenPower::put(out_packet, green_power);
+    CommandBluePower::put(out_packet, blue_power);
+    CommandGreenDose::put(out_packet, green_dose);
+    CommandBlueDose::put(out_packet, blue_dose);
+
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    comms_message = interpret_return_packet(&returned_packet[0], &controller_status);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    if (
+        controller_status.channel_power[1] == green_power &&
+        controller_status.channel_power[2] == blue_power &&
+        controller_status.target_millis == 0)
+        return MESSAGE_OK;
+
+    return MESSAGE_SET_FAILED;
+}
 
-void initialise_radio()
+
+CommsMessage set_channel_power(uint8_t red_power, uint16_t green_power, uint16_t blue_power)
 {
-    digitalWrite(PIN_RADIO_CSN, HIGH);
-    pinMode(PIN_RADIO_CSN, OUTPUT);
-    digitalWrite(PIN_RADIO_CE, HIGH);
-    pinMode(PIN_RADIO_CE, OUTPUT);
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
+    ControllerExternalStatus controller_status;
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    pack_channel_power(&out_packet[0], red_power, green_power, blue_power);
+
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    comms_message = interpret_return_packet(&returned_packet[0], &controller_status);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
     
-    SPI.begin();
-    SPI.setDataMode(SPI_MODE0);
-    SPI.setBitOrder(MSBFIRST);
+    if (
+        controller_status.channel_power[0] == uint16_t(red_power) << 4 &&
+        controller_status.channel_power[1] == green_power &&
+        controller_status.channel_power[2] == blue_power)
+        return MESSAGE_OK;
 
-    _radio.begin();
-    _radio.setRetries(15,15);
-    _radio.setChannel(RADIO_CHANNEL);
-    _radio.setAddressWidth(5);
-#ifdef DEBUG
-    _radio.setPALevel(RF24_PA_MIN);     // For close-proximity testing
-#else
-    _radio.setPALevel(RF24_PA_LOW);
-#endif
-    _radio.openWritingPipe(RADIO_ADDRESS_CONTROLLER);
-    _radio.openReadingPipe(1, RADIO_ADDRESS_INTERFACE);
-    _radio.stopListening();    
+    return MESSAGE_SET_FAILED;
 }
 
 
-CommsMessage communicate_with_slave(const RadioPacket* out_packet, RadioPacket* returned_packet)
+static void pack_channel_power(RadioPacket* out_packet, uint8_t red_power, uint16_t green_power, uint16_t blue_power)
 {
-    static uint8_t packet_counter = 0;
+    PacketCommand::put(out_packet, COMMAND_SET_CHANNEL_POWER);
+    CommandRedPower::put(out_packet, red_power);
+    CommandGreenPower::put(out_packet, green_power);
+    CommandBluePower::put(out_packet, blue_power);
+    CommandTargetMillis::put(out_packet, 0);
+}
 
-    RadioPacket out_packet_copy[PACKET_SIZE];
-    RadioPacket* out_packet_copy_ptr = &out_packet_copy[0];
-    memcpy(out_packet_copy_ptr, out_packet, sizeof(out_packet_copy));
-    out_packet_copy[15] = packet_counter++;
-    
-    _radio.stopListening();
 
-#ifdef DEBUG
-    Serial.println("Interface: Sending packet:");
-    print_packet(out_packet_copy_ptr);
-#endif
+CommsMessage send_command(CommsCommand command, ControllerExternalStatus* controller_status)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
 
-    if (!_radio.write(out_packet_copy_ptr, PACKET_SIZE))
-        return MESSAGE_NO_RECEIVER;
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, command);
 
-    _radio.startListening();
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
 
-    uint32_t end_time = millis() + 40;
-    bool message_received = false;
-    while (message_received == false && millis() < end_time)
-    {
-        delay(1);
-        while (_radio.available())
-        {
-            message_received = true;
-            _radio.read(returned_packet, PACKET_SIZE);
-        }
-    }
-    _radio.stopListening();
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
 
-#ifdef DEBUG
-    Serial.println("Interface: Received packet:");
-    print_packet(returned_packet);
-#endif
+    return interpret_return_packet(&returned_packet[0], controller_status);
+}
 
-    if (message_received == false)
-        return MESSAGE_TIMEOUT;
 
-    return MESSAGE_OK;
+// As send_command(COMMAND_REPORT_STATUS), but the reply carries the doses in
+// place of the times, which are left as zero.
+CommsMessage query_dose(ControllerExternalStatus* controller_status, uint32_t* green_dose, uint32_t* blue_dose)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, COMMAND_REPORT_DOSE);
+
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    return interpret_dose_packet(&returned_packet[0], controller_status, green_dose, blue_dose);
 }
 
 
-CommsMessage interpret_return_packet(const uint8_t* returned_packet, ControllerExternalStatus* controller_status)
+// As interpret_return_packet(), for the reply to COMMAND_REPORT_DOSE.
+CommsMessage interpret_dose_packet(const uint8_t* returned_packet, ControllerExternalStatus* controller_status, uint32_t* green_dose, uint32_t* blue_dose)
 {
-    controller_status->state = ControllerState(returned_packet[0] >> 6);
-    
-    controller_status->channel_power[0] = returned_packet[1];
-    controller_status->channel_power[1] = returned_packet[2];
-    controller_status->channel_power[2] = returned_packet[3];
-    
-    controller_status->target_millis = returned_packet[4];
-    controller_status->target_millis <<= 8;
-    controller_status->target_millis |= returned_packet[5];
-    controller_status->target_millis <<= 8;
-    controller_status->target_millis |= returned_packet[6];
-    controller_status->target_millis <<= 8;
-    controller_status->target_millis |= returned_packet[7];
+    CommsMessage comms_message = interpret_return_packet(returned_packet, controller_status);
 
-    controller_status->achieved_millis = returned_packet[8];
-    controller_status->achieved_millis <<= 8;
-    controller_status->achieved_millis |= returned_packet[9];
-    controller_status->achieved_millis <<= 8;
-    controller_status->achieved_millis |= returned_packet[10];
-    controller_status->achieved_millis <<= 8;
-    controller_status->achieved_millis |= returned_packet[11];
+    *green_dose = ReplyGreenDose::get(returned_packet);
+    *blue_dose = ReplyBlueDose::get(returned_packet);
+    controller_status->target_millis = 0;
+    controller_status->achieved_millis = 0;
 
-    return CommsMessage(returned_packet[0] & 0x3F);
+    return comms_message;
 }
 
 
-CommsMessage set_controller_exposure(uint8_t green_power, uint8_t blue_power, uint32_t target_millis)
+CommsMessage set_controller_metered(uint16_t green_power, uint16_t blue_power, uint32_t meter_dose)
 {
     CommsMessage comms_message;
-    RadioPacket out_packet[PACKET_SIZE], returned_packet[PACKET_SIZE];
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
     ControllerExternalStatus controller_status;
 
-    out_packet[0] = uint8_t(COMMAND_SET_EXPOSURE);
-    out_packet[1] = 0;
-    out_packet[2] = green_power;
-    out_packet[3] = blue_power;
-    out_packet[4] = target_millis >> 32;
-    out_packet[5] = (target_millis >> 16) & 0xFF;
-    out_packet[6] = (target_millis >> 8) & 0xFF;
-    out_packet[7] = target_millis & 0xFF;
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, COMMAND_SET_METERED);
+    CommandGreenPower::put(out_packet, green_power);
+    CommandBluePower::put(out_packet, blue_power);
+    CommandMeterDose::put(out_packet, meter_dose);
 
     comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
 
@@ -136,68 +1388,195 @@ CommsMessage set_controller_exposure(uint8_t green_power, uint8_t blue_power, ui
     if (comms_message != MESSAGE_OK)
         return comms_message;
 
-#ifdef DEBUG
-    print_paired_status(0, green_power, blue_power, target_millis, &controller_status);
-#endif
-
     if (
         controller_status.channel_power[1] == green_power &&
         controller_status.channel_power[2] == blue_power &&
-        controller_status.target_millis == target_millis)
+        controller_status.target_millis == 0)
         return MESSAGE_OK;
 
     return MESSAGE_SET_FAILED;
 }
 
 
-CommsMessage set_channel_power(uint8_t red_power, uint8_t green_power, uint8_t blue_power)
+// As query_dose(), for the light meter.
+CommsMessage query_meter(ControllerExternalStatus* controller_status, uint32_t* meter_dose, uint16_t* dark, uint16_t* light_level)
 {
     CommsMessage comms_message;
-    RadioPacket out_packet[PACKET_SIZE], returned_packet[PACKET_SIZE];
-    ControllerExternalStatus controller_status;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
 
-    out_packet[0] = uint8_t(COMMAND_SET_CHANNEL_POWER);
-    out_packet[1] = red_power;
-    out_packet[2] = green_power;
-    out_packet[3] = blue_power;
-    out_packet[4] = 0;
-    out_packet[5] = 0;
-    out_packet[6] = 0;
-    out_packet[7] = 0;
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, COMMAND_REPORT_METER);
 
     comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
 
     if (comms_message != MESSAGE_OK)
         return comms_message;
 
-    comms_message = interpret_return_packet(&returned_packet[0], &controller_status);
+    comms_message = interpret_return_packet(&returned_packet[0], controller_status);
+
+    *meter_dose = ReplyMeterDose::get(returned_packet);
+    *dark = ReplyMeterDark::get(returned_packet);
+    *light_level = ReplyMeterLight::get(returned_packet);
+    controller_status->target_millis = 0;
+    controller_status->achieved_millis = 0;
+
+    return comms_message;
+}
+
+
+// As query_dose(), for the controller's command-to-light latency.
+CommsMessage query_latency(ControllerExternalStatus* controller_status, uint16_t* latency_micros, uint16_t* worst_latency_micros, uint8_t* receive_overflows)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, COMMAND_REPORT_LATENCY);
+
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
 
     if (comms_message != MESSAGE_OK)
         return comms_message;
-    
-    if (
-        controller_status.channel_power[0] == red_power &&
-        controller_status.channel_power[1] == green_power &&
-        controller_status.channel_power[2] == blue_power)
-        return MESSAGE_OK;
 
-    return MESSAGE_SET_FAILED;
+    comms_message = interpret_return_packet(&returned_packet[0], controller_status);
+
+    *latency_micros = ReplyLatency::get(returned_packet);
+    *worst_latency_micros = ReplyWorstLatency::get(returned_packet);
+    *receive_overflows = ReplyReceiveOverflows::get(returned_packet);
+    controller_status->target_millis = 0;
+    controller_status->achieved_millis = 0;
+
+    return comms_message;
 }
 
 
-CommsMessage send_command(CommsCommand command, ControllerExternalStatus* controller_status)
+// Reads a page of up to HISTORY_RECORDS_PER_PACKET records into records,
+// starting from first_sequence, or the oldest the controller still holds.
+CommsMessage query_history(uint8_t first_sequence, ExposureHistoryRecord* records, uint8_t* record_count)
 {
     CommsMessage comms_message;
-    RadioPacket out_packet[PACKET_SIZE], returned_packet[PACKET_SIZE];
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
 
-    out_packet[0] = uint8_t(command);
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, COMMAND_REPORT_HISTORY);
+    CommandHistorySequence::put(out_packet, first_sequence);
+
+    *record_count = 0;
 
     comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
 
     if (comms_message != MESSAGE_OK)
         return comms_message;
 
-    return interpret_return_packet(&returned_packet[0], controller_status);
+    return unpack_history_page(&returned_packet[0], records, record_count);
+}
+
+
+// As query_history(), for page_count pages at once, from first_sequence on.
+// The pages are fetched together (see communicate_pipelined()), so this is
+// much quicker than reading them one at a time.  records must have room for
+// page_count * HISTORY_RECORDS_PER_PACKET.
+CommsMessage query_history_pages(uint8_t first_sequence, uint8_t page_count, ExposureHistoryRecord* records, uint8_t* record_count)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packets[COMMS_PIPELINE_MAX][PACKET_SIZE], returned_packets[COMMS_PIPELINE_MAX][ACK_PAYLOAD_SIZE];
+
+    *record_count = 0;
+
+    if (page_count > COMMS_PIPELINE_MAX)
+        return MESSAGE_INVALID_COMMAND;
+
+    memset(&out_packets[0][0], 0, sizeof(out_packets));
+
+    for (uint8_t i = 0; i < page_count; i++)
+    {
+        PacketCommand::put(out_packets[i], COMMAND_REPORT_HISTORY);
+        CommandHistorySequence::put(out_packets[i], first_sequence + i * HISTORY_RECORDS_PER_PACKET);
+    }
+
+    comms_message = communicate_pipelined(&out_packets[0][0], page_count, &returned_packets[0][0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    for (uint8_t i = 0; i < page_count; i++)
+    {
+        uint8_t page_record_count;
+
+        comms_message = unpack_history_page(&returned_packets[i][0], &records[*record_count], &page_record_count);
+
+        if (comms_message != MESSAGE_OK)
+            return comms_message;
+
+        *record_count += page_record_count;
+
+        // The rest are past the newest record
+        if (page_record_count < HISTORY_RECORDS_PER_PACKET)
+            break;
+    }
+
+    return MESSAGE_OK;
+}
+
+
+static CommsMessage unpack_history_page(const RadioPacket* returned_packet, ExposureHistoryRecord* records, uint8_t* record_count)
+{
+    CommsMessage comms_message = CommsMessage(ReplyMessage::get(returned_packet));
+
+    *record_count = 0;
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    for (uint8_t i = 0; i < HISTORY_RECORDS_PER_PACKET; i++)
+    {
+        const RadioPacket* record = &returned_packet[2 + i * HISTORY_RECORD_SIZE];
+        uint32_t achieved = (uint32_t(record[0]) << 24) | (uint32_t(record[1]) << 16) | (uint32_t(record[2]) << 8) | record[3];
+
+        // Empty slots are only ever at the end
+        if ((achieved & 0x3FF) > 999)
+            break;
+
+        records[i].sequence = ReplyHistorySequence::get(returned_packet) + i;
+        records[i].achieved_millis = achieved >> 10;
+        records[i].achieved_sub_micros = achieved & 0x3FF;
+        records[i].timed = int8_t(record[4]) != HISTORY_OVERSHOOT_UNTIMED;
+        records[i].overshoot_micros = records[i].timed ? int8_t(record[4]) : 0;
+        records[i].green_power = uint16_t(record[5]) << 4;
+        records[i].blue_power = uint16_t(record[6]) << 4;
+        (*record_count)++;
+    }
+
+    return MESSAGE_OK;
+}
+
+
+// Skews are in controller timer counts (0.5 us); see COMMAND_MEASURE_SKEW.
+CommsMessage measure_skew(uint16_t green_power, uint16_t blue_power, int16_t* on_skew_counts, int16_t* off_skew_counts)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
+    ControllerExternalStatus controller_status;
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    PacketCommand::put(out_packet, COMMAND_MEASURE_SKEW);
+    CommandGreenPower::put(out_packet, green_power);
+    CommandBluePower::put(out_packet, blue_power);
+
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    comms_message = interpret_return_packet(&returned_packet[0], &controller_status);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    *on_skew_counts = int16_t(ReplyOnSkew::get(returned_packet));
+    *off_skew_counts = int16_t(ReplyOffSkew::get(returned_packet));
+
+    return MESSAGE_OK;
 }
 
 
@@ -218,6 +1597,51 @@ CommsMessage start_exposure()
 }
 
 
+// Sets the powers and target and starts the exposure in one exchange.  With
+// by_dose, each channel is exposed to the dose of the target time at its
+// power, so its power may be changed with set_channel_power() as it runs.
+CommsMessage expose(uint8_t red_power, uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros, bool by_dose)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
+    ControllerExternalStatus controller_status;
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    pack_expose(&out_packet[0], red_power, green_power, blue_power, target_millis, target_sub_micros, by_dose);
+
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    comms_message = interpret_return_packet(&returned_packet[0], &controller_status);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    if (
+        controller_status.state == CONTROLLER_STATE_EXPOSING &&
+        controller_status.channel_power[0] == uint16_t(red_power) << 4 &&
+        controller_status.channel_power[1] == green_power &&
+        controller_status.channel_power[2] == blue_power)
+        return MESSAGE_OK;
+
+    return MESSAGE_SET_FAILED;
+}
+
+
+static void pack_expose(RadioPacket* out_packet, uint8_t red_power, uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros, bool by_dose)
+{
+    PacketCommand::put(out_packet, COMMAND_EXPOSE);
+    CommandRedPower::put(out_packet, red_power);
+    CommandGreenPower::put(out_packet, green_power);
+    CommandBluePower::put(out_packet, blue_power);
+    CommandTargetMillis::put(out_packet, target_millis);
+    CommandExposeFlags::put(out_packet, by_dose ? EXPOSE_FLAG_BY_DOSE : 0);
+    CommandTargetSubMicros::put(out_packet, target_sub_micros);
+}
+
+
 CommsMessage stop_exposure()
 {
     ControllerExternalStatus controller_status;
@@ -235,6 +1659,107 @@ CommsMessage stop_exposure()
 }
 
 
+// The steps are sent together (see communicate_pipelined()).
+CommsMessage upload_program(const ProgramStep* steps, uint8_t step_count)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packets[PROGRAM_MAX_STEPS][PACKET_SIZE], returned_packets[PROGRAM_MAX_STEPS][ACK_PAYLOAD_SIZE];
+    ControllerExternalStatus controller_status;
+
+    if (step_count == 0 || step_count > PROGRAM_MAX_STEPS)
+        return MESSAGE_INVALID_PROGRAM;
+
+    for (uint8_t i = 0; i < step_count; i++)
+    {
+        RadioPacket* out_packet = &out_packets[i][0];
+
+        memset(out_packet, 0, PACKET_SIZE);
+        PacketCommand::put(out_packet, COMMAND_PROGRAM_UPLOAD_STEP);
+        packet_encode_program_step(out_packet, i, &steps[i]);
+    }
+
+    comms_message = communicate_pipelined(&out_packets[0][0], step_count, &returned_packets[0][0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    for (uint8_t i = 0; i < step_count; i++)
+    {
+        comms_message = interpret_return_packet(&returned_packets[i][0], &controller_status);
+
+        if (comms_message != MESSAGE_OK)
+            return comms_message;
+    }
+
+    return MESSAGE_OK;
+}
+
+
+CommsMessage start_program()
+{
+    ControllerExternalStatus controller_status;
+    CommsMessage comms_message;
+
+    comms_message = send_command(COMMAND_PROGRAM_START, &controller_status);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    if (controller_status.state == CONTROLLER_STATE_NOT_EXPOSING)
+        return MESSAGE_SET_FAILED;
+
+    return MESSAGE_OK;
+}
+
+
+CommsMessage continue_program()
+{
+    ControllerExternalStatus controller_status;
+
+    return send_command(COMMAND_PROGRAM_CONTINUE, &controller_status);
+}
+
+
+CommsMessage start_test_strip(uint16_t green_power, uint16_t blue_power, uint32_t base_millis, uint16_t base_sub_micros, uint8_t stop_divisor, uint8_t strip_count, uint16_t pause_millis)
+{
+    CommsMessage comms_message;
+    RadioPacket out_packet[PACKET_SIZE], returned_packet[ACK_PAYLOAD_SIZE];
+    ControllerExternalStatus controller_status;
+
+    memset(&out_packet[0], 0, PACKET_SIZE);
+    pack_test_strip(&out_packet[0], green_power, blue_power, base_millis, base_sub_micros, stop_divisor, strip_count, pause_millis);
+
+    comms_message = communicate_with_slave(&out_packet[0], &returned_packet[0]);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    comms_message = interpret_return_packet(&returned_packet[0], &controller_status);
+
+    if (comms_message != MESSAGE_OK)
+        return comms_message;
+
+    if (controller_status.state == CONTROLLER_STATE_NOT_EXPOSING)
+        return MESSAGE_SET_FAILED;
+
+    return MESSAGE_OK;
+}
+
+
+
+static void pack_test_strip(RadioPacket* out_packet, uint16_t green_power, uint16_t blue_power, uint32_t base_millis, uint16_t base_sub_micros, uint8_t stop_divisor, uint8_t strip_count, uint16_t pause_millis)
+{
+    PacketCommand::put(out_packet, COMMAND_TEST_STRIP);
+    CommandGreenPower::put(out_packet, green_power);
+    CommandBluePower::put(out_packet, blue_power);
+    CommandTargetMillis::put(out_packet, base_millis);
+    CommandStopDivisor::put(out_packet, stop_divisor);
+    CommandStripCount::put(out_packet, strip_count);
+    CommandStripPauseMillis::put(out_packet, pause_millis);
+    CommandTargetSubMicros::put(out_packet, base_sub_micros);
+}
+
+
 #ifdef DEBUG
 void print_status(const ControllerExternalStatus* controller_status)
 {
@@ -251,12 +1776,12 @@ void print_status(const ControllerExternalStatus* controller_status)
 }
 
 
-void print_paired_status(uint8_t red_power, uint8_t green_power, uint8_t blue_power, uint32_t target_millis, const ControllerExternalStatus* controller_status)
+void print_paired_status(uint8_t red_power, uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros, const ControllerExternalStatus* controller_status)
 {
     Serial.println("CONTROLLER-INTERFACE AGREEMENT:");
     Serial.println("Value\tInterface\tController");
     Serial.print("Red\t");
-    Serial.print(red_power);
+    Serial.print(uint16_t(red_power) << 4);
     Serial.print("\t\t");
     Serial.println(controller_status->channel_power[0]);
     Serial.print("Green\t");
@@ -271,6 +1796,10 @@ void print_paired_status(uint8_t red_power, uint8_t green_power, uint8_t blue_po
     Serial.print(target_millis);
     Serial.print("\t\t");
     Serial.println(controller_status->target_millis);
+    Serial.print("Sub-ms\t");
+    Serial.print(target_sub_micros);
+    Serial.print("\t\t");
+    Serial.println(controller_status->target_sub_micros);
 }
 
 
@@ -291,7 +1820,7 @@ void print_packet(const RadioPacket* packet)
     CommsMessage msg;
     ControllerExternalStatus controller_status;
     
-    msg = interpret_return_packet(packet, &controller_status);
+    msg = packet_decode_status(packet, &controller_status);
 
     print_packet_raw(packet);
     Serial.println("PACKET:");
@@ -306,16 +1835,18 @@ void print_packet(const RadioPacket* packet)
     Serial.print("Blue:     ");
     Serial.println(controller_status.channel_power[2]);
     Serial.print("Target:   ");
-    Serial.println(controller_status.target_millis);
+    Serial.print(controller_status.target_millis);
+    Serial.print(" ms + ");
+    Serial.print(controller_status.target_sub_micros);
+    Serial.println(" us");
     Serial.print("Achieved: ");
-    Serial.println(controller_status.achieved_millis);
-    Serial.print("Reserved: ");
-    Serial.print(packet[12]);
-    Serial.print(" ");
-    Serial.print(packet[13]);
-    Serial.print(" ");
-    Serial.print(packet[14]);
-    Serial.print(" ");
+    Serial.print(controller_status.achieved_millis);
+    Serial.print(" ms + ");
+    Serial.print(controller_status.achieved_sub_micros);
+    Serial.println(" us");
+    Serial.print("Step:     ");
+    Serial.println(controller_status.step_index);
+    Serial.print("Counter:  ");
     Serial.println(packet[15]);
 }
-#endif
+#endif
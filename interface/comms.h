@@ -1,32 +1,87 @@
 #pragma once
 
-#include "shared.h"
+#include <lamphouse_shared.h>
+#include <lamphouse_packet.h>
+
+#include "link.h"
 
 #undef DEBUG
 
-struct ControllerExternalStatus
+// An exposure history record (see lamphouse_shared.h), unpacked
+struct ExposureHistoryRecord
 {
-    ControllerState state;
-    uint8_t channel_power[3];
-    uint32_t target_millis;
+    uint8_t sequence;
     uint32_t achieved_millis;
+    uint16_t achieved_sub_micros;
+    bool timed;                 // Overshoot is valid; dose and metered exposures have no target time
+    int8_t overshoot_micros;
+    uint16_t green_power;       // 12-bit, though only the upper 8 bits are recorded
+    uint16_t blue_power;
+};
+
+
+// Request priorities, highest first
+enum CommsPriority {
+    COMMS_PRIORITY_STOP,                // COMMAND_STOP_EXPOSURE is always sent first
+    COMMS_PRIORITY_CONTROL,
+    COMMS_PRIORITY_QUERY
 };
 
 
+// Called when a queued request completes.  reply is the controller's reply
+// if there was one; otherwise it's NULL, and message says why.
+typedef void (*CommsCallback)(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+
+const static uint8_t COMMS_QUEUE_LENGTH = 8;
+// A pipelined packet is resent after the rest of its pass, so a pass must fit
+// the controller's replay window, or a resent one is acted on twice
+const static uint8_t COMMS_PIPELINE_MAX = REPLAY_WINDOW;
+
+
 void initialise_radio();
+void comms_survey_channels();
 
-CommsMessage communicate_with_slave(const RadioPacket* out_packet, RadioPacket* returned_packet);
+// Queued requests, which return as soon as they're queued (see comms.cpp).
+// comms_poll() must be called from loop() to send them.
+void comms_poll();
+bool comms_idle();
+bool request_command(CommsCommand command, CommsCallback callback);
+bool request_channel_power(uint8_t red_power, uint16_t green_power, uint16_t blue_power, CommsCallback callback);
+bool request_expose(uint8_t red_power, uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros, bool by_dose, CommsCallback callback);
+bool request_test_strip(uint16_t green_power, uint16_t blue_power, uint32_t base_millis, uint16_t base_sub_micros, uint8_t stop_divisor, uint8_t strip_count, uint16_t pause_millis, CommsCallback callback);
+
+bool receive_event(ControllerExternalStatus* controller_status, bool* dose_reply, uint32_t* green_dose, uint32_t* blue_dose);
+void query_round_trip(uint32_t* median_micros, uint32_t* p99_micros, uint32_t* timeout_micros);
+void query_link(LinkStats* stats);
 CommsMessage interpret_return_packet(const uint8_t* returned_packet, ControllerExternalStatus* controller_status);
-CommsMessage set_controller_exposure(uint8_t green_power, uint8_t blue_power, uint32_t target_millis);
-CommsMessage set_channel_power(uint8_t red_power, uint8_t green_power, uint8_t blue_power);
+CommsMessage interpret_dose_packet(const uint8_t* returned_packet, ControllerExternalStatus* controller_status, uint32_t* green_dose, uint32_t* blue_dose);
+
+// These wait for the reply.
+CommsMessage communicate_with_slave(const RadioPacket* out_packet, RadioPacket* returned_packet);
+CommsMessage communicate_pipelined(const RadioPacket* out_packets, uint8_t count, RadioPacket* returned_packets);
+CommsMessage set_controller_exposure(uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros);
+CommsMessage set_controller_dose(uint16_t green_power, uint16_t blue_power, uint32_t green_dose, uint32_t blue_dose);
+CommsMessage set_channel_power(uint8_t red_power, uint16_t green_power, uint16_t blue_power);
+CommsMessage query_dose(ControllerExternalStatus* controller_status, uint32_t* green_dose, uint32_t* blue_dose);
+CommsMessage set_controller_metered(uint16_t green_power, uint16_t blue_power, uint32_t meter_dose);
+CommsMessage query_meter(ControllerExternalStatus* controller_status, uint32_t* meter_dose, uint16_t* dark, uint16_t* light_level);
+CommsMessage query_latency(ControllerExternalStatus* controller_status, uint16_t* latency_micros, uint16_t* worst_latency_micros, uint8_t* receive_overflows);
+CommsMessage query_history(uint8_t first_sequence, ExposureHistoryRecord* records, uint8_t* record_count);
+CommsMessage query_history_pages(uint8_t first_sequence, uint8_t page_count, ExposureHistoryRecord* records, uint8_t* record_count);
+CommsMessage measure_skew(uint16_t green_power, uint16_t blue_power, int16_t* on_skew_counts, int16_t* off_skew_counts);
 CommsMessage send_command(CommsCommand command, ControllerExternalStatus* controller_status);
 CommsMessage start_exposure();
+CommsMessage expose(uint8_t red_power, uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros, bool by_dose);
 CommsMessage stop_exposure();
+CommsMessage upload_program(const ProgramStep* steps, uint8_t step_count);
+CommsMessage start_program();
+CommsMessage continue_program();
+CommsMessage start_test_strip(uint16_t green_power, uint16_t blue_power, uint32_t base_millis, uint16_t base_sub_micros, uint8_t stop_divisor, uint8_t strip_count, uint16_t pause_millis);
 
 #ifdef DEBUG
 void print_status(const ControllerExternalStatus* controller_status);
-void print_paired_status(uint8_t red_power, uint8_t green_power, uint8_t blue_power, uint32_t target_millis, const ControllerExternalStatus* controller_status);
+void print_paired_status(uint8_t red_power, uint16_t green_power, uint16_t blue_power, uint32_t target_millis, uint16_t target_sub_micros, const ControllerExternalStatus* controller_status);
 void print_packet_raw(const RadioPacket* packet);
 void print_packet(const RadioPacket* packet);
 #endif
-
+
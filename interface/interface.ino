@@ -3,7 +3,7 @@
 #include "comms.h"
 #include "tft.h"
 
-#include "shared.h"
+#include <lamphouse_shared.h>
 
 /* Notes:
  *  Timing logic susceptible to overflow.  Will only be a problem if system is on
@@ -33,6 +33,9 @@ void setup()
 
 void loop()
 {
+    // Radio exchanges advance a step at a time, between display and touch
+    // work.
+    comms_poll();
     display_loop();
 }
 
@@ -43,11 +46,14 @@ void display_loop(void)
     static uint8_t mode = 0;
     uint32_t tick = millis();
 
+    // Acted on as soon as they arrive
+    display_receive_controller_event();
+
     if (tick < display_next_update)
         return;
 
     //  Mode    Action
-    //  0       Radio query
+    //  0       Radio query, if due
     //  1       Display update
     //  2       Touch
     //  3       Display update
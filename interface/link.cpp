@@ -0,0 +1,362 @@
+#include "link.h"
+
+
+// Values of rf24_datarate_e and rf24_pa_dbm_e, which aren't included here so
+// that this builds on a host
+const static uint8_t LINK_1MBPS = 0;
+const static uint8_t LINK_2MBPS = 1;
+const static uint8_t LINK_250KBPS = 2;
+const static uint8_t LINK_PA_MIN = 0;
+const static uint8_t LINK_PA_LOW = 1;
+const static uint8_t LINK_PA_HIGH = 2;
+const static uint8_t LINK_PA_MAX = 3;
+
+const LinkLevel LINK_LEVELS[LINK_LEVEL_COUNT] = {
+    { LINK_2MBPS, LINK_PA_MIN, 1 },     // ARD 500 us
+    { LINK_2MBPS, LINK_PA_LOW, 1 },
+    { LINK_2MBPS, LINK_PA_HIGH, 1 },
+    { LINK_2MBPS, LINK_PA_MAX, 1 },
+    { LINK_1MBPS, LINK_PA_MAX, 3 },     // ARD 1 ms
+    { LINK_250KBPS, LINK_PA_MAX, 5 }    // ARD 1.5 ms
+};
+
+// As RADIO_DEFAULT_DATA_RATE and RADIO_DEFAULT_PA_LEVEL in lamphouse_shared.h
+const uint8_t LINK_DEFAULT_LEVEL = 4;
+
+const static uint8_t LINK_NO_LEVEL = 0xFF;
+const static uint8_t LINK_NO_CHANNEL = 0xFF;
+
+
+struct LinkMonitor
+{
+    uint8_t level;
+    uint8_t wanted_level;               // LINK_NO_LEVEL if none
+    uint8_t switch_level;               // Being switched to, or LINK_NO_LEVEL
+    bool lowered;                       // The last switch lowered the level
+    uint8_t channel;
+    uint8_t wanted_channel;             // LINK_NO_CHANNEL if none
+    uint8_t switch_channel;             // Being switched to, or LINK_NO_CHANNEL
+    uint8_t retry_channel;              // To try again, or LINK_NO_CHANNEL
+    uint8_t retry_wait;                 // Good exchanges until it's tried
+    uint8_t channel_attempts;           // Since the survey
+    uint8_t window_packets;
+    uint16_t window_retransmits;
+    bool window_lost;
+    uint8_t good_windows;
+    uint8_t good_windows_needed;
+    uint8_t failed_exchanges;           // In a row
+    LinkStats stats;
+};
+
+
+static LinkMonitor _link;
+
+
+static void link_end_window();
+static void link_reset_window();
+static void link_back_off();
+static void link_set_level(uint8_t level);
+static void link_channel_failed(uint8_t channel);
+
+
+void link_init()
+{
+    _link.level = LINK_DEFAULT_LEVEL;
+    _link.wanted_level = LINK_NO_LEVEL;
+    _link.switch_level = LINK_NO_LEVEL;
+    _link.lowered = false;
+    _link.channel = RADIO_CHANNEL;
+    _link.wanted_channel = LINK_NO_CHANNEL;
+    _link.switch_channel = LINK_NO_CHANNEL;
+    _link.retry_channel = LINK_NO_CHANNEL;
+    _link.channel_attempts = 0;
+    _link.good_windows = 0;
+    _link.good_windows_needed = LINK_GOOD_WINDOWS;
+    _link.failed_exchanges = 0;
+    link_reset_window();
+
+    _link.stats.level = LINK_DEFAULT_LEVEL;
+    _link.stats.channel = RADIO_CHANNEL;
+    _link.stats.packets = 0;
+    _link.stats.retransmits = 0;
+    _link.stats.lost_packets = 0;
+    _link.stats.exchanges = 0;
+    _link.stats.failed_exchanges = 0;
+    _link.stats.window_loss_percent = 0;
+    _link.stats.switches = 0;
+    _link.stats.failed_switches = 0;
+}
+
+
+// After each packet written, with its ARC_CNT, and whether it hit MAX_RT
+void link_record_packet(uint8_t retransmits, bool lost)
+{
+    _link.stats.packets++;
+    _link.stats.retransmits += retransmits;
+    if (lost)
+        _link.stats.lost_packets++;
+
+    // Packets during a switch are at one level or the other
+    if (_link.switch_level != LINK_NO_LEVEL || _link.switch_channel != LINK_NO_CHANNEL)
+        return;
+
+    _link.window_packets++;
+    _link.window_retransmits += retransmits;
+    _link.window_lost |= lost;
+
+    // A lost packet ends the window early, so the level goes up at once
+    if (_link.window_packets >= LINK_WINDOW_PACKETS || lost)
+        link_end_window();
+}
+
+
+// After each exchange, whether its reply came
+void link_record_exchange(bool ok)
+{
+    _link.stats.exchanges++;
+
+    if (ok)
+    {
+        _link.failed_exchanges = 0;
+        if (_link.retry_channel != LINK_NO_CHANNEL && --_link.retry_wait == 0)
+        {
+            _link.wanted_channel = _link.retry_channel;
+            _link.retry_channel = LINK_NO_CHANNEL;
+        }
+        return;
+    }
+
+    _link.stats.failed_exchanges++;
+    if (++_link.failed_exchanges < LINK_LOST_EXCHANGES)
+        return;
+    _link.failed_exchanges = 0;
+
+    // The ends may be at different settings, so go back to those the
+    // controller falls back to.
+    if (_link.switch_level != LINK_NO_LEVEL || _link.switch_channel != LINK_NO_CHANNEL)
+        return;
+    if (_link.level != LINK_DEFAULT_LEVEL)
+    {
+        link_back_off();
+        link_set_level(LINK_DEFAULT_LEVEL);
+        _link.lowered = false;
+    }
+    if (_link.channel != RADIO_CHANNEL)
+    {
+        link_channel_failed(_link.channel);
+        _link.channel = RADIO_CHANNEL;
+        _link.stats.channel = RADIO_CHANNEL;
+        link_reset_window();
+    }
+}
+
+
+// A switch is wanted to level, and none is under way.
+bool link_wanted_level(uint8_t* level)
+{
+    if (_link.wanted_level == LINK_NO_LEVEL || _link.switch_level != LINK_NO_LEVEL || _link.switch_channel != LINK_NO_CHANNEL)
+        return false;
+
+    *level = _link.wanted_level;
+    return true;
+}
+
+
+void link_switch_started(uint8_t level)
+{
+    _link.switch_level = level;
+    _link.wanted_level = LINK_NO_LEVEL;
+}
+
+
+// Whether the controller confirmed the switch at the new level
+void link_switch_finished(bool ok)
+{
+    uint8_t level = _link.switch_level;
+
+    if (level == LINK_NO_LEVEL)
+        return;
+    _link.switch_level = LINK_NO_LEVEL;
+
+    if (!ok)
+    {
+        _link.stats.failed_switches++;
+        if (level < _link.level)
+            link_back_off();
+        link_reset_window();
+        return;
+    }
+
+    // Going up straight after coming down, the lower level wasn't good
+    // enough; coming down again, it was.
+    if (_link.lowered && level > _link.level)
+        link_back_off();
+    else if (_link.lowered && _link.good_windows_needed > LINK_GOOD_WINDOWS)
+        _link.good_windows_needed /= 2;
+    _link.lowered = level < _link.level;
+
+    link_set_level(level);
+}
+
+
+uint8_t link_level()
+{
+    return _link.level;
+}
+
+
+// From a survey's counts for each of LINK_CHANNEL_COUNT channels.  A switch
+// is wanted if the channel chosen isn't the current one.
+uint8_t link_choose_channel(const uint8_t* busy_counts)
+{
+    uint8_t best_channel = RADIO_CHANNEL;
+    uint16_t best_score = 0xFFFF;
+
+    for (uint8_t channel = 0; channel < LINK_CHANNEL_COUNT; channel++)
+    {
+        uint16_t score = 0;
+
+        for (int16_t neighbour = int16_t(channel) - LINK_SURVEY_SPREAD; neighbour <= channel + LINK_SURVEY_SPREAD; neighbour++)
+        {
+            if (neighbour >= 0 && neighbour < LINK_CHANNEL_COUNT)
+                score += busy_counts[neighbour];
+        }
+
+        uint8_t distance = channel > RADIO_CHANNEL ? channel - RADIO_CHANNEL : RADIO_CHANNEL - channel;
+        uint8_t best_distance = best_channel > RADIO_CHANNEL ? best_channel - RADIO_CHANNEL : RADIO_CHANNEL - best_channel;
+        if (score < best_score || (score == best_score && distance < best_distance))
+        {
+            best_score = score;
+            best_channel = channel;
+        }
+    }
+
+    _link.wanted_channel = best_channel == _link.channel ? LINK_NO_CHANNEL : best_channel;
+    _link.retry_channel = LINK_NO_CHANNEL;
+    _link.channel_attempts = 0;
+
+    return best_channel;
+}
+
+
+// A switch is wanted to channel, and none is under way.
+bool link_wanted_channel(uint8_t* channel)
+{
+    if (_link.wanted_channel == LINK_NO_CHANNEL || _link.switch_channel != LINK_NO_CHANNEL || _link.switch_level != LINK_NO_LEVEL)
+        return false;
+
+    *channel = _link.wanted_channel;
+    return true;
+}
+
+
+void link_channel_switch_started(uint8_t channel)
+{
+    _link.switch_channel = channel;
+    _link.wanted_channel = LINK_NO_CHANNEL;
+}
+
+
+// Whether the controller confirmed the switch on the new channel
+void link_channel_switch_finished(bool ok)
+{
+    uint8_t channel = _link.switch_channel;
+
+    if (channel == LINK_NO_CHANNEL)
+        return;
+    _link.switch_channel = LINK_NO_CHANNEL;
+
+    if (ok)
+    {
+        _link.channel = channel;
+        _link.stats.channel = channel;
+    }
+    else
+        link_channel_failed(channel);
+    link_reset_window();
+}
+
+
+uint8_t link_channel()
+{
+    return _link.channel;
+}
+
+
+void link_stats(LinkStats* stats)
+{
+    *stats = _link.stats;
+}
+
+
+static void link_end_window()
+{
+    uint16_t transmissions = _link.window_packets + _link.window_retransmits;
+    uint8_t loss_percent = uint8_t(uint32_t(_link.window_retransmits) * 100 / transmissions);
+
+    _link.stats.window_loss_percent = loss_percent;
+
+    if (_link.window_lost || loss_percent > LINK_LOSS_HIGH_PERCENT)
+    {
+        _link.good_windows = 0;
+        if (_link.level + 1 < LINK_LEVEL_COUNT)
+            _link.wanted_level = _link.level + 1;
+    }
+    else if (loss_percent < LINK_LOSS_LOW_PERCENT)
+    {
+        if (++_link.good_windows >= _link.good_windows_needed && _link.level > 0)
+        {
+            _link.good_windows = 0;
+            _link.wanted_level = _link.level - 1;
+        }
+    }
+    else
+        _link.good_windows = 0;
+
+    link_reset_window();
+}
+
+
+static void link_reset_window()
+{
+    _link.window_packets = 0;
+    _link.window_retransmits = 0;
+    _link.window_lost = false;
+}
+
+
+// Waits longer before lowering the level again
+static void link_back_off()
+{
+    if (_link.good_windows_needed < LINK_MAX_GOOD_WINDOWS)
+        _link.good_windows_needed *= 2;
+    _link.good_windows = 0;
+}
+
+
+static void link_set_level(uint8_t level)
+{
+    if (level == _link.level)
+        return;
+
+    _link.level = level;
+    _link.wanted_level = LINK_NO_LEVEL;
+    _link.good_windows = 0;
+    _link.failed_exchanges = 0;
+    link_reset_window();
+
+    _link.stats.level = level;
+    _link.stats.switches++;
+}
+
+
+// Tries channel again later, unless it has had all its attempts
+static void link_channel_failed(uint8_t channel)
+{
+    _link.wanted_channel = LINK_NO_CHANNEL;
+    if (++_link.channel_attempts >= LINK_CHANNEL_ATTEMPTS)
+        return;
+
+    _link.retry_channel = channel;
+    _link.retry_wait = LINK_CHANNEL_RETRY_EXCHANGES;
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <lamphouse_shared.h>
+
+/* Link monitor.
+ *
+ * Counts, for every packet written, the radio's retransmits (OBSERVE_TX
+ * ARC_CNT) and whether it was lost (MAX_RT), and for every exchange whether
+ * it succeeded, and from these chooses the radio's level: a data rate and PA
+ * level from LINK_LEVELS, which run from the least airtime and power to the
+ * most robust.  Loss is measured over windows of LINK_WINDOW_PACKETS packets
+ * as retransmits / (packets + retransmits), the fraction of transmissions
+ * that weren't acknowledged first time:
+ *   - Above LINK_LOSS_HIGH_PERCENT, or with any packet lost, the level is
+ *     raised at once.
+ *   - Below LINK_LOSS_LOW_PERCENT for a run of windows, it's lowered.  The
+ *     run starts at LINK_GOOD_WINDOWS, and doubles each time a lowered level
+ *     has to be raised again or couldn't be switched to, so the level
+ *     doesn't hunt.  It halves again each time a lowered level holds.
+ * Between the two the level is held.
+ *
+ * It also chooses the channel.  A survey counts, over LINK_SURVEY_SWEEPS
+ * sweeps, how often each channel had a signal on it, and the channel chosen
+ * is the one with the fewest counts, including those of the channels within
+ * LINK_SURVEY_SPREAD of it, as a WiFi channel is about 20 wide.  Ties go to
+ * the channel nearest RADIO_CHANNEL.
+ *
+ * Both ends must match, so the controller is switched first
+ * (COMMAND_SET_RADIO and COMMAND_SET_CHANNEL, see lamphouse_shared.h), and
+ * the switch is confirmed by the exchange completing at the new settings;
+ * otherwise both ends go back to the old ones.  If LINK_LOST_EXCHANGES
+ * exchanges in a row fail, the link falls back to the default level and
+ * RADIO_CHANNEL, which the controller also returns to when it hears nothing
+ * for a while.  A channel that couldn't be switched to, or was fallen back
+ * from, is tried again after LINK_CHANNEL_RETRY_EXCHANGES good exchanges on
+ * RADIO_CHANNEL, up to LINK_CHANNEL_ATTEMPTS times in all.
+ *
+ * The monitor doesn't touch any hardware, so it can be built on a host and
+ * driven by a simulated lossy channel.
+ */
+
+struct LinkLevel
+{
+    uint8_t data_rate;          // rf24_datarate_e
+    uint8_t pa_level;           // rf24_pa_dbm_e
+    uint8_t retry_delay;        // ARD that fits a full ACK payload at the data rate, as RF24::setRetries()
+};
+
+struct LinkStats
+{
+    uint8_t level;              // Index into LINK_LEVELS
+    uint8_t channel;
+    uint32_t packets;
+    uint32_t retransmits;
+    uint32_t lost_packets;
+    uint32_t exchanges;
+    uint32_t failed_exchanges;
+    uint8_t window_loss_percent;    // Over the last complete window
+    uint16_t switches;          // Level changes, including fallbacks
+    uint16_t failed_switches;
+    // CPU cycles in the radio's SPI transactions, filled in by query_link()
+    // with SPI_CYCLE_COUNT (see RF24_config_STM32.h); otherwise 0
+    uint32_t spi_cycles;        // Over all exchanges
+    uint32_t last_exchange_spi_cycles;
+};
+
+const static uint8_t LINK_LEVEL_COUNT = 6;
+extern const LinkLevel LINK_LEVELS[LINK_LEVEL_COUNT];
+extern const uint8_t LINK_DEFAULT_LEVEL;
+
+const static uint8_t LINK_WINDOW_PACKETS = 64;
+const static uint8_t LINK_LOSS_HIGH_PERCENT = 10;
+const static uint8_t LINK_LOSS_LOW_PERCENT = 2;
+const static uint8_t LINK_GOOD_WINDOWS = 4;
+const static uint8_t LINK_MAX_GOOD_WINDOWS = 64;
+const static uint8_t LINK_LOST_EXCHANGES = 3;
+
+const static uint8_t LINK_CHANNEL_COUNT = RADIO_MAX_CHANNEL + 1;
+const static uint8_t LINK_SURVEY_SWEEPS = 16;
+const static uint8_t LINK_SURVEY_SPREAD = 2;
+const static uint8_t LINK_CHANNEL_ATTEMPTS = 3;
+const static uint8_t LINK_CHANNEL_RETRY_EXCHANGES = 16;
+
+
+void link_init();
+void link_record_packet(uint8_t retransmits, bool lost);
+void link_record_exchange(bool ok);
+bool link_wanted_level(uint8_t* level);
+void link_switch_started(uint8_t level);
+void link_switch_finished(bool ok);
+uint8_t link_level();
+uint8_t link_choose_channel(const uint8_t* busy_counts);
+bool link_wanted_channel(uint8_t* channel);
+void link_channel_switch_started(uint8_t channel);
+void link_channel_switch_finished(bool ok);
+uint8_t link_channel();
+void link_stats(LinkStats* stats);
@@ -0,0 +1,133 @@
+#include "rtt.h"
+
+
+struct RttEstimator
+{
+    int32_t srtt_x8;                    // Smoothed RTT, times 8
+    int32_t rttvar_x4;                  // Mean deviation, times 4
+    uint8_t backoffs;                   // Timeout doublings since the last sample
+    uint32_t samples[RTT_SAMPLE_COUNT]; // Most recent, as a ring
+    uint8_t next_sample;
+    uint8_t sample_count;
+};
+
+
+static RttEstimator _rtt;
+
+
+void rtt_init()
+{
+    _rtt.srtt_x8 = 0;
+    _rtt.rttvar_x4 = 0;
+    _rtt.backoffs = 0;
+    _rtt.next_sample = 0;
+    _rtt.sample_count = 0;
+}
+
+
+void rtt_sample(uint32_t rtt_micros)
+{
+    if (rtt_micros > RTT_MAX_TIMEOUT_MICROS)
+        rtt_micros = RTT_MAX_TIMEOUT_MICROS;
+
+    if (_rtt.sample_count == 0)
+    {
+        _rtt.srtt_x8 = int32_t(rtt_micros) << 3;
+        _rtt.rttvar_x4 = int32_t(rtt_micros) << 1;      // rttvar = rtt / 2
+    }
+    else
+    {
+        int32_t error = int32_t(rtt_micros) - (_rtt.srtt_x8 >> 3);
+
+        _rtt.srtt_x8 += error;
+        if (error < 0)
+            error = -error;
+        _rtt.rttvar_x4 += error - (_rtt.rttvar_x4 >> 2);
+    }
+
+    _rtt.backoffs = 0;
+
+    _rtt.samples[_rtt.next_sample] = rtt_micros;
+    _rtt.next_sample = (_rtt.next_sample + 1) % RTT_SAMPLE_COUNT;
+    if (_rtt.sample_count < RTT_SAMPLE_COUNT)
+        _rtt.sample_count++;
+}
+
+
+// After a failed exchange
+void rtt_backoff()
+{
+    // Beyond this the timeout is at its maximum anyway
+    if (_rtt.backoffs < 8)
+        _rtt.backoffs++;
+}
+
+
+uint32_t rtt_timeout_micros()
+{
+    uint32_t timeout_micros;
+
+    if (_rtt.sample_count == 0)
+        timeout_micros = RTT_INITIAL_TIMEOUT_MICROS;
+    else
+        timeout_micros = uint32_t((_rtt.srtt_x8 >> 3) + _rtt.rttvar_x4);
+
+    if (timeout_micros < RTT_MIN_TIMEOUT_MICROS)
+        timeout_micros = RTT_MIN_TIMEOUT_MICROS;
+    timeout_micros <<= _rtt.backoffs;
+    if (timeout_micros > RTT_MAX_TIMEOUT_MICROS)
+        timeout_micros = RTT_MAX_TIMEOUT_MICROS;
+
+    return timeout_micros;
+}
+
+
+// The count for the delay, both as for RF24::setRetries()
+void rtt_radio_retries(uint8_t delay, uint8_t* count)
+{
+    const uint32_t delay_micros = 250 * (uint32_t(delay) + 1);
+    uint32_t retries = (rtt_timeout_micros() + delay_micros - 1) / delay_micros;
+
+    if (retries < RTT_MIN_RADIO_RETRIES)
+        retries = RTT_MIN_RADIO_RETRIES;
+    if (retries > RTT_MAX_RADIO_RETRIES)
+        retries = RTT_MAX_RADIO_RETRIES;
+
+    *count = uint8_t(retries);
+}
+
+
+// Of the samples held, by nearest rank; 0 if there are none.
+uint32_t rtt_percentile_micros(uint8_t percent)
+{
+    uint32_t sorted[RTT_SAMPLE_COUNT];
+    uint8_t count = _rtt.sample_count;
+
+    if (count == 0)
+        return 0;
+    if (percent > 100)
+        percent = 100;
+
+    // Insertion sort; there are few samples, and this is only for reporting.
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint32_t sample = _rtt.samples[i];
+        uint8_t j = i;
+
+        for (; j > 0 && sorted[j - 1] > sample; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = sample;
+    }
+
+    uint8_t rank = (uint16_t(percent) * count + 99) / 100;      // ceil(percent/100 * count)
+    if (rank == 0)
+        rank = 1;
+
+    return sorted[rank - 1];
+}
+
+
+uint8_t rtt_sample_count()
+{
+    return _rtt.sample_count;
+}
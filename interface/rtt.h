@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Round trip time estimator.
+ *
+ * Times exchanges with the controller, from sending the command to receiving
+ * its reply, and sets the reply timeout and the radio's retries from them,
+ * rather than waiting out a fixed worst case.  The estimate is Jacobson and
+ * Karels' smoothed RTT and mean deviation, in integer arithmetic:
+ *   srtt += (rtt - srtt) / 8
+ *   rttvar += (|rtt - srtt| - rttvar) / 4
+ *   timeout = srtt + 4 * rttvar
+ * The timeout doubles on each failed exchange, and is taken from the estimate
+ * again at the next sample.  Only exchanges that succeed at the first attempt
+ * are sampled, as the reply to a retried one may be to either attempt.
+ *
+ * The radio's retry delay (ARD) is held at the shortest that fits a full ACK
+ * payload at its data rate (see link.h), as a longer one only delays the
+ * retry of a lost packet.  Its retry count (ARC) is set so that its retries
+ * span about one timeout.
+ *
+ * The last RTT_SAMPLE_COUNT samples are kept for the median and 99th
+ * percentile.
+ *
+ * Times are in microseconds.  The estimator doesn't touch any hardware, so it
+ * can be built on a host and fed latency traces.
+ */
+
+const static uint8_t RTT_SAMPLE_COUNT = 64;
+const static uint32_t RTT_INITIAL_TIMEOUT_MICROS = 10000;
+const static uint32_t RTT_MIN_TIMEOUT_MICROS = 2000;
+const static uint32_t RTT_MAX_TIMEOUT_MICROS = 40000;
+
+const static uint8_t RTT_MIN_RADIO_RETRIES = 2;
+const static uint8_t RTT_MAX_RADIO_RETRIES = 15;
+
+
+void rtt_init();
+void rtt_sample(uint32_t rtt_micros);
+void rtt_backoff();
+uint32_t rtt_timeout_micros();
+void rtt_radio_retries(uint8_t delay, uint8_t* count);
+uint32_t rtt_percentile_micros(uint8_t percent);
+uint8_t rtt_sample_count();
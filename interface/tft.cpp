@@ -5,7 +5,7 @@
 #include "FT8_commands.h"
 
 #include "comms.h"
-#include "shared.h"
+#include <lamphouse_shared.h>
 
 
 #define DEBUG
@@ -13,12 +13,25 @@
 
 #define DARKRED   0x00400000
 
+// Test strips: 1/3 stop apart, holding between strips for the card to be moved.
+const static uint8_t TEST_STRIP_STOP_DIVISOR = 3;
+const static uint8_t TEST_STRIP_COUNT = 7;
+
+// The controller sends an event when an exposure ends or changes step, so
+// it's only polled as a heartbeat, and to follow a running exposure's time.
+const static uint16_t CONTROLLER_HEARTBEAT_MILLIS = 1000;
+const static uint16_t CONTROLLER_PROGRESS_MILLIS = 200;
+
 struct DisplayState
 {
-    bool hc, red, on;
+    bool hc, red, on, strip, holding;
+    bool starting;              // A start has been requested, but not yet replied to
+    uint8_t step_index;
     uint16_t dial_angle;
     uint16_t set_time_lc, set_time_hc, current_time_lc, current_time_hc, start_time_lc, start_time_hc;
-    uint8_t power_lc, power_hc;
+    uint16_t power_lc, power_hc;
+    uint16_t exposure_power;    // Power the running exposure's dose was set at
+    bool diagnostics;           // Showing the radio link diagnostics in place of the controls
 };
 
 
@@ -29,12 +42,24 @@ DisplayState _display_state;
 // Defined in interface.ino
 extern InterfaceStatus _interface_status;
 
+// Names of rf24_datarate_e and rf24_pa_dbm_e, for the diagnostics
+static const char* _data_rate_strings[] = { "1 Mbps", "2 Mbps", "250 kbps" };
+static const char* _pa_level_strings[] = { "MIN", "LOW", "HIGH", "MAX" };
+
+
+static void display_update_diagnostics();
+
 
 void display_init()
 {
     _display_state.hc = false;
     _display_state.red = false;
     _display_state.on = false;
+    _display_state.strip = false;
+    _display_state.holding = false;
+    _display_state.starting = false;
+    _display_state.diagnostics = false;
+    _display_state.step_index = 0;
     _display_state.dial_angle = 0x8000;
     _display_state.set_time_lc = 0;
     _display_state.set_time_hc = 0;
@@ -42,8 +67,9 @@ void display_init()
     _display_state.current_time_hc = 0;
     _display_state.start_time_lc = 0;
     _display_state.start_time_hc = 0;
-    _display_state.power_lc = 255;
-    _display_state.power_hc = 255;
+    _display_state.power_lc = POWER_FULL;
+    _display_state.power_hc = POWER_FULL;
+    _display_state.exposure_power = 0;
     
     digitalWrite(FT8_CS, HIGH);
     pinMode(FT8_CS, OUTPUT);
@@ -55,7 +81,7 @@ void display_init()
 
     FT8_init();
     FT8_cmd_setrotate(2);
-    FT8_cmd_track(480/2, 800/2-10, 1, 1, TAG(5));       // Register tracking for the spinner
+    FT8_cmd_track(480/2, 800/2-10, 1, 1, 5);       // Register tracking for the spinner
     FT8_cmd_execute();
 
 //    display_calibrate_touch();
@@ -103,13 +129,13 @@ void display_process_touch_buttons()
 
     uint8_t tag = FT8_get_touch_tag();
 
-    if (tag >= 1 && tag <= 4)
+    if (tag >= 1 && tag <= 8)
         last_processed_touch_millis = millis();
 
     uint16_t& set_time_ref = _display_state.hc ? _display_state.set_time_hc : _display_state.set_time_lc;
     uint16_t& current_time_ref = _display_state.hc ? _display_state.current_time_hc : _display_state.current_time_lc;
     uint16_t& start_time_ref = _display_state.hc ? _display_state.start_time_hc : _display_state.start_time_lc;
-    uint8_t& power_ref = _display_state.hc ? _display_state.power_hc : _display_state.power_lc;
+    uint16_t& power_ref = _display_state.hc ? _display_state.power_hc : _display_state.power_lc;
 
     switch(tag)
     {
@@ -118,20 +144,21 @@ void display_process_touch_buttons()
                 _display_state.hc = !_display_state.hc;
             break;
         case 2:     // Red channel toggle
-            if (!_interface_status.is_controller_connected)
+            if (!_interface_status.is_controller_connected || _display_state.on)
                 break;
-            if (set_channel_power(_display_state.red ? 0 : CHANNEL_POWER_SAFE, 0, 0) == MESSAGE_OK)
-                _display_state.red = !_display_state.red;
+            request_channel_power(_display_state.red ? 0 : CHANNEL_POWER_SAFE, 0, 0, display_red_reply);
             break;
-        case 3:     // Start/Stop
+        case 3:     // Start/Stop, or Next when holding between test strips
             if (!_interface_status.is_controller_connected)
                 break;
-            if (_display_state.on)
+            if (_display_state.on && _display_state.holding)
+                request_command(COMMAND_PROGRAM_CONTINUE, display_continue_reply);
+            else if (_display_state.on)
             {
-                stop_exposure();
+                request_command(COMMAND_STOP_EXPOSURE, NULL);
                 _display_state.on = false;
             }
-            else
+            else if (!_display_state.starting)
             {
                 // Send the time to the controller, and start the exposure.
                 // We need to convert the time in _display_state to ms for use by the controller.
@@ -157,16 +184,25 @@ void display_process_touch_buttons()
                 // Old code (kept fractional time not shown on the rounded display):
                 // uint32_t target_millis = (uint32_t(set_time_ref - current_time_ref)*25) >> 4;
 
-                set_channel_power(_display_state.red ? CHANNEL_POWER_SAFE : 0, 0, 0);
-                if (set_controller_exposure(_display_state.hc ? 0 : _display_state.power_lc, _display_state.hc ? _display_state.power_hc : 0, target_millis) != MESSAGE_OK)
+                if (_display_state.strip)
+                {
+                    // One packet; the controller sequences the strips itself.
+                    request_channel_power(_display_state.red ? CHANNEL_POWER_SAFE : 0, 0, 0, NULL);
+                    _display_state.starting = request_test_strip(_display_state.hc ? 0 : _display_state.power_lc, _display_state.hc ? _display_state.power_hc : 0, target_millis, 0,
+                        TEST_STRIP_STOP_DIVISOR, TEST_STRIP_COUNT, PROGRAM_PAUSE_HOLD, display_start_reply);
                     break;
-                if (start_exposure() != MESSAGE_OK)
-                    break;
-                _display_state.on = true;
+                }
+                // Expose by dose, so that the power can be changed during
+                // the exposure, in a single exchange.
+                _display_state.exposure_power = power_ref;
+                _display_state.starting = request_expose(_display_state.red ? CHANNEL_POWER_SAFE : 0, _display_state.hc ? 0 : power_ref, _display_state.hc ? power_ref : 0,
+                    target_millis, 0, true, display_start_reply);
             }
             break;
-        case 4:     // Reset
-            if (!_display_state.on)
+        case 4:     // Reset, or abandon a held test strip
+            if (_display_state.on && _display_state.holding)
+                request_command(COMMAND_STOP_EXPOSURE, display_abort_reply);
+            else if (!_display_state.on)
             {
                 start_time_ref = 0;
                 if (current_time_ref == 0)
@@ -175,15 +211,109 @@ void display_process_touch_buttons()
                     current_time_ref = 0;
             }
             break;
+        case 6:     // Test strip mode toggle
+            if (!_display_state.on)
+                _display_state.strip = !_display_state.strip;
+            break;
+        case 7:     // Connection status: diagnostics toggle
+            _display_state.diagnostics = !_display_state.diagnostics;
+            break;
+        case 8:     // Diagnostics: survey the channels again
+            if (_display_state.diagnostics && !_display_state.on)
+                comms_survey_channels();
+            break;
         // Power buttons:
-        case '6': power_ref = 4; break;
-        case '5': power_ref = 8; break;
-        case '4': power_ref = 16; break;
-        case '3': power_ref = 32; break;
-        case '2': power_ref = 64; break;
-        case '1': power_ref = 128; break;
-        case '0': power_ref = 255; break;
+        case '6': display_set_power(4 * POWER_FINE_STEPS); break;
+        case '5': display_set_power(8 * POWER_FINE_STEPS); break;
+        case '4': display_set_power(16 * POWER_FINE_STEPS); break;
+        case '3': display_set_power(32 * POWER_FINE_STEPS); break;
+        case '2': display_set_power(64 * POWER_FINE_STEPS); break;
+        case '1': display_set_power(128 * POWER_FINE_STEPS); break;
+        case '0': display_set_power(POWER_FULL); break;
+    }
+}
+
+
+void display_set_power(uint16_t power)
+{
+    uint16_t& power_ref = _display_state.hc ? _display_state.power_hc : _display_state.power_lc;
+
+    if (_display_state.on)
+    {
+        // Only a dose exposure can change power as it runs.  Test strips are
+        // timed.  The power is shown once the controller has it.
+        if (!_display_state.strip && _interface_status.is_controller_connected)
+            request_channel_power(_display_state.red ? CHANNEL_POWER_SAFE : 0, _display_state.hc ? 0 : power, _display_state.hc ? power : 0, display_power_reply);
+        return;
     }
+
+    power_ref = power;
+}
+
+
+// Replies to the requests made from the touch handlers.  Each acts only if
+// the controller did what was asked.
+static bool display_reply_ok(CommsMessage message, const RadioPacket* reply, ControllerExternalStatus* controller_status)
+{
+    return message == MESSAGE_OK && interpret_return_packet(reply, controller_status) == MESSAGE_OK;
+}
+
+
+void display_red_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    ControllerExternalStatus controller_status;
+
+    if (display_reply_ok(message, reply, &controller_status))
+        _display_state.red = controller_status.channel_power[0] != 0;
+}
+
+
+void display_start_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    ControllerExternalStatus controller_status;
+
+    _display_state.starting = false;
+    _display_state.diagnostics = false;
+
+    if (!display_reply_ok(message, reply, &controller_status) || controller_status.state == CONTROLLER_STATE_NOT_EXPOSING)
+        return;
+
+    _display_state.step_index = 0;
+    _display_state.holding = false;
+    _display_state.on = true;
+}
+
+
+void display_continue_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    ControllerExternalStatus controller_status;
+
+    if (display_reply_ok(message, reply, &controller_status))
+        _display_state.holding = false;
+}
+
+
+void display_abort_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    ControllerExternalStatus controller_status;
+
+    if (!display_reply_ok(message, reply, &controller_status))
+        return;
+
+    _display_state.on = false;
+    _display_state.holding = false;
+}
+
+
+void display_power_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
+{
+    ControllerExternalStatus controller_status;
+
+    if (!display_reply_ok(message, reply, &controller_status))
+        return;
+
+    uint16_t& power_ref = _display_state.hc ? _display_state.power_hc : _display_state.power_lc;
+    power_ref = _display_state.hc ? controller_status.channel_power[2] : controller_status.channel_power[1];
 }
 
 
@@ -247,11 +377,29 @@ void display_process_touch_dial()
 
 
 void display_query_controller_state()
+{
+    static uint32_t last_query_millis = 0;
+
+    bool dose_exposure = _display_state.on && !_display_state.strip;
+
+    if (millis() - last_query_millis < (_display_state.on ? CONTROLLER_PROGRESS_MILLIS : CONTROLLER_HEARTBEAT_MILLIS))
+        return;
+    last_query_millis = millis();
+
+    request_command(dose_exposure ? COMMAND_REPORT_DOSE : COMMAND_REPORT_STATUS, display_query_reply);
+}
+
+
+void display_query_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply)
 {
     ControllerExternalStatus controller_status;
-    CommsMessage comms_status;
+    CommsMessage comms_status = message;
+    uint32_t green_dose = 0, blue_dose = 0;
 
-    comms_status = send_command(COMMAND_REPORT_STATUS, &controller_status);
+    if (comms_status == MESSAGE_OK && command == COMMAND_REPORT_DOSE)
+        comms_status = interpret_dose_packet(reply, &controller_status, &green_dose, &blue_dose);
+    else if (comms_status == MESSAGE_OK)
+        comms_status = interpret_return_packet(reply, &controller_status);
 
     _interface_status.is_controller_connected = comms_status == MESSAGE_OK;
     
@@ -260,20 +408,54 @@ void display_query_controller_state()
 
     // TODO: synchronise with controller state when connection lost
 
+    display_apply_controller_state(&controller_status, command == COMMAND_REPORT_DOSE, green_dose, blue_dose);
+}
+
+
+void display_receive_controller_event()
+{
+    ControllerExternalStatus controller_status;
+    bool dose_reply;
+    uint32_t green_dose, blue_dose;
+
+    if (!receive_event(&controller_status, &dose_reply, &green_dose, &blue_dose))
+        return;
+
+    _interface_status.is_controller_connected = true;
+    display_apply_controller_state(&controller_status, dose_reply, green_dose, blue_dose);
+}
+
+
+// With dose_reply, the status is as query_dose(), with the doses.  They're
+// only used for a dose exposure.
+void display_apply_controller_state(const ControllerExternalStatus* controller_status, bool dose_reply, uint32_t green_dose, uint32_t blue_dose)
+{
+    bool dose_exposure = _display_state.on && !_display_state.strip && dose_reply;
+
     if (_display_state.on)
     {
         // Either exposure is in progress, or exposure has just completed.  Either way assign the achieved_millis to the relevant achieved time variable.
-        uint16_t achieved_time = uint16_t((controller_status.achieved_millis << 4) / 25);
+        uint32_t achieved_micros = controller_status->achieved_millis*1000 + controller_status->achieved_sub_micros;
+        if (dose_exposure)
+        {
+            // Show the time at the set power that would have given the same
+            // dose.
+            uint32_t dose = _display_state.hc ? blue_dose : green_dose;
+            achieved_micros = uint32_t(uint64_t(dose) * 1000 * POWER_FINE_STEPS / _display_state.exposure_power);
+        }
+        uint16_t achieved_time = uint16_t((uint64_t(achieved_micros) << 4) / 25000);
         uint16_t& current_time_ref = _display_state.hc ? _display_state.current_time_hc : _display_state.current_time_lc;
         uint16_t& start_time_ref = _display_state.hc ? _display_state.start_time_hc : _display_state.start_time_lc;
 
         current_time_ref = achieved_time + start_time_ref;
 
         // Update the interface state to match the controller
-        _display_state.on = controller_status.state == CONTROLLER_STATE_EXPOSING;
+        _display_state.on = controller_status->state != CONTROLLER_STATE_NOT_EXPOSING;
+        _display_state.holding = controller_status->state == CONTROLLER_STATE_HOLDING;
+        _display_state.step_index = controller_status->step_index;
 
         if (!_display_state.on)
-            set_channel_power(_display_state.red ? CHANNEL_POWER_SAFE : 0, 0, 0);  // We've just transitioned from ON to OFF.  Set the red channel to the last value.
+            request_channel_power(_display_state.red ? CHANNEL_POWER_SAFE : 0, 0, 0, NULL);  // We've just transitioned from ON to OFF.  Set the red channel to the last value.
     }
 }
 
@@ -288,6 +470,12 @@ void display_update()
     FT8_cmd_dl(DL_CLEAR | CLR_COL | CLR_STN | CLR_TAG);
     //FT8_cmd_dl(TAG(0));
 
+    if (_display_state.diagnostics)
+    {
+        display_update_diagnostics();
+        return;
+    }
+
     FT8_cmd_dl(TAG(1));
     FT8_cmd_dl(DL_COLOR_RGB | (_display_state.hc ? BLACK : RED));
     FT8_cmd_fgcolor(_display_state.hc ? RED : DARKRED);
@@ -304,13 +492,18 @@ void display_update()
     FT8_cmd_dl(DL_COLOR_RGB | (_display_state.on ? BLACK : RED));
     FT8_cmd_fgcolor(_display_state.on ? RED : DARKRED);
     FT8_cmd_romfont(1, 32);
-    FT8_cmd_button(15, 800-15-125, 200, 125, 1, FT8_OPT_FLAT, _display_state.on ? "STOP" : "START");
+    FT8_cmd_button(15, 800-15-125, 200, 125, 1, FT8_OPT_FLAT, _display_state.holding ? "NEXT" : (_display_state.on ? "STOP" : "START"));
 
     FT8_cmd_dl(TAG(4));
-    FT8_cmd_dl(DL_COLOR_RGB | (!_display_state.on ? BLACK : RED));
-    FT8_cmd_fgcolor(!_display_state.on ? RED : DARKRED);
+    FT8_cmd_dl(DL_COLOR_RGB | (!_display_state.on || _display_state.holding ? BLACK : RED));
+    FT8_cmd_fgcolor(!_display_state.on || _display_state.holding ? RED : DARKRED);
     FT8_cmd_romfont(1, 32);
-    FT8_cmd_button(480-200-15, 800-15-125, 200, 125, 1, FT8_OPT_FLAT, "RESET");
+    FT8_cmd_button(480-200-15, 800-15-125, 200, 125, 1, FT8_OPT_FLAT, _display_state.holding ? "ABORT" : "RESET");
+
+    FT8_cmd_dl(TAG(6));
+    FT8_cmd_dl(DL_COLOR_RGB | (_display_state.strip ? BLACK : RED));
+    FT8_cmd_fgcolor(_display_state.strip ? RED : DARKRED);
+    FT8_cmd_button(480-125-15, 585, 125, 60, 28, FT8_OPT_FLAT, "STRIP");
 
     FT8_cmd_dl(TAG(5));
     FT8_cmd_dl(DL_COLOR_RGB | RED);
@@ -320,19 +513,19 @@ void display_update()
     char buf[32];
     uint16_t& set_time_ref = _display_state.hc ? _display_state.set_time_hc : _display_state.set_time_lc;
     uint16_t& current_time_ref = _display_state.hc ? _display_state.current_time_hc : _display_state.current_time_lc;
-    uint16_t& start_time_ref = _display_state.hc ? _display_state.start_time_hc : _display_state.start_time_lc;
-    uint8_t& power_ref = _display_state.hc ? _display_state.power_hc : _display_state.power_lc;
+    uint16_t& power_ref = _display_state.hc ? _display_state.power_hc : _display_state.power_lc;
 
     uint16_t key_pressed;
     switch (power_ref)
     {
-        case 4: key_pressed = '6'; break;
-        case 8: key_pressed = '5'; break;
-        case 16: key_pressed = '4'; break;
-        case 32: key_pressed = '3'; break;
-        case 64: key_pressed = '2'; break;
-        case 128: key_pressed = '1'; break;
-        case 255: key_pressed = '0'; break;
+        case 4 * POWER_FINE_STEPS: key_pressed = '6'; break;
+        case 8 * POWER_FINE_STEPS: key_pressed = '5'; break;
+        case 16 * POWER_FINE_STEPS: key_pressed = '4'; break;
+        case 32 * POWER_FINE_STEPS: key_pressed = '3'; break;
+        case 64 * POWER_FINE_STEPS: key_pressed = '2'; break;
+        case 128 * POWER_FINE_STEPS: key_pressed = '1'; break;
+        case POWER_FULL: key_pressed = '0'; break;
+        default: key_pressed = 0; break;
     }
 
     FT8_cmd_dl(DL_COLOR_RGB | RED);
@@ -351,7 +544,14 @@ void display_update()
     FT8_cmd_text(30, 615, 29, 0, "HC");
     FT8_cmd_text(75, 615, 29, 0, &buf[0]);
 
+    FT8_cmd_dl(TAG(7));
     FT8_cmd_text(270, 590, 29, 0, _interface_status.is_controller_connected ? "CON" : "DIS");
+    FT8_cmd_dl(TAG(0));
+    if (_display_state.strip && _display_state.on)
+    {
+        sprintf(&buf[0], "%d/%d", _display_state.step_index + 1, TEST_STRIP_COUNT);
+        FT8_cmd_text(270, 615, 29, 0, &buf[0]);
+    }
 //    FT8_cmd_text(340, 590, 29, 0, "SYNC");
 
     FT8_cmd_dl(DL_DISPLAY);
@@ -361,6 +561,60 @@ void display_update()
 }
 
 
+// The radio link's statistics (see link.h) and round trip times, after
+// display_update() has started the display list.  Touching anywhere but the
+// survey button returns to the controls.
+static void display_update_diagnostics()
+{
+    char buf[48];
+    LinkStats stats;
+    uint32_t median_micros, p99_micros, timeout_micros;
+
+    query_link(&stats);
+    query_round_trip(&median_micros, &p99_micros, &timeout_micros);
+
+    FT8_cmd_dl(TAG(7));
+    FT8_cmd_dl(DL_COLOR_RGB | BLACK);
+    FT8_cmd_fgcolor(BLACK);
+    FT8_cmd_button(0, 0, 480, 800, 28, FT8_OPT_FLAT, "");
+
+    FT8_cmd_dl(DL_COLOR_RGB | RED);
+    FT8_cmd_text(30, 30, 29, 0, _interface_status.is_controller_connected ? "Controller connected" : "Controller disconnected");
+
+    sprintf(&buf[0], "Channel %d (%d MHz)", stats.channel, 2400 + stats.channel);
+    FT8_cmd_text(30, 80, 29, 0, &buf[0]);
+    sprintf(&buf[0], "Level %d: %s, PA %s", stats.level,
+        _data_rate_strings[LINK_LEVELS[stats.level].data_rate], _pa_level_strings[LINK_LEVELS[stats.level].pa_level]);
+    FT8_cmd_text(30, 110, 29, 0, &buf[0]);
+    sprintf(&buf[0], "Switches %u, failed %u", stats.switches, stats.failed_switches);
+    FT8_cmd_text(30, 140, 29, 0, &buf[0]);
+
+    sprintf(&buf[0], "Packets %lu", (unsigned long)stats.packets);
+    FT8_cmd_text(30, 190, 29, 0, &buf[0]);
+    sprintf(&buf[0], "Retransmits %lu, lost %lu", (unsigned long)stats.retransmits, (unsigned long)stats.lost_packets);
+    FT8_cmd_text(30, 220, 29, 0, &buf[0]);
+    sprintf(&buf[0], "Loss %d%% (last %d packets)", stats.window_loss_percent, LINK_WINDOW_PACKETS);
+    FT8_cmd_text(30, 250, 29, 0, &buf[0]);
+    sprintf(&buf[0], "Exchanges %lu, failed %lu", (unsigned long)stats.exchanges, (unsigned long)stats.failed_exchanges);
+    FT8_cmd_text(30, 280, 29, 0, &buf[0]);
+
+    sprintf(&buf[0], "RTT median %lu us, p99 %lu us", (unsigned long)median_micros, (unsigned long)p99_micros);
+    FT8_cmd_text(30, 330, 29, 0, &buf[0]);
+    sprintf(&buf[0], "Reply timeout %lu us", (unsigned long)timeout_micros);
+    FT8_cmd_text(30, 360, 29, 0, &buf[0]);
+
+    FT8_cmd_dl(TAG(8));
+    FT8_cmd_dl(DL_COLOR_RGB | (_display_state.on ? BLACK : RED));
+    FT8_cmd_fgcolor(DARKRED);
+    FT8_cmd_button(480-200-15, 800-15-125, 200, 125, 29, FT8_OPT_FLAT, "SURVEY");
+
+    FT8_cmd_dl(DL_DISPLAY);
+    FT8_cmd_dl(CMD_SWAP);
+
+    FT8_cmd_execute();
+}
+
+
 
 void display_calibrate_touch()
 {
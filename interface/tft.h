@@ -1,13 +1,30 @@
 #ifndef TFT_H_
 #define TFT_H_
 
+#include "comms.h"
+
+struct InterfaceStatus
+{
+    bool is_controller_connected;
+};
+
+
 void display_calibrate_touch(void);
 void display_init(void);
 void display_loop(void);
 void display_process_touch(void);
 void display_process_touch_buttons(void);
 void display_process_touch_dial(void);
+void display_set_power(uint16_t power);
 void display_update(void);
 void display_query_controller_state(void);
+void display_query_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+void display_receive_controller_event(void);
+void display_apply_controller_state(const ControllerExternalStatus* controller_status, bool dose_reply, uint32_t green_dose, uint32_t blue_dose);
+void display_red_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+void display_start_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+void display_continue_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+void display_abort_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
+void display_power_reply(CommsCommand command, CommsMessage message, const RadioPacket* reply);
 
-#endif /* TFT_H_ */
+#endif /* TFT_H_ */
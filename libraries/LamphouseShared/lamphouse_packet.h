@@ -0,0 +1,221 @@
+#ifndef _LAMPHOUSE_PACKET_H
+#define _LAMPHOUSE_PACKET_H
+
+#include <stdint.h>
+
+#include "lamphouse_shared.h"
+
+/* Packet codec.
+ *
+ * Each field of the packet formats in lamphouse_shared.h is described by a
+ * type giving its position, and is read and written through that type's
+ * get() and put():
+ *   PacketField<OFFSET, BYTES, SHIFT, WIDTH>
+ *       An unsigned field of WIDTH bits, SHIFT bits up from the bottom of the
+ *       big-endian BYTES bytes at RadioPacket[OFFSET].  By default the field
+ *       is the whole of the bytes.
+ *   PacketSplitField<UPPER, LOWER, LOWER_BITS>
+ *       A field whose upper bits are in field UPPER and lower LOWER_BITS bits
+ *       in field LOWER, such as the 12-bit powers.
+ * All positions are template arguments, so each get() and put() compiles to
+ * the same shifts and masks as would be written out by hand.  put() leaves
+ * the bits outside its field as they were, so fields sharing a byte may be
+ * written in any order.  It reads those bits to do so, so a packet must be
+ * cleared before its first put(), or the bytes its fields don't cover go out
+ * as they were.
+ *
+ * Header only, so that both sketches inline it.
+ */
+
+
+constexpr uint32_t packet_field_mask(uint8_t width)
+{
+    return width >= 32 ? 0xFFFFFFFF : (uint32_t(1) << width) - 1;
+}
+
+
+// The smallest unsigned type that holds BYTES bytes
+template <uint8_t BYTES> struct PacketFieldType { typedef uint32_t Type; };
+template <> struct PacketFieldType<0> { typedef uint8_t Type; };
+template <> struct PacketFieldType<1> { typedef uint8_t Type; };
+template <> struct PacketFieldType<2> { typedef uint16_t Type; };
+
+
+// The BYTES bytes at RadioPacket[OFFSET], MSB first
+template <uint8_t OFFSET, uint8_t BYTES>
+struct PacketBytes
+{
+    typedef typename PacketFieldType<BYTES>::Type Type;
+
+    static inline Type load(const RadioPacket* packet)
+    {
+        return (Type(PacketBytes<OFFSET, BYTES - 1>::load(packet)) << 8) | packet[OFFSET + BYTES - 1];
+    }
+
+    static inline void store(RadioPacket* packet, Type value)
+    {
+        packet[OFFSET + BYTES - 1] = uint8_t(value);
+        PacketBytes<OFFSET, BYTES - 1>::store(packet, value >> 8);
+    }
+};
+
+template <uint8_t OFFSET>
+struct PacketBytes<OFFSET, 0>
+{
+    static inline uint8_t load(const RadioPacket*) { return 0; }
+    static inline void store(RadioPacket*, uint8_t) { }
+};
+
+
+template <uint8_t OFFSET, uint8_t BYTES, uint8_t SHIFT = 0, uint8_t WIDTH = 8 * BYTES>
+struct PacketField
+{
+    static_assert(BYTES >= 1 && BYTES <= 4, "Fields are 1 to 4 bytes");
+    static_assert(OFFSET + BYTES <= ACK_PAYLOAD_SIZE, "Field is beyond the end of the packet");
+    static_assert(SHIFT + WIDTH <= 8 * BYTES, "Field is wider than its bytes");
+
+    typedef typename PacketFieldType<BYTES>::Type Type;
+
+    static constexpr Type mask() { return Type(packet_field_mask(WIDTH)); }
+
+    static inline Type get(const RadioPacket* packet)
+    {
+        return (PacketBytes<OFFSET, BYTES>::load(packet) >> SHIFT) & mask();
+    }
+
+    static inline void put(RadioPacket* packet, Type value)
+    {
+        if (WIDTH == 8 * BYTES)
+            PacketBytes<OFFSET, BYTES>::store(packet, value);
+        else
+            PacketBytes<OFFSET, BYTES>::store(packet,
+                (PacketBytes<OFFSET, BYTES>::load(packet) & ~Type(mask() << SHIFT)) | Type((value & mask()) << SHIFT));
+    }
+};
+
+
+template <typename UPPER, typename LOWER, uint8_t LOWER_BITS>
+struct PacketSplitField
+{
+    static_assert(LOWER_BITS <= 8, "The low part is at most a byte");
+
+    typedef typename PacketFieldType<sizeof(typename UPPER::Type) + 1>::Type Type;
+
+    static inline Type get(const RadioPacket* packet)
+    {
+        return (Type(UPPER::get(packet)) << LOWER_BITS) | LOWER::get(packet);
+    }
+
+    static inline void put(RadioPacket* packet, Type value)
+    {
+        UPPER::put(packet, value >> LOWER_BITS);
+        LOWER::put(packet, value & packet_field_mask(LOWER_BITS));
+    }
+};
+
+
+// Every packet
+typedef PacketField<0, 1> PacketCommand;
+typedef PacketField<15, 1> PacketCounter;
+typedef PacketField<16, 1> AckPayloadCounter;       // Also an event's format
+typedef PacketField<17, 2> AckPayloadLatency;
+
+// Master -> slave
+typedef PacketField<1, 1> CommandRedPower;
+typedef PacketSplitField<PacketField<2, 1>, PacketField<14, 1, 4, 4>, 4> CommandGreenPower;
+typedef PacketSplitField<PacketField<3, 1>, PacketField<14, 1, 0, 4>, 4> CommandBluePower;
+typedef PacketField<4, 4> CommandTargetMillis;
+typedef PacketField<12, 2, 6, 10> CommandTargetSubMicros;
+typedef PacketField<4, 4> CommandGreenDose;         // COMMAND_SET_DOSE
+typedef PacketField<8, 4> CommandBlueDose;
+typedef PacketField<4, 4> CommandMeterDose;         // COMMAND_SET_METERED
+typedef PacketField<1, 1> CommandStepIndex;         // COMMAND_PROGRAM_UPLOAD_STEP
+typedef PacketField<8, 2> CommandStepPauseMillis;
+typedef PacketField<8, 1> CommandStopDivisor;       // COMMAND_TEST_STRIP
+typedef PacketField<9, 1> CommandStripCount;
+typedef PacketField<10, 2> CommandStripPauseMillis;
+typedef PacketField<8, 1> CommandExposeFlags;       // COMMAND_EXPOSE
+typedef PacketField<1, 1> CommandHistorySequence;   // COMMAND_REPORT_HISTORY
+typedef PacketField<1, 1> CommandRadioDataRate;     // COMMAND_SET_RADIO
+typedef PacketField<2, 1> CommandRadioPaLevel;
+typedef PacketField<1, 1> CommandRadioChannel;      // COMMAND_SET_CHANNEL
+
+// Slave -> master
+typedef PacketField<0, 1, 6, 2> ReplyState;
+typedef PacketField<0, 1, 0, 6> ReplyMessage;
+typedef PacketField<1, 1> ReplyRedPower;
+typedef PacketSplitField<PacketField<2, 1>, PacketField<15, 1, 4, 4>, 4> ReplyGreenPower;
+typedef PacketSplitField<PacketField<3, 1>, PacketField<15, 1, 0, 4>, 4> ReplyBluePower;
+typedef PacketField<4, 4> ReplyTargetMillis;
+typedef PacketField<8, 4> ReplyAchievedMillis;
+typedef PacketField<12, 2, 6, 10> ReplyTargetSubMicros;
+typedef PacketField<13, 2, 4, 10> ReplyAchievedSubMicros;
+typedef PacketField<14, 1, 0, 4> ReplyStepIndex;
+typedef PacketField<4, 4> ReplyGreenDose;           // COMMAND_REPORT_DOSE
+typedef PacketField<8, 4> ReplyBlueDose;
+typedef PacketField<4, 4> ReplyMeterDose;           // COMMAND_REPORT_METER
+typedef PacketField<8, 2> ReplyMeterDark;
+typedef PacketField<10, 2> ReplyMeterLight;
+typedef PacketField<4, 2> ReplyLatency;             // COMMAND_REPORT_LATENCY
+typedef PacketField<6, 2> ReplyWorstLatency;
+typedef PacketField<8, 1> ReplyReceiveOverflows;
+typedef PacketField<4, 2> ReplyOnSkew;              // COMMAND_MEASURE_SKEW
+typedef PacketField<6, 2> ReplyOffSkew;
+typedef PacketField<1, 1> ReplyHistorySequence;     // COMMAND_REPORT_HISTORY
+
+
+// The status reply, unpacked
+struct ControllerExternalStatus
+{
+    ControllerState state;
+    uint16_t channel_power[3];
+    uint32_t target_millis;
+    uint32_t achieved_millis;
+    uint16_t target_sub_micros;
+    uint16_t achieved_sub_micros;
+    uint8_t step_index;
+    uint16_t latency_micros;    // From the ACK payload, so not set by packet_decode_status()
+};
+
+
+inline CommsMessage packet_decode_status(const RadioPacket* packet, ControllerExternalStatus* status)
+{
+    status->state = ControllerState(ReplyState::get(packet));
+    status->channel_power[0] = uint16_t(ReplyRedPower::get(packet)) << 4;
+    status->channel_power[1] = ReplyGreenPower::get(packet);
+    status->channel_power[2] = ReplyBluePower::get(packet);
+    status->target_millis = ReplyTargetMillis::get(packet);
+    status->achieved_millis = ReplyAchievedMillis::get(packet);
+    status->target_sub_micros = ReplyTargetSubMicros::get(packet);
+    status->achieved_sub_micros = ReplyAchievedSubMicros::get(packet);
+    status->step_index = ReplyStepIndex::get(packet);
+
+    return CommsMessage(ReplyMessage::get(packet));
+}
+
+
+// All but the command and counter
+inline void packet_encode_program_step(RadioPacket* packet, uint8_t index, const ProgramStep* step)
+{
+    CommandStepIndex::put(packet, index);
+    CommandGreenPower::put(packet, step->green_power);
+    CommandBluePower::put(packet, step->blue_power);
+    CommandTargetMillis::put(packet, step->millis);
+    CommandStepPauseMillis::put(packet, step->pause_millis);
+    CommandTargetSubMicros::put(packet, step->sub_micros);
+}
+
+
+// Returns the step index
+inline uint8_t packet_decode_program_step(const RadioPacket* packet, ProgramStep* step)
+{
+    step->green_power = CommandGreenPower::get(packet);
+    step->blue_power = CommandBluePower::get(packet);
+    step->millis = CommandTargetMillis::get(packet);
+    step->pause_millis = CommandStepPauseMillis::get(packet);
+    step->sub_micros = CommandTargetSubMicros::get(packet);
+
+    return CommandStepIndex::get(packet);
+}
+
+#endif
@@ -0,0 +1,148 @@
+#ifndef _LAMPHOUSE_RADIO_IRQ_H
+#define _LAMPHOUSE_RADIO_IRQ_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Radio interrupt events.
+ *
+ * The radio's IRQ output goes low when it has sent a packet (TX_DS), given up
+ * on one (MAX_RT), or received one (RX_DR), and stays low until the flags are
+ * cleared.  Rather than spinning on the radio's status until one of these
+ * happens, each sketch's interrupt handler latches it into a RadioIrqQueue,
+ * and loop() dispatches it with radio_irq_dispatch() to the callback
+ * registered for it, which is passed the time of the interrupt.
+ *
+ * A handler that can use the radio itself reads and clears the flags, as
+ * RF24::whatHappened(), and latches them.  One that can't, as loop() uses the
+ * radio without masking the interrupt, latches RADIO_IRQ_FLAGS_UNKNOWN, and
+ * the flags are read when it's dispatched.
+ *
+ * The queue is lock free: only the handler writes at head, and only
+ * radio_irq_dispatch() reads at tail.  It's empty when they're equal, so holds
+ * up to RADIO_IRQ_QUEUE_LENGTH - 1.  An interrupt latched while it's full is
+ * counted in overflows and dropped.  Its flags aren't lost if it would have
+ * been RADIO_IRQ_FLAGS_UNKNOWN, as the entries waiting read them.
+ *
+ * Header only, so that both sketches inline it.
+ */
+
+
+enum RadioIrqEvent {
+    RADIO_IRQ_TX_DONE,                  // TX_DS: sent, and acknowledged
+    RADIO_IRQ_TX_FAILED,                // MAX_RT: the retries ran out
+    RADIO_IRQ_RX_READY,                 // RX_DR
+    RADIO_IRQ_EVENT_COUNT
+};
+
+// Read the flags when dispatched
+const static uint8_t RADIO_IRQ_FLAGS_UNKNOWN = 0x80;
+
+// Must be a power of two
+const static uint8_t RADIO_IRQ_QUEUE_LENGTH = 4;
+
+
+typedef void (*RadioIrqCallback)(uint32_t irq_micros);
+
+// Reads and clears the radio's flags, as radio_irq_flags()
+typedef uint8_t (*RadioIrqReadFlags)();
+
+
+struct RadioIrqEntry
+{
+    uint8_t flags;                      // Bit RadioIrqEvent set for each that happened
+    uint32_t irq_micros;
+};
+
+
+struct RadioIrqQueue
+{
+    RadioIrqEntry entries[RADIO_IRQ_QUEUE_LENGTH];
+    volatile uint8_t head;
+    volatile uint8_t tail;
+    volatile uint8_t overflows;
+    RadioIrqCallback callbacks[RADIO_IRQ_EVENT_COUNT];
+};
+
+
+inline uint8_t radio_irq_flags(bool tx_ok, bool tx_fail, bool rx_ready)
+{
+    return (tx_ok ? 1 << RADIO_IRQ_TX_DONE : 0) |
+        (tx_fail ? 1 << RADIO_IRQ_TX_FAILED : 0) |
+        (rx_ready ? 1 << RADIO_IRQ_RX_READY : 0);
+}
+
+
+inline void radio_irq_init(RadioIrqQueue* queue)
+{
+    queue->head = 0;
+    queue->tail = 0;
+    queue->overflows = 0;
+
+    for (uint8_t i = 0; i < RADIO_IRQ_EVENT_COUNT; i++)
+        queue->callbacks[i] = NULL;
+}
+
+
+// callback may be NULL, to ignore the event
+inline void radio_irq_register(RadioIrqQueue* queue, RadioIrqEvent event, RadioIrqCallback callback)
+{
+    queue->callbacks[event] = callback;
+}
+
+
+// From the interrupt handler only
+inline void radio_irq_latch(RadioIrqQueue* queue, uint8_t flags, uint32_t irq_micros)
+{
+    uint8_t head = queue->head;
+    uint8_t next_head = (head + 1) & (RADIO_IRQ_QUEUE_LENGTH - 1);
+
+    if (next_head == queue->tail)
+    {
+        if (queue->overflows != 0xFF)
+            queue->overflows++;
+        return;
+    }
+
+    queue->entries[head].flags = flags;
+    queue->entries[head].irq_micros = irq_micros;
+    __asm__ __volatile__("" ::: "memory");      // Fill the entry before publishing it
+    queue->head = next_head;
+}
+
+
+// Calls the callbacks for flags, in RadioIrqEvent order.  From loop() only;
+// also for flags found other than by an interrupt.
+inline void radio_irq_call(const RadioIrqQueue* queue, uint8_t flags, uint32_t irq_micros)
+{
+    for (uint8_t i = 0; i < RADIO_IRQ_EVENT_COUNT; i++)
+    {
+        if ((flags & (1 << i)) && queue->callbacks[i] != NULL)
+            queue->callbacks[i](irq_micros);
+    }
+}
+
+
+// Dispatches the interrupts latched since the last call.  read_flags may be
+// NULL if the handler never latches RADIO_IRQ_FLAGS_UNKNOWN.  Returns how
+// many there were.  From loop() only.
+inline uint8_t radio_irq_dispatch(RadioIrqQueue* queue, RadioIrqReadFlags read_flags)
+{
+    uint8_t count = 0;
+
+    while (queue->tail != queue->head)
+    {
+        RadioIrqEntry entry = queue->entries[queue->tail];
+        __asm__ __volatile__("" ::: "memory");      // Finish with the entry before freeing it
+        queue->tail = (queue->tail + 1) & (RADIO_IRQ_QUEUE_LENGTH - 1);
+
+        if (entry.flags == RADIO_IRQ_FLAGS_UNKNOWN)
+            entry.flags = read_flags();
+        radio_irq_call(queue, entry.flags, entry.irq_micros);
+        count++;
+    }
+
+    return count;
+}
+
+#endif
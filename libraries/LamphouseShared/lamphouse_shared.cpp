@@ -1,16 +1,19 @@
-#include "shared.h"
+#include "lamphouse_shared.h"
 
 const uint8_t RADIO_ADDRESS_CONTROLLER[5] = { 0x6B, 0xE3, 0x10, 0xE6, 0xCF };
 const uint8_t RADIO_ADDRESS_INTERFACE[5] =  { 0x6C, 0x28, 0xA4, 0x88, 0x44 };
 const uint8_t RADIO_CHANNEL = 80;
-const uint8_t PACKET_SIZE = 16;
+const uint8_t RADIO_DEFAULT_DATA_RATE = 0;         // RF24_1MBPS
+const uint8_t RADIO_DEFAULT_PA_LEVEL = 3;          // RF24_PA_MAX
 
 const uint8_t CHANNEL_POWER_SAFE = 255;
 
 
 const char *_comms_controller_state_strings[] = {
     "Not exposing",
-    "Exposing"
+    "Exposing",
+    "Paused",
+    "Holding"
 };
 
 const char *_comms_command_strings[] = {
@@ -18,7 +21,22 @@ const char *_comms_command_strings[] = {
     "Set exposure",
     "Start exposure",
     "Stop exposure",
-    "Set channel power"
+    "Set channel power",
+    "Upload program step",
+    "Start program",
+    "Continue program",
+    "Test strip",
+    "Set dose",
+    "Report dose",
+    "Set metered",
+    "Report meter",
+    "Measure skew",
+    "Report latency",
+    "Report history",
+    "Expose",
+    "Fetch reply",
+    "Set radio",
+    "Set channel"
 };
 
 const char *_comms_status_strings[] = {
@@ -29,6 +47,7 @@ const char *_comms_status_strings[] = {
     "Not exposing",
     "No receiver",
     "Set failed",
-    "Timeout"
+    "Timeout",
+    "Invalid program"
 };
-
+
@@ -0,0 +1,363 @@
+#ifndef _LAMPHOUSE_SHARED_H
+#define _LAMPHOUSE_SHARED_H
+
+#include <stdint.h>
+
+/* Definitions shared by the controller and the interface: the radio protocol
+ * and its constants.  This is an Arduino library, so that both sketches build
+ * from the one copy; link or copy libraries/LamphouseShared into the
+ * sketchbook's libraries folder.  The packet formats below are encoded and
+ * decoded by lamphouse_packet.h.
+ */
+
+
+enum ControllerState {
+    CONTROLLER_STATE_NOT_EXPOSING                   = 0,
+    CONTROLLER_STATE_EXPOSING                       = 1,
+    CONTROLLER_STATE_PAUSED                         = 2,    // Timed pause between program steps
+    CONTROLLER_STATE_HOLDING                        = 3     // Waiting for COMMAND_PROGRAM_CONTINUE between program steps
+};
+
+enum InterfaceState {
+
+};
+
+enum CommsMessage {
+    MESSAGE_OK                                      = 0,
+    MESSAGE_INVALID_COMMAND                         = 1,
+    MESSAGE_CANNOT_SET_EXPOSURE_WHILE_EXPOSING      = 2,
+    MESSAGE_EXPOSURE_ALREADY_UNDERWAY               = 3,
+    MESSAGE_NOT_EXPOSING                            = 4,
+    MESSAGE_NO_RECEIVER                             = 5,
+    MESSAGE_SET_FAILED                              = 6,
+    MESSAGE_TIMEOUT                                 = 7,
+    MESSAGE_INVALID_PROGRAM                         = 8
+};
+
+enum CommsCommand {
+    COMMAND_REPORT_STATUS                           = 0,
+    COMMAND_SET_EXPOSURE                            = 1,
+    COMMAND_START_EXPOSURE                          = 2,
+    COMMAND_STOP_EXPOSURE                           = 3,
+    COMMAND_SET_CHANNEL_POWER                       = 4,
+    COMMAND_PROGRAM_UPLOAD_STEP                     = 5,
+    COMMAND_PROGRAM_START                           = 6,
+    COMMAND_PROGRAM_CONTINUE                        = 7,
+    COMMAND_TEST_STRIP                              = 8,
+    COMMAND_SET_DOSE                                = 9,
+    COMMAND_REPORT_DOSE                             = 10,
+    COMMAND_SET_METERED                             = 11,
+    COMMAND_REPORT_METER                            = 12,
+    COMMAND_MEASURE_SKEW                            = 13,
+    COMMAND_REPORT_LATENCY                          = 14,
+    COMMAND_REPORT_HISTORY                          = 15,
+    COMMAND_EXPOSE                                  = 16,
+    COMMAND_FETCH_REPLY                             = 17,
+    COMMAND_SET_RADIO                               = 18,
+    COMMAND_SET_CHANNEL                             = 19
+};
+
+
+/* Exposure programs.
+ *
+ * A program is a list of up to PROGRAM_MAX_STEPS steps, uploaded to the
+ * controller one step per COMMAND_PROGRAM_UPLOAD_STEP and run by
+ * COMMAND_PROGRAM_START.  The controller runs the whole program from its
+ * exposure timer, switching directly from one step to the next.  A step
+ * may be followed by a timed pause with the lights off, or by a hold, in which
+ * case the controller waits for COMMAND_PROGRAM_CONTINUE.  A pause after the
+ * last step is ignored.  COMMAND_STOP_EXPOSURE abandons the program.
+ */
+struct ProgramStep
+{
+    uint16_t green_power;
+    uint16_t blue_power;
+    uint32_t millis;
+    uint16_t sub_micros;
+    uint16_t pause_millis;
+};
+
+const static uint8_t PROGRAM_MAX_STEPS = 8;
+const static uint16_t PROGRAM_PAUSE_HOLD = 0xFFFF;
+
+
+/* Channel power.
+ *
+ * Green and blue powers are 12 bits, in sixteenths of the 8-bit power
+ * fields, which carry their upper 8 bits; the lower 4 bits are carried in
+ * the fine power byte (see below).  POWER_FULL is full intensity, and higher
+ * values are treated as full.  The controller linearises power, so light
+ * output is proportional to it.  Red is an 8-bit safelight power.
+ */
+const static uint16_t POWER_FINE_STEPS = 16;
+const static uint16_t POWER_FULL = 255 * POWER_FINE_STEPS;
+
+
+extern const uint8_t RADIO_ADDRESS_CONTROLLER[5];
+extern const uint8_t RADIO_ADDRESS_INTERFACE[5];
+// Where both ends start, and meet again on losing each other
+extern const uint8_t RADIO_CHANNEL;
+extern const uint8_t RADIO_DEFAULT_DATA_RATE;      // rf24_datarate_e
+extern const uint8_t RADIO_DEFAULT_PA_LEVEL;       // rf24_pa_dbm_e
+
+extern const uint8_t CHANNEL_POWER_SAFE;
+
+extern const char *_comms_controller_state_strings[];
+extern const char *_comms_command_strings[];
+extern const char *_comms_status_strings[];
+
+
+const static uint8_t PACKET_SIZE = 16;
+const static uint8_t ACK_PAYLOAD_SIZE = PACKET_SIZE + 3;
+typedef uint8_t RadioPacket;
+/* Packet format:
+ * RadioPacket[0]   CommsCommand (if master -> slave) or ControllerState (upper 2 bits) | CommsMessage (lower 6 bits) (if slave -> master)
+ * RadioPacket[1]   Red channel power
+ * RadioPacket[2]   Green channel power
+ * RadioPacket[3]   Blue channel power
+ * RadioPacket[4]   -+
+ * RadioPacket[5]    |-- Target exposure time (milliseconds)
+ * RadioPacket[6]    |   4 is MSB
+ * RadioPacket[7]   -+
+ * RadioPacket[8]   -+
+ * RadioPacket[9]    |-- Achieved exposure time (milliseconds)
+ * RadioPacket[10]   |   4 is MSB
+ * RadioPacket[11]  -+
+ * RadioPacket[12]  -+
+ * RadioPacket[13]   |-- Sub-millisecond target and achieved times (microseconds, 0-999)
+ * RadioPacket[14]  -+   See below
+ * RadioPacket[15]  -- Packet counter (master -> slave) or fine powers (slave -> master)
+ */
+/* Replies are carried in the controller's hardware ACK payloads, so neither
+ * radio changes role during an exchange.  The controller keeps the reply to
+ * the last command it acted on preloaded as its ACK payload, so the ACK to a
+ * command carries the reply to the one before.  The master therefore follows
+ * each command with COMMAND_FETCH_REPLY until the ACK payload is marked with
+ * the command's packet counter.  COMMAND_FETCH_REPLY does nothing else, and
+ * its ACK carries the reply to the last command, refreshed with the current
+ * status.  ACK payloads are ACK_PAYLOAD_SIZE bytes:
+ * RadioPacket[0-15] Reply, in the formats given here
+ * RadioPacket[16]  Packet counter of the command replied to
+ * RadioPacket[17-18] Command-to-light latency, as in the reply to
+ *                  COMMAND_REPORT_LATENCY below, 17 is MSB.  So the master
+ *                  learns it from the replies it fetches anyway.
+ *
+ * The master may resend a command whose reply it didn't get, with the same
+ * packet counter.  The controller remembers the last REPLAY_WINDOW commands
+ * it acted on, by packet counter, command and a checksum of the rest of the
+ * packet, and answers a resent one with its original message and the current
+ * status, without acting on it again.  So the master must resend a command
+ * before it has sent REPLAY_WINDOW other new commands (resends and
+ * COMMAND_FETCH_REPLY aren't remembered); one resent later is acted on again.
+ *
+ * Replies are queued, up to three (the radio's FIFO), and each packet the
+ * controller receives is acknowledged with the oldest.  So the master can
+ * send up to three commands without waiting (the controller's receive queue
+ * holds three), and then fetch their replies in turn, matching them by
+ * packet counter.  COMMAND_FETCH_REPLY only queues the refreshed reply to the
+ * last command once the queue is empty.
+ */
+const static uint8_t REPLAY_WINDOW = 8;
+/* Events: the controller pushes one to RADIO_ADDRESS_INTERFACE whenever the
+ * exposure state or program step changes, such as when an exposure ends, so
+ * that the master needn't poll for it.  The master listens for them between
+ * its own exchanges.  Events are ACK_PAYLOAD_SIZE bytes:
+ * RadioPacket[0-15] Reply to the command in RadioPacket[16], with MESSAGE_OK
+ * RadioPacket[16]  COMMAND_REPORT_DOSE for a dose exposure, otherwise
+ *                  COMMAND_REPORT_STATUS
+ * RadioPacket[17-18] Command-to-light latency, as an ACK payload
+ * The controller retries an event a few times, but an event can still be
+ * lost, so the master should also poll occasionally.
+ */
+/* Sub-millisecond times are added to the millisecond fields, and are packed
+ * as two 10-bit values:
+ * RadioPacket[12]  Target sub-ms bits 9-2
+ * RadioPacket[13]  Target sub-ms bits 1-0 (bits 7-6) | Achieved sub-ms bits 9-4 (bits 5-0)
+ * RadioPacket[14]  Achieved sub-ms bits 3-0 (bits 7-4) | Program step index (bits 3-0)
+ * Master -> slave packets leave the achieved bits as zero, and instead carry
+ * the fine powers in RadioPacket[14].
+ *
+ * While a program is running the target and achieved times are totals over
+ * the program's steps, and the step index is the step being exposed, or if
+ * paused or holding, the step to be exposed next.
+ */
+/* Fine powers, the lower 4 bits of the 12-bit green and blue powers, are
+ * packed into one byte: green in bits 7-4, blue in bits 3-0.  This is
+ * RadioPacket[14] in every master -> slave packet that sets green and blue
+ * powers, and RadioPacket[15] in every slave -> master packet.
+ */
+/* COMMAND_PROGRAM_UPLOAD_STEP packet format:
+ * RadioPacket[0]   COMMAND_PROGRAM_UPLOAD_STEP
+ * RadioPacket[1]   Step index.  Uploading step n discards any steps after n,
+ *                  so steps must be uploaded in order.
+ * RadioPacket[2]   Green channel power
+ * RadioPacket[3]   Blue channel power
+ * RadioPacket[4-7] Step exposure time (milliseconds), 4 is MSB
+ * RadioPacket[8-9] Pause after step (milliseconds), 8 is MSB.  PROGRAM_PAUSE_HOLD to hold.
+ * RadioPacket[12-13] Step exposure time, sub-millisecond part, packed as the target above
+ */
+/* COMMAND_TEST_STRIP packet format.  The controller builds an f-stop test
+ * strip program (replacing any uploaded program) and starts it.
+ * RadioPacket[0]   COMMAND_TEST_STRIP
+ * RadioPacket[2]   Green channel power
+ * RadioPacket[3]   Blue channel power
+ * RadioPacket[4-7] Base exposure time (milliseconds), 4 is MSB
+ * RadioPacket[8]   Stop divisor: strips are 1/n stop apart.  3, 6 or 12.
+ * RadioPacket[9]   Number of strips, at most PROGRAM_MAX_STEPS
+ * RadioPacket[10-11] Pause between strips (milliseconds), 10 is MSB.  PROGRAM_PAUSE_HOLD to hold.
+ * RadioPacket[12-13] Base exposure time, sub-millisecond part, packed as the target above
+ */
+/* Dose exposures.
+ *
+ * Dose is the integral of channel power over time, in power-milliseconds,
+ * with power in units of the 8-bit power fields: one second at full power is
+ * 255000.  A dose exposure
+ * exposes each channel until it has received its target dose, rather than for
+ * a fixed time, so COMMAND_SET_CHANNEL_POWER may be used to change the powers
+ * while it runs (to burn or dodge) without changing the dose delivered.
+ *
+ * COMMAND_SET_DOSE packet format.  Sets a dose exposure, which
+ * COMMAND_START_EXPOSURE then starts in place of a timed one, until the next
+ * COMMAND_SET_EXPOSURE.  A channel with a target of zero is not exposed.  The
+ * target time is reported as zero.
+ * RadioPacket[0]   COMMAND_SET_DOSE
+ * RadioPacket[2]   Green channel power
+ * RadioPacket[3]   Blue channel power
+ * RadioPacket[4-7] Green target dose (power-milliseconds), 4 is MSB
+ * RadioPacket[8-11] Blue target dose (power-milliseconds), 8 is MSB
+ *
+ * The reply to COMMAND_REPORT_DOSE is as the status reply above, except:
+ * RadioPacket[4-7] Green dose achieved (power-milliseconds), 4 is MSB
+ * RadioPacket[8-11] Blue dose achieved (power-milliseconds), 8 is MSB
+ */
+/* Metered exposures.
+ *
+ * A metered exposure ends when the light measured by the controller's
+ * photodiode reaches a target, so is unaffected by LED ageing and warm-up.
+ * Measured dose is in count-milliseconds: one millisecond at one ADC count
+ * above the dark level, which is taken just before the lights come on.  As
+ * with dose exposures, the powers may be changed while it runs.
+ *
+ * COMMAND_SET_METERED packet format.  Sets a metered exposure, which
+ * COMMAND_START_EXPOSURE then starts in place of a timed one, until the next
+ * COMMAND_SET_EXPOSURE or COMMAND_SET_DOSE.  The target time is reported as
+ * zero.
+ * RadioPacket[0]   COMMAND_SET_METERED
+ * RadioPacket[2]   Green channel power
+ * RadioPacket[3]   Blue channel power
+ * RadioPacket[4-7] Target measured dose (count-milliseconds), 4 is MSB
+ *
+ * The reply to COMMAND_REPORT_METER is as the status reply above, except:
+ * RadioPacket[4-7] Measured dose since the last metered exposure started (count-milliseconds), 4 is MSB
+ * RadioPacket[8-9] Dark level (ADC counts), 8 is MSB
+ * RadioPacket[10-11] Light level over the last millisecond (ADC counts above dark), 10 is MSB
+ */
+/* COMMAND_MEASURE_SKEW packet format.  Measures how closely the green and
+ * blue outputs switch together: the controller switches both on at the given
+ * powers and then off, timing each channel's edges.  This lights the
+ * enlarger briefly, and leaves the outputs off.  Only while not exposing.
+ * Full power on both gives the skew of the switching itself; at lower powers
+ * it also includes the PWM phase.
+ * RadioPacket[0]   COMMAND_MEASURE_SKEW
+ * RadioPacket[2]   Green channel power
+ * RadioPacket[3]   Blue channel power
+ *
+ * The reply is as the status reply above, except:
+ * RadioPacket[4-5] Switch-on skew, green edge less blue edge (signed, 0.5 us counts), 4 is MSB
+ * RadioPacket[6-7] Switch-off skew, as above
+ */
+/* The reply to COMMAND_REPORT_LATENCY is as the status reply above, except:
+ * RadioPacket[4-5] Command-to-light latency of the last command to change the
+ *                  outputs (microseconds), 4 is MSB.  This runs from the
+ *                  controller's radio interrupt to its outputs first
+ *                  changing for the command, which the controller latches
+ *                  as they change, so it's kept until the next such command.
+ *                  0xFFFF if there has been no such command, or if it is
+ *                  still to take effect (eg an exposure that starts at the
+ *                  next millisecond).  Saturates at 0xFFFE.
+ * RadioPacket[6-7] Worst command-to-light latency since reset, as above
+ * RadioPacket[8]   Packets dropped because the receive queue was full (saturates at 255)
+ */
+/* Exposure history.
+ *
+ * The controller keeps records of its last finished exposures and programs
+ * (stopped or not), numbered by an 8-bit sequence number that wraps.
+ * COMMAND_REPORT_HISTORY reads them a page of HISTORY_RECORDS_PER_PACKET
+ * records at a time.
+ * RadioPacket[0]   COMMAND_REPORT_HISTORY
+ * RadioPacket[1]   Sequence number of the first record wanted
+ *
+ * The reply is:
+ * RadioPacket[0]   ControllerState | CommsMessage, as the status reply above
+ * RadioPacket[1]   Sequence number of the first record returned.  This is
+ *                  later than asked for if that record has been overwritten.
+ * RadioPacket[2-8] First record
+ * RadioPacket[9-15] Second record
+ * Records are consecutive.  A slot with no record (none finished yet) is all
+ * HISTORY_RECORD_EMPTY.
+ *
+ * Record format:
+ * Record[0-3]      Achieved time: milliseconds in bits 31-10, and
+ *                  microseconds (0-999) in bits 9-0; 0 is MSB.  Saturates at
+ *                  HISTORY_MAX_MILLIS.  Timed from the timer counts read as
+ *                  the outputs switched on and off, so it includes any delay
+ *                  in the interrupts that switched them.
+ * Record[4]        Overshoot, achieved less target time (signed microseconds),
+ *                  saturating at +-HISTORY_OVERSHOOT_MAX.  Dose and metered
+ *                  exposures have no target time, and give
+ *                  HISTORY_OVERSHOOT_UNTIMED.
+ * Record[5]        Green channel power (upper 8 bits), as the exposure
+ *                  started; for a program or test strip, its first step's
+ * Record[6]        Blue channel power (upper 8 bits), likewise
+ */
+const static uint8_t HISTORY_RECORD_SIZE = 7;
+const static uint8_t HISTORY_RECORDS_PER_PACKET = 2;
+const static uint32_t HISTORY_MAX_MILLIS = 0x3FFFFF;
+const static int8_t HISTORY_OVERSHOOT_MAX = 127;
+const static int8_t HISTORY_OVERSHOOT_UNTIMED = -128;
+const static uint8_t HISTORY_RECORD_EMPTY = 0xFF;
+
+
+/* COMMAND_EXPOSE packet format.  Sets all channel powers and the target, and
+ * starts the exposure, in one exchange; the reply is the status after
+ * starting.  Equivalent to COMMAND_SET_CHANNEL_POWER, COMMAND_SET_EXPOSURE
+ * (or COMMAND_SET_DOSE) and COMMAND_START_EXPOSURE, but refused as a whole
+ * while exposing.
+ * RadioPacket[0]   COMMAND_EXPOSE
+ * RadioPacket[1]   Red channel power
+ * RadioPacket[2]   Green channel power
+ * RadioPacket[3]   Blue channel power
+ * RadioPacket[4-7] Target exposure time (milliseconds), 4 is MSB
+ * RadioPacket[8]   Flags, EXPOSE_FLAG_*
+ * RadioPacket[12-13] Target sub-ms time, as above
+ * RadioPacket[14]  Fine powers
+ *
+ * With EXPOSE_FLAG_BY_DOSE, it's a dose exposure, each channel's target dose
+ * being that of the target time at its power, so that the powers can be
+ * changed while it runs.  The target time is then reported as zero.
+ */
+const static uint8_t EXPOSE_FLAG_BY_DOSE = 0x01;
+
+
+/* COMMAND_SET_RADIO and COMMAND_SET_CHANNEL switch the controller's radio to
+ * other settings, which the master then switches to too.  The reply is the
+ * status reply, sent at the new settings.  Until a packet is received at the
+ * new settings, the old ones are on probation: if none is within
+ * RADIO_PROBATION_MILLIS, the controller goes back to them.  Whatever the
+ * settings, if nothing is received for RADIO_SILENCE_MILLIS, it goes back to
+ * the defaults and RADIO_CHANNEL, so the two ends always meet again there.
+ *
+ * COMMAND_SET_RADIO packet format:
+ * RadioPacket[0]   COMMAND_SET_RADIO
+ * RadioPacket[1]   Data rate, rf24_datarate_e
+ * RadioPacket[2]   PA level, rf24_pa_dbm_e
+ *
+ * COMMAND_SET_CHANNEL packet format:
+ * RadioPacket[0]   COMMAND_SET_CHANNEL
+ * RadioPacket[1]   Channel, 0 to RADIO_MAX_CHANNEL
+ */
+const static uint16_t RADIO_PROBATION_MILLIS = 1000;
+const static uint16_t RADIO_SILENCE_MILLIS = 5000;
+const static uint8_t RADIO_MAX_CHANNEL = 83;        // 2483 MHz, the top of the 2.4 GHz ISM band
+
+#endif